@@ -0,0 +1,191 @@
+/* Micro-benchmark for decoding and merging the docid-only doclists of
+ * the bundled FTS3. Includes the amalgamation to get at its static
+ * functions, see the 'bench' target in the Makefile. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "sqlite-3.6.22-fts3/sqlite3.c"
+
+#define N_DOCIDS 1000000
+
+typedef struct {
+    const char *name;
+    int max_gap;
+} Profile;
+
+/* gaps up to 4 all fit in one byte, up to 400 are mostly two bytes,
+ * up to 40000 mostly three */
+static const Profile profiles[] = {
+  { "dense", 4 },
+  { "mixed", 400 },
+  { "sparse", 40000 },
+  { NULL, 0 }
+};
+
+static double
+now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static char *
+make_doclist (int max_gap, unsigned int seed, int *len)
+{
+  char *buf = malloc (N_DOCIDS * FTS3_VARINT_MAX);
+  char *p = buf;
+  sqlite3_int64 docid = 0;
+  sqlite3_int64 prev = 0;
+  int i;
+
+  srand (seed);
+  for (i = 0; i < N_DOCIDS; i++)
+    {
+      docid += 1 + rand () % max_gap;
+      fts3PutDeltaVarint (&p, &prev, docid);
+    }
+
+  *len = p - buf;
+  return buf;
+}
+
+/* The way doclists were walked before, one varint per call */
+static sqlite3_int64
+decode_single (char *a, int n)
+{
+  char *p = a;
+  char *end = a + n;
+  sqlite3_int64 docid = 0;
+  sqlite3_int64 sum = 0;
+
+  while (p < end)
+    {
+      fts3GetDeltaVarint (&p, &docid);
+      sum += docid;
+    }
+
+  return sum;
+}
+
+static sqlite3_int64
+decode_block (char *a, int n)
+{
+  sqlite3_int64 docids[FTS3_DECODE_BLOCK];
+  char *p = a;
+  char *end = a + n;
+  sqlite3_int64 docid = 0;
+  sqlite3_int64 sum = 0;
+  int got;
+  int i;
+
+  while ((got = fts3DecodeDocids (&p, end, &docid, docids,
+              FTS3_DECODE_BLOCK)) > 0)
+    {
+      for (i = 0; i < got; i++)
+          sum += docids[i];
+    }
+
+  return sum;
+}
+
+/* The machine may be busy with other things, so each measurement
+ * takes the fastest of RUNS runs */
+#define RUNS 15
+
+/* Returns the number of docids fn decodes per second */
+static double
+time_decode (sqlite3_int64 (*fn) (char *, int), char *a, int n,
+    sqlite3_int64 *sum)
+{
+  double best = 1e9;
+  double elapsed;
+  double start;
+  int i;
+
+  for (i = 0; i < RUNS; i++)
+    {
+      start = now ();
+      *sum = fn (a, n);
+      elapsed = now () - start;
+      if (elapsed < best)
+          best = elapsed;
+    }
+
+  return N_DOCIDS / best;
+}
+
+/* Returns the number of input docids merged per second */
+static double
+time_merge (int mergetype, char *a1, int n1, char *a2, int n2)
+{
+  char *out = malloc (n1 + n2);
+  double best = 1e9;
+  double elapsed;
+  double start;
+  int n_out;
+  int i;
+
+  for (i = 0; i < RUNS; i++)
+    {
+      start = now ();
+      fts3DoclistMerge (mergetype, 0, 0, out, &n_out, a1, n1, a2, n2);
+      elapsed = now () - start;
+      if (elapsed < best)
+          best = elapsed;
+    }
+
+  free (out);
+  return 2.0 * N_DOCIDS / best;
+}
+
+int
+main (int argc, char **argv)
+{
+  int i;
+
+#if defined(FTS3_SIMD_VARINT) && defined(__SSE2__)
+  printf ("block decoder: SSE2\n");
+#elif defined(FTS3_SIMD_VARINT)
+  printf ("block decoder: NEON\n");
+#else
+  printf ("block decoder: plain C\n");
+#endif
+  printf ("%-8s %8s %10s %10s %10s %10s\n", "doclist", "bytes",
+      "single", "block", "AND", "OR");
+
+  for (i = 0; profiles[i].name; i++)
+    {
+      sqlite3_int64 sum1, sum2;
+      double single, block, and, or;
+      char *a1, *a2;
+      int n1, n2;
+
+      a1 = make_doclist (profiles[i].max_gap, 1, &n1);
+      a2 = make_doclist (profiles[i].max_gap, 2, &n2);
+
+      single = time_decode (decode_single, a1, n1, &sum1);
+      block = time_decode (decode_block, a1, n1, &sum2);
+      and = time_merge (MERGE_AND, a1, n1, a2, n2);
+      or = time_merge (MERGE_OR, a1, n1, a2, n2);
+
+      if (sum1 != sum2)
+        {
+          fprintf (stderr, "%s: block decoder returned wrong docids\n",
+              profiles[i].name);
+          return 1;
+        }
+
+      /* in millions of docids per second */
+      printf ("%-8s %8d %10.1f %10.1f %10.1f %10.1f\n", profiles[i].name,
+          n1, single / 1e6, block / 1e6, and / 1e6, or / 1e6);
+
+      free (a1);
+      free (a2);
+    }
+
+  return 0;
+}
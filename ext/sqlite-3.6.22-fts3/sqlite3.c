@@ -98456,6 +98456,64 @@ SQLITE_PRIVATE Fts3HashElem *sqlite3Fts3HashFindElem(const Fts3Hash *, const voi
 */
 #define FTS3_MAX_PENDING_DATA (1*1024*1024)
 
+/*
+** When the index is rebuilt with "INSERT INTO tbl(tbl) VALUES('rebuild')",
+** the pending-terms table is allowed to grow this big before it is
+** written out as a segment.
+*/
+#define FTS3_REBUILD_PENDING_DATA (16*1024*1024)
+
+/*
+** Memory budget (in bytes) of the per-table cache of doclists returned
+** by term and prefix lookups. Zero disables the cache.
+*/
+#ifndef FTS3_DOCLIST_CACHE_SIZE
+# define FTS3_DOCLIST_CACHE_SIZE (8*1024*1024)
+#endif
+
+/*
+** Cached docid-only doclists get a skip list with an entry for every
+** FTS3_SKIP_INTERVAL docids. An AND of two doclists uses the skip list of
+** one of them if it is more than FTS3_SKIP_RATIO times longer than the
+** other. Only cached doclists have one, and a doclist is only cached if
+** it takes up at most half of FTS3_DOCLIST_CACHE_SIZE with its skip list
+** (4MB by default), so a longer one is always merged in full. That costs
+** no more than reading it from the segments did.
+*/
+#define FTS3_SKIP_INTERVAL 32
+#define FTS3_SKIP_RATIO 16
+
+/*
+** Length in characters of the prefixes that the %_terms table built by
+** "INSERT INTO tbl(tbl) VALUES('termstats')" has document counts for.
+*/
+#define FTS3_TERMSTATS_PREFIX 3
+
+/*
+** The %_prefixes table built by "INSERT INTO tbl(tbl) VALUES('prefixes')"
+** has the merged doclists of all prefixes of up to FTS3_PREFIXES_MAX
+** characters.
+*/
+#define FTS3_PREFIXES_MAX 3
+
+/*
+** Docid-only doclists are merged FTS3_DECODE_BLOCK docids at a time, see
+** fts3DecodeDocids(). Where SSE2 or NEON is available runs of one-byte
+** deltas are decoded 16 at a time; define SQLITE_FTS3_NO_SIMD to always
+** use the plain C decoder.
+*/
+#define FTS3_DECODE_BLOCK 64
+
+#if !defined(SQLITE_FTS3_NO_SIMD) && defined(__GNUC__)
+# if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define FTS3_SIMD_VARINT 1
+# elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define FTS3_SIMD_VARINT 1
+# endif
+#endif
+
 /*
 ** Macro to return the number of elements in an array. SQLite has a
 ** similar macro called ArraySize(). Use a different name to avoid
@@ -98500,6 +98558,8 @@ typedef struct Fts3Expr Fts3Expr;
 typedef struct Fts3Phrase Fts3Phrase;
 typedef struct Fts3SegReader Fts3SegReader;
 typedef struct Fts3SegFilter Fts3SegFilter;
+typedef struct Fts3CacheEntry Fts3CacheEntry;
+typedef struct Fts3SkipList Fts3SkipList;
 
 /*
 ** A connection to a fulltext index is an instance of the following
@@ -98520,7 +98580,7 @@ struct Fts3Table {
   /* Precompiled statements used by the implementation. Each of these 
   ** statements is run and reset within a single virtual table API call. 
   */
-  sqlite3_stmt *aStmt[18];
+  sqlite3_stmt *aStmt[21];
 
   /* Pointer to string containing the SQL:
   **
@@ -98546,6 +98606,30 @@ struct Fts3Table {
   int nPendingData;
   sqlite_int64 iPrevDocid;
   Fts3Hash pendingTerms;
+
+  /* Cache of doclists returned by fts3TermSelect(), keyed by column,
+  ** term and flags. Entries are kept on a list from the most to the least
+  ** recently used one, nCache is the total size of all entries. The cache
+  ** is valid for the database file version iCacheVersion only.
+  */
+  Fts3Hash cache;
+  int nCache;
+  int nMaxCache;
+  u32 iCacheVersion;
+  Fts3CacheEntry *pNewest;
+  Fts3CacheEntry *pOldest;
+
+  /* True once it is known that there is no %_prefixes table, or that it
+  ** was emptied because the index changed. Prefix lookups then go to the
+  ** segments only. Only valid until the next write transaction, see
+  ** fts3BeginMethod().
+  */
+  int noPrefixes;
+
+  /* True once it is known that there is no %_terms table, or that it was
+  ** emptied because the index changed. Reset like noPrefixes.
+  */
+  int noTermStats;
 };
 
 /*
@@ -98564,6 +98648,7 @@ struct Fts3Cursor {
   char *pNextId;                  /* Pointer into the body of aDoclist */
   char *aDoclist;                 /* List of docids for full-text queries */
   int nDoclist;                   /* Size of buffer at aDoclist */
+  Fts3CacheEntry *pEntry;         /* Cache entry aDoclist belongs to, or 0 */
   int isMatchinfoOk;              /* True when aMatchinfo[] matches iPrevId */
   u32 *aMatchinfo;
 };
@@ -98671,6 +98756,7 @@ SQLITE_PRIVATE int sqlite3Fts3SegReaderIterate(
 );
 SQLITE_PRIVATE int sqlite3Fts3ReadBlock(Fts3Table*, sqlite3_int64, char const**, int*);
 SQLITE_PRIVATE int sqlite3Fts3AllSegdirs(Fts3Table*, sqlite3_stmt **);
+SQLITE_PRIVATE int sqlite3Fts3PrefixSelect(Fts3Table*,const char*,int,int*,char**);
 
 /* Flags allowed as part of the 4th argument to SegmentReaderIterate() */
 #define FTS3_SEGMENT_REQUIRE_POS   0x00000001
@@ -98757,6 +98843,11 @@ SQLITE_PRIVATE int sqlite3Fts3PutVarint(char *p, sqlite_int64 v){
 SQLITE_PRIVATE int sqlite3Fts3GetVarint(const char *p, sqlite_int64 *v){
   const unsigned char *q = (const unsigned char *) p;
   sqlite_uint64 x = 0, y = 1;
+  if( (*q&0x80)==0 ){
+    /* Most docid deltas and positions fit in a single byte */
+    *v = (sqlite_int64) *q;
+    return 1;
+  }
   while( (*q&0x80)==0x80 && q-(unsigned char *)p<FTS3_VARINT_MAX ){
     x += y * (*q++ & 0x7f);
     y <<= 7;
@@ -98842,6 +98933,161 @@ static void fts3GetDeltaVarint2(char **pp, char *pEnd, sqlite3_int64 *pVal){
   }
 }
 
+#ifdef FTS3_SIMD_VARINT
+/*
+** Return a mask with bit i set if byte a[i] has the 0x80 bit set, that
+** is, if it is not the last byte of a varint. Exactly 16 bytes are read.
+*/
+static unsigned int fts3VarintMask16(const unsigned char *a){
+#if defined(__SSE2__)
+  return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)a));
+#else
+  static const signed char aShift[16] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7
+  };
+  uint8x16_t v = vshlq_u8(vshrq_n_u8(vld1q_u8(a), 7), vld1q_s8(aShift));
+  uint8x8_t m = vpadd_u8(vget_low_u8(v), vget_high_u8(v));
+  m = vpadd_u8(m, m);
+  m = vpadd_u8(m, m);
+  return vget_lane_u8(m, 0) | ((unsigned int)vget_lane_u8(m, 1) << 8);
+#endif
+}
+
+/*
+** Store iPrev plus the running sums of the 16 one-byte deltas at a[] in
+** aOut[0] to aOut[15].
+*/
+static void fts3PrefixSum16(
+  const unsigned char *a,
+  sqlite3_int64 iPrev,
+  sqlite3_int64 *aOut
+){
+#if defined(__SSE2__)
+  __m128i z = _mm_setzero_si128();
+  __m128i v = _mm_loadu_si128((const __m128i *)a);
+  __m128i lo = _mm_unpacklo_epi8(v, z);
+  __m128i hi = _mm_unpackhi_epi8(v, z);
+  __m128i base = _mm_set1_epi64x(iPrev);
+  __m128i a32[4];
+  int i;
+
+  /* Running sums of each half as 16-bit lanes (at most 16*127) */
+  lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 2));
+  hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 2));
+  lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 4));
+  hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 4));
+  lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 8));
+  hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 8));
+  hi = _mm_add_epi16(hi, _mm_set1_epi16((short)_mm_extract_epi16(lo, 7)));
+
+  /* Widen to 64 bits and add iPrev */
+  a32[0] = _mm_unpacklo_epi16(lo, z);
+  a32[1] = _mm_unpackhi_epi16(lo, z);
+  a32[2] = _mm_unpacklo_epi16(hi, z);
+  a32[3] = _mm_unpackhi_epi16(hi, z);
+  for(i=0; i<4; i++){
+    _mm_storeu_si128((__m128i *)&aOut[i*4],
+        _mm_add_epi64(base, _mm_unpacklo_epi32(a32[i], z)));
+    _mm_storeu_si128((__m128i *)&aOut[i*4+2],
+        _mm_add_epi64(base, _mm_unpackhi_epi32(a32[i], z)));
+  }
+#else
+  int i;
+  for(i=0; i<16; i++){
+    iPrev += a[i];
+    aOut[i] = iPrev;
+  }
+#endif
+}
+#endif
+
+/*
+** Decode up to nMax docids from the docid-only doclist at *pp, which
+** ends at pEnd. Each delta is added to *piPrev and the result stored in
+** aOut. Return the number of docids decoded, leaving *pp pointing to the
+** first varint not decoded.
+**
+** With SIMD support, the high bits of 16 bytes are tested at once. If
+** none is set, the block holds 16 one-byte deltas (the usual case for the
+** long doclists of common terms) and is summed up directly. Once a block
+** has a longer varint, the rest of the call decodes one varint at a time:
+** assembling the varints of such blocks from the mask was measured to be
+** slower than that.
+*/
+static int fts3DecodeDocids(
+  char **pp,                      /* IN/OUT: Next varint to decode */
+  char *pEnd,                     /* End of the doclist */
+  sqlite3_int64 *piPrev,          /* IN/OUT: Last docid decoded */
+  sqlite3_int64 *aOut,            /* OUT: Decoded docids */
+  int nMax                        /* Size of aOut */
+){
+  const unsigned char *p = (const unsigned char *)*pp;
+  const unsigned char *pStop = (const unsigned char *)pEnd;
+  sqlite3_int64 iPrev = *piPrev;
+  int n = 0;
+
+#ifdef FTS3_SIMD_VARINT
+  while( nMax-n>=16 && pStop-p>=16 && fts3VarintMask16(p)==0 ){
+    fts3PrefixSum16(p, iPrev, &aOut[n]);
+    n += 16;
+    iPrev = aOut[n-1];
+    p += 16;
+  }
+#endif
+
+  while( n<nMax && p<pStop ){
+    sqlite3_int64 iVal;
+    p += sqlite3Fts3GetVarint((const char *)p, &iVal);
+    iPrev += iVal;
+    aOut[n++] = iPrev;
+  }
+
+  *pp = (char *)p;
+  *piPrev = iPrev;
+  return n;
+}
+
+/*
+** A cursor that returns the docids of a docid-only doclist one at a time,
+** decoding them FTS3_DECODE_BLOCK at a time.
+*/
+typedef struct Fts3DocidReader Fts3DocidReader;
+struct Fts3DocidReader {
+  char *p;                        /* First byte not yet decoded */
+  char *pEnd;                     /* End of the doclist */
+  sqlite3_int64 iPrev;            /* Last docid decoded */
+  int i;                          /* Next entry of aDocid to return */
+  int n;                          /* Number of entries in aDocid */
+  sqlite3_int64 aDocid[FTS3_DECODE_BLOCK];
+};
+
+static void fts3DocidReaderInit(Fts3DocidReader *pReader, char *a, int n){
+  pReader->p = a;
+  pReader->pEnd = &a[n];
+  pReader->iPrev = 0;
+  pReader->i = 0;
+  pReader->n = 0;
+}
+
+/*
+** Set *piDocid to the next docid and return 1, or return 0 at the end
+** of the doclist.
+*/
+static int fts3DocidReaderNext(Fts3DocidReader *pReader, sqlite3_int64 *piDocid){
+  if( pReader->i==pReader->n ){
+    pReader->n = fts3DecodeDocids(&pReader->p, pReader->pEnd,
+        &pReader->iPrev, pReader->aDocid, FTS3_DECODE_BLOCK
+    );
+    pReader->i = 0;
+    if( pReader->n==0 ) return 0;
+  }
+  *piDocid = pReader->aDocid[pReader->i++];
+  return 1;
+}
+
+static void fts3CacheClear(Fts3Table *);
+static void fts3DoclistFree(char *, Fts3CacheEntry *);
+
 /*
 ** The xDisconnect() virtual table method.
 */
@@ -98850,6 +99096,7 @@ static int fts3DisconnectMethod(sqlite3_vtab *pVtab){
   int i;
 
   assert( p->nPendingData==0 );
+  fts3CacheClear(p);
 
   /* Free any prepared statements held */
   for(i=0; i<SizeofArray(p->aStmt); i++){
@@ -98875,12 +99122,15 @@ static int fts3DestroyMethod(sqlite3_vtab *pVtab){
   int rc;                         /* Return code */
   Fts3Table *p = (Fts3Table *)pVtab;
 
-  /* Create a script to drop the underlying three storage tables. */
+  /* Create a script to drop the underlying storage tables. */
   char *zSql = sqlite3_mprintf(
       "DROP TABLE IF EXISTS %Q.'%q_content';"
       "DROP TABLE IF EXISTS %Q.'%q_segments';"
-      "DROP TABLE IF EXISTS %Q.'%q_segdir';", 
-      p->zDb, p->zName, p->zDb, p->zName, p->zDb, p->zName
+      "DROP TABLE IF EXISTS %Q.'%q_segdir';"
+      "DROP TABLE IF EXISTS %Q.'%q_terms';"
+      "DROP TABLE IF EXISTS %Q.'%q_prefixes';", 
+      p->zDb, p->zName, p->zDb, p->zName, p->zDb, p->zName,
+      p->zDb, p->zName, p->zDb, p->zName
   );
 
   /* If malloc has failed, set rc to SQLITE_NOMEM. Otherwise, try to
@@ -99062,9 +99312,11 @@ static int fts3InitVtab(
   p->pTokenizer = pTokenizer;
   p->nNodeSize = 1000;
   p->nMaxPendingData = FTS3_MAX_PENDING_DATA;
+  p->nMaxCache = FTS3_DOCLIST_CACHE_SIZE;
   zCsr = (char *)&p->azColumn[nCol];
 
   fts3HashInit(&p->pendingTerms, FTS3_HASH_STRING, 1);
+  fts3HashInit(&p->cache, FTS3_HASH_BINARY, 0);
 
   /* Fill in the zName and zDb fields of the vtab structure. */
   p->zName = zCsr;
@@ -99236,7 +99488,7 @@ static int fulltextClose(sqlite3_vtab_cursor *pCursor){
   Fts3Cursor *pCsr = (Fts3Cursor *)pCursor;
   sqlite3_finalize(pCsr->pStmt);
   sqlite3Fts3ExprFree(pCsr->pExpr);
-  sqlite3_free(pCsr->aDoclist);
+  fts3DoclistFree(pCsr->aDoclist, pCsr->pEntry);
   sqlite3_free(pCsr->aMatchinfo);
   sqlite3_free(pCsr);
   return SQLITE_OK;
@@ -99730,6 +99982,84 @@ static int fts3PoslistNearMerge(
 #define MERGE_NEAR       8        /* P + P -> D */
 #define MERGE_POS_NEAR   9        /* P + P -> P */
 
+/*
+** The MERGE_OR, MERGE_AND and MERGE_NOT cases of fts3DoclistMerge(). As
+** each docid is written only after it was decoded, aBuffer may be the
+** same buffer as a1.
+*/
+static void fts3DocidMerge(
+  int mergetype,                  /* MERGE_OR, MERGE_AND or MERGE_NOT */
+  char *aBuffer,                  /* Pre-allocated output buffer */
+  int *pnBuffer,                  /* OUT: Bytes written to aBuffer */
+  char *a1,                       /* Buffer containing first doclist */
+  int n1,                         /* Size of buffer a1 */
+  char *a2,                       /* Buffer containing second doclist */
+  int n2                          /* Size of buffer a2 */
+){
+  Fts3DocidReader r1;
+  Fts3DocidReader r2;
+  sqlite3_int64 i1 = 0;
+  sqlite3_int64 i2 = 0;
+  sqlite3_int64 iPrev = 0;
+  char *p = aBuffer;
+  int is1;                        /* True while i1 is valid */
+  int is2;                        /* True while i2 is valid */
+
+  fts3DocidReaderInit(&r1, a1, n1);
+  fts3DocidReaderInit(&r2, a2, n2);
+  is1 = fts3DocidReaderNext(&r1, &i1);
+  is2 = fts3DocidReaderNext(&r2, &i2);
+
+  switch( mergetype ){
+    case MERGE_OR:
+      while( is1 || is2 ){
+        if( is1 && is2 && i1==i2 ){
+          fts3PutDeltaVarint(&p, &iPrev, i1);
+          is1 = fts3DocidReaderNext(&r1, &i1);
+          is2 = fts3DocidReaderNext(&r2, &i2);
+        }else if( !is2 || (is1 && i1<i2) ){
+          fts3PutDeltaVarint(&p, &iPrev, i1);
+          is1 = fts3DocidReaderNext(&r1, &i1);
+        }else{
+          fts3PutDeltaVarint(&p, &iPrev, i2);
+          is2 = fts3DocidReaderNext(&r2, &i2);
+        }
+      }
+      break;
+
+    case MERGE_AND:
+      while( is1 && is2 ){
+        if( i1==i2 ){
+          fts3PutDeltaVarint(&p, &iPrev, i1);
+          is1 = fts3DocidReaderNext(&r1, &i1);
+          is2 = fts3DocidReaderNext(&r2, &i2);
+        }else if( i1<i2 ){
+          is1 = fts3DocidReaderNext(&r1, &i1);
+        }else{
+          is2 = fts3DocidReaderNext(&r2, &i2);
+        }
+      }
+      break;
+
+    default:
+      assert( mergetype==MERGE_NOT );
+      while( is1 ){
+        if( is2 && i1==i2 ){
+          is1 = fts3DocidReaderNext(&r1, &i1);
+          is2 = fts3DocidReaderNext(&r2, &i2);
+        }else if( !is2 || i1<i2 ){
+          fts3PutDeltaVarint(&p, &iPrev, i1);
+          is1 = fts3DocidReaderNext(&r1, &i1);
+        }else{
+          is2 = fts3DocidReaderNext(&r2, &i2);
+        }
+      }
+      break;
+  }
+
+  *pnBuffer = (int)(p - aBuffer);
+}
+
 /*
 ** Merge the two doclists passed in buffer a1 (size n1 bytes) and a2
 ** (size n2 bytes). The output is written to pre-allocated buffer aBuffer,
@@ -99772,54 +100102,31 @@ static int fts3DoclistMerge(
     return SQLITE_NOMEM;
   }
 
+  /* Docid-only doclists are decoded in blocks */
+  if( mergetype==MERGE_OR || mergetype==MERGE_AND || mergetype==MERGE_NOT ){
+    fts3DocidMerge(mergetype, aBuffer, pnBuffer, a1, n1, a2, n2);
+    return SQLITE_OK;
+  }
+
   /* Read the first docid from each doclist */
   fts3GetDeltaVarint2(&p1, pEnd1, &i1);
   fts3GetDeltaVarint2(&p2, pEnd2, &i2);
 
   switch( mergetype ){
-    case MERGE_OR:
     case MERGE_POS_OR:
       while( p1 || p2 ){
         if( p2 && p1 && i1==i2 ){
           fts3PutDeltaVarint(&p, &iPrev, i1);
-          if( mergetype==MERGE_POS_OR ) fts3PoslistMerge(&p, &p1, &p2);
+          fts3PoslistMerge(&p, &p1, &p2);
           fts3GetDeltaVarint2(&p1, pEnd1, &i1);
           fts3GetDeltaVarint2(&p2, pEnd2, &i2);
         }else if( !p2 || (p1 && i1<i2) ){
           fts3PutDeltaVarint(&p, &iPrev, i1);
-          if( mergetype==MERGE_POS_OR ) fts3PoslistCopy(&p, &p1);
+          fts3PoslistCopy(&p, &p1);
           fts3GetDeltaVarint2(&p1, pEnd1, &i1);
         }else{
           fts3PutDeltaVarint(&p, &iPrev, i2);
-          if( mergetype==MERGE_POS_OR ) fts3PoslistCopy(&p, &p2);
-          fts3GetDeltaVarint2(&p2, pEnd2, &i2);
-        }
-      }
-      break;
-
-    case MERGE_AND:
-      while( p1 && p2 ){
-        if( i1==i2 ){
-          fts3PutDeltaVarint(&p, &iPrev, i1);
-          fts3GetDeltaVarint2(&p1, pEnd1, &i1);
-          fts3GetDeltaVarint2(&p2, pEnd2, &i2);
-        }else if( i1<i2 ){
-          fts3GetDeltaVarint2(&p1, pEnd1, &i1);
-        }else{
-          fts3GetDeltaVarint2(&p2, pEnd2, &i2);
-        }
-      }
-      break;
-
-    case MERGE_NOT:
-      while( p1 ){
-        if( p2 && i1==i2 ){
-          fts3GetDeltaVarint2(&p1, pEnd1, &i1);
-          fts3GetDeltaVarint2(&p2, pEnd2, &i2);
-        }else if( !p2 || i1<i2 ){
-          fts3PutDeltaVarint(&p, &iPrev, i1);
-          fts3GetDeltaVarint2(&p1, pEnd1, &i1);
-        }else{
+          fts3PoslistCopy(&p, &p2);
           fts3GetDeltaVarint2(&p2, pEnd2, &i2);
         }
       }
@@ -99902,6 +100209,24 @@ struct TermSelect {
   int nOutput;                    /* Size of output in bytes */
 };
 
+/*
+** Return SQLITE_INTERRUPT if the progress handler of the database
+** connection asks for the statement to be stopped, or SQLITE_OK. No VDBE
+** instructions run while xFilter merges the doclists of a prefix search,
+** so the handler is called once per term merged as well.
+*/
+static int fts3CheckProgress(Fts3Table *p){
+#ifndef SQLITE_OMIT_PROGRESS_CALLBACK
+  sqlite3 *db = p->db;
+  if( db->xProgress && db->xProgress(db->pProgressArg) ){
+    return SQLITE_INTERRUPT;
+  }
+#else
+  UNUSED_PARAMETER(p);
+#endif
+  return SQLITE_OK;
+}
+
 /*
 ** This function is used as the sqlite3Fts3SegReaderIterate() callback when
 ** querying the full-text index for a doclist associated with a term or
@@ -99917,12 +100242,16 @@ static int fts3TermSelectCb(
 ){
   TermSelect *pTS = (TermSelect *)pContext;
   int nNew = pTS->nOutput + nDoclist;
-  char *aNew = sqlite3_malloc(nNew);
+  char *aNew;
 
-  UNUSED_PARAMETER(p);
   UNUSED_PARAMETER(zTerm);
   UNUSED_PARAMETER(nTerm);
 
+  if( pTS->nOutput>0 && fts3CheckProgress(p)!=SQLITE_OK ){
+    return SQLITE_INTERRUPT;
+  }
+
+  aNew = sqlite3_malloc(nNew);
   if( !aNew ){
     return SQLITE_NOMEM;
   }
@@ -99951,6 +100280,275 @@ static int fts3TermSelectCb(
   return SQLITE_OK;
 }
 
+/*
+** Skip list of a docid-only doclist. Block i of the doclist starts at
+** byte offset aSkip[i].iOff, and its first docid is delta-encoded
+** relative to aSkip[i].iPrev, the last docid of block i-1 (0 for the
+** first block).
+*/
+struct Fts3SkipList {
+  int nByte;                      /* Size of this structure in bytes */
+  int nSkip;                      /* Number of entries in aSkip */
+  struct Fts3Skip {
+    sqlite3_int64 iPrev;          /* Docid preceding the block */
+    int iOff;                     /* Offset of the block in the doclist */
+  } aSkip[1];
+};
+
+/*
+** Return the number of docids in the nDoclist byte docid-only doclist
+** aDoclist. Each varint ends with the one byte that does not have the
+** 0x80 bit set.
+*/
+static int fts3DoclistCount(const char *aDoclist, int nDoclist){
+  int nDocid = 0;
+  int i;
+  for(i=0; i<nDoclist; i++){
+    if( (aDoclist[i] & 0x80)==0 ) nDocid++;
+  }
+  return nDocid;
+}
+
+/*
+** Return the size of the skip list for the nDoclist byte docid-only
+** doclist aDoclist, or 0 if it is too short to need one.
+*/
+static int fts3SkipListSize(const char *aDoclist, int nDoclist){
+  int nDocid = fts3DoclistCount(aDoclist, nDoclist);
+  int nSkip;
+
+  nSkip = (nDocid + FTS3_SKIP_INTERVAL - 1) / FTS3_SKIP_INTERVAL;
+  if( nSkip<2 ) return 0;
+  return sizeof(Fts3SkipList) + (nSkip-1)*sizeof(struct Fts3Skip);
+}
+
+/*
+** Fill in skip list pSkip, of nByte bytes, for doclist aDoclist.
+*/
+static void fts3SkipListFill(
+  Fts3SkipList *pSkip,
+  int nByte,
+  char *aDoclist,
+  int nDoclist
+){
+  int nMax = 1 + (nByte - sizeof(Fts3SkipList)) / sizeof(struct Fts3Skip);
+  char *p = aDoclist;
+  char *pEnd = &aDoclist[nDoclist];
+  sqlite3_int64 iDocid = 0;
+  sqlite3_int64 aDocid[FTS3_SKIP_INTERVAL];
+
+  pSkip->nByte = nByte;
+  pSkip->nSkip = 0;
+  while( p<pEnd && pSkip->nSkip<nMax ){
+    pSkip->aSkip[pSkip->nSkip].iPrev = iDocid;
+    pSkip->aSkip[pSkip->nSkip].iOff = (int)(p - aDoclist);
+    pSkip->nSkip++;
+    fts3DecodeDocids(&p, pEnd, &iDocid, aDocid, FTS3_SKIP_INTERVAL);
+  }
+}
+
+/*
+** An entry in the doclist cache. The skip list (if any), the key and the
+** doclist are stored in the same allocation, right after the structure.
+** Lookups hand out references to the entry rather than copies of the
+** doclist, the entry is freed once the cache and every caller let go of
+** it. Nothing writes to an entry once it is in the cache.
+*/
+struct Fts3CacheEntry {
+  Fts3CacheEntry *pNewer;         /* Next more recently used entry */
+  Fts3CacheEntry *pOlder;         /* Next less recently used entry */
+  char *pKey;                     /* Hash key */
+  int nKey;                       /* Size of pKey in bytes */
+  char *aDoclist;                 /* Cached doclist */
+  int nDoclist;                   /* Size of aDoclist in bytes */
+  Fts3SkipList *pSkip;            /* Skip list of aDoclist, or NULL */
+  int nByte;                      /* Size of the allocation */
+  int nRef;                       /* The cache's reference and callers' */
+};
+
+/*
+** Drop a reference to cache entry pEntry, freeing it with the last one.
+** pEntry may be NULL.
+*/
+static void fts3CacheRelease(Fts3CacheEntry *pEntry){
+  if( pEntry && --pEntry->nRef==0 ){
+    sqlite3_free(pEntry);
+  }
+}
+
+/*
+** Unlink entry pEntry from the list of cache entries.
+*/
+static void fts3CacheUnlink(Fts3Table *p, Fts3CacheEntry *pEntry){
+  if( pEntry->pNewer ){
+    pEntry->pNewer->pOlder = pEntry->pOlder;
+  }else{
+    p->pNewest = pEntry->pOlder;
+  }
+  if( pEntry->pOlder ){
+    pEntry->pOlder->pNewer = pEntry->pNewer;
+  }else{
+    p->pOldest = pEntry->pNewer;
+  }
+}
+
+/*
+** Link entry pEntry in as the most recently used one.
+*/
+static void fts3CacheLink(Fts3Table *p, Fts3CacheEntry *pEntry){
+  pEntry->pNewer = 0;
+  pEntry->pOlder = p->pNewest;
+  if( p->pNewest ){
+    p->pNewest->pNewer = pEntry;
+  }else{
+    p->pOldest = pEntry;
+  }
+  p->pNewest = pEntry;
+}
+
+/*
+** Remove entry pEntry from the cache and free it.
+*/
+static void fts3CacheRemove(Fts3Table *p, Fts3CacheEntry *pEntry){
+  fts3CacheUnlink(p, pEntry);
+  fts3HashInsert(&p->cache, pEntry->pKey, pEntry->nKey, 0);
+  p->nCache -= pEntry->nByte;
+  fts3CacheRelease(pEntry);
+}
+
+/*
+** Discard the contents of the doclist cache. This is called whenever the
+** table is written to.
+*/
+static void fts3CacheClear(Fts3Table *p){
+  while( p->pNewest ){
+    Fts3CacheEntry *pEntry = p->pNewest;
+    p->pNewest = pEntry->pOlder;
+    fts3CacheRelease(pEntry);
+  }
+  p->pOldest = 0;
+  p->nCache = 0;
+  fts3HashClear(&p->cache);
+}
+
+/*
+** Discard the contents of the doclist cache if the database file has
+** been modified since they were loaded, by this or any other connection.
+** The first 4 bytes of the file change counter are incremented by every
+** write transaction. Pager.dbFileVers is up to date while a read
+** transaction is open, which is always the case when this is called
+** from within xFilter.
+*/
+static void fts3CacheValidate(Fts3Table *p){
+  int iDb = sqlite3FindDbName(p->db, p->zDb);
+  u32 iVersion = 0;
+
+  if( iDb>=0 && p->db->aDb[iDb].pBt ){
+    Pager *pPager = sqlite3BtreePager(p->db->aDb[iDb].pBt);
+    iVersion = sqlite3Get4byte((u8 *)pPager->dbFileVers);
+  }
+  if( iVersion!=p->iCacheVersion ){
+    fts3CacheClear(p);
+    p->iCacheVersion = iVersion;
+  }
+}
+
+/*
+** Build the cache key for a term lookup: the column, flags and the term.
+** Returns a buffer allocated with sqlite3_malloc(), or NULL if out of
+** memory.
+*/
+static char *fts3CacheKey(
+  int iColumn,
+  const char *zTerm,
+  int nTerm,
+  int isPrefix,
+  int isReqPos,
+  int *pnKey
+){
+  char *pKey = (char *)sqlite3_malloc(nTerm + 6);
+  if( pKey ){
+    sqlite3Put4byte((u8 *)pKey, (u32)iColumn);
+    pKey[4] = (char)isPrefix;
+    pKey[5] = (char)isReqPos;
+    memcpy(&pKey[6], zTerm, nTerm);
+    *pnKey = nTerm + 6;
+  }
+  return pKey;
+}
+
+/*
+** Look up a doclist in the cache and return its entry, now the most
+** recently used one, or NULL if it isn't there. The entry stays valid
+** until the next call to fts3CacheStore() or fts3CacheClear(), unless a
+** reference to it is taken.
+*/
+static Fts3CacheEntry *fts3CacheLookup(
+  Fts3Table *p,
+  const char *pKey,
+  int nKey
+){
+  Fts3CacheEntry *pEntry;
+
+  pEntry = (Fts3CacheEntry *)fts3HashFind(&p->cache, pKey, nKey);
+  if( pEntry ){
+    fts3CacheUnlink(p, pEntry);
+    fts3CacheLink(p, pEntry);
+  }
+  return pEntry;
+}
+
+/*
+** Add a copy of a doclist to the cache, evicting the least recently used
+** entries to stay within budget, and return the new entry. Docid-only
+** doclists (isReqPos==0) get a skip list. Doclists that would take up
+** more than half of the budget are not cached. Failing to allocate memory
+** for the copy is not an error, the doclist just isn't cached.
+*/
+static Fts3CacheEntry *fts3CacheStore(
+  Fts3Table *p,
+  const char *pKey,
+  int nKey,
+  char *aDoclist,
+  int nDoclist,
+  int isReqPos
+){
+  int nSkip = isReqPos ? 0 : fts3SkipListSize(aDoclist, nDoclist);
+  int nByte = sizeof(Fts3CacheEntry) + nSkip + nKey + nDoclist;
+  Fts3CacheEntry *pEntry;
+
+  if( nByte>p->nMaxCache/2 ) return 0;
+
+  pEntry = (Fts3CacheEntry *)sqlite3_malloc(nByte);
+  if( !pEntry ) return 0;
+  pEntry->nByte = nByte;
+  pEntry->nRef = 1;
+  pEntry->pSkip = nSkip ? (Fts3SkipList *)&pEntry[1] : 0;
+  pEntry->pKey = &((char *)&pEntry[1])[nSkip];
+  pEntry->nKey = nKey;
+  pEntry->aDoclist = &pEntry->pKey[nKey];
+  pEntry->nDoclist = nDoclist;
+  memcpy(pEntry->pKey, pKey, nKey);
+  memcpy(pEntry->aDoclist, aDoclist, nDoclist);
+  if( nSkip ){
+    fts3SkipListFill(pEntry->pSkip, nSkip, aDoclist, nDoclist);
+  }
+
+  /* HashInsert() returns the data passed to it if it fails to allocate
+  ** a new hash table element. */
+  if( fts3HashInsert(&p->cache, pEntry->pKey, nKey, pEntry)==pEntry ){
+    sqlite3_free(pEntry);
+    return 0;
+  }
+
+  fts3CacheLink(p, pEntry);
+  p->nCache += nByte;
+  while( p->nCache>p->nMaxCache ){
+    fts3CacheRemove(p, p->pOldest);
+  }
+  return pEntry;
+}
+
 /*
 ** This function retreives the doclist for the specified term (or term
 ** prefix) from the database. 
@@ -99961,6 +100559,12 @@ static int fts3TermSelectCb(
 ** then the returned list is in the same format as is stored in the
 ** database without the found length specifier at the start of on-disk
 ** doclists.
+**
+** If ppEntry is not NULL and the doclist is in the cache, *ppEntry is set
+** to a new reference to its cache entry and *ppOut points to the doclist
+** in the entry. The caller must not write to it or free it, but pass the
+** entry to fts3CacheRelease() when done with it. Otherwise *ppEntry is
+** set to NULL and *ppOut is a malloced buffer for the caller to free.
 */
 static int fts3TermSelect(
   Fts3Table *p,                   /* Virtual table handle */
@@ -99970,20 +100574,69 @@ static int fts3TermSelect(
   int isPrefix,                   /* True for a prefix search */
   int isReqPos,                   /* True to include position lists in output */
   int *pnOut,                     /* OUT: Size of buffer at *ppOut */
-  char **ppOut                    /* OUT: Malloced result buffer */
+  char **ppOut,                   /* OUT: Result buffer */
+  Fts3CacheEntry **ppEntry        /* OUT: Cache entry *ppOut is in, or NULL */
 ){
   int i;
   TermSelect tsc;
   Fts3SegFilter filter;           /* Segment term filter configuration */
-  Fts3SegReader **apSegment;      /* Array of segments to read data from */
+  Fts3SegReader **apSegment = 0;  /* Array of segments to read data from */
   int nSegment = 0;               /* Size of apSegment array */
   int nAlloc = 16;                /* Allocated size of segment array */
   int rc;                         /* Return code */
   sqlite3_stmt *pStmt = 0;        /* SQL statement to scan %_segdir table */
   int iAge = 0;                   /* Used to assign ages to segments */
-
-  apSegment = (Fts3SegReader **)sqlite3_malloc(sizeof(Fts3SegReader*)*nAlloc);
-  if( !apSegment ) return SQLITE_NOMEM;
+  char *pKey = 0;                 /* Doclist cache key */
+  int nKey = 0;                   /* Size of pKey in bytes */
+  Fts3CacheEntry *pEntry;         /* Cache entry for the doclist */
+
+  if( ppEntry ) *ppEntry = 0;
+
+  /* Repeated lookups, as when a query is refined word by word, are
+  ** answered from the cache without reading any segments. */
+  if( p->nMaxCache>0 ){
+    fts3CacheValidate(p);
+    pKey = fts3CacheKey(iColumn, zTerm, nTerm, isPrefix, isReqPos, &nKey);
+    if( !pKey ) return SQLITE_NOMEM;
+    pEntry = fts3CacheLookup(p, pKey, nKey);
+    if( pEntry ){
+      sqlite3_free(pKey);
+      *pnOut = pEntry->nDoclist;
+      if( ppEntry ){
+        pEntry->nRef++;
+        *ppEntry = pEntry;
+        *ppOut = pEntry->aDoclist;
+      }else{
+        *ppOut = 0;
+        if( pEntry->nDoclist>0 ){
+          *ppOut = (char *)sqlite3_malloc(pEntry->nDoclist);
+          if( !*ppOut ) return SQLITE_NOMEM;
+          memcpy(*ppOut, pEntry->aDoclist, pEntry->nDoclist);
+        }
+      }
+      return SQLITE_OK;
+    }
+  }
+
+  memset(&tsc, 0, sizeof(TermSelect));
+  tsc.isReqPos = isReqPos;
+
+  /* A short prefix of a query that needs no positions may have its
+  ** doclist in the %_prefixes table, then no segments are read at all.
+  ** The table is for all columns, which a filter on the only column of
+  ** the table is the same as.
+  */
+  if( isPrefix && !isReqPos && (iColumn>=p->nColumn || p->nColumn==1) ){
+    rc = sqlite3Fts3PrefixSelect(p, zTerm, nTerm, &tsc.nOutput, &tsc.aOutput);
+    if( rc!=SQLITE_OK ) goto finished;
+    if( tsc.aOutput ) goto selected;
+  }
+
+  apSegment = (Fts3SegReader **)sqlite3_malloc(sizeof(Fts3SegReader*)*nAlloc);
+  if( !apSegment ){
+    sqlite3_free(pKey);
+    return SQLITE_NOMEM;
+  }
   rc = sqlite3Fts3SegReaderPending(p, zTerm, nTerm, isPrefix, &apSegment[0]);
   if( rc!=SQLITE_OK ) goto finished;
   if( apSegment[0] ){
@@ -100057,9 +100710,6 @@ static int fts3TermSelect(
     goto finished;
   }
 
-  memset(&tsc, 0, sizeof(TermSelect));
-  tsc.isReqPos = isReqPos;
-
   filter.flags = FTS3_SEGMENT_IGNORE_EMPTY 
         | (isPrefix ? FTS3_SEGMENT_PREFIX : 0)
         | (isReqPos ? FTS3_SEGMENT_REQUIRE_POS : 0)
@@ -100072,9 +100722,22 @@ static int fts3TermSelect(
       fts3TermSelectCb, (void *)&tsc
   );
 
+selected:
   if( rc==SQLITE_OK ){
-    *ppOut = tsc.aOutput;
+    pEntry = 0;
+    if( pKey ){
+      pEntry = fts3CacheStore(p, pKey, nKey, tsc.aOutput, tsc.nOutput,
+          isReqPos);
+    }
     *pnOut = tsc.nOutput;
+    if( pEntry && ppEntry ){
+      pEntry->nRef++;
+      *ppEntry = pEntry;
+      *ppOut = pEntry->aDoclist;
+      sqlite3_free(tsc.aOutput);
+    }else{
+      *ppOut = tsc.aOutput;
+    }
   }else{
     sqlite3_free(tsc.aOutput);
   }
@@ -100085,19 +100748,23 @@ finished:
     sqlite3Fts3SegReaderFree(p, apSegment[i]);
   }
   sqlite3_free(apSegment);
+  sqlite3_free(pKey);
   return rc;
 }
 
 
 /* 
-** Return a DocList corresponding to the phrase *pPhrase.
+** Return a DocList corresponding to the phrase *pPhrase. If ppEntry is not
+** NULL, it is set as by fts3TermSelect() for single term phrases, and to
+** NULL otherwise.
 */
 static int fts3PhraseSelect(
   Fts3Table *p,                   /* Virtual table handle */
   Fts3Phrase *pPhrase,            /* Phrase to return a doclist for */
   int isReqPos,                   /* True if output should contain positions */
-  char **paOut,                   /* OUT: Pointer to malloc'd result buffer */
-  int *pnOut                      /* OUT: Size of buffer at *paOut */
+  char **paOut,                   /* OUT: Pointer to result buffer */
+  int *pnOut,                     /* OUT: Size of buffer at *paOut */
+  Fts3CacheEntry **ppEntry        /* OUT: Cache entry *paOut is in, or NULL */
 ){
   char *pOut = 0;
   int nOut = 0;
@@ -100106,6 +100773,7 @@ static int fts3PhraseSelect(
   int iCol = pPhrase->iColumn;
   int isTermPos = (pPhrase->nToken>1 || isReqPos);
 
+  if( ppEntry ) *ppEntry = 0;
   for(ii=0; ii<pPhrase->nToken; ii++){
     struct PhraseToken *pTok = &pPhrase->aToken[ii];
     char *z = pTok->z;            /* Next token of the phrase */
@@ -100114,7 +100782,9 @@ static int fts3PhraseSelect(
     char *pList;                  /* Pointer to token doclist */
     int nList;                    /* Size of buffer at pList */
 
-    rc = fts3TermSelect(p, iCol, z, n, isPrefix, isTermPos, &nList, &pList);
+    rc = fts3TermSelect(p, iCol, z, n, isPrefix, isTermPos, &nList, &pList,
+        pPhrase->nToken==1 ? ppEntry : 0
+    );
     if( rc!=SQLITE_OK ) break;
 
     if( ii==0 ){
@@ -100149,22 +100819,132 @@ static int fts3PhraseSelect(
   return rc;
 }
 
+/*
+** Intersect the docid-only doclists aShort and aLong, writing the result
+** to aOut (which may be the same buffer as aShort). Instead of reading
+** all of aLong, skip list pSkip is used to gallop ahead to the block of
+** aLong that may contain the next docid of aShort, so this takes time
+** proportional to the length of aShort.
+*/
+static void fts3DoclistIntersect(
+  char *aOut,                     /* Output buffer */
+  int *pnOut,                     /* OUT: Bytes written to aOut */
+  char *aShort,                   /* The shorter doclist */
+  int nShort,                     /* Size of aShort in bytes */
+  char *aLong,                    /* The longer doclist */
+  int nLong,                      /* Size of aLong in bytes */
+  Fts3SkipList *pSkip             /* Skip list of aLong */
+){
+  char *p = aShort;
+  char *pEnd = &aShort[nShort];
+  char *q = aLong;
+  char *qEnd = &aLong[nLong];
+  char *pOut = aOut;
+  sqlite3_int64 iShort = 0;       /* Current docid of aShort */
+  sqlite3_int64 iLong = 0;        /* Current docid of aLong */
+  sqlite3_int64 iPrev = 0;        /* Last docid written to aOut */
+  int isLong = 0;                 /* True once iLong was read from q */
+  int iBlock = 0;                 /* Last block jumped to */
+
+  while( p<pEnd ){
+    fts3GetDeltaVarint(&p, &iShort);
+
+    if( !isLong || iLong<iShort ){
+      /* Find the last block that starts with a docid below iShort: first
+      ** double the step until a block starting at or above iShort is
+      ** found, then binary search between the last two steps.
+      */
+      int iLo = iBlock;
+      int iHi = iBlock + 1;
+      int nStep = 1;
+      while( iHi<pSkip->nSkip && pSkip->aSkip[iHi].iPrev<iShort ){
+        iLo = iHi;
+        nStep *= 2;
+        iHi = iLo + nStep;
+      }
+      if( iHi>pSkip->nSkip ) iHi = pSkip->nSkip;
+      while( iHi-iLo>1 ){
+        int iMid = (iLo + iHi) / 2;
+        if( pSkip->aSkip[iMid].iPrev<iShort ){
+          iLo = iMid;
+        }else{
+          iHi = iMid;
+        }
+      }
+
+      /* Jump there, unless reading on got us that far already */
+      iBlock = iLo;
+      if( &aLong[pSkip->aSkip[iLo].iOff]>q ){
+        q = &aLong[pSkip->aSkip[iLo].iOff];
+        iLong = pSkip->aSkip[iLo].iPrev;
+        isLong = 0;
+      }
+    }
+
+    while( (!isLong || iLong<iShort) && q<qEnd ){
+      fts3GetDeltaVarint(&q, &iLong);
+      isLong = 1;
+    }
+    if( isLong && iLong==iShort ){
+      fts3PutDeltaVarint(&pOut, &iPrev, iShort);
+    }else if( q>=qEnd && (!isLong || iLong<iShort) ){
+      break;
+    }
+  }
+
+  *pnOut = (int)(pOut - aOut);
+}
+
+/*
+** Set *paOut to a buffer for the result of an AND or NOT of doclist aIn,
+** nIn bytes long, and another one. That is aIn itself, unless it belongs
+** to cache entry pEntry, which must not be written to.
+*/
+static int fts3DoclistOutput(
+  char *aIn,                      /* Doclist the result may overwrite */
+  int nIn,                        /* Size of aIn in bytes */
+  Fts3CacheEntry *pEntry,         /* Cache entry aIn is in, or NULL */
+  char **paOut                    /* OUT: Output buffer */
+){
+  *paOut = aIn;
+  if( pEntry ){
+    *paOut = (char *)sqlite3_malloc(nIn+1);
+    if( !*paOut ) return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Free doclist aDoclist, or release cache entry pEntry if it is in one.
+*/
+static void fts3DoclistFree(char *aDoclist, Fts3CacheEntry *pEntry){
+  if( pEntry ){
+    fts3CacheRelease(pEntry);
+  }else{
+    sqlite3_free(aDoclist);
+  }
+}
+
 /*
 ** Evaluate the full-text expression pExpr against fts3 table pTab. Store
-** the resulting doclist in *paOut and *pnOut.
+** the resulting doclist in *paOut and *pnOut. If ppEntry is not NULL, it
+** is set as by fts3PhraseSelect(), only the doclists of phrases can be
+** in the cache.
 */
 static int evalFts3Expr(
   Fts3Table *p,                   /* Virtual table handle */
   Fts3Expr *pExpr,                /* Parsed fts3 expression */
-  char **paOut,                   /* OUT: Pointer to malloc'd result buffer */
+  char **paOut,                   /* OUT: Pointer to result buffer */
   int *pnOut,                     /* OUT: Size of buffer at *paOut */
-  int isReqPos                    /* Require positions in output buffer */
+  int isReqPos,                   /* Require positions in output buffer */
+  Fts3CacheEntry **ppEntry        /* OUT: Cache entry *paOut is in, or NULL */
 ){
   int rc = SQLITE_OK;             /* Return code */
 
   /* Zero the output parameters. */
   *paOut = 0;
   *pnOut = 0;
+  if( ppEntry ) *ppEntry = 0;
 
   if( pExpr ){
     assert( pExpr->eType==FTSQUERY_PHRASE 
@@ -100174,17 +100954,37 @@ static int evalFts3Expr(
     if( pExpr->eType==FTSQUERY_PHRASE ){
       rc = fts3PhraseSelect(p, pExpr->pPhrase, 
           isReqPos || (pExpr->pParent && pExpr->pParent->eType==FTSQUERY_NEAR),
-          paOut, pnOut
+          paOut, pnOut, ppEntry
       );
     }else{
-      char *aLeft;
-      char *aRight;
-      int nLeft;
-      int nRight;
+      char *aLeft = 0;
+      char *aRight = 0;
+      int nLeft = 0;
+      int nRight = 0;
+      Fts3CacheEntry *pLeftEntry = 0;
+      Fts3CacheEntry *pRightEntry = 0;
+
+      /* Unless this is an OR, the result is empty if the left side is,
+      ** and, except for NOT, if the right side is. So evaluate one side
+      ** first and don't bother with the other if it matched nothing.
+      */
+      if( pExpr->eType==FTSQUERY_NOT ){
+        rc = evalFts3Expr(p, pExpr->pLeft, &aLeft, &nLeft, isReqPos, 0);
+        if( rc==SQLITE_OK && nLeft>0 ){
+          rc = evalFts3Expr(p, pExpr->pRight, &aRight, &nRight, isReqPos, 0);
+        }
+      }else{
+        rc = evalFts3Expr(p, pExpr->pRight, &aRight, &nRight, isReqPos,
+            &pRightEntry
+        );
+        if( rc==SQLITE_OK && (nRight>0 || pExpr->eType==FTSQUERY_OR) ){
+          rc = evalFts3Expr(p, pExpr->pLeft, &aLeft, &nLeft, isReqPos,
+              &pLeftEntry
+          );
+        }
+      }
 
-      if( 0==(rc = evalFts3Expr(p, pExpr->pRight, &aRight, &nRight, isReqPos))
-       && 0==(rc = evalFts3Expr(p, pExpr->pLeft, &aLeft, &nLeft, isReqPos))
-      ){
+      if( rc==SQLITE_OK ){
         assert( pExpr->eType==FTSQUERY_NEAR || pExpr->eType==FTSQUERY_OR     
             || pExpr->eType==FTSQUERY_AND  || pExpr->eType==FTSQUERY_NOT
         );
@@ -100219,7 +101019,6 @@ static int evalFts3Expr(
             }else{
               *paOut = aBuffer;
             }
-            sqlite3_free(aLeft);
             break;
           }
 
@@ -100234,21 +101033,62 @@ static int evalFts3Expr(
                 aLeft, nLeft, aRight, nRight
             );
             *paOut = aBuffer;
-            sqlite3_free(aLeft);
             break;
           }
 
+          case FTSQUERY_AND: {
+            /* If one doclist is much longer than the other, look up the
+            ** docids of the short one in it through its skip list instead
+            ** of merging the two. The long one is only read where the
+            ** skip list points, it is in the cache to have one. The
+            ** result goes to the short one, if that may be written to.
+            */
+            char *aOut;
+            if( pRightEntry && pRightEntry->pSkip
+             && nRight>nLeft*FTS3_SKIP_RATIO
+            ){
+              rc = fts3DoclistOutput(aLeft, nLeft, pLeftEntry, &aOut);
+              if( rc==SQLITE_OK ){
+                fts3DoclistIntersect(aOut, pnOut, aLeft, nLeft,
+                    aRight, nRight, pRightEntry->pSkip
+                );
+                *paOut = aOut;
+              }
+              break;
+            }
+            if( pLeftEntry && pLeftEntry->pSkip
+             && nLeft>nRight*FTS3_SKIP_RATIO
+            ){
+              rc = fts3DoclistOutput(aRight, nRight, pRightEntry, &aOut);
+              if( rc==SQLITE_OK ){
+                fts3DoclistIntersect(aOut, pnOut, aRight, nRight,
+                    aLeft, nLeft, pLeftEntry->pSkip
+                );
+                *paOut = aOut;
+              }
+              break;
+            }
+            /* fall through */
+          }
+
           default: {
+            char *aOut;
             assert( FTSQUERY_NOT==MERGE_NOT && FTSQUERY_AND==MERGE_AND );
-            fts3DoclistMerge(pExpr->eType, 0, 0, aLeft, pnOut,
-                aLeft, nLeft, aRight, nRight
-            );
-            *paOut = aLeft;
+            rc = fts3DoclistOutput(aLeft, nLeft, pLeftEntry, &aOut);
+            if( rc==SQLITE_OK ){
+              fts3DoclistMerge(pExpr->eType, 0, 0, aOut, pnOut,
+                  aLeft, nLeft, aRight, nRight
+              );
+              *paOut = aOut;
+            }
             break;
           }
         }
       }
-      sqlite3_free(aRight);
+
+      /* The inputs, except one the result was written over */
+      if( aLeft!=*paOut ) fts3DoclistFree(aLeft, pLeftEntry);
+      if( aRight!=*paOut ) fts3DoclistFree(aRight, pRightEntry);
     }
   }
 
@@ -100301,7 +101141,7 @@ static int fts3FilterMethod(
 
   /* In case the cursor has been used before, clear it now. */
   sqlite3_finalize(pCsr->pStmt);
-  sqlite3_free(pCsr->aDoclist);
+  fts3DoclistFree(pCsr->aDoclist, pCsr->pEntry);
   sqlite3Fts3ExprFree(pCsr->pExpr);
   memset(&pCursor[1], 0, sizeof(Fts3Cursor)-sizeof(sqlite3_vtab_cursor));
 
@@ -100335,7 +101175,9 @@ static int fts3FilterMethod(
     );
     if( rc!=SQLITE_OK ) return rc;
 
-    rc = evalFts3Expr(p, pCsr->pExpr, &pCsr->aDoclist, &pCsr->nDoclist, 0);
+    rc = evalFts3Expr(p, pCsr->pExpr, &pCsr->aDoclist, &pCsr->nDoclist, 0,
+        &pCsr->pEntry
+    );
     pCsr->pNextId = pCsr->aDoclist;
     pCsr->iPrevId = 0;
   }
@@ -100417,6 +101259,7 @@ static int fts3UpdateMethod(
   sqlite3_value **apVal,          /* Array of arguments */
   sqlite_int64 *pRowid            /* OUT: The affected (or effected) rowid */
 ){
+  fts3CacheClear((Fts3Table *)pVtab);
   return sqlite3Fts3UpdateMethod(pVtab, nArg, apVal, pRowid);
 }
 
@@ -100429,11 +101272,16 @@ static int fts3SyncMethod(sqlite3_vtab *pVtab){
 }
 
 /*
-** Implementation of xBegin() method. This is a no-op.
+** Implementation of xBegin() method. Another connection may have built
+** the %_prefixes or %_terms table since this one found it missing or
+** emptied it, so forget about that. The first write of the transaction
+** then empties them again if they are there.
 */
 static int fts3BeginMethod(sqlite3_vtab *pVtab){
-  UNUSED_PARAMETER(pVtab);
-  assert( ((Fts3Table *)pVtab)->nPendingData==0 );
+  Fts3Table *p = (Fts3Table *)pVtab;
+  assert( p->nPendingData==0 );
+  p->noPrefixes = 0;
+  p->noTermStats = 0;
   return SQLITE_OK;
 }
 
@@ -100454,6 +101302,7 @@ static int fts3CommitMethod(sqlite3_vtab *pVtab){
 */
 static int fts3RollbackMethod(sqlite3_vtab *pVtab){
   sqlite3Fts3PendingTermsClear((Fts3Table *)pVtab);
+  fts3CacheClear((Fts3Table *)pVtab);
   return SQLITE_OK;
 }
 
@@ -100464,7 +101313,7 @@ static int fts3RollbackMethod(sqlite3_vtab *pVtab){
 ** functions.
 */
 SQLITE_PRIVATE int sqlite3Fts3ExprLoadDoclist(Fts3Table *pTab, Fts3Expr *pExpr){
-  return evalFts3Expr(pTab, pExpr, &pExpr->aDoclist, &pExpr->nDoclist, 1);
+  return evalFts3Expr(pTab, pExpr, &pExpr->aDoclist, &pExpr->nDoclist, 1, 0);
 }
 
 /*
@@ -100751,6 +101600,8 @@ static int fts3RenameMethod(
   Fts3Table *p = (Fts3Table *)pVtab;     
   int rc = SQLITE_NOMEM;          /* Return Code */
   char *zSql;                     /* SQL script to run to rename tables */
+  const char *azOptional[] = { "terms", "prefixes" };
+  int i;                          /* Iterator variable */
  
   zSql = sqlite3_mprintf(
     "ALTER TABLE %Q.'%q_content'  RENAME TO '%q_content';"
@@ -100764,6 +101615,32 @@ static int fts3RenameMethod(
     rc = sqlite3_exec(p->db, zSql, 0, 0, 0);
     sqlite3_free(zSql);
   }
+
+  /* The %_terms and %_prefixes tables are only there once 'termstats'
+  ** and 'prefixes' were run */
+  for(i=0; rc==SQLITE_OK && i<SizeofArray(azOptional); i++){
+    sqlite3_stmt *pStmt = 0;
+    int isTable = 0;
+    zSql = sqlite3_mprintf(
+        "SELECT 1 FROM %Q.sqlite_master WHERE name = '%q_%s'",
+        p->zDb, p->zName, azOptional[i]
+    );
+    if( !zSql ) return SQLITE_NOMEM;
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &pStmt, 0);
+    sqlite3_free(zSql);
+    if( rc==SQLITE_OK ){
+      isTable = (sqlite3_step(pStmt)==SQLITE_ROW);
+      rc = sqlite3_finalize(pStmt);
+    }
+    if( rc==SQLITE_OK && isTable ){
+      zSql = sqlite3_mprintf("ALTER TABLE %Q.'%q_%s' RENAME TO '%q_%s';",
+          p->zDb, p->zName, azOptional[i], zName, azOptional[i]
+      );
+      if( !zSql ) return SQLITE_NOMEM;
+      rc = sqlite3_exec(p->db, zSql, 0, 0, 0);
+      sqlite3_free(zSql);
+    }
+  }
   return rc;
 }
 
@@ -100816,6 +101693,16 @@ SQLITE_PRIVATE void sqlite3Fts3SimpleTokenizerModule(sqlite3_tokenizer_module co
 SQLITE_PRIVATE void sqlite3Fts3PorterTokenizerModule(sqlite3_tokenizer_module const**ppModule);
 SQLITE_PRIVATE void sqlite3Fts3IcuTokenizerModule(sqlite3_tokenizer_module const**ppModule);
 
+/*
+** The "fold" tokenizer (fts3_fold.c) folds case and removes diacritics
+** from the characters of most European scripts, "cjk" also splits CJK
+** text into bigrams. They come with the SQL function fts3_fold(),
+** registered by sqlite3Fts3FoldInit().
+*/
+SQLITE_PRIVATE void sqlite3Fts3FoldTokenizerModule(sqlite3_tokenizer_module const**ppModule);
+SQLITE_PRIVATE void sqlite3Fts3CjkTokenizerModule(sqlite3_tokenizer_module const**ppModule);
+SQLITE_PRIVATE int sqlite3Fts3FoldInit(sqlite3 *db);
+
 /*
 ** Initialise the fts3 extension. If this extension is built as part
 ** of the sqlite library, then this function is called directly by
@@ -100827,6 +101714,8 @@ SQLITE_PRIVATE int sqlite3Fts3Init(sqlite3 *db){
   Fts3Hash *pHash = 0;
   const sqlite3_tokenizer_module *pSimple = 0;
   const sqlite3_tokenizer_module *pPorter = 0;
+  const sqlite3_tokenizer_module *pFold = 0;
+  const sqlite3_tokenizer_module *pCjk = 0;
 
 #ifdef SQLITE_ENABLE_ICU
   const sqlite3_tokenizer_module *pIcu = 0;
@@ -100835,6 +101724,8 @@ SQLITE_PRIVATE int sqlite3Fts3Init(sqlite3 *db){
 
   sqlite3Fts3SimpleTokenizerModule(&pSimple);
   sqlite3Fts3PorterTokenizerModule(&pPorter);
+  sqlite3Fts3FoldTokenizerModule(&pFold);
+  sqlite3Fts3CjkTokenizerModule(&pCjk);
 
   /* Allocate and initialise the hash-table used to store tokenizers. */
   pHash = sqlite3_malloc(sizeof(Fts3Hash));
@@ -100848,6 +101739,8 @@ SQLITE_PRIVATE int sqlite3Fts3Init(sqlite3 *db){
   if( rc==SQLITE_OK ){
     if( sqlite3Fts3HashInsert(pHash, "simple", 7, (void *)pSimple)
      || sqlite3Fts3HashInsert(pHash, "porter", 7, (void *)pPorter) 
+     || sqlite3Fts3HashInsert(pHash, "fold", 5, (void *)pFold)
+     || sqlite3Fts3HashInsert(pHash, "cjk", 4, (void *)pCjk)
 #ifdef SQLITE_ENABLE_ICU
      || (pIcu && sqlite3Fts3HashInsert(pHash, "icu", 4, (void *)pIcu))
 #endif
@@ -100873,6 +101766,7 @@ SQLITE_PRIVATE int sqlite3Fts3Init(sqlite3 *db){
    && SQLITE_OK==(rc = sqlite3_overload_function(db, "offsets", 1))
    && SQLITE_OK==(rc = sqlite3_overload_function(db, "matchinfo", -1))
    && SQLITE_OK==(rc = sqlite3_overload_function(db, "optimize", 1))
+   && SQLITE_OK==(rc = sqlite3Fts3FoldInit(db))
   ){
     return sqlite3_create_module_v2(
         db, "fts3", &fts3Module, (void *)pHash, hashDestroy
@@ -103567,486 +104461,1457 @@ SQLITE_PRIVATE void sqlite3Fts3SimpleTokenizerModule(
 #endif /* !defined(SQLITE_CORE) || defined(SQLITE_ENABLE_FTS3) */
 
 /************** End of fts3_tokenizer1.c *************************************/
-/************** Begin file fts3_write.c **************************************/
+/************** Begin file fts3_fold.c ***************************************/
 /*
-** 2009 Oct 23
-**
-** The author disclaims copyright to this source code.  In place of
-** a legal notice, here is a blessing:
+** Implementation of the "fold" full-text-search tokenizer, for mawire.
 **
-**    May you do good and not evil.
-**    May you find forgiveness for yourself and forgive others.
-**    May you share freely, never taking more than you give.
+** Splits text into tokens like the "simple" tokenizer, but also folds
+** the characters of the scripts most titles are written in: case is
+** folded and diacritics are removed, so that "Zürich", "zurich" and
+** "ZÜRICH" are all the term "zurich". Non-ASCII punctuation, symbols
+** and spaces separate tokens, as ASCII ones do.
 **
-******************************************************************************
+** Folding is a lookup in the tables below per non-ASCII character.
+** They are generated by python/mkfoldtable.py, which also describes
+** exactly what is folded to what.
 **
-** This file is part of the SQLite FTS3 extension module. Specifically,
-** this file contains code to insert, update and delete rows from FTS3
-** tables. It also contains code to merge FTS3 b-tree segments. Some
-** of the sub-routines used to merge segments are also used by the query 
-** code in fts3.c.
+** The "cjk" tokenizer folds the same way, but for Chinese, Japanese and
+** Korean, which are not written with spaces between the words, it
+** splits a run of CJK characters into overlapping bigrams: "ABCD" is
+** the tokens "AB", "BC", "CD" and "D". Any word of two or more
+** characters is then made of terms of the index, and the last
+** character of the run is a token of its own so that a prefix search
+** for a single character finds every run it is in.
 */
 
+/*
+** The code in this file is only compiled if:
+**
+**     * The FTS3 module is being built as an extension
+**       (in which case SQLITE_CORE is not defined), or
+**
+**     * The FTS3 module is being built into the core of
+**       SQLite (in which case SQLITE_ENABLE_FTS3 is defined).
+*/
 #if !defined(SQLITE_CORE) || defined(SQLITE_ENABLE_FTS3)
 
+/*
+** Values of aFoldBlock[] entries other than code points. An entry of 0
+** leaves the character as it is, FOLD_DROP removes it, FOLD_DELIM makes
+** it a token separator and FOLD_EXPAND+i replaces it with the string
+** aFoldExpand[i]. These are UTF-16 surrogates, never characters.
+*/
+#define FOLD_DROP    0xD800
+#define FOLD_DELIM   0xD801
+#define FOLD_EXPAND  0xD802
+
+/* Most bytes a single character can fold to */
+#define FOLD_MAX_BYTES 4
+
+/*
+** aFoldIndex[c>>6] is 0 if no character from c&~63 to c|63 is folded,
+** or 1 plus the index of the block of aFoldBlock[] they are folded by.
+*/
+static const unsigned char aFoldIndex[1024] = {
+   0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0, 22, 23, 24, 25, 26, 27, 28, 29,
+  30, 31,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  32,  0, 33, 34,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 35,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 36, 37, 38, 39
+};
 
-typedef struct PendingList PendingList;
-typedef struct SegmentNode SegmentNode;
-typedef struct SegmentWriter SegmentWriter;
+static const unsigned short aFoldBlock[39][64] = {
+  {
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0x0000, 0xd801, 0xd801, 0xd800, 0xd801, 0xd801,
+    0xd801, 0xd801, 0x0000, 0x0000, 0xd801, 0x03bc, 0xd801, 0xd801,
+    0xd801, 0x0000, 0x0000, 0xd801, 0x0000, 0x0000, 0x0000, 0xd801
+  },
+  {
+    0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0xd802, 0x0063,
+    0x0065, 0x0065, 0x0065, 0x0065, 0x0069, 0x0069, 0x0069, 0x0069,
+    0x0064, 0x006e, 0x006f, 0x006f, 0x006f, 0x006f, 0x006f, 0xd801,
+    0x006f, 0x0075, 0x0075, 0x0075, 0x0075, 0x0079, 0xd803, 0xd804,
+    0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0xd802, 0x0063,
+    0x0065, 0x0065, 0x0065, 0x0065, 0x0069, 0x0069, 0x0069, 0x0069,
+    0x0064, 0x006e, 0x006f, 0x006f, 0x006f, 0x006f, 0x006f, 0xd801,
+    0x006f, 0x0075, 0x0075, 0x0075, 0x0075, 0x0079, 0xd803, 0x0079
+  },
+  {
+    0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0063, 0x0063,
+    0x0063, 0x0063, 0x0063, 0x0063, 0x0063, 0x0063, 0x0064, 0x0064,
+    0x0064, 0x0064, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065,
+    0x0065, 0x0065, 0x0065, 0x0065, 0x0067, 0x0067, 0x0067, 0x0067,
+    0x0067, 0x0067, 0x0067, 0x0067, 0x0068, 0x0068, 0x0068, 0x0068,
+    0x0069, 0x0069, 0x0069, 0x0069, 0x0069, 0x0069, 0x0069, 0x0069,
+    0x0069, 0x0069, 0xd805, 0xd805, 0x006a, 0x006a, 0x006b, 0x006b,
+    0x0000, 0x006c, 0x006c, 0x006c, 0x006c, 0x006c, 0x006c, 0x006c
+  },
+  {
+    0x006c, 0x006c, 0x006c, 0x006e, 0x006e, 0x006e, 0x006e, 0x006e,
+    0x006e, 0xd806, 0x014b, 0x0000, 0x006f, 0x006f, 0x006f, 0x006f,
+    0x006f, 0x006f, 0xd807, 0xd807, 0x0072, 0x0072, 0x0072, 0x0072,
+    0x0072, 0x0072, 0x0073, 0x0073, 0x0073, 0x0073, 0x0073, 0x0073,
+    0x0073, 0x0073, 0x0074, 0x0074, 0x0074, 0x0074, 0x0074, 0x0074,
+    0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075,
+    0x0075, 0x0075, 0x0075, 0x0075, 0x0077, 0x0077, 0x0079, 0x0079,
+    0x0079, 0x007a, 0x007a, 0x007a, 0x007a, 0x007a, 0x007a, 0x0073
+  },
+  {
+    0x0062, 0x0253, 0x0183, 0x0000, 0x0185, 0x0000, 0x0254, 0x0188,
+    0x0000, 0x0256, 0x0257, 0x018c, 0x0000, 0x0000, 0x01dd, 0x0259,
+    0x025b, 0x0192, 0x0000, 0x0260, 0x0263, 0x0000, 0x0269, 0x0069,
+    0x0199, 0x0000, 0x006c, 0x0000, 0x026f, 0x0272, 0x0000, 0x0275,
+    0x006f, 0x006f, 0x01a3, 0x0000, 0x01a5, 0x0000, 0x0280, 0x01a8,
+    0x0000, 0x0283, 0x0000, 0x0000, 0x01ad, 0x0000, 0x0288, 0x0075,
+    0x0075, 0x028a, 0x028b, 0x01b4, 0x0000, 0x007a, 0x007a, 0x0292,
+    0x01b9, 0x0000, 0x0000, 0x0000, 0x01bd, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0x0000, 0x0000, 0x0000, 0x0000, 0xd808, 0xd808, 0xd808, 0xd809,
+    0xd809, 0xd809, 0xd80a, 0xd80a, 0xd80a, 0x0061, 0x0061, 0x0069,
+    0x0069, 0x006f, 0x006f, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075,
+    0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0000, 0x0061, 0x0061,
+    0x0061, 0x0061, 0xd802, 0xd802, 0x0067, 0x0067, 0x0067, 0x0067,
+    0x006b, 0x006b, 0x006f, 0x006f, 0x006f, 0x006f, 0x0292, 0x0292,
+    0x006a, 0xd808, 0xd808, 0xd808, 0x0067, 0x0067, 0x0195, 0x01bf,
+    0x006e, 0x006e, 0x0061, 0x0061, 0xd802, 0xd802, 0x006f, 0x006f
+  },
+  {
+    0x0061, 0x0061, 0x0061, 0x0061, 0x0065, 0x0065, 0x0065, 0x0065,
+    0x0069, 0x0069, 0x0069, 0x0069, 0x006f, 0x006f, 0x006f, 0x006f,
+    0x0072, 0x0072, 0x0072, 0x0072, 0x0075, 0x0075, 0x0075, 0x0075,
+    0x0073, 0x0073, 0x0074, 0x0074, 0x021d, 0x0000, 0x0068, 0x0068,
+    0x019e, 0x0000, 0x0223, 0x0000, 0x0225, 0x0000, 0x0061, 0x0061,
+    0x0065, 0x0065, 0x006f, 0x006f, 0x006f, 0x006f, 0x006f, 0x006f,
+    0x006f, 0x006f, 0x0079, 0x0079, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x2c65, 0x0063, 0x0063, 0x006c, 0x2c66, 0x0000
+  },
+  {
+    0x0000, 0x0242, 0x0000, 0x0062, 0x0075, 0x028c, 0x0065, 0x0065,
+    0x006a, 0x006a, 0x024b, 0x0000, 0x0072, 0x0072, 0x0079, 0x0079,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0069, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0075, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0x0000, 0x0000, 0xd801, 0xd801, 0xd801, 0xd801, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0x0000, 0xd801, 0x0000, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801
+  },
+  {
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800
+  },
+  {
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0x0371, 0x0000, 0x0373, 0x0000, 0x0000, 0xd801, 0x0377, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0xd801, 0x03f3
+  },
+  {
+    0x0000, 0x0000, 0x0000, 0x0000, 0xd801, 0xd801, 0x03b1, 0xd801,
+    0x03b5, 0x03b7, 0x03b9, 0x0000, 0x03bf, 0x0000, 0x03c5, 0x03c9,
+    0x03b9, 0x03b1, 0x03b2, 0x03b3, 0x03b4, 0x03b5, 0x03b6, 0x03b7,
+    0x03b8, 0x03b9, 0x03ba, 0x03bb, 0x03bc, 0x03bd, 0x03be, 0x03bf,
+    0x03c0, 0x03c1, 0x0000, 0x03c3, 0x03c4, 0x03c5, 0x03c6, 0x03c7,
+    0x03c8, 0x03c9, 0x03b9, 0x03c5, 0x03b1, 0x03b5, 0x03b7, 0x03b9,
+    0x03c5, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0x0000, 0x0000, 0x03c3, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x03b9, 0x03c5, 0x03bf, 0x03c5, 0x03c9, 0x03d7,
+    0x03b2, 0x03b8, 0x0000, 0x03d2, 0x03d2, 0x03c6, 0x03c0, 0x0000,
+    0x03d9, 0x0000, 0x03db, 0x0000, 0x03dd, 0x0000, 0x03df, 0x0000,
+    0x03e1, 0x0000, 0x03e3, 0x0000, 0x03e5, 0x0000, 0x03e7, 0x0000,
+    0x03e9, 0x0000, 0x03eb, 0x0000, 0x03ed, 0x0000, 0x03ef, 0x0000,
+    0x03ba, 0x03c1, 0x0000, 0x0000, 0x03b8, 0x03b5, 0xd801, 0x03f8,
+    0x0000, 0x03f2, 0x03fb, 0x0000, 0x0000, 0x037b, 0x037c, 0x037d
+  },
+  {
+    0x0435, 0x0435, 0x0452, 0x0433, 0x0454, 0x0455, 0x0456, 0x0456,
+    0x0458, 0x0459, 0x045a, 0x045b, 0x043a, 0x0438, 0x0443, 0x045f,
+    0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,
+    0x0438, 0x0438, 0x043a, 0x043b, 0x043c, 0x043d, 0x043e, 0x043f,
+    0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,
+    0x0448, 0x0449, 0x044a, 0x044b, 0x044c, 0x044d, 0x044e, 0x044f,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0438, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0435, 0x0435, 0x0000, 0x0433, 0x0000, 0x0000, 0x0000, 0x0456,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x043a, 0x0438, 0x0443, 0x0000,
+    0x0461, 0x0000, 0x0463, 0x0000, 0x0465, 0x0000, 0x0467, 0x0000,
+    0x0469, 0x0000, 0x046b, 0x0000, 0x046d, 0x0000, 0x046f, 0x0000,
+    0x0471, 0x0000, 0x0473, 0x0000, 0x0475, 0x0000, 0x0475, 0x0475,
+    0x0479, 0x0000, 0x047b, 0x0000, 0x047d, 0x0000, 0x047f, 0x0000
+  },
+  {
+    0x0481, 0x0000, 0xd801, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x048b, 0x0000, 0x048d, 0x0000, 0x048f, 0x0000,
+    0x0491, 0x0000, 0x0493, 0x0000, 0x0495, 0x0000, 0x0497, 0x0000,
+    0x0499, 0x0000, 0x049b, 0x0000, 0x049d, 0x0000, 0x049f, 0x0000,
+    0x04a1, 0x0000, 0x04a3, 0x0000, 0x04a5, 0x0000, 0x04a7, 0x0000,
+    0x04a9, 0x0000, 0x04ab, 0x0000, 0x04ad, 0x0000, 0x04af, 0x0000,
+    0x04b1, 0x0000, 0x04b3, 0x0000, 0x04b5, 0x0000, 0x04b7, 0x0000,
+    0x04b9, 0x0000, 0x04bb, 0x0000, 0x04bd, 0x0000, 0x04bf, 0x0000
+  },
+  {
+    0x04cf, 0x0436, 0x0436, 0x04c4, 0x0000, 0x04c6, 0x0000, 0x04c8,
+    0x0000, 0x04ca, 0x0000, 0x04cc, 0x0000, 0x04ce, 0x0000, 0x0000,
+    0x0430, 0x0430, 0x0430, 0x0430, 0x04d5, 0x0000, 0x0435, 0x0435,
+    0x04d9, 0x0000, 0x04d9, 0x04d9, 0x0436, 0x0436, 0x0437, 0x0437,
+    0x04e1, 0x0000, 0x0438, 0x0438, 0x0438, 0x0438, 0x043e, 0x043e,
+    0x04e9, 0x0000, 0x04e9, 0x04e9, 0x044d, 0x044d, 0x0443, 0x0443,
+    0x0443, 0x0443, 0x0443, 0x0443, 0x0447, 0x0447, 0x04f7, 0x0000,
+    0x044b, 0x044b, 0x04fb, 0x0000, 0x04fd, 0x0000, 0x04ff, 0x0000
+  },
+  {
+    0x0501, 0x0000, 0x0503, 0x0000, 0x0505, 0x0000, 0x0507, 0x0000,
+    0x0509, 0x0000, 0x050b, 0x0000, 0x050d, 0x0000, 0x050f, 0x0000,
+    0x0511, 0x0000, 0x0513, 0x0000, 0x0515, 0x0000, 0x0517, 0x0000,
+    0x0519, 0x0000, 0x051b, 0x0000, 0x051d, 0x0000, 0x051f, 0x0000,
+    0x0521, 0x0000, 0x0523, 0x0000, 0x0525, 0x0000, 0x0527, 0x0000,
+    0x0529, 0x0000, 0x052b, 0x0000, 0x052d, 0x0000, 0x052f, 0x0000,
+    0x0000, 0x0561, 0x0562, 0x0563, 0x0564, 0x0565, 0x0566, 0x0567,
+    0x0568, 0x0569, 0x056a, 0x056b, 0x056c, 0x056d, 0x056e, 0x056f
+  },
+  {
+    0x0570, 0x0571, 0x0572, 0x0573, 0x0574, 0x0575, 0x0576, 0x0577,
+    0x0578, 0x0579, 0x057a, 0x057b, 0x057c, 0x057d, 0x057e, 0x057f,
+    0x0580, 0x0581, 0x0582, 0x0583, 0x0584, 0x0585, 0x0586, 0x0000,
+    0x0000, 0x0000, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0xd80b,
+    0x0000, 0xd801, 0xd801, 0x0000, 0x0000, 0xd801, 0xd801, 0xd801,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0x0061, 0x0061, 0x0062, 0x0062, 0x0062, 0x0062, 0x0062, 0x0062,
+    0x0063, 0x0063, 0x0064, 0x0064, 0x0064, 0x0064, 0x0064, 0x0064,
+    0x0064, 0x0064, 0x0064, 0x0064, 0x0065, 0x0065, 0x0065, 0x0065,
+    0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0066, 0x0066,
+    0x0067, 0x0067, 0x0068, 0x0068, 0x0068, 0x0068, 0x0068, 0x0068,
+    0x0068, 0x0068, 0x0068, 0x0068, 0x0069, 0x0069, 0x0069, 0x0069,
+    0x006b, 0x006b, 0x006b, 0x006b, 0x006b, 0x006b, 0x006c, 0x006c,
+    0x006c, 0x006c, 0x006c, 0x006c, 0x006c, 0x006c, 0x006d, 0x006d
+  },
+  {
+    0x006d, 0x006d, 0x006d, 0x006d, 0x006e, 0x006e, 0x006e, 0x006e,
+    0x006e, 0x006e, 0x006e, 0x006e, 0x006f, 0x006f, 0x006f, 0x006f,
+    0x006f, 0x006f, 0x006f, 0x006f, 0x0070, 0x0070, 0x0070, 0x0070,
+    0x0072, 0x0072, 0x0072, 0x0072, 0x0072, 0x0072, 0x0072, 0x0072,
+    0x0073, 0x0073, 0x0073, 0x0073, 0x0073, 0x0073, 0x0073, 0x0073,
+    0x0073, 0x0073, 0x0074, 0x0074, 0x0074, 0x0074, 0x0074, 0x0074,
+    0x0074, 0x0074, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075,
+    0x0075, 0x0075, 0x0075, 0x0075, 0x0076, 0x0076, 0x0076, 0x0076
+  },
+  {
+    0x0077, 0x0077, 0x0077, 0x0077, 0x0077, 0x0077, 0x0077, 0x0077,
+    0x0077, 0x0077, 0x0078, 0x0078, 0x0078, 0x0078, 0x0079, 0x0079,
+    0x007a, 0x007a, 0x007a, 0x007a, 0x007a, 0x007a, 0x0068, 0x0074,
+    0x0077, 0x0079, 0xd80c, 0x0073, 0x0000, 0x0000, 0xd804, 0x0000,
+    0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061,
+    0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061,
+    0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061,
+    0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065
+  },
+  {
+    0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065,
+    0x0069, 0x0069, 0x0069, 0x0069, 0x006f, 0x006f, 0x006f, 0x006f,
+    0x006f, 0x006f, 0x006f, 0x006f, 0x006f, 0x006f, 0x006f, 0x006f,
+    0x006f, 0x006f, 0x006f, 0x006f, 0x006f, 0x006f, 0x006f, 0x006f,
+    0x006f, 0x006f, 0x006f, 0x006f, 0x0075, 0x0075, 0x0075, 0x0075,
+    0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075,
+    0x0075, 0x0075, 0x0079, 0x0079, 0x0079, 0x0079, 0x0079, 0x0079,
+    0x0079, 0x0079, 0x1efb, 0x0000, 0x1efd, 0x0000, 0x1eff, 0x0000
+  },
+  {
+    0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1,
+    0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1,
+    0x03b5, 0x03b5, 0x03b5, 0x03b5, 0x03b5, 0x03b5, 0x0000, 0x0000,
+    0x03b5, 0x03b5, 0x03b5, 0x03b5, 0x03b5, 0x03b5, 0x0000, 0x0000,
+    0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7,
+    0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7,
+    0x03b9, 0x03b9, 0x03b9, 0x03b9, 0x03b9, 0x03b9, 0x03b9, 0x03b9,
+    0x03b9, 0x03b9, 0x03b9, 0x03b9, 0x03b9, 0x03b9, 0x03b9, 0x03b9
+  },
+  {
+    0x03bf, 0x03bf, 0x03bf, 0x03bf, 0x03bf, 0x03bf, 0x0000, 0x0000,
+    0x03bf, 0x03bf, 0x03bf, 0x03bf, 0x03bf, 0x03bf, 0x0000, 0x0000,
+    0x03c5, 0x03c5, 0x03c5, 0x03c5, 0x03c5, 0x03c5, 0x03c5, 0x03c5,
+    0x0000, 0x03c5, 0x0000, 0x03c5, 0x0000, 0x03c5, 0x0000, 0x03c5,
+    0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9,
+    0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9,
+    0x03b1, 0x03b1, 0x03b5, 0x03b5, 0x03b7, 0x03b7, 0x03b9, 0x03b9,
+    0x03bf, 0x03bf, 0x03c5, 0x03c5, 0x03c9, 0x03c9, 0x0000, 0x0000
+  },
+  {
+    0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1,
+    0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1,
+    0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7,
+    0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7, 0x03b7,
+    0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9,
+    0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9, 0x03c9,
+    0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x0000, 0x03b1, 0x03b1,
+    0x03b1, 0x03b1, 0x03b1, 0x03b1, 0x03b1, 0xd801, 0x03b9, 0xd801
+  },
+  {
+    0xd801, 0xd801, 0x03b7, 0x03b7, 0x03b7, 0x0000, 0x03b7, 0x03b7,
+    0x03b5, 0x03b5, 0x03b7, 0x03b7, 0x03b7, 0xd801, 0xd801, 0xd801,
+    0x03b9, 0x03b9, 0x03b9, 0x03b9, 0x0000, 0x0000, 0x03b9, 0x03b9,
+    0x03b9, 0x03b9, 0x03b9, 0x03b9, 0x0000, 0xd801, 0xd801, 0xd801,
+    0x03c5, 0x03c5, 0x03c5, 0x03c5, 0x03c1, 0x03c1, 0x03c5, 0x03c5,
+    0x03c5, 0x03c5, 0x03c5, 0x03c5, 0x03c1, 0xd801, 0xd801, 0xd801,
+    0x0000, 0x0000, 0x03c9, 0x03c9, 0x03c9, 0x0000, 0x03c9, 0x03c9,
+    0x03bf, 0x03bf, 0x03c9, 0x03c9, 0x03c9, 0xd801, 0xd801, 0x0000
+  },
+  {
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801
+  },
+  {
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0x0000, 0xd800, 0xd800,
+    0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800, 0xd800,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0x0000, 0x0000, 0x0000,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0xd801, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0xd801, 0xd801,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0xd801, 0xd801, 0xd801
+  },
+  {
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0xd801, 0xd801, 0x0000, 0x0000, 0x0000,
+    0xd801, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0xd801, 0x0000, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0xd80d, 0xd80e, 0xd80f, 0xd810, 0xd811, 0xd812, 0xd812, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0xd813, 0xd814, 0xd815, 0xd816, 0xd817,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+  },
+  {
+    0x0000, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007a, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801
+  },
+  {
+    0xd801, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007a, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0x30f2, 0x30a1,
+    0x30a3, 0x30a5, 0x30a7, 0x30a9, 0x30e3, 0x30e5, 0x30e7, 0x30c3,
+    0x30fc, 0x30a2, 0x30a4, 0x30a6, 0x30a8, 0x30aa, 0x30ab, 0x30ad,
+    0x30af, 0x30b1, 0x30b3, 0x30b5, 0x30b7, 0x30b9, 0x30bb, 0x30bd
+  },
+  {
+    0x30bf, 0x30c1, 0x30c4, 0x30c6, 0x30c8, 0x30ca, 0x30cb, 0x30cc,
+    0x30cd, 0x30ce, 0x30cf, 0x30d2, 0x30d5, 0x30d8, 0x30db, 0x30de,
+    0x30df, 0x30e0, 0x30e1, 0x30e2, 0x30e4, 0x30e6, 0x30e8, 0x30e9,
+    0x30ea, 0x30eb, 0x30ec, 0x30ed, 0x30ef, 0x30f3, 0xd800, 0xd800,
+    0x1160, 0x1100, 0x1101, 0x11aa, 0x1102, 0x11ac, 0x11ad, 0x1103,
+    0x1104, 0x1105, 0x11b0, 0x11b1, 0x11b2, 0x11b3, 0x11b4, 0x11b5,
+    0x111a, 0x1106, 0x1107, 0x1108, 0x1121, 0x1109, 0x110a, 0x110b,
+    0x110c, 0x110d, 0x110e, 0x110f, 0x1110, 0x1111, 0x1112, 0x0000
+  },
+  {
+    0x0000, 0x0000, 0x1161, 0x1162, 0x1163, 0x1164, 0x1165, 0x1166,
+    0x0000, 0x0000, 0x1167, 0x1168, 0x1169, 0x116a, 0x116b, 0x116c,
+    0x0000, 0x0000, 0x116d, 0x116e, 0x116f, 0x1170, 0x1171, 0x1172,
+    0x0000, 0x0000, 0x1173, 0x1174, 0x1175, 0x0000, 0x0000, 0x0000,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0x0000,
+    0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0xd801, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+  }
+};
+
+static const char *const aFoldExpand[22] = {
+  "ae", "th", "ss", "ij", "\xca\xbcn", "oe", "dz", "lj", "nj",
+  "\xd5\xa5\xd6\x82", "a\xca\xbe", "ff", "fi", "fl", "ffi", "ffl", "st",
+  "\xd5\xb4\xd5\xb6", "\xd5\xb4\xd5\xa5", "\xd5\xb4\xd5\xab",
+  "\xd5\xbe\xd5\xb6", "\xd5\xb4\xd5\xad"
+};
+
+typedef struct fold_tokenizer {
+  sqlite3_tokenizer base;
+  int bBigrams;                /* true for the "cjk" tokenizer */
+} fold_tokenizer;
+
+typedef struct fold_tokenizer_cursor {
+  sqlite3_tokenizer_cursor base;
+  const unsigned char *pInput; /* input we are tokenizing */
+  int nBytes;                  /* size of the input */
+  int iOffset;                 /* current position in pInput */
+  int iToken;                  /* index of next token to be returned */
+  char *pToken;                /* storage for current token */
+  int nTokenAllocated;         /* space allocated to zToken buffer */
+  int bBigrams;                /* split CJK runs into bigrams */
+  int bRun;                    /* last token was a bigram */
+  int bTail;                   /* token is the last character of a run */
+} fold_tokenizer_cursor;
 
 /*
-** Data structure used while accumulating terms in the pending-terms hash
-** table. The hash table entry maps from term (a string) to a malloc'd
-** instance of this structure.
+** Return what the character c folds to: FOLD_DELIM, FOLD_DROP, a
+** FOLD_EXPAND value or the folded character itself.
 */
-struct PendingList {
-  int nData;
-  char *aData;
-  int nSpace;
-  sqlite3_int64 iLastDocid;
-  sqlite3_int64 iLastCol;
-  sqlite3_int64 iLastPos;
-};
+static int foldChar(int c){
+  int iBlock;
+  if( c<0x80 ){
+    return sqlite3Isalnum(c) ? sqlite3Tolower(c) : FOLD_DELIM;
+  }
+  if( c>=0x10000 ) return c;
+  iBlock = aFoldIndex[c>>6];
+  if( iBlock && aFoldBlock[iBlock-1][c&63] ){
+    return aFoldBlock[iBlock-1][c&63];
+  }
+  return c;
+}
 
 /*
-** An instance of this structure is used to iterate through the terms on
-** a contiguous set of segment b-tree leaf nodes. Although the details of
-** this structure are only manipulated by code in this file, opaque handles
-** of type Fts3SegReader* are also used by code in fts3.c to iterate through
-** terms when querying the full-text index. See functions:
-**
-**   sqlite3Fts3SegReaderNew()
-**   sqlite3Fts3SegReaderFree()
-**   sqlite3Fts3SegReaderIterate()
-**
-** Methods used to manipulate Fts3SegReader structures:
-**
-**   fts3SegReaderNext()
-**   fts3SegReaderFirstDocid()
-**   fts3SegReaderNextDocid()
+** Return true if the folded character c is one of the Han ideographs,
+** kana or Hangul that the "cjk" tokenizer splits into bigrams.
 */
-struct Fts3SegReader {
-  int iIdx;                       /* Index within level, or 0x7FFFFFFF for PT */
-  sqlite3_int64 iStartBlock;
-  sqlite3_int64 iEndBlock;
-  sqlite3_stmt *pStmt;            /* SQL Statement to access leaf nodes */
-  char *aNode;                    /* Pointer to node data (or NULL) */
-  int nNode;                      /* Size of buffer at aNode (or 0) */
-  int nTermAlloc;                 /* Allocated size of zTerm buffer */
-  Fts3HashElem **ppNextElem;
+static int foldIsCjk(int c){
+  return (c>=0x1100 && c<=0x11FF)       /* Hangul Jamo */
+      || (c>=0x2E80 && c<=0x2FDF)       /* CJK and Kangxi radicals */
+      || (c>=0x3005 && c<=0x3007)       /* iteration marks, ideographic 0 */
+      || (c>=0x3040 && c<=0x30FF)       /* Hiragana, Katakana */
+      || (c>=0x3100 && c<=0x31FF)       /* Bopomofo, Hangul Jamo, ... */
+      || (c>=0x3400 && c<=0x4DBF)       /* CJK Extension A */
+      || (c>=0x4E00 && c<=0x9FFF)       /* CJK Unified Ideographs */
+      || (c>=0xA960 && c<=0xA97F)       /* Hangul Jamo Extended-A */
+      || (c>=0xAC00 && c<=0xD7FF)       /* Hangul, Jamo Extended-B */
+      || (c>=0xF900 && c<=0xFAFF)       /* CJK Compatibility Ideographs */
+      || (c>=0x20000 && c<=0x2FFFF);    /* CJK Extension B and later */
+}
 
-  /* Variables set by fts3SegReaderNext(). These may be read directly
-  ** by the caller. They are valid from the time SegmentReaderNew() returns
-  ** until SegmentReaderNext() returns something other than SQLITE_OK
-  ** (i.e. SQLITE_DONE).
-  */
-  int nTerm;                      /* Number of bytes in current term */
-  char *zTerm;                    /* Pointer to current term */
-  char *aDoclist;                 /* Pointer to doclist of current entry */
-  int nDoclist;                   /* Size of doclist in current entry */
+/*
+** Create a new tokenizer instance. The tokenizers take no arguments.
+*/
+static int foldCreateTokenizer(
+  int bBigrams,
+  sqlite3_tokenizer **ppTokenizer
+){
+  fold_tokenizer *t;
 
-  /* The following variables are used to iterate through the current doclist */
-  char *pOffsetList;
-  sqlite3_int64 iDocid;
-};
+  t = (fold_tokenizer *) sqlite3_malloc(sizeof(*t));
+  if( t==NULL ) return SQLITE_NOMEM;
+  memset(t, 0, sizeof(*t));
+  t->bBigrams = bBigrams;
 
-#define fts3SegReaderIsPending(p) ((p)->ppNextElem!=0)
+  *ppTokenizer = &t->base;
+  return SQLITE_OK;
+}
 
-/*
-** An instance of this structure is used to create a segment b-tree in the
-** database. The internal details of this type are only accessed by the
-** following functions:
-**
-**   fts3SegWriterAdd()
-**   fts3SegWriterFlush()
-**   fts3SegWriterFree()
+static int foldCreate(
+  int argc, const char * const *argv,
+  sqlite3_tokenizer **ppTokenizer
+){
+  UNUSED_PARAMETER(argc);
+  UNUSED_PARAMETER(argv);
+  return foldCreateTokenizer(0, ppTokenizer);
+}
+
+static int cjkCreate(
+  int argc, const char * const *argv,
+  sqlite3_tokenizer **ppTokenizer
+){
+  UNUSED_PARAMETER(argc);
+  UNUSED_PARAMETER(argv);
+  return foldCreateTokenizer(1, ppTokenizer);
+}
+
+/*
+** Destroy a tokenizer
 */
-struct SegmentWriter {
-  SegmentNode *pTree;             /* Pointer to interior tree structure */
-  sqlite3_int64 iFirst;           /* First slot in %_segments written */
-  sqlite3_int64 iFree;            /* Next free slot in %_segments */
-  char *zTerm;                    /* Pointer to previous term buffer */
-  int nTerm;                      /* Number of bytes in zTerm */
-  int nMalloc;                    /* Size of malloc'd buffer at zMalloc */
-  char *zMalloc;                  /* Malloc'd space (possibly) used for zTerm */
-  int nSize;                      /* Size of allocation at aData */
-  int nData;                      /* Bytes of data in aData */
-  char *aData;                    /* Pointer to block from malloc() */
-};
+static int foldDestroy(sqlite3_tokenizer *pTokenizer){
+  sqlite3_free(pTokenizer);
+  return SQLITE_OK;
+}
 
 /*
-** Type SegmentNode is used by the following three functions to create
-** the interior part of the segment b+-tree structures (everything except
-** the leaf nodes). These functions and type are only ever used by code
-** within the fts3SegWriterXXX() family of functions described above.
-**
-**   fts3NodeAddTerm()
-**   fts3NodeWrite()
-**   fts3NodeFree()
+** Prepare to begin tokenizing a particular string.  The input
+** string to be tokenized is pInput[0..nBytes-1].  A cursor
+** used to incrementally tokenize this string is returned in 
+** *ppCursor.
 */
-struct SegmentNode {
-  SegmentNode *pParent;           /* Parent node (or NULL for root node) */
-  SegmentNode *pRight;            /* Pointer to right-sibling */
-  SegmentNode *pLeftmost;         /* Pointer to left-most node of this depth */
-  int nEntry;                     /* Number of terms written to node so far */
-  char *zTerm;                    /* Pointer to previous term buffer */
-  int nTerm;                      /* Number of bytes in zTerm */
-  int nMalloc;                    /* Size of malloc'd buffer at zMalloc */
-  char *zMalloc;                  /* Malloc'd space (possibly) used for zTerm */
-  int nData;                      /* Bytes of valid data so far */
-  char *aData;                    /* Node data */
-};
+static int foldOpen(
+  sqlite3_tokenizer *pTokenizer,         /* The tokenizer */
+  const char *pInput, int nBytes,        /* String to be tokenized */
+  sqlite3_tokenizer_cursor **ppCursor    /* OUT: Tokenization cursor */
+){
+  fold_tokenizer_cursor *c;
+
+  c = (fold_tokenizer_cursor *) sqlite3_malloc(sizeof(*c));
+  if( c==NULL ) return SQLITE_NOMEM;
+
+  c->pInput = (const unsigned char *)pInput;
+  if( pInput==0 ){
+    c->nBytes = 0;
+  }else if( nBytes<0 ){
+    c->nBytes = (int)strlen(pInput);
+  }else{
+    c->nBytes = nBytes;
+  }
+  c->iOffset = 0;                 /* start tokenizing at the beginning */
+  c->iToken = 0;
+  c->pToken = NULL;               /* no space allocated, yet. */
+  c->nTokenAllocated = 0;
+  c->bBigrams = pTokenizer ? ((fold_tokenizer *)pTokenizer)->bBigrams : 0;
+  c->bRun = 0;
+  c->bTail = 0;
+
+  *ppCursor = &c->base;
+  return SQLITE_OK;
+}
 
 /*
-** Valid values for the second argument to fts3SqlStmt().
+** Close a tokenization cursor previously opened by a call to
+** foldOpen() above.
 */
-#define SQL_DELETE_CONTENT             0
-#define SQL_IS_EMPTY                   1
-#define SQL_DELETE_ALL_CONTENT         2 
-#define SQL_DELETE_ALL_SEGMENTS        3
-#define SQL_DELETE_ALL_SEGDIR          4
-#define SQL_SELECT_CONTENT_BY_ROWID    5
-#define SQL_NEXT_SEGMENT_INDEX         6
-#define SQL_INSERT_SEGMENTS            7
-#define SQL_NEXT_SEGMENTS_ID           8
-#define SQL_INSERT_SEGDIR              9
-#define SQL_SELECT_LEVEL              10
-#define SQL_SELECT_ALL_LEVEL          11
-#define SQL_SELECT_LEVEL_COUNT        12
-#define SQL_SELECT_SEGDIR_COUNT_MAX   13
-#define SQL_DELETE_SEGDIR_BY_LEVEL    14
-#define SQL_DELETE_SEGMENTS_RANGE     15
-#define SQL_CONTENT_INSERT            16
-#define SQL_GET_BLOCK                 17
+static int foldClose(sqlite3_tokenizer_cursor *pCursor){
+  fold_tokenizer_cursor *c = (fold_tokenizer_cursor *) pCursor;
+  sqlite3_free(c->pToken);
+  sqlite3_free(c);
+  return SQLITE_OK;
+}
 
 /*
-** This function is used to obtain an SQLite prepared statement handle
-** for the statement identified by the second argument. If successful,
-** *pp is set to the requested statement handle and SQLITE_OK returned.
-** Otherwise, an SQLite error code is returned and *pp is set to 0.
+** Append what a character folds to (iFold, as returned by foldChar())
+** to the token being built, which is *pn bytes long so far.
+*/
+static int foldAppend(fold_tokenizer_cursor *c, int *pn, int iFold){
+  int n = *pn;
+
+  if( n+FOLD_MAX_BYTES>c->nTokenAllocated ){
+    char *pNew;
+    c->nTokenAllocated = n+FOLD_MAX_BYTES+20;
+    pNew = sqlite3_realloc(c->pToken, c->nTokenAllocated);
+    if( pNew==NULL ) return SQLITE_NOMEM;
+    c->pToken = pNew;
+  }
+
+  if( iFold>=FOLD_EXPAND && iFold<0xE000 ){
+    const char *zExpand = aFoldExpand[iFold-FOLD_EXPAND];
+    int nExpand = (int)strlen(zExpand);
+    memcpy(&c->pToken[n], zExpand, nExpand);
+    n += nExpand;
+  }else{
+    unsigned char *zOut = (unsigned char *)&c->pToken[n];
+    WRITE_UTF8(zOut, iFold);
+    n = (int)(zOut - (unsigned char *)c->pToken);
+  }
+
+  *pn = n;
+  return SQLITE_OK;
+}
+
+/*
+** Extract the next token from a tokenization cursor.  The cursor must
+** have been opened by a prior call to foldOpen(). Characters that are
+** dropped are part of the token's extent in the input, but a run of
+** nothing but dropped characters is not a token.
 **
-** If argument apVal is not NULL, then it must point to an array with
-** at least as many entries as the requested statement has bound 
-** parameters. The values are bound to the statements parameters before
-** returning.
+** For the "cjk" tokenizer, a CJK character is a token together with
+** the next character if that is CJK too. The cursor then stays just
+** before the next character, where the next bigram starts.
 */
-static int fts3SqlStmt(
-  Fts3Table *p,                   /* Virtual table handle */
-  int eStmt,                      /* One of the SQL_XXX constants above */
-  sqlite3_stmt **pp,              /* OUT: Statement handle */
-  sqlite3_value **apVal           /* Values to bind to statement */
+static int foldNext(
+  sqlite3_tokenizer_cursor *pCursor,  /* Cursor returned by foldOpen */
+  const char **ppToken,               /* OUT: *ppToken is the token text */
+  int *pnBytes,                       /* OUT: Number of bytes in token */
+  int *piStartOffset,                 /* OUT: Starting offset of token */
+  int *piEndOffset,                   /* OUT: Ending offset of token */
+  int *piPosition                     /* OUT: Position integer of token */
 ){
-  const char *azSql[] = {
-/* 0  */  "DELETE FROM %Q.'%q_content' WHERE rowid = ?",
-/* 1  */  "SELECT NOT EXISTS(SELECT docid FROM %Q.'%q_content' WHERE rowid!=?)",
-/* 2  */  "DELETE FROM %Q.'%q_content'",
-/* 3  */  "DELETE FROM %Q.'%q_segments'",
-/* 4  */  "DELETE FROM %Q.'%q_segdir'",
-/* 5  */  "SELECT * FROM %Q.'%q_content' WHERE rowid=?",
-/* 6  */  "SELECT coalesce(max(idx)+1, 0) FROM %Q.'%q_segdir' WHERE level=?",
-/* 7  */  "INSERT INTO %Q.'%q_segments'(blockid, block) VALUES(?, ?)",
-/* 8  */  "SELECT coalesce(max(blockid)+1, 1) FROM %Q.'%q_segments'",
-/* 9  */  "INSERT INTO %Q.'%q_segdir' VALUES(?,?,?,?,?,?)",
-
-          /* Return segments in order from oldest to newest.*/ 
-/* 10 */  "SELECT idx, start_block, leaves_end_block, end_block, root "
-            "FROM %Q.'%q_segdir' WHERE level = ? ORDER BY idx ASC",
-/* 11 */  "SELECT idx, start_block, leaves_end_block, end_block, root "
-            "FROM %Q.'%q_segdir' ORDER BY level DESC, idx ASC",
+  fold_tokenizer_cursor *c = (fold_tokenizer_cursor *) pCursor;
+  const unsigned char *zTerm = &c->pInput[c->nBytes];
+  int iStartOffset = -1;
+  int iEndOffset;
+  int isCjk = 0;
+  int n = 0;
+  int rc;
 
-/* 12 */  "SELECT count(*) FROM %Q.'%q_segdir' WHERE level = ?",
-/* 13 */  "SELECT count(*), max(level) FROM %Q.'%q_segdir'",
+  while( c->iOffset<c->nBytes ){
+    const unsigned char *z = &c->pInput[c->iOffset];
+    int ch;
+    int iFold;
 
-/* 14 */  "DELETE FROM %Q.'%q_segdir' WHERE level = ?",
-/* 15 */  "DELETE FROM %Q.'%q_segments' WHERE blockid BETWEEN ? AND ?",
-/* 16 */  "INSERT INTO %Q.'%q_content' VALUES(%z)",
-/* 17 */  "SELECT block FROM %Q.'%q_segments' WHERE blockid = ?",
-  };
-  int rc = SQLITE_OK;
-  sqlite3_stmt *pStmt;
+    READ_UTF8(z, zTerm, ch);
+    iFold = foldChar(ch);
 
-  assert( SizeofArray(azSql)==SizeofArray(p->aStmt) );
-  assert( eStmt<SizeofArray(azSql) && eStmt>=0 );
-  
-  pStmt = p->aStmt[eStmt];
-  if( !pStmt ){
-    char *zSql;
-    if( eStmt==SQL_CONTENT_INSERT ){
-      int i;                      /* Iterator variable */  
-      char *zVarlist;             /* The "?, ?, ..." string */
-      zVarlist = (char *)sqlite3_malloc(2*p->nColumn+2);
-      if( !zVarlist ){
-        *pp = 0;
-        return SQLITE_NOMEM;
-      }
-      zVarlist[0] = '?';
-      zVarlist[p->nColumn*2+1] = '\0';
-      for(i=1; i<=p->nColumn; i++){
-        zVarlist[i*2-1] = ',';
-        zVarlist[i*2] = '?';
-      }
-      zSql = sqlite3_mprintf(azSql[eStmt], p->zDb, p->zName, zVarlist);
-    }else{
-      zSql = sqlite3_mprintf(azSql[eStmt], p->zDb, p->zName);
+    if( iFold==FOLD_DELIM ){
+      if( n>0 ) break;
+      iStartOffset = -1;
+      c->iOffset = (int)(z - c->pInput);
+      continue;
     }
-    if( !zSql ){
-      rc = SQLITE_NOMEM;
-    }else{
-      rc = sqlite3_prepare_v2(p->db, zSql, -1, &pStmt, NULL);
-      sqlite3_free(zSql);
-      assert( rc==SQLITE_OK || pStmt==0 );
-      p->aStmt[eStmt] = pStmt;
+
+    if( c->bBigrams && foldIsCjk(iFold) ){
+      /* A CJK character ends the token before it */
+      if( n>0 ) break;
+      isCjk = 1;
     }
+
+    if( iStartOffset<0 ) iStartOffset = c->iOffset;
+    c->iOffset = (int)(z - c->pInput);
+    if( iFold==FOLD_DROP ) continue;
+
+    rc = foldAppend(c, &n, iFold);
+    if( rc!=SQLITE_OK ) return rc;
+    if( isCjk ) break;
   }
-  if( apVal ){
-    int i;
-    int nParam = sqlite3_bind_parameter_count(pStmt);
-    for(i=0; rc==SQLITE_OK && i<nParam; i++){
-      rc = sqlite3_bind_value(pStmt, i+1, apVal[i]);
+
+  if( n==0 ) return SQLITE_DONE;
+  iEndOffset = c->iOffset;
+
+  if( isCjk ){
+    const unsigned char *z = &c->pInput[c->iOffset];
+    int isBigram = 0;
+
+    while( z<zTerm ){
+      int ch;
+      int iFold;
+
+      READ_UTF8(z, zTerm, ch);
+      iFold = foldChar(ch);
+      if( iFold==FOLD_DROP ) continue;
+      if( foldIsCjk(iFold) ){
+        rc = foldAppend(c, &n, iFold);
+        if( rc!=SQLITE_OK ) return rc;
+        iEndOffset = (int)(z - c->pInput);
+        isBigram = 1;
+      }
+      break;
     }
+
+    c->bTail = !isBigram && c->bRun;
+    c->bRun = isBigram;
+  }else{
+    c->bTail = 0;
+    c->bRun = 0;
   }
-  *pp = pStmt;
-  return rc;
+
+  *ppToken = c->pToken;
+  *pnBytes = n;
+  *piStartOffset = iStartOffset;
+  *piEndOffset = iEndOffset;
+  *piPosition = c->iToken++;
+  return SQLITE_OK;
 }
 
 /*
-** Similar to fts3SqlStmt(). Except, after binding the parameters in
-** array apVal[] to the SQL statement identified by eStmt, the statement
-** is executed.
-**
-** Returns SQLITE_OK if the statement is successfully executed, or an
-** SQLite error code otherwise.
+** The set of routines that implement the fold and cjk tokenizers
 */
-static int fts3SqlExec(Fts3Table *p, int eStmt, sqlite3_value **apVal){
-  sqlite3_stmt *pStmt;
-  int rc = fts3SqlStmt(p, eStmt, &pStmt, apVal); 
-  if( rc==SQLITE_OK ){
-    sqlite3_step(pStmt);
-    rc = sqlite3_reset(pStmt);
-  }
-  return rc;
-}
+static const sqlite3_tokenizer_module foldTokenizerModule = {
+  0,
+  foldCreate,
+  foldDestroy,
+  foldOpen,
+  foldClose,
+  foldNext,
+};
 
+static const sqlite3_tokenizer_module cjkTokenizerModule = {
+  0,
+  cjkCreate,
+  foldDestroy,
+  foldOpen,
+  foldClose,
+  foldNext,
+};
 
 /*
-** Read a single block from the %_segments table. If the specified block
-** does not exist, return SQLITE_CORRUPT. If some other error (malloc, IO 
-** etc.) occurs, return the appropriate SQLite error code.
-**
-** Otherwise, if successful, set *pzBlock to point to a buffer containing
-** the block read from the database, and *pnBlock to the size of the read
-** block in bytes.
-**
-** WARNING: The returned buffer is only valid until the next call to 
-** sqlite3Fts3ReadBlock().
+** Allocate a new fold tokenizer.  Return a pointer to the new
+** tokenizer in *ppModule
 */
-SQLITE_PRIVATE int sqlite3Fts3ReadBlock(
-  Fts3Table *p,
-  sqlite3_int64 iBlock,
-  char const **pzBlock,
-  int *pnBlock
+SQLITE_PRIVATE void sqlite3Fts3FoldTokenizerModule(
+  sqlite3_tokenizer_module const**ppModule
 ){
-  sqlite3_stmt *pStmt;
-  int rc = fts3SqlStmt(p, SQL_GET_BLOCK, &pStmt, 0);
-  if( rc!=SQLITE_OK ) return rc;
-  sqlite3_reset(pStmt);
-
-  if( pzBlock ){
-    sqlite3_bind_int64(pStmt, 1, iBlock);
-    rc = sqlite3_step(pStmt); 
-    if( rc!=SQLITE_ROW ){
-      return (rc==SQLITE_DONE ? SQLITE_CORRUPT : rc);
-    }
-  
-    *pnBlock = sqlite3_column_bytes(pStmt, 0);
-    *pzBlock = (char *)sqlite3_column_blob(pStmt, 0);
-    if( sqlite3_column_type(pStmt, 0)!=SQLITE_BLOB ){
-      return SQLITE_CORRUPT;
-    }
-  }
-  return SQLITE_OK;
+  *ppModule = &foldTokenizerModule;
 }
 
 /*
-** Set *ppStmt to a statement handle that may be used to iterate through
-** all rows in the %_segdir table, from oldest to newest. If successful,
-** return SQLITE_OK. If an error occurs while preparing the statement, 
-** return an SQLite error code.
-**
-** There is only ever one instance of this SQL statement compiled for
-** each FTS3 table.
-**
-** The statement returns the following columns from the %_segdir table:
-**
-**   0: idx
-**   1: start_block
-**   2: leaves_end_block
-**   3: end_block
-**   4: root
+** Allocate a new cjk tokenizer.  Return a pointer to the new
+** tokenizer in *ppModule
 */
-SQLITE_PRIVATE int sqlite3Fts3AllSegdirs(Fts3Table *p, sqlite3_stmt **ppStmt){
-  return fts3SqlStmt(p, SQL_SELECT_ALL_LEVEL, ppStmt, 0);
+SQLITE_PRIVATE void sqlite3Fts3CjkTokenizerModule(
+  sqlite3_tokenizer_module const**ppModule
+){
+  *ppModule = &cjkTokenizerModule;
 }
 
-
 /*
-** Append a single varint to a PendingList buffer. SQLITE_OK is returned
-** if successful, or an SQLite error code otherwise.
-**
-** This function also serves to allocate the PendingList structure itself.
-** For example, to create a new PendingList structure containing two
-** varints:
-**
-**   PendingList *p = 0;
-**   fts3PendingListAppendVarint(&p, 1);
-**   fts3PendingListAppendVarint(&p, 2);
+** Implementation of the SQL function fts3_fold(X, TOKENIZER). Returns
+** the tokens the tokenizer, "fold" (the default) or "cjk", makes of X,
+** separated by single spaces, that is X as the index sees it. Lets a
+** query be looked up in the tables built from the index terms
+** ('termstats' and 'prefixes'). The last character of a CJK run is
+** left out after a bigram, which already has it.
 */
-static int fts3PendingListAppendVarint(
-  PendingList **pp,               /* IN/OUT: Pointer to PendingList struct */
-  sqlite3_int64 i                 /* Value to append to data */
+static void fts3FoldFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
 ){
-  PendingList *p = *pp;
+  sqlite3_tokenizer_cursor *pCursor = 0;
+  fold_tokenizer tokenizer;
+  const char *zInput;
+  const char *zToken;
+  int nToken, iStart, iEnd, iPos;
+  char *zOut;
+  int nOut = 0;
+  int nInput;
+  int rc;
 
-  /* Allocate or grow the PendingList as required. */
-  if( !p ){
-    p = sqlite3_malloc(sizeof(*p) + 100);
-    if( !p ){
-      return SQLITE_NOMEM;
-    }
-    p->nSpace = 100;
-    p->aData = (char *)&p[1];
-    p->nData = 0;
-  }
-  else if( p->nData+FTS3_VARINT_MAX+1>p->nSpace ){
-    int nNew = p->nSpace * 2;
-    p = sqlite3_realloc(p, sizeof(*p) + nNew);
-    if( !p ){
-      sqlite3_free(*pp);
-      *pp = 0;
-      return SQLITE_NOMEM;
+  memset(&tokenizer, 0, sizeof(tokenizer));
+  if( argc>1 ){
+    const char *zTokenizer = (const char *)sqlite3_value_text(argv[1]);
+    if( zTokenizer && 0==sqlite3StrICmp(zTokenizer, "cjk") ){
+      tokenizer.bBigrams = 1;
+    }else if( !zTokenizer || sqlite3StrICmp(zTokenizer, "fold") ){
+      sqlite3_result_error(context, "unknown tokenizer", -1);
+      return;
     }
-    p->nSpace = nNew;
-    p->aData = (char *)&p[1];
   }
 
-  /* Append the new serialized varint to the end of the list. */
-  p->nData += sqlite3Fts3PutVarint(&p->aData[p->nData], i);
-  p->aData[p->nData] = '\0';
-  *pp = p;
-  return SQLITE_OK;
-}
-
-/*
-** Add a docid/column/position entry to a PendingList structure. Non-zero
-** is returned if the structure is sqlite3_realloced as part of adding
-** the entry. Otherwise, zero.
-**
-** If an OOM error occurs, *pRc is set to SQLITE_NOMEM before returning.
-** Zero is always returned in this case. Otherwise, if no OOM error occurs,
-** it is set to SQLITE_OK.
-*/
-static int fts3PendingListAppend(
-  PendingList **pp,               /* IN/OUT: PendingList structure */
-  sqlite3_int64 iDocid,           /* Docid for entry to add */
-  sqlite3_int64 iCol,             /* Column for entry to add */
-  sqlite3_int64 iPos,             /* Position of term for entry to add */
-  int *pRc                        /* OUT: Return code */
-){
-  PendingList *p = *pp;
-  int rc = SQLITE_OK;
-
-  assert( !p || p->iLastDocid<=iDocid );
+  zInput = (const char *)sqlite3_value_text(argv[0]);
+  if( zInput==0 ) return;
+  nInput = sqlite3_value_bytes(argv[0]);
 
-  if( !p || p->iLastDocid!=iDocid ){
-    sqlite3_int64 iDelta = iDocid - (p ? p->iLastDocid : 0);
-    if( p ){
-      assert( p->nData<p->nSpace );
-      assert( p->aData[p->nData]==0 );
-      p->nData++;
-    }
-    if( SQLITE_OK!=(rc = fts3PendingListAppendVarint(&p, iDelta)) ){
-      goto pendinglistappend_out;
-    }
-    p->iLastCol = -1;
-    p->iLastPos = 0;
-    p->iLastDocid = iDocid;
+  /* No character folds to more than twice its length in bytes, but an
+  ** invalid byte becomes U+FFFD, three bytes long. The spaces take the
+  ** place of the separators between the tokens. A CJK character is in
+  ** two bigrams, but it is at least three bytes long and the bigrams
+  ** share a single space. */
+  zOut = (char *)sqlite3_malloc(nInput*3+1);
+  if( zOut==0 ){
+    sqlite3_result_error_nomem(context);
+    return;
   }
-  if( iCol>0 && p->iLastCol!=iCol ){
-    if( SQLITE_OK!=(rc = fts3PendingListAppendVarint(&p, 1))
-     || SQLITE_OK!=(rc = fts3PendingListAppendVarint(&p, iCol))
-    ){
-      goto pendinglistappend_out;
+
+  rc = foldOpen(&tokenizer.base, zInput, nInput, &pCursor);
+  if( rc==SQLITE_OK ){
+    pCursor->pTokenizer = &tokenizer.base;
+    while( SQLITE_OK==(rc = foldNext(pCursor, &zToken, &nToken,
+                                     &iStart, &iEnd, &iPos)) ){
+      if( ((fold_tokenizer_cursor *)pCursor)->bTail ) continue;
+      if( nOut>0 ) zOut[nOut++] = ' ';
+      memcpy(&zOut[nOut], zToken, nToken);
+      nOut += nToken;
     }
-    p->iLastCol = iCol;
-    p->iLastPos = 0;
+    foldClose(pCursor);
   }
-  if( iCol>=0 ){
-    assert( iPos>p->iLastPos || (iPos==0 && p->iLastPos==0) );
-    rc = fts3PendingListAppendVarint(&p, 2+iPos-p->iLastPos);
-    if( rc==SQLITE_OK ){
-      p->iLastPos = iPos;
-    }
+
+  if( rc!=SQLITE_DONE ){
+    sqlite3_free(zOut);
+    sqlite3_result_error_code(context, rc);
+    return;
   }
+  sqlite3_result_text(context, zOut, nOut, sqlite3_free);
+}
 
- pendinglistappend_out:
-  *pRc = rc;
-  if( p!=*pp ){
-    *pp = p;
-    return 1;
+/*
+** Register the fts3_fold() SQL function with database handle db.
+*/
+SQLITE_PRIVATE int sqlite3Fts3FoldInit(sqlite3 *db){
+  int rc = sqlite3_create_function(db, "fts3_fold", 1, SQLITE_UTF8, 0,
+      fts3FoldFunc, 0, 0);
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "fts3_fold", 2, SQLITE_UTF8, 0,
+        fts3FoldFunc, 0, 0);
   }
-  return 0;
+  return rc;
 }
 
+#endif /* !defined(SQLITE_CORE) || defined(SQLITE_ENABLE_FTS3) */
+
+/************** End of fts3_fold.c *******************************************/
+/************** Begin file fts3_write.c **************************************/
 /*
-** Tokenize the nul-terminated string zText and add all tokens to the
-** pending-terms hash-table. The docid used is that currently stored in
-** p->iPrevDocid, and the column is specified by argument iCol.
+** 2009 Oct 23
 **
-** If successful, SQLITE_OK is returned. Otherwise, an SQLite error code.
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+******************************************************************************
+**
+** This file is part of the SQLite FTS3 extension module. Specifically,
+** this file contains code to insert, update and delete rows from FTS3
+** tables. It also contains code to merge FTS3 b-tree segments. Some
+** of the sub-routines used to merge segments are also used by the query 
+** code in fts3.c.
 */
-static int fts3PendingTermsAdd(Fts3Table *p, const char *zText, int iCol){
-  int rc;
-  int iStart;
-  int iEnd;
-  int iPos;
-
-  char const *zToken;
-  int nToken;
 
-  sqlite3_tokenizer *pTokenizer = p->pTokenizer;
-  sqlite3_tokenizer_module const *pModule = pTokenizer->pModule;
-  sqlite3_tokenizer_cursor *pCsr;
-  int (*xNext)(sqlite3_tokenizer_cursor *pCursor,
-      const char**,int*,int*,int*,int*);
+#if !defined(SQLITE_CORE) || defined(SQLITE_ENABLE_FTS3)
 
-  assert( pTokenizer && pModule );
 
-  rc = pModule->xOpen(pTokenizer, zText, -1, &pCsr);
-  if( rc!=SQLITE_OK ){
-    return rc;
-  }
-  pCsr->pTokenizer = pTokenizer;
+typedef struct PendingList PendingList;
+typedef struct SegmentNode SegmentNode;
+typedef struct SegmentWriter SegmentWriter;
 
-  xNext = pModule->xNext;
-  while( SQLITE_OK==rc
-      && SQLITE_OK==(rc = xNext(pCsr, &zToken, &nToken, &iStart, &iEnd, &iPos))
-  ){
-    PendingList *pList;
+/*
+** Data structure used while accumulating terms in the pending-terms hash
+** table. The hash table entry maps from term (a string) to a malloc'd
+** instance of this structure.
+*/
+struct PendingList {
+  int nData;
+  char *aData;
+  int nSpace;
+  sqlite3_int64 iLastDocid;
+  sqlite3_int64 iLastCol;
+  sqlite3_int64 iLastPos;
+};
 
-    /* Positions cannot be negative; we use -1 as a terminator internally.
-    ** Tokens must have a non-zero length.
-    */
-    if( iPos<0 || !zToken || nToken<=0 ){
-      rc = SQLITE_ERROR;
-      break;
-    }
+/*
+** An instance of this structure is used to iterate through the terms on
+** a contiguous set of segment b-tree leaf nodes. Although the details of
+** this structure are only manipulated by code in this file, opaque handles
+** of type Fts3SegReader* are also used by code in fts3.c to iterate through
+** terms when querying the full-text index. See functions:
+**
+**   sqlite3Fts3SegReaderNew()
+**   sqlite3Fts3SegReaderFree()
+**   sqlite3Fts3SegReaderIterate()
+**
+** Methods used to manipulate Fts3SegReader structures:
+**
+**   fts3SegReaderNext()
+**   fts3SegReaderFirstDocid()
+**   fts3SegReaderNextDocid()
+*/
+struct Fts3SegReader {
+  int iIdx;                       /* Index within level, or 0x7FFFFFFF for PT */
+  sqlite3_int64 iStartBlock;
+  sqlite3_int64 iEndBlock;
+  sqlite3_stmt *pStmt;            /* SQL Statement to access leaf nodes */
+  char *aNode;                    /* Pointer to node data (or NULL) */
+  int nNode;                      /* Size of buffer at aNode (or 0) */
+  int nTermAlloc;                 /* Allocated size of zTerm buffer */
+  Fts3HashElem **ppNextElem;
 
-    pList = (PendingList *)fts3HashFind(&p->pendingTerms, zToken, nToken);
-    if( pList ){
-      p->nPendingData -= (pList->nData + nToken + sizeof(Fts3HashElem));
-    }
-    if( fts3PendingListAppend(&pList, p->iPrevDocid, iCol, iPos, &rc) ){
-      if( pList==fts3HashInsert(&p->pendingTerms, zToken, nToken, pList) ){
+  /* Variables set by fts3SegReaderNext(). These may be read directly
+  ** by the caller. They are valid from the time SegmentReaderNew() returns
+  ** until SegmentReaderNext() returns something other than SQLITE_OK
+  ** (i.e. SQLITE_DONE).
+  */
+  int nTerm;                      /* Number of bytes in current term */
+  char *zTerm;                    /* Pointer to current term */
+  char *aDoclist;                 /* Pointer to doclist of current entry */
+  int nDoclist;                   /* Size of doclist in current entry */
+
+  /* The following variables are used to iterate through the current doclist */
+  char *pOffsetList;
+  sqlite3_int64 iDocid;
+};
+
+#define fts3SegReaderIsPending(p) ((p)->ppNextElem!=0)
+
+/*
+** An instance of this structure is used to create a segment b-tree in the
+** database. The internal details of this type are only accessed by the
+** following functions:
+**
+**   fts3SegWriterAdd()
+**   fts3SegWriterFlush()
+**   fts3SegWriterFree()
+*/
+struct SegmentWriter {
+  SegmentNode *pTree;             /* Pointer to interior tree structure */
+  sqlite3_int64 iFirst;           /* First slot in %_segments written */
+  sqlite3_int64 iFree;            /* Next free slot in %_segments */
+  char *zTerm;                    /* Pointer to previous term buffer */
+  int nTerm;                      /* Number of bytes in zTerm */
+  int nMalloc;                    /* Size of malloc'd buffer at zMalloc */
+  char *zMalloc;                  /* Malloc'd space (possibly) used for zTerm */
+  int nSize;                      /* Size of allocation at aData */
+  int nData;                      /* Bytes of data in aData */
+  char *aData;                    /* Pointer to block from malloc() */
+};
+
+/*
+** Type SegmentNode is used by the following three functions to create
+** the interior part of the segment b+-tree structures (everything except
+** the leaf nodes). These functions and type are only ever used by code
+** within the fts3SegWriterXXX() family of functions described above.
+**
+**   fts3NodeAddTerm()
+**   fts3NodeWrite()
+**   fts3NodeFree()
+*/
+struct SegmentNode {
+  SegmentNode *pParent;           /* Parent node (or NULL for root node) */
+  SegmentNode *pRight;            /* Pointer to right-sibling */
+  SegmentNode *pLeftmost;         /* Pointer to left-most node of this depth */
+  int nEntry;                     /* Number of terms written to node so far */
+  char *zTerm;                    /* Pointer to previous term buffer */
+  int nTerm;                      /* Number of bytes in zTerm */
+  int nMalloc;                    /* Size of malloc'd buffer at zMalloc */
+  char *zMalloc;                  /* Malloc'd space (possibly) used for zTerm */
+  int nData;                      /* Bytes of valid data so far */
+  char *aData;                    /* Node data */
+};
+
+/*
+** Valid values for the second argument to fts3SqlStmt().
+*/
+#define SQL_DELETE_CONTENT             0
+#define SQL_IS_EMPTY                   1
+#define SQL_DELETE_ALL_CONTENT         2 
+#define SQL_DELETE_ALL_SEGMENTS        3
+#define SQL_DELETE_ALL_SEGDIR          4
+#define SQL_SELECT_CONTENT_BY_ROWID    5
+#define SQL_NEXT_SEGMENT_INDEX         6
+#define SQL_INSERT_SEGMENTS            7
+#define SQL_NEXT_SEGMENTS_ID           8
+#define SQL_INSERT_SEGDIR              9
+#define SQL_SELECT_LEVEL              10
+#define SQL_SELECT_ALL_LEVEL          11
+#define SQL_SELECT_LEVEL_COUNT        12
+#define SQL_SELECT_SEGDIR_COUNT_MAX   13
+#define SQL_DELETE_SEGDIR_BY_LEVEL    14
+#define SQL_DELETE_SEGMENTS_RANGE     15
+#define SQL_CONTENT_INSERT            16
+#define SQL_GET_BLOCK                 17
+#define SQL_SELECT_PREFIX             18
+#define SQL_DELETE_ALL_PREFIXES       19
+#define SQL_DELETE_ALL_TERMS          20
+
+/*
+** This function is used to obtain an SQLite prepared statement handle
+** for the statement identified by the second argument. If successful,
+** *pp is set to the requested statement handle and SQLITE_OK returned.
+** Otherwise, an SQLite error code is returned and *pp is set to 0.
+**
+** If argument apVal is not NULL, then it must point to an array with
+** at least as many entries as the requested statement has bound 
+** parameters. The values are bound to the statements parameters before
+** returning.
+*/
+static int fts3SqlStmt(
+  Fts3Table *p,                   /* Virtual table handle */
+  int eStmt,                      /* One of the SQL_XXX constants above */
+  sqlite3_stmt **pp,              /* OUT: Statement handle */
+  sqlite3_value **apVal           /* Values to bind to statement */
+){
+  const char *azSql[] = {
+/* 0  */  "DELETE FROM %Q.'%q_content' WHERE rowid = ?",
+/* 1  */  "SELECT NOT EXISTS(SELECT docid FROM %Q.'%q_content' WHERE rowid!=?)",
+/* 2  */  "DELETE FROM %Q.'%q_content'",
+/* 3  */  "DELETE FROM %Q.'%q_segments'",
+/* 4  */  "DELETE FROM %Q.'%q_segdir'",
+/* 5  */  "SELECT * FROM %Q.'%q_content' WHERE rowid=?",
+/* 6  */  "SELECT coalesce(max(idx)+1, 0) FROM %Q.'%q_segdir' WHERE level=?",
+/* 7  */  "INSERT INTO %Q.'%q_segments'(blockid, block) VALUES(?, ?)",
+/* 8  */  "SELECT coalesce(max(blockid)+1, 1) FROM %Q.'%q_segments'",
+/* 9  */  "INSERT INTO %Q.'%q_segdir' VALUES(?,?,?,?,?,?)",
+
+          /* Return segments in order from oldest to newest.*/ 
+/* 10 */  "SELECT idx, start_block, leaves_end_block, end_block, root "
+            "FROM %Q.'%q_segdir' WHERE level = ? ORDER BY idx ASC",
+/* 11 */  "SELECT idx, start_block, leaves_end_block, end_block, root "
+            "FROM %Q.'%q_segdir' ORDER BY level DESC, idx ASC",
+
+/* 12 */  "SELECT count(*) FROM %Q.'%q_segdir' WHERE level = ?",
+/* 13 */  "SELECT count(*), max(level) FROM %Q.'%q_segdir'",
+
+/* 14 */  "DELETE FROM %Q.'%q_segdir' WHERE level = ?",
+/* 15 */  "DELETE FROM %Q.'%q_segments' WHERE blockid BETWEEN ? AND ?",
+/* 16 */  "INSERT INTO %Q.'%q_content' VALUES(%z)",
+/* 17 */  "SELECT block FROM %Q.'%q_segments' WHERE blockid = ?",
+/* 18 */  "SELECT doclist FROM %Q.'%q_prefixes' WHERE prefix = ?",
+/* 19 */  "DELETE FROM %Q.'%q_prefixes'",
+/* 20 */  "DELETE FROM %Q.'%q_terms'",
+  };
+  int rc = SQLITE_OK;
+  sqlite3_stmt *pStmt;
+
+  assert( SizeofArray(azSql)==SizeofArray(p->aStmt) );
+  assert( eStmt<SizeofArray(azSql) && eStmt>=0 );
+  
+  pStmt = p->aStmt[eStmt];
+  if( !pStmt ){
+    char *zSql;
+    if( eStmt==SQL_CONTENT_INSERT ){
+      int i;                      /* Iterator variable */  
+      char *zVarlist;             /* The "?, ?, ..." string */
+      zVarlist = (char *)sqlite3_malloc(2*p->nColumn+2);
+      if( !zVarlist ){
+        *pp = 0;
+        return SQLITE_NOMEM;
+      }
+      zVarlist[0] = '?';
+      zVarlist[p->nColumn*2+1] = '\0';
+      for(i=1; i<=p->nColumn; i++){
+        zVarlist[i*2-1] = ',';
+        zVarlist[i*2] = '?';
+      }
+      zSql = sqlite3_mprintf(azSql[eStmt], p->zDb, p->zName, zVarlist);
+    }else{
+      zSql = sqlite3_mprintf(azSql[eStmt], p->zDb, p->zName);
+    }
+    if( !zSql ){
+      rc = SQLITE_NOMEM;
+    }else{
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &pStmt, NULL);
+      sqlite3_free(zSql);
+      assert( rc==SQLITE_OK || pStmt==0 );
+      p->aStmt[eStmt] = pStmt;
+    }
+  }
+  if( apVal ){
+    int i;
+    int nParam = sqlite3_bind_parameter_count(pStmt);
+    for(i=0; rc==SQLITE_OK && i<nParam; i++){
+      rc = sqlite3_bind_value(pStmt, i+1, apVal[i]);
+    }
+  }
+  *pp = pStmt;
+  return rc;
+}
+
+/*
+** Similar to fts3SqlStmt(). Except, after binding the parameters in
+** array apVal[] to the SQL statement identified by eStmt, the statement
+** is executed.
+**
+** Returns SQLITE_OK if the statement is successfully executed, or an
+** SQLite error code otherwise.
+*/
+static int fts3SqlExec(Fts3Table *p, int eStmt, sqlite3_value **apVal){
+  sqlite3_stmt *pStmt;
+  int rc = fts3SqlStmt(p, eStmt, &pStmt, apVal); 
+  if( rc==SQLITE_OK ){
+    sqlite3_step(pStmt);
+    rc = sqlite3_reset(pStmt);
+  }
+  return rc;
+}
+
+
+/*
+** Read a single block from the %_segments table. If the specified block
+** does not exist, return SQLITE_CORRUPT. If some other error (malloc, IO 
+** etc.) occurs, return the appropriate SQLite error code.
+**
+** Otherwise, if successful, set *pzBlock to point to a buffer containing
+** the block read from the database, and *pnBlock to the size of the read
+** block in bytes.
+**
+** WARNING: The returned buffer is only valid until the next call to 
+** sqlite3Fts3ReadBlock().
+*/
+SQLITE_PRIVATE int sqlite3Fts3ReadBlock(
+  Fts3Table *p,
+  sqlite3_int64 iBlock,
+  char const **pzBlock,
+  int *pnBlock
+){
+  sqlite3_stmt *pStmt;
+  int rc = fts3SqlStmt(p, SQL_GET_BLOCK, &pStmt, 0);
+  if( rc!=SQLITE_OK ) return rc;
+  sqlite3_reset(pStmt);
+
+  if( pzBlock ){
+    sqlite3_bind_int64(pStmt, 1, iBlock);
+    rc = sqlite3_step(pStmt); 
+    if( rc!=SQLITE_ROW ){
+      return (rc==SQLITE_DONE ? SQLITE_CORRUPT : rc);
+    }
+  
+    *pnBlock = sqlite3_column_bytes(pStmt, 0);
+    *pzBlock = (char *)sqlite3_column_blob(pStmt, 0);
+    if( sqlite3_column_type(pStmt, 0)!=SQLITE_BLOB ){
+      return SQLITE_CORRUPT;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Set *ppStmt to a statement handle that may be used to iterate through
+** all rows in the %_segdir table, from oldest to newest. If successful,
+** return SQLITE_OK. If an error occurs while preparing the statement, 
+** return an SQLite error code.
+**
+** There is only ever one instance of this SQL statement compiled for
+** each FTS3 table.
+**
+** The statement returns the following columns from the %_segdir table:
+**
+**   0: idx
+**   1: start_block
+**   2: leaves_end_block
+**   3: end_block
+**   4: root
+*/
+SQLITE_PRIVATE int sqlite3Fts3AllSegdirs(Fts3Table *p, sqlite3_stmt **ppStmt){
+  return fts3SqlStmt(p, SQL_SELECT_ALL_LEVEL, ppStmt, 0);
+}
+
+/*
+** Look up the docid-only doclist of all the terms that start with the
+** nTerm byte prefix zTerm in the %_prefixes table. *ppOut is set to a
+** malloced copy of it, or to NULL if the table has no row for zTerm, or
+** there is no such table. The caller then reads the segments instead.
+*/
+SQLITE_PRIVATE int sqlite3Fts3PrefixSelect(
+  Fts3Table *p,                   /* Virtual table handle */
+  const char *zTerm,              /* Prefix to look up */
+  int nTerm,                      /* Size of zTerm in bytes */
+  int *pnOut,                     /* OUT: Size of buffer at *ppOut */
+  char **ppOut                    /* OUT: Malloced doclist, or NULL */
+){
+  sqlite3_stmt *pStmt;
+  int nChar = 0;                  /* Characters in zTerm */
+  int rc;
+  int i;
+
+  *ppOut = 0;
+  if( p->noPrefixes ) return SQLITE_OK;
+
+  for(i=0; i<nTerm; i++){
+    if( (zTerm[i] & 0xC0)!=0x80 ) nChar++;
+  }
+  if( nChar==0 || nChar>FTS3_PREFIXES_MAX ) return SQLITE_OK;
+
+  rc = fts3SqlStmt(p, SQL_SELECT_PREFIX, &pStmt, 0);
+  if( rc==SQLITE_ERROR ){
+    /* There is no %_prefixes table, do not try again */
+    p->noPrefixes = 1;
+    return SQLITE_OK;
+  }
+  if( rc!=SQLITE_OK ) return rc;
+
+  sqlite3_bind_text(pStmt, 1, zTerm, nTerm, SQLITE_STATIC);
+  if( SQLITE_ROW==sqlite3_step(pStmt) ){
+    int nDoclist = sqlite3_column_bytes(pStmt, 0);
+    const char *aDoclist = sqlite3_column_blob(pStmt, 0);
+    if( nDoclist>0 ){
+      *ppOut = sqlite3_malloc(nDoclist);
+      if( *ppOut ){
+        memcpy(*ppOut, aDoclist, nDoclist);
+        *pnOut = nDoclist;
+      }else{
+        sqlite3_reset(pStmt);
+        return SQLITE_NOMEM;
+      }
+    }
+  }
+  return sqlite3_reset(pStmt);
+}
+
+
+/*
+** Append a single varint to a PendingList buffer. SQLITE_OK is returned
+** if successful, or an SQLite error code otherwise.
+**
+** This function also serves to allocate the PendingList structure itself.
+** For example, to create a new PendingList structure containing two
+** varints:
+**
+**   PendingList *p = 0;
+**   fts3PendingListAppendVarint(&p, 1);
+**   fts3PendingListAppendVarint(&p, 2);
+*/
+static int fts3PendingListAppendVarint(
+  PendingList **pp,               /* IN/OUT: Pointer to PendingList struct */
+  sqlite3_int64 i                 /* Value to append to data */
+){
+  PendingList *p = *pp;
+
+  /* Allocate or grow the PendingList as required. */
+  if( !p ){
+    p = sqlite3_malloc(sizeof(*p) + 100);
+    if( !p ){
+      return SQLITE_NOMEM;
+    }
+    p->nSpace = 100;
+    p->aData = (char *)&p[1];
+    p->nData = 0;
+  }
+  else if( p->nData+FTS3_VARINT_MAX+1>p->nSpace ){
+    int nNew = p->nSpace * 2;
+    p = sqlite3_realloc(p, sizeof(*p) + nNew);
+    if( !p ){
+      sqlite3_free(*pp);
+      *pp = 0;
+      return SQLITE_NOMEM;
+    }
+    p->nSpace = nNew;
+    p->aData = (char *)&p[1];
+  }
+
+  /* Append the new serialized varint to the end of the list. */
+  p->nData += sqlite3Fts3PutVarint(&p->aData[p->nData], i);
+  p->aData[p->nData] = '\0';
+  *pp = p;
+  return SQLITE_OK;
+}
+
+/*
+** Add a docid/column/position entry to a PendingList structure. Non-zero
+** is returned if the structure is sqlite3_realloced as part of adding
+** the entry. Otherwise, zero.
+**
+** If an OOM error occurs, *pRc is set to SQLITE_NOMEM before returning.
+** Zero is always returned in this case. Otherwise, if no OOM error occurs,
+** it is set to SQLITE_OK.
+*/
+static int fts3PendingListAppend(
+  PendingList **pp,               /* IN/OUT: PendingList structure */
+  sqlite3_int64 iDocid,           /* Docid for entry to add */
+  sqlite3_int64 iCol,             /* Column for entry to add */
+  sqlite3_int64 iPos,             /* Position of term for entry to add */
+  int *pRc                        /* OUT: Return code */
+){
+  PendingList *p = *pp;
+  int rc = SQLITE_OK;
+
+  assert( !p || p->iLastDocid<=iDocid );
+
+  if( !p || p->iLastDocid!=iDocid ){
+    sqlite3_int64 iDelta = iDocid - (p ? p->iLastDocid : 0);
+    if( p ){
+      assert( p->nData<p->nSpace );
+      assert( p->aData[p->nData]==0 );
+      p->nData++;
+    }
+    if( SQLITE_OK!=(rc = fts3PendingListAppendVarint(&p, iDelta)) ){
+      goto pendinglistappend_out;
+    }
+    p->iLastCol = -1;
+    p->iLastPos = 0;
+    p->iLastDocid = iDocid;
+  }
+  if( iCol>0 && p->iLastCol!=iCol ){
+    if( SQLITE_OK!=(rc = fts3PendingListAppendVarint(&p, 1))
+     || SQLITE_OK!=(rc = fts3PendingListAppendVarint(&p, iCol))
+    ){
+      goto pendinglistappend_out;
+    }
+    p->iLastCol = iCol;
+    p->iLastPos = 0;
+  }
+  if( iCol>=0 ){
+    assert( iPos>p->iLastPos || (iPos==0 && p->iLastPos==0) );
+    rc = fts3PendingListAppendVarint(&p, 2+iPos-p->iLastPos);
+    if( rc==SQLITE_OK ){
+      p->iLastPos = iPos;
+    }
+  }
+
+ pendinglistappend_out:
+  *pRc = rc;
+  if( p!=*pp ){
+    *pp = p;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+** Tokenize the nul-terminated string zText and add all tokens to the
+** pending-terms hash-table. The docid used is that currently stored in
+** p->iPrevDocid, and the column is specified by argument iCol.
+**
+** If successful, SQLITE_OK is returned. Otherwise, an SQLite error code.
+*/
+static int fts3PendingTermsAdd(Fts3Table *p, const char *zText, int iCol){
+  int rc;
+  int iStart;
+  int iEnd;
+  int iPos;
+
+  char const *zToken;
+  int nToken;
+
+  sqlite3_tokenizer *pTokenizer = p->pTokenizer;
+  sqlite3_tokenizer_module const *pModule = pTokenizer->pModule;
+  sqlite3_tokenizer_cursor *pCsr;
+  int (*xNext)(sqlite3_tokenizer_cursor *pCursor,
+      const char**,int*,int*,int*,int*);
+
+  assert( pTokenizer && pModule );
+
+  rc = pModule->xOpen(pTokenizer, zText, -1, &pCsr);
+  if( rc!=SQLITE_OK ){
+    return rc;
+  }
+  pCsr->pTokenizer = pTokenizer;
+
+  xNext = pModule->xNext;
+  while( SQLITE_OK==rc
+      && SQLITE_OK==(rc = xNext(pCsr, &zToken, &nToken, &iStart, &iEnd, &iPos))
+  ){
+    PendingList *pList;
+
+    /* Positions cannot be negative; we use -1 as a terminator internally.
+    ** Tokens must have a non-zero length.
+    */
+    if( iPos<0 || !zToken || nToken<=0 ){
+      rc = SQLITE_ERROR;
+      break;
+    }
+
+    pList = (PendingList *)fts3HashFind(&p->pendingTerms, zToken, nToken);
+    if( pList ){
+      p->nPendingData -= (pList->nData + nToken + sizeof(Fts3HashElem));
+    }
+    if( fts3PendingListAppend(&pList, p->iPrevDocid, iCol, iPos, &rc) ){
+      if( pList==fts3HashInsert(&p->pendingTerms, zToken, nToken, pList) ){
         /* Malloc failed while inserting the new entry. This can only 
         ** happen if there was no previous entry for this token.
         */
@@ -105186,593 +107051,1197 @@ static int fts3SegWriterAdd(
   }else{
     pWriter->zTerm = (char *)zTerm;
   }
-  pWriter->nTerm = nTerm;
+  pWriter->nTerm = nTerm;
+
+  return SQLITE_OK;
+}
+
+/*
+** Flush all data associated with the SegmentWriter object pWriter to the
+** database. This function must be called after all terms have been added
+** to the segment using fts3SegWriterAdd(). If successful, SQLITE_OK is
+** returned. Otherwise, an SQLite error code.
+*/
+static int fts3SegWriterFlush(
+  Fts3Table *p,                   /* Virtual table handle */
+  SegmentWriter *pWriter,         /* SegmentWriter to flush to the db */
+  int iLevel,                     /* Value for 'level' column of %_segdir */
+  int iIdx                        /* Value for 'idx' column of %_segdir */
+){
+  int rc;                         /* Return code */
+  if( pWriter->pTree ){
+    sqlite3_int64 iLast = 0;      /* Largest block id written to database */
+    sqlite3_int64 iLastLeaf;      /* Largest leaf block id written to db */
+    char *zRoot = NULL;           /* Pointer to buffer containing root node */
+    int nRoot = 0;                /* Size of buffer zRoot */
+
+    iLastLeaf = pWriter->iFree;
+    rc = fts3WriteSegment(p, pWriter->iFree++, pWriter->aData, pWriter->nData);
+    if( rc==SQLITE_OK ){
+      rc = fts3NodeWrite(p, pWriter->pTree, 1,
+          pWriter->iFirst, pWriter->iFree, &iLast, &zRoot, &nRoot);
+    }
+    if( rc==SQLITE_OK ){
+      rc = fts3WriteSegdir(
+          p, iLevel, iIdx, pWriter->iFirst, iLastLeaf, iLast, zRoot, nRoot);
+    }
+  }else{
+    /* The entire tree fits on the root node. Write it to the segdir table. */
+    rc = fts3WriteSegdir(
+        p, iLevel, iIdx, 0, 0, 0, pWriter->aData, pWriter->nData);
+  }
+  return rc;
+}
+
+/*
+** Release all memory held by the SegmentWriter object passed as the 
+** first argument.
+*/
+static void fts3SegWriterFree(SegmentWriter *pWriter){
+  if( pWriter ){
+    sqlite3_free(pWriter->aData);
+    sqlite3_free(pWriter->zMalloc);
+    fts3NodeFree(pWriter->pTree);
+    sqlite3_free(pWriter);
+  }
+}
+
+/*
+** The first value in the apVal[] array is assumed to contain an integer.
+** This function tests if there exist any documents with docid values that
+** are different from that integer. i.e. if deleting the document with docid
+** apVal[0] would mean the FTS3 table were empty.
+**
+** If successful, *pisEmpty is set to true if the table is empty except for
+** document apVal[0], or false otherwise, and SQLITE_OK is returned. If an
+** error occurs, an SQLite error code is returned.
+*/
+static int fts3IsEmpty(Fts3Table *p, sqlite3_value **apVal, int *pisEmpty){
+  sqlite3_stmt *pStmt;
+  int rc;
+  rc = fts3SqlStmt(p, SQL_IS_EMPTY, &pStmt, apVal);
+  if( rc==SQLITE_OK ){
+    if( SQLITE_ROW==sqlite3_step(pStmt) ){
+      *pisEmpty = sqlite3_column_int(pStmt, 0);
+    }
+    rc = sqlite3_reset(pStmt);
+  }
+  return rc;
+}
+
+/*
+** Set *pnSegment to the number of segments of level iLevel in the database.
+**
+** Return SQLITE_OK if successful, or an SQLite error code if not.
+*/
+static int fts3SegmentCount(Fts3Table *p, int iLevel, int *pnSegment){
+  sqlite3_stmt *pStmt;
+  int rc;
+
+  assert( iLevel>=0 );
+  rc = fts3SqlStmt(p, SQL_SELECT_LEVEL_COUNT, &pStmt, 0);
+  if( rc!=SQLITE_OK ) return rc;
+  sqlite3_bind_int(pStmt, 1, iLevel);
+  if( SQLITE_ROW==sqlite3_step(pStmt) ){
+    *pnSegment = sqlite3_column_int(pStmt, 0);
+  }
+  return sqlite3_reset(pStmt);
+}
+
+/*
+** Set *pnSegment to the total number of segments in the database. Set
+** *pnMax to the largest segment level in the database (segment levels
+** are stored in the 'level' column of the %_segdir table).
+**
+** Return SQLITE_OK if successful, or an SQLite error code if not.
+*/
+static int fts3SegmentCountMax(Fts3Table *p, int *pnSegment, int *pnMax){
+  sqlite3_stmt *pStmt;
+  int rc;
+
+  rc = fts3SqlStmt(p, SQL_SELECT_SEGDIR_COUNT_MAX, &pStmt, 0);
+  if( rc!=SQLITE_OK ) return rc;
+  if( SQLITE_ROW==sqlite3_step(pStmt) ){
+    *pnSegment = sqlite3_column_int(pStmt, 0);
+    *pnMax = sqlite3_column_int(pStmt, 1);
+  }
+  return sqlite3_reset(pStmt);
+}
+
+/*
+** This function is used after merging multiple segments into a single large
+** segment to delete the old, now redundant, segment b-trees. Specifically,
+** it:
+** 
+**   1) Deletes all %_segments entries for the segments associated with 
+**      each of the SegReader objects in the array passed as the third 
+**      argument, and
+**
+**   2) deletes all %_segdir entries with level iLevel, or all %_segdir
+**      entries regardless of level if (iLevel<0).
+**
+** SQLITE_OK is returned if successful, otherwise an SQLite error code.
+*/
+static int fts3DeleteSegdir(
+  Fts3Table *p,                   /* Virtual table handle */
+  int iLevel,                     /* Level of %_segdir entries to delete */
+  Fts3SegReader **apSegment,      /* Array of SegReader objects */
+  int nReader                     /* Size of array apSegment */
+){
+  int rc;                         /* Return Code */
+  int i;                          /* Iterator variable */
+  sqlite3_stmt *pDelete;          /* SQL statement to delete rows */
+
+  rc = fts3SqlStmt(p, SQL_DELETE_SEGMENTS_RANGE, &pDelete, 0);
+  for(i=0; rc==SQLITE_OK && i<nReader; i++){
+    Fts3SegReader *pSegment = apSegment[i];
+    if( pSegment->iStartBlock ){
+      sqlite3_bind_int64(pDelete, 1, pSegment->iStartBlock);
+      sqlite3_bind_int64(pDelete, 2, pSegment->iEndBlock);
+      sqlite3_step(pDelete);
+      rc = sqlite3_reset(pDelete);
+    }
+  }
+  if( rc!=SQLITE_OK ){
+    return rc;
+  }
+
+  if( iLevel>=0 ){
+    rc = fts3SqlStmt(p, SQL_DELETE_SEGDIR_BY_LEVEL, &pDelete, 0);
+    if( rc==SQLITE_OK ){
+      sqlite3_bind_int(pDelete, 1, iLevel);
+      sqlite3_step(pDelete);
+      rc = sqlite3_reset(pDelete);
+    }
+  }else{
+    rc = fts3SqlExec(p, SQL_DELETE_ALL_SEGDIR, 0);
+  }
+
+  return rc;
+}
+
+/*
+** When this function is called, buffer *ppList (size *pnList bytes) contains 
+** a position list that may (or may not) feature multiple columns. This
+** function adjusts the pointer *ppList and the length *pnList so that they
+** identify the subset of the position list that corresponds to column iCol.
+**
+** If there are no entries in the input position list for column iCol, then
+** *pnList is set to zero before returning.
+*/
+static void fts3ColumnFilter(
+  int iCol,                       /* Column to filter on */
+  char **ppList,                  /* IN/OUT: Pointer to position list */
+  int *pnList                     /* IN/OUT: Size of buffer *ppList in bytes */
+){
+  char *pList = *ppList;
+  int nList = *pnList;
+  char *pEnd = &pList[nList];
+  int iCurrent = 0;
+  char *p = pList;
+
+  assert( iCol>=0 );
+  while( 1 ){
+    char c = 0;
+    while( p<pEnd && (c | *p)&0xFE ) c = *p++ & 0x80;
+  
+    if( iCol==iCurrent ){
+      nList = (int)(p - pList);
+      break;
+    }
+
+    nList -= (int)(p - pList);
+    pList = p;
+    if( nList==0 ){
+      break;
+    }
+    p = &pList[1];
+    p += sqlite3Fts3GetVarint32(p, &iCurrent);
+  }
 
-  return SQLITE_OK;
+  *ppList = pList;
+  *pnList = nList;
 }
 
 /*
-** Flush all data associated with the SegmentWriter object pWriter to the
-** database. This function must be called after all terms have been added
-** to the segment using fts3SegWriterAdd(). If successful, SQLITE_OK is
-** returned. Otherwise, an SQLite error code.
+** sqlite3Fts3SegReaderIterate() callback used when merging multiple 
+** segments to create a single, larger segment.
 */
-static int fts3SegWriterFlush(
-  Fts3Table *p,                   /* Virtual table handle */
-  SegmentWriter *pWriter,         /* SegmentWriter to flush to the db */
-  int iLevel,                     /* Value for 'level' column of %_segdir */
-  int iIdx                        /* Value for 'idx' column of %_segdir */
+static int fts3MergeCallback(
+  Fts3Table *p,                   /* FTS3 Virtual table handle */
+  void *pContext,                 /* Pointer to SegmentWriter* to write with */
+  char *zTerm,                    /* Term to write to the db */
+  int nTerm,                      /* Number of bytes in zTerm */
+  char *aDoclist,                 /* Doclist associated with zTerm */
+  int nDoclist                    /* Number of bytes in doclist */
 ){
-  int rc;                         /* Return code */
-  if( pWriter->pTree ){
-    sqlite3_int64 iLast = 0;      /* Largest block id written to database */
-    sqlite3_int64 iLastLeaf;      /* Largest leaf block id written to db */
-    char *zRoot = NULL;           /* Pointer to buffer containing root node */
-    int nRoot = 0;                /* Size of buffer zRoot */
-
-    iLastLeaf = pWriter->iFree;
-    rc = fts3WriteSegment(p, pWriter->iFree++, pWriter->aData, pWriter->nData);
-    if( rc==SQLITE_OK ){
-      rc = fts3NodeWrite(p, pWriter->pTree, 1,
-          pWriter->iFirst, pWriter->iFree, &iLast, &zRoot, &nRoot);
-    }
-    if( rc==SQLITE_OK ){
-      rc = fts3WriteSegdir(
-          p, iLevel, iIdx, pWriter->iFirst, iLastLeaf, iLast, zRoot, nRoot);
-    }
-  }else{
-    /* The entire tree fits on the root node. Write it to the segdir table. */
-    rc = fts3WriteSegdir(
-        p, iLevel, iIdx, 0, 0, 0, pWriter->aData, pWriter->nData);
-  }
-  return rc;
+  SegmentWriter **ppW = (SegmentWriter **)pContext;
+  return fts3SegWriterAdd(p, ppW, 1, zTerm, nTerm, aDoclist, nDoclist);
 }
 
 /*
-** Release all memory held by the SegmentWriter object passed as the 
-** first argument.
+** sqlite3Fts3SegReaderIterate() callback used when flushing the contents
+** of the pending-terms hash table to the database.
 */
-static void fts3SegWriterFree(SegmentWriter *pWriter){
-  if( pWriter ){
-    sqlite3_free(pWriter->aData);
-    sqlite3_free(pWriter->zMalloc);
-    fts3NodeFree(pWriter->pTree);
-    sqlite3_free(pWriter);
-  }
+static int fts3FlushCallback(
+  Fts3Table *p,                   /* FTS3 Virtual table handle */
+  void *pContext,                 /* Pointer to SegmentWriter* to write with */
+  char *zTerm,                    /* Term to write to the db */
+  int nTerm,                      /* Number of bytes in zTerm */
+  char *aDoclist,                 /* Doclist associated with zTerm */
+  int nDoclist                    /* Number of bytes in doclist */
+){
+  SegmentWriter **ppW = (SegmentWriter **)pContext;
+  return fts3SegWriterAdd(p, ppW, 0, zTerm, nTerm, aDoclist, nDoclist);
 }
 
 /*
-** The first value in the apVal[] array is assumed to contain an integer.
-** This function tests if there exist any documents with docid values that
-** are different from that integer. i.e. if deleting the document with docid
-** apVal[0] would mean the FTS3 table were empty.
+** This function is used to iterate through a contiguous set of terms 
+** stored in the full-text index. It merges data contained in one or 
+** more segments to support this.
 **
-** If successful, *pisEmpty is set to true if the table is empty except for
-** document apVal[0], or false otherwise, and SQLITE_OK is returned. If an
-** error occurs, an SQLite error code is returned.
+** The second argument is passed an array of pointers to SegReader objects
+** allocated with sqlite3Fts3SegReaderNew(). This function merges the range 
+** of terms selected by each SegReader. If a single term is present in
+** more than one segment, the associated doclists are merged. For each
+** term and (possibly merged) doclist in the merged range, the callback
+** function xFunc is invoked with its arguments set as follows.
+**
+**   arg 0: Copy of 'p' parameter passed to this function
+**   arg 1: Copy of 'pContext' parameter passed to this function
+**   arg 2: Pointer to buffer containing term
+**   arg 3: Size of arg 2 buffer in bytes
+**   arg 4: Pointer to buffer containing doclist
+**   arg 5: Size of arg 2 buffer in bytes
+**
+** The 4th argument to this function is a pointer to a structure of type
+** Fts3SegFilter, defined in fts3Int.h. The contents of this structure
+** further restrict the range of terms that callbacks are made for and
+** modify the behaviour of this function. See comments above structure
+** definition for details.
 */
-static int fts3IsEmpty(Fts3Table *p, sqlite3_value **apVal, int *pisEmpty){
-  sqlite3_stmt *pStmt;
-  int rc;
-  rc = fts3SqlStmt(p, SQL_IS_EMPTY, &pStmt, apVal);
-  if( rc==SQLITE_OK ){
-    if( SQLITE_ROW==sqlite3_step(pStmt) ){
-      *pisEmpty = sqlite3_column_int(pStmt, 0);
+SQLITE_PRIVATE int sqlite3Fts3SegReaderIterate(
+  Fts3Table *p,                   /* Virtual table handle */
+  Fts3SegReader **apSegment,      /* Array of Fts3SegReader objects */
+  int nSegment,                   /* Size of apSegment array */
+  Fts3SegFilter *pFilter,         /* Restrictions on range of iteration */
+  int (*xFunc)(Fts3Table *, void *, char *, int, char *, int),  /* Callback */
+  void *pContext                  /* Callback context (2nd argument) */
+){
+  int i;                          /* Iterator variable */
+  char *aBuffer = 0;              /* Buffer to merge doclists in */
+  int nAlloc = 0;                 /* Allocated size of aBuffer buffer */
+  int rc = SQLITE_OK;             /* Return code */
+
+  int isIgnoreEmpty =  (pFilter->flags & FTS3_SEGMENT_IGNORE_EMPTY);
+  int isRequirePos =   (pFilter->flags & FTS3_SEGMENT_REQUIRE_POS);
+  int isColFilter =    (pFilter->flags & FTS3_SEGMENT_COLUMN_FILTER);
+  int isPrefix =       (pFilter->flags & FTS3_SEGMENT_PREFIX);
+
+  /* If there are zero segments, this function is a no-op. This scenario
+  ** comes about only when reading from an empty database.
+  */
+  if( nSegment==0 ) goto finished;
+
+  /* If the Fts3SegFilter defines a specific term (or term prefix) to search 
+  ** for, then advance each segment iterator until it points to a term of
+  ** equal or greater value than the specified term. This prevents many
+  ** unnecessary merge/sort operations for the case where single segment
+  ** b-tree leaf nodes contain more than one term.
+  */
+  if( pFilter->zTerm ){
+    int nTerm = pFilter->nTerm;
+    const char *zTerm = pFilter->zTerm;
+    for(i=0; i<nSegment; i++){
+      Fts3SegReader *pSeg = apSegment[i];
+      while( fts3SegReaderTermCmp(pSeg, zTerm, nTerm)<0 ){
+        rc = fts3SegReaderNext(pSeg);
+        if( rc!=SQLITE_OK ) goto finished; }
     }
-    rc = sqlite3_reset(pStmt);
   }
-  return rc;
-}
 
-/*
-** Set *pnSegment to the number of segments of level iLevel in the database.
-**
-** Return SQLITE_OK if successful, or an SQLite error code if not.
-*/
-static int fts3SegmentCount(Fts3Table *p, int iLevel, int *pnSegment){
-  sqlite3_stmt *pStmt;
-  int rc;
+  fts3SegReaderSort(apSegment, nSegment, nSegment, fts3SegReaderCmp);
+  while( apSegment[0]->aNode ){
+    int nTerm = apSegment[0]->nTerm;
+    char *zTerm = apSegment[0]->zTerm;
+    int nMerge = 1;
 
-  assert( iLevel>=0 );
-  rc = fts3SqlStmt(p, SQL_SELECT_LEVEL_COUNT, &pStmt, 0);
-  if( rc!=SQLITE_OK ) return rc;
-  sqlite3_bind_int(pStmt, 1, iLevel);
-  if( SQLITE_ROW==sqlite3_step(pStmt) ){
-    *pnSegment = sqlite3_column_int(pStmt, 0);
-  }
-  return sqlite3_reset(pStmt);
-}
+    /* If this is a prefix-search, and if the term that apSegment[0] points
+    ** to does not share a suffix with pFilter->zTerm/nTerm, then all 
+    ** required callbacks have been made. In this case exit early.
+    **
+    ** Similarly, if this is a search for an exact match, and the first term
+    ** of segment apSegment[0] is not a match, exit early.
+    */
+    if( pFilter->zTerm ){
+      if( nTerm<pFilter->nTerm 
+       || (!isPrefix && nTerm>pFilter->nTerm)
+       || memcmp(zTerm, pFilter->zTerm, pFilter->nTerm) 
+    ){
+        goto finished;
+      }
+    }
+
+    while( nMerge<nSegment 
+        && apSegment[nMerge]->aNode
+        && apSegment[nMerge]->nTerm==nTerm 
+        && 0==memcmp(zTerm, apSegment[nMerge]->zTerm, nTerm)
+    ){
+      nMerge++;
+    }
+
+    assert( isIgnoreEmpty || (isRequirePos && !isColFilter) );
+    if( nMerge==1 && !isIgnoreEmpty ){
+      Fts3SegReader *p0 = apSegment[0];
+      rc = xFunc(p, pContext, zTerm, nTerm, p0->aDoclist, p0->nDoclist);
+      if( rc!=SQLITE_OK ) goto finished;
+    }else{
+      int nDoclist = 0;           /* Size of doclist */
+      sqlite3_int64 iPrev = 0;    /* Previous docid stored in doclist */
+
+      /* The current term of the first nMerge entries in the array
+      ** of Fts3SegReader objects is the same. The doclists must be merged
+      ** and a single term added to the new segment.
+      */
+      for(i=0; i<nMerge; i++){
+        fts3SegReaderFirstDocid(apSegment[i]);
+      }
+      fts3SegReaderSort(apSegment, nMerge, nMerge, fts3SegReaderDoclistCmp);
+      while( apSegment[0]->pOffsetList ){
+        int j;                    /* Number of segments that share a docid */
+        char *pList;
+        int nList;
+        int nByte;
+        sqlite3_int64 iDocid = apSegment[0]->iDocid;
+        fts3SegReaderNextDocid(apSegment[0], &pList, &nList);
+        j = 1;
+        while( j<nMerge
+            && apSegment[j]->pOffsetList
+            && apSegment[j]->iDocid==iDocid
+        ){
+          fts3SegReaderNextDocid(apSegment[j], 0, 0);
+          j++;
+        }
+
+        if( isColFilter ){
+          fts3ColumnFilter(pFilter->iCol, &pList, &nList);
+        }
+
+        if( !isIgnoreEmpty || nList>0 ){
+          nByte = sqlite3Fts3VarintLen(iDocid-iPrev) + (isRequirePos?nList+1:0);
+          if( nDoclist+nByte>nAlloc ){
+            char *aNew;
+            nAlloc = nDoclist+nByte*2;
+            aNew = sqlite3_realloc(aBuffer, nAlloc);
+            if( !aNew ){
+              rc = SQLITE_NOMEM;
+              goto finished;
+            }
+            aBuffer = aNew;
+          }
+          nDoclist += sqlite3Fts3PutVarint(&aBuffer[nDoclist], iDocid-iPrev);
+          iPrev = iDocid;
+          if( isRequirePos ){
+            memcpy(&aBuffer[nDoclist], pList, nList);
+            nDoclist += nList;
+            aBuffer[nDoclist++] = '\0';
+          }
+        }
+
+        fts3SegReaderSort(apSegment, nMerge, j, fts3SegReaderDoclistCmp);
+      }
+
+      if( nDoclist>0 ){
+        rc = xFunc(p, pContext, zTerm, nTerm, aBuffer, nDoclist);
+        if( rc!=SQLITE_OK ) goto finished;
+      }
+    }
 
-/*
-** Set *pnSegment to the total number of segments in the database. Set
-** *pnMax to the largest segment level in the database (segment levels
-** are stored in the 'level' column of the %_segdir table).
-**
-** Return SQLITE_OK if successful, or an SQLite error code if not.
-*/
-static int fts3SegmentCountMax(Fts3Table *p, int *pnSegment, int *pnMax){
-  sqlite3_stmt *pStmt;
-  int rc;
+    /* If there is a term specified to filter on, and this is not a prefix
+    ** search, return now. The callback that corresponds to the required
+    ** term (if such a term exists in the index) has already been made.
+    */
+    if( pFilter->zTerm && !isPrefix ){
+      goto finished;
+    }
 
-  rc = fts3SqlStmt(p, SQL_SELECT_SEGDIR_COUNT_MAX, &pStmt, 0);
-  if( rc!=SQLITE_OK ) return rc;
-  if( SQLITE_ROW==sqlite3_step(pStmt) ){
-    *pnSegment = sqlite3_column_int(pStmt, 0);
-    *pnMax = sqlite3_column_int(pStmt, 1);
+    for(i=0; i<nMerge; i++){
+      rc = fts3SegReaderNext(apSegment[i]);
+      if( rc!=SQLITE_OK ) goto finished;
+    }
+    fts3SegReaderSort(apSegment, nSegment, nMerge, fts3SegReaderCmp);
   }
-  return sqlite3_reset(pStmt);
+
+ finished:
+  sqlite3_free(aBuffer);
+  return rc;
 }
 
 /*
-** This function is used after merging multiple segments into a single large
-** segment to delete the old, now redundant, segment b-trees. Specifically,
-** it:
-** 
-**   1) Deletes all %_segments entries for the segments associated with 
-**      each of the SegReader objects in the array passed as the third 
-**      argument, and
-**
-**   2) deletes all %_segdir entries with level iLevel, or all %_segdir
-**      entries regardless of level if (iLevel<0).
+** Merge all level iLevel segments in the database into a single 
+** iLevel+1 segment. Or, if iLevel<0, merge all segments into a
+** single segment with a level equal to the numerically largest level 
+** currently present in the database.
 **
-** SQLITE_OK is returned if successful, otherwise an SQLite error code.
+** If this function is called with iLevel<0, but there is only one
+** segment in the database, SQLITE_DONE is returned immediately. 
+** Otherwise, if successful, SQLITE_OK is returned. If an error occurs, 
+** an SQLite error code is returned.
 */
-static int fts3DeleteSegdir(
-  Fts3Table *p,                   /* Virtual table handle */
-  int iLevel,                     /* Level of %_segdir entries to delete */
-  Fts3SegReader **apSegment,      /* Array of SegReader objects */
-  int nReader                     /* Size of array apSegment */
-){
-  int rc;                         /* Return Code */
+static int fts3SegmentMerge(Fts3Table *p, int iLevel){
   int i;                          /* Iterator variable */
-  sqlite3_stmt *pDelete;          /* SQL statement to delete rows */
+  int rc;                         /* Return code */
+  int iIdx;                       /* Index of new segment */
+  int iNewLevel;                  /* Level to create new segment at */
+  sqlite3_stmt *pStmt = 0;
+  SegmentWriter *pWriter = 0;
+  int nSegment = 0;               /* Number of segments being merged */
+  Fts3SegReader **apSegment = 0;  /* Array of Segment iterators */
+  Fts3SegReader *pPending = 0;    /* Iterator for pending-terms */
+  Fts3SegFilter filter;           /* Segment term filter condition */
 
-  rc = fts3SqlStmt(p, SQL_DELETE_SEGMENTS_RANGE, &pDelete, 0);
-  for(i=0; rc==SQLITE_OK && i<nReader; i++){
-    Fts3SegReader *pSegment = apSegment[i];
-    if( pSegment->iStartBlock ){
-      sqlite3_bind_int64(pDelete, 1, pSegment->iStartBlock);
-      sqlite3_bind_int64(pDelete, 2, pSegment->iEndBlock);
-      sqlite3_step(pDelete);
-      rc = sqlite3_reset(pDelete);
+  if( iLevel<0 ){
+    /* This call is to merge all segments in the database to a single
+    ** segment. The level of the new segment is equal to the the numerically 
+    ** greatest segment level currently present in the database. The index
+    ** of the new segment is always 0.
+    */
+    iIdx = 0;
+    rc = sqlite3Fts3SegReaderPending(p, 0, 0, 1, &pPending);
+    if( rc!=SQLITE_OK ) goto finished;
+    rc = fts3SegmentCountMax(p, &nSegment, &iNewLevel);
+    if( rc!=SQLITE_OK ) goto finished;
+    nSegment += (pPending!=0);
+    if( nSegment<=1 ){
+      return SQLITE_DONE;
     }
+  }else{
+    /* This call is to merge all segments at level iLevel. Find the next
+    ** available segment index at level iLevel+1. The call to
+    ** fts3AllocateSegdirIdx() will merge the segments at level iLevel+1 to 
+    ** a single iLevel+2 segment if necessary.
+    */
+    iNewLevel = iLevel+1;
+    rc = fts3AllocateSegdirIdx(p, iNewLevel, &iIdx);
+    if( rc!=SQLITE_OK ) goto finished;
+    rc = fts3SegmentCount(p, iLevel, &nSegment);
+    if( rc!=SQLITE_OK ) goto finished;
   }
-  if( rc!=SQLITE_OK ){
-    return rc;
+  assert( nSegment>0 );
+  assert( iNewLevel>=0 );
+
+  /* Allocate space for an array of pointers to segment iterators. */
+  apSegment = (Fts3SegReader**)sqlite3_malloc(sizeof(Fts3SegReader *)*nSegment);
+  if( !apSegment ){
+    rc = SQLITE_NOMEM;
+    goto finished;
   }
+  memset(apSegment, 0, sizeof(Fts3SegReader *)*nSegment);
 
-  if( iLevel>=0 ){
-    rc = fts3SqlStmt(p, SQL_DELETE_SEGDIR_BY_LEVEL, &pDelete, 0);
-    if( rc==SQLITE_OK ){
-      sqlite3_bind_int(pDelete, 1, iLevel);
-      sqlite3_step(pDelete);
-      rc = sqlite3_reset(pDelete);
+  /* Allocate a Fts3SegReader structure for each segment being merged. A 
+  ** Fts3SegReader stores the state data required to iterate through all 
+  ** entries on all leaves of a single segment. 
+  */
+  assert( SQL_SELECT_LEVEL+1==SQL_SELECT_ALL_LEVEL);
+  rc = fts3SqlStmt(p, SQL_SELECT_LEVEL+(iLevel<0), &pStmt, 0);
+  if( rc!=SQLITE_OK ) goto finished;
+  sqlite3_bind_int(pStmt, 1, iLevel);
+  for(i=0; SQLITE_ROW==(sqlite3_step(pStmt)); i++){
+    rc = fts3SegReaderNew(p, pStmt, i, &apSegment[i]);
+    if( rc!=SQLITE_OK ){
+      goto finished;
     }
-  }else{
-    rc = fts3SqlExec(p, SQL_DELETE_ALL_SEGDIR, 0);
+  }
+  rc = sqlite3_reset(pStmt);
+  if( pPending ){
+    apSegment[i] = pPending;
+    pPending = 0;
+  }
+  pStmt = 0;
+  if( rc!=SQLITE_OK ) goto finished;
+
+  memset(&filter, 0, sizeof(Fts3SegFilter));
+  filter.flags = FTS3_SEGMENT_REQUIRE_POS;
+  filter.flags |= (iLevel<0 ? FTS3_SEGMENT_IGNORE_EMPTY : 0);
+  rc = sqlite3Fts3SegReaderIterate(p, apSegment, nSegment,
+      &filter, fts3MergeCallback, (void *)&pWriter
+  );
+  if( rc!=SQLITE_OK ) goto finished;
+
+  rc = fts3DeleteSegdir(p, iLevel, apSegment, nSegment);
+  if( rc==SQLITE_OK ){
+    rc = fts3SegWriterFlush(p, pWriter, iNewLevel, iIdx);
   }
 
+ finished:
+  fts3SegWriterFree(pWriter);
+  if( apSegment ){
+    for(i=0; i<nSegment; i++){
+      sqlite3Fts3SegReaderFree(p, apSegment[i]);
+    }
+    sqlite3_free(apSegment);
+  }
+  sqlite3Fts3SegReaderFree(p, pPending);
+  sqlite3_reset(pStmt);
   return rc;
 }
 
-/*
-** When this function is called, buffer *ppList (size *pnList bytes) contains 
-** a position list that may (or may not) feature multiple columns. This
-** function adjusts the pointer *ppList and the length *pnList so that they
-** identify the subset of the position list that corresponds to column iCol.
-**
-** If there are no entries in the input position list for column iCol, then
-** *pnList is set to zero before returning.
+
+/* 
+** Flush the contents of pendingTerms to a level 0 segment with index idx.
+** If idx is negative, the next free index at level 0 is used.
 */
-static void fts3ColumnFilter(
-  int iCol,                       /* Column to filter on */
-  char **ppList,                  /* IN/OUT: Pointer to position list */
-  int *pnList                     /* IN/OUT: Size of buffer *ppList in bytes */
-){
-  char *pList = *ppList;
-  int nList = *pnList;
-  char *pEnd = &pList[nList];
-  int iCurrent = 0;
-  char *p = pList;
+static int fts3PendingTermsWrite(Fts3Table *p, int idx){
+  int rc;                         /* Return Code */
+  SegmentWriter *pWriter = 0;     /* Used to write the segment */
+  Fts3SegReader *pReader = 0;     /* Used to iterate through the hash table */
 
-  assert( iCol>=0 );
-  while( 1 ){
-    char c = 0;
-    while( p<pEnd && (c | *p)&0xFE ) c = *p++ & 0x80;
-  
-    if( iCol==iCurrent ){
-      nList = (int)(p - pList);
-      break;
-    }
+  /* Allocate a SegReader object to iterate through the contents of the
+  ** pending-terms table. If an error occurs, or if there are no terms
+  ** in the pending-terms table, return immediately.
+  */
+  rc = sqlite3Fts3SegReaderPending(p, 0, 0, 1, &pReader);
+  if( rc!=SQLITE_OK || pReader==0 ){
+    return rc;
+  }
 
-    nList -= (int)(p - pList);
-    pList = p;
-    if( nList==0 ){
-      break;
-    }
-    p = &pList[1];
-    p += sqlite3Fts3GetVarint32(p, &iCurrent);
+  /* Determine the next index at level 0. If level 0 is already full, this
+  ** call may merge all existing level 0 segments into a single level 1
+  ** segment.
+  */
+  if( idx<0 ){
+    rc = fts3AllocateSegdirIdx(p, 0, &idx);
   }
 
-  *ppList = pList;
-  *pnList = nList;
-}
+  /* If no errors have occured, iterate through the contents of the 
+  ** pending-terms hash table using the Fts3SegReader iterator. The callback
+  ** writes each term (along with its doclist) to the database via the
+  ** SegmentWriter handle pWriter.
+  */
+  if( rc==SQLITE_OK ){
+    void *c = (void *)&pWriter;   /* SegReaderIterate() callback context */
+    Fts3SegFilter f;              /* SegReaderIterate() parameters */
 
-/*
-** sqlite3Fts3SegReaderIterate() callback used when merging multiple 
-** segments to create a single, larger segment.
-*/
-static int fts3MergeCallback(
-  Fts3Table *p,                   /* FTS3 Virtual table handle */
-  void *pContext,                 /* Pointer to SegmentWriter* to write with */
-  char *zTerm,                    /* Term to write to the db */
-  int nTerm,                      /* Number of bytes in zTerm */
-  char *aDoclist,                 /* Doclist associated with zTerm */
-  int nDoclist                    /* Number of bytes in doclist */
-){
-  SegmentWriter **ppW = (SegmentWriter **)pContext;
-  return fts3SegWriterAdd(p, ppW, 1, zTerm, nTerm, aDoclist, nDoclist);
+    memset(&f, 0, sizeof(Fts3SegFilter));
+    f.flags = FTS3_SEGMENT_REQUIRE_POS;
+    rc = sqlite3Fts3SegReaderIterate(p, &pReader, 1, &f, fts3FlushCallback, c);
+  }
+  assert( pWriter || rc!=SQLITE_OK );
+
+  /* If no errors have occured, flush the SegmentWriter object to the
+  ** database. Then delete the SegmentWriter and Fts3SegReader objects
+  ** allocated by this function.
+  */
+  if( rc==SQLITE_OK ){
+    rc = fts3SegWriterFlush(p, pWriter, 0, idx);
+  }
+  fts3SegWriterFree(pWriter);
+  sqlite3Fts3SegReaderFree(p, pReader);
+
+  if( rc==SQLITE_OK ){
+    sqlite3Fts3PendingTermsClear(p);
+  }
+  return rc;
 }
 
-/*
-** sqlite3Fts3SegReaderIterate() callback used when flushing the contents
-** of the pending-terms hash table to the database.
+/* 
+** Flush the contents of pendingTerms to a level 0 segment.
 */
-static int fts3FlushCallback(
-  Fts3Table *p,                   /* FTS3 Virtual table handle */
-  void *pContext,                 /* Pointer to SegmentWriter* to write with */
-  char *zTerm,                    /* Term to write to the db */
-  int nTerm,                      /* Number of bytes in zTerm */
-  char *aDoclist,                 /* Doclist associated with zTerm */
-  int nDoclist                    /* Number of bytes in doclist */
-){
-  SegmentWriter **ppW = (SegmentWriter **)pContext;
-  return fts3SegWriterAdd(p, ppW, 0, zTerm, nTerm, aDoclist, nDoclist);
+SQLITE_PRIVATE int sqlite3Fts3PendingTermsFlush(Fts3Table *p){
+  return fts3PendingTermsWrite(p, -1);
 }
 
 /*
-** This function is used to iterate through a contiguous set of terms 
-** stored in the full-text index. It merges data contained in one or 
-** more segments to support this.
-**
-** The second argument is passed an array of pointers to SegReader objects
-** allocated with sqlite3Fts3SegReaderNew(). This function merges the range 
-** of terms selected by each SegReader. If a single term is present in
-** more than one segment, the associated doclists are merged. For each
-** term and (possibly merged) doclist in the merged range, the callback
-** function xFunc is invoked with its arguments set as follows.
-**
-**   arg 0: Copy of 'p' parameter passed to this function
-**   arg 1: Copy of 'pContext' parameter passed to this function
-**   arg 2: Pointer to buffer containing term
-**   arg 3: Size of arg 2 buffer in bytes
-**   arg 4: Pointer to buffer containing doclist
-**   arg 5: Size of arg 2 buffer in bytes
+** Rebuild the full-text index from the contents of the %_content table.
+** This is the fast way to index a large table: fill %_content directly,
+** then run "INSERT INTO tbl(tbl) VALUES('rebuild')".
 **
-** The 4th argument to this function is a pointer to a structure of type
-** Fts3SegFilter, defined in fts3Int.h. The contents of this structure
-** further restrict the range of terms that callbacks are made for and
-** modify the behaviour of this function. See comments above structure
-** definition for details.
+** The index is built like an external sort. Rows are tokenized in docid
+** order into the pending-terms table, which is written out as a sorted
+** run (a level 0 segment) whenever it holds FTS3_REBUILD_PENDING_DATA
+** bytes. The runs are not merged with each other along the way, as they
+** would be by sqlite3Fts3PendingTermsFlush(); instead all of them are
+** merged in a single pass at the end, into one segment.
 */
-SQLITE_PRIVATE int sqlite3Fts3SegReaderIterate(
-  Fts3Table *p,                   /* Virtual table handle */
-  Fts3SegReader **apSegment,      /* Array of Fts3SegReader objects */
-  int nSegment,                   /* Size of apSegment array */
-  Fts3SegFilter *pFilter,         /* Restrictions on range of iteration */
-  int (*xFunc)(Fts3Table *, void *, char *, int, char *, int),  /* Callback */
-  void *pContext                  /* Callback context (2nd argument) */
-){
-  int i;                          /* Iterator variable */
-  char *aBuffer = 0;              /* Buffer to merge doclists in */
-  int nAlloc = 0;                 /* Allocated size of aBuffer buffer */
-  int rc = SQLITE_OK;             /* Return code */
-
-  int isIgnoreEmpty =  (pFilter->flags & FTS3_SEGMENT_IGNORE_EMPTY);
-  int isRequirePos =   (pFilter->flags & FTS3_SEGMENT_REQUIRE_POS);
-  int isColFilter =    (pFilter->flags & FTS3_SEGMENT_COLUMN_FILTER);
-  int isPrefix =       (pFilter->flags & FTS3_SEGMENT_PREFIX);
-
-  /* If there are zero segments, this function is a no-op. This scenario
-  ** comes about only when reading from an empty database.
-  */
-  if( nSegment==0 ) goto finished;
+static int fts3RebuildIndex(Fts3Table *p){
+  int rc;                         /* Return Code */
+  int rc2;                        /* sqlite3_finalize() return code */
+  int nRun = 0;                   /* Number of runs written so far */
+  char *zSql;                     /* SQL to read the %_content table */
+  sqlite3_stmt *pStmt = 0;        /* Statement to read %_content */
 
-  /* If the Fts3SegFilter defines a specific term (or term prefix) to search 
-  ** for, then advance each segment iterator until it points to a term of
-  ** equal or greater value than the specified term. This prevents many
-  ** unnecessary merge/sort operations for the case where single segment
-  ** b-tree leaf nodes contain more than one term.
-  */
-  if( pFilter->zTerm ){
-    int nTerm = pFilter->nTerm;
-    const char *zTerm = pFilter->zTerm;
-    for(i=0; i<nSegment; i++){
-      Fts3SegReader *pSeg = apSegment[i];
-      while( fts3SegReaderTermCmp(pSeg, zTerm, nTerm)<0 ){
-        rc = fts3SegReaderNext(pSeg);
-        if( rc!=SQLITE_OK ) goto finished; }
-    }
+  sqlite3Fts3PendingTermsClear(p);
+  rc = fts3SqlExec(p, SQL_DELETE_ALL_SEGMENTS, 0);
+  if( rc==SQLITE_OK ){
+    rc = fts3SqlExec(p, SQL_DELETE_ALL_SEGDIR, 0);
   }
+  if( rc!=SQLITE_OK ) return rc;
 
-  fts3SegReaderSort(apSegment, nSegment, nSegment, fts3SegReaderCmp);
-  while( apSegment[0]->aNode ){
-    int nTerm = apSegment[0]->nTerm;
-    char *zTerm = apSegment[0]->zTerm;
-    int nMerge = 1;
+  zSql = sqlite3_mprintf("SELECT * FROM %Q.'%q_content' ORDER BY docid",
+      p->zDb, p->zName);
+  if( !zSql ) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if( rc!=SQLITE_OK ) return rc;
 
-    /* If this is a prefix-search, and if the term that apSegment[0] points
-    ** to does not share a suffix with pFilter->zTerm/nTerm, then all 
-    ** required callbacks have been made. In this case exit early.
-    **
-    ** Similarly, if this is a search for an exact match, and the first term
-    ** of segment apSegment[0] is not a match, exit early.
-    */
-    if( pFilter->zTerm ){
-      if( nTerm<pFilter->nTerm 
-       || (!isPrefix && nTerm>pFilter->nTerm)
-       || memcmp(zTerm, pFilter->zTerm, pFilter->nTerm) 
-    ){
-        goto finished;
+  while( rc==SQLITE_OK && SQLITE_ROW==sqlite3_step(pStmt) ){
+    int i;
+    if( p->nPendingData>FTS3_REBUILD_PENDING_DATA ){
+      rc = fts3PendingTermsWrite(p, nRun++);
+    }
+    p->iPrevDocid = sqlite3_column_int64(pStmt, 0);
+    for(i=0; rc==SQLITE_OK && i<p->nColumn; i++){
+      const char *zText = (const char *)sqlite3_column_text(pStmt, i+1);
+      if( zText ){
+        rc = fts3PendingTermsAdd(p, zText, i);
       }
     }
+  }
+  rc2 = sqlite3_finalize(pStmt);
+  if( rc==SQLITE_OK ) rc = rc2;
 
-    while( nMerge<nSegment 
-        && apSegment[nMerge]->aNode
-        && apSegment[nMerge]->nTerm==nTerm 
-        && 0==memcmp(zTerm, apSegment[nMerge]->zTerm, nTerm)
-    ){
-      nMerge++;
+  /* Merge the runs, and the terms still pending, into a single segment.
+  ** If there is only one of those, it is the final segment as it is.
+  */
+  if( rc==SQLITE_OK ){
+    rc = fts3SegmentMerge(p, -1);
+    if( rc==SQLITE_DONE ){
+      rc = fts3PendingTermsWrite(p, nRun);
     }
+  }
+  sqlite3Fts3PendingTermsClear(p);
+  return rc;
+}
 
-    assert( isIgnoreEmpty || (isRequirePos && !isColFilter) );
-    if( nMerge==1 && !isIgnoreEmpty ){
-      Fts3SegReader *p0 = apSegment[0];
-      rc = xFunc(p, pContext, zTerm, nTerm, p0->aDoclist, p0->nDoclist);
-      if( rc!=SQLITE_OK ) goto finished;
-    }else{
-      int nDoclist = 0;           /* Size of doclist */
-      sqlite3_int64 iPrev = 0;    /* Previous docid stored in doclist */
+/*
+** Call xCallback for each term of the index with its docid-only doclist,
+** in sorted order, reading all the segments as fts3SegmentMerge() does.
+** Used to build the %_terms and %_prefixes tables.
+*/
+static int fts3IterateAllTerms(
+  Fts3Table *p,                   /* Virtual table handle */
+  int (*xCallback)(Fts3Table *, void *, char *, int, char *, int),
+  void *pContext                  /* First argument to pass to xCallback */
+){
+  int rc;                         /* Return Code */
+  int i;                          /* Iterator variable */
+  int iMaxLevel;                  /* Unused output of fts3SegmentCountMax */
+  sqlite3_stmt *pStmt = 0;        /* Statement to read %_segdir */
+  int nSegment = 0;               /* Number of segments in the index */
+  Fts3SegReader **apSegment = 0;  /* Array of Segment iterators */
+  Fts3SegFilter filter;           /* Segment term filter condition */
 
-      /* The current term of the first nMerge entries in the array
-      ** of Fts3SegReader objects is the same. The doclists must be merged
-      ** and a single term added to the new segment.
-      */
-      for(i=0; i<nMerge; i++){
-        fts3SegReaderFirstDocid(apSegment[i]);
-      }
-      fts3SegReaderSort(apSegment, nMerge, nMerge, fts3SegReaderDoclistCmp);
-      while( apSegment[0]->pOffsetList ){
-        int j;                    /* Number of segments that share a docid */
-        char *pList;
-        int nList;
-        int nByte;
-        sqlite3_int64 iDocid = apSegment[0]->iDocid;
-        fts3SegReaderNextDocid(apSegment[0], &pList, &nList);
-        j = 1;
-        while( j<nMerge
-            && apSegment[j]->pOffsetList
-            && apSegment[j]->iDocid==iDocid
-        ){
-          fts3SegReaderNextDocid(apSegment[j], 0, 0);
-          j++;
-        }
+  rc = fts3SegmentCountMax(p, &nSegment, &iMaxLevel);
+  if( rc!=SQLITE_OK || nSegment==0 ) return rc;
+  apSegment = (Fts3SegReader**)sqlite3_malloc(sizeof(Fts3SegReader *)*nSegment);
+  if( !apSegment ) return SQLITE_NOMEM;
+  memset(apSegment, 0, sizeof(Fts3SegReader *)*nSegment);
 
-        if( isColFilter ){
-          fts3ColumnFilter(pFilter->iCol, &pList, &nList);
-        }
+  rc = fts3SqlStmt(p, SQL_SELECT_ALL_LEVEL, &pStmt, 0);
+  if( rc!=SQLITE_OK ) goto finished;
+  for(i=0; i<nSegment && SQLITE_ROW==(sqlite3_step(pStmt)); i++){
+    rc = fts3SegReaderNew(p, pStmt, i, &apSegment[i]);
+    if( rc!=SQLITE_OK ) goto finished;
+  }
+  rc = sqlite3_reset(pStmt);
+  pStmt = 0;
+  if( rc!=SQLITE_OK ) goto finished;
 
-        if( !isIgnoreEmpty || nList>0 ){
-          nByte = sqlite3Fts3VarintLen(iDocid-iPrev) + (isRequirePos?nList+1:0);
-          if( nDoclist+nByte>nAlloc ){
-            char *aNew;
-            nAlloc = nDoclist+nByte*2;
-            aNew = sqlite3_realloc(aBuffer, nAlloc);
-            if( !aNew ){
-              rc = SQLITE_NOMEM;
-              goto finished;
-            }
-            aBuffer = aNew;
-          }
-          nDoclist += sqlite3Fts3PutVarint(&aBuffer[nDoclist], iDocid-iPrev);
-          iPrev = iDocid;
-          if( isRequirePos ){
-            memcpy(&aBuffer[nDoclist], pList, nList);
-            nDoclist += nList;
-            aBuffer[nDoclist++] = '\0';
-          }
-        }
+  memset(&filter, 0, sizeof(Fts3SegFilter));
+  filter.flags = FTS3_SEGMENT_IGNORE_EMPTY;
+  rc = sqlite3Fts3SegReaderIterate(p, apSegment, nSegment,
+      &filter, xCallback, pContext
+  );
 
-        fts3SegReaderSort(apSegment, nMerge, j, fts3SegReaderDoclistCmp);
-      }
+ finished:
+  if( pStmt ) sqlite3_reset(pStmt);
+  for(i=0; i<nSegment; i++){
+    sqlite3Fts3SegReaderFree(p, apSegment[i]);
+  }
+  sqlite3_free(apSegment);
+  return rc;
+}
 
-      if( nDoclist>0 ){
-        rc = xFunc(p, pContext, zTerm, nTerm, aBuffer, nDoclist);
-        if( rc!=SQLITE_OK ) goto finished;
-      }
-    }
+/*
+** The union of a number of docid-only doclists, added one at a time.
+** Merging each of them into the union of those before would take time
+** quadratic in their number, so they are merged as in a balanced tree:
+** aSlot[i] holds the union of 2^i of them or nothing, and a new doclist
+** is carried up the slots like a bit added to a binary counter.
+*/
+#define FTS3_UNION_SLOTS 32
+typedef struct Fts3DoclistUnion Fts3DoclistUnion;
+struct Fts3DoclistUnion {
+  struct Fts3UnionSlot {
+    char *aDoclist;               /* Union of 2^i doclists, or NULL */
+    int nDoclist;                 /* Size of aDoclist in bytes */
+  } aSlot[FTS3_UNION_SLOTS];
+};
 
-    /* If there is a term specified to filter on, and this is not a prefix
-    ** search, return now. The callback that corresponds to the required
-    ** term (if such a term exists in the index) has already been made.
-    */
-    if( pFilter->zTerm && !isPrefix ){
-      goto finished;
+/*
+** Set *paOut to a malloced doclist with the docids of docid-only
+** doclists a1 and a2, and *pnOut to its size. a1 and a2 are freed, also
+** if an error is returned.
+*/
+static int fts3UnionMerge(
+  char *a1, int n1,               /* First doclist */
+  char *a2, int n2,               /* Second doclist */
+  char **paOut,                   /* OUT: Malloced result */
+  int *pnOut                      /* OUT: Size of *paOut in bytes */
+){
+  int rc = SQLITE_NOMEM;
+  char *aOut = sqlite3_malloc(n1+n2+1);
+  *paOut = 0;
+  if( aOut ){
+    rc = fts3DoclistMerge(MERGE_OR, 0, 0, aOut, pnOut, a1, n1, a2, n2);
+    if( rc==SQLITE_OK ){
+      *paOut = aOut;
+    }else{
+      sqlite3_free(aOut);
     }
+  }
+  sqlite3_free(a1);
+  sqlite3_free(a2);
+  return rc;
+}
 
-    for(i=0; i<nMerge; i++){
-      rc = fts3SegReaderNext(apSegment[i]);
-      if( rc!=SQLITE_OK ) goto finished;
+/*
+** Add the docids of doclist aDoclist to union pUnion.
+*/
+static int fts3UnionAdd(
+  Fts3DoclistUnion *pUnion,
+  const char *aDoclist,
+  int nDoclist
+){
+  char *a;
+  int n = nDoclist;
+  int i;
+
+  if( nDoclist==0 ) return SQLITE_OK;
+  a = sqlite3_malloc(nDoclist);
+  if( !a ) return SQLITE_NOMEM;
+  memcpy(a, aDoclist, nDoclist);
+
+  for(i=0; pUnion->aSlot[i].aDoclist; i++){
+    struct Fts3UnionSlot *pSlot = &pUnion->aSlot[i];
+    int rc = fts3UnionMerge(pSlot->aDoclist, pSlot->nDoclist, a, n, &a, &n);
+    pSlot->aDoclist = 0;
+    if( rc!=SQLITE_OK ) return rc;
+    assert( i+1<FTS3_UNION_SLOTS );
+  }
+  pUnion->aSlot[i].aDoclist = a;
+  pUnion->aSlot[i].nDoclist = n;
+  return SQLITE_OK;
+}
+
+/*
+** Set *paOut to a malloced doclist with all the docids added to pUnion,
+** or NULL if there are none, and *pnOut to its size. pUnion is empty
+** afterwards.
+*/
+static int fts3UnionFinish(
+  Fts3DoclistUnion *pUnion,
+  char **paOut,
+  int *pnOut
+){
+  int rc = SQLITE_OK;
+  char *a = 0;
+  int n = 0;
+  int i;
+
+  for(i=0; i<FTS3_UNION_SLOTS; i++){
+    struct Fts3UnionSlot *pSlot = &pUnion->aSlot[i];
+    if( !pSlot->aDoclist ) continue;
+    if( rc==SQLITE_OK && a ){
+      rc = fts3UnionMerge(a, n, pSlot->aDoclist, pSlot->nDoclist, &a, &n);
+    }else if( rc==SQLITE_OK ){
+      a = pSlot->aDoclist;
+      n = pSlot->nDoclist;
+    }else{
+      sqlite3_free(pSlot->aDoclist);
     }
-    fts3SegReaderSort(apSegment, nSegment, nMerge, fts3SegReaderCmp);
+    pSlot->aDoclist = 0;
   }
-
- finished:
-  sqlite3_free(aBuffer);
+  *paOut = a;
+  *pnOut = (rc==SQLITE_OK ? n : 0);
   return rc;
 }
 
 /*
-** Merge all level iLevel segments in the database into a single 
-** iLevel+1 segment. Or, if iLevel<0, merge all segments into a
-** single segment with a level equal to the numerically largest level 
-** currently present in the database.
-**
-** If this function is called with iLevel<0, but there is only one
-** segment in the database, SQLITE_DONE is returned immediately. 
-** Otherwise, if successful, SQLITE_OK is returned. If an error occurs, 
-** an SQLite error code is returned.
+** Free the doclists of union pUnion.
 */
-static int fts3SegmentMerge(Fts3Table *p, int iLevel){
-  int i;                          /* Iterator variable */
-  int rc;                         /* Return code */
-  int iIdx;                       /* Index of new segment */
-  int iNewLevel;                  /* Level to create new segment at */
-  sqlite3_stmt *pStmt = 0;
-  SegmentWriter *pWriter = 0;
-  int nSegment = 0;               /* Number of segments being merged */
-  Fts3SegReader **apSegment = 0;  /* Array of Segment iterators */
-  Fts3SegReader *pPending = 0;    /* Iterator for pending-terms */
-  Fts3SegFilter filter;           /* Segment term filter condition */
+static void fts3UnionClear(Fts3DoclistUnion *pUnion){
+  int i;
+  for(i=0; i<FTS3_UNION_SLOTS; i++){
+    sqlite3_free(pUnion->aSlot[i].aDoclist);
+    pUnion->aSlot[i].aDoclist = 0;
+  }
+}
 
-  if( iLevel<0 ){
-    /* This call is to merge all segments in the database to a single
-    ** segment. The level of the new segment is equal to the the numerically 
-    ** greatest segment level currently present in the database. The index
-    ** of the new segment is always 0.
-    */
-    iIdx = 0;
-    rc = sqlite3Fts3SegReaderPending(p, 0, 0, 1, &pPending);
-    if( rc!=SQLITE_OK ) goto finished;
-    rc = fts3SegmentCountMax(p, &nSegment, &iNewLevel);
-    if( rc!=SQLITE_OK ) goto finished;
-    nSegment += (pPending!=0);
-    if( nSegment<=1 ){
-      return SQLITE_DONE;
-    }
+/*
+** State of fts3TermStatsBuild() while it goes through the terms of the
+** index. Terms arrive in sorted order, so the terms that start with the
+** same characters arrive one after another, and a term is the start of
+** longer terms exactly if the term after it starts with it.
+*/
+typedef struct TermStats TermStats;
+struct TermStats {
+  sqlite3_stmt *pInsert;          /* INSERT INTO %_terms VALUES(?, ?, ?) */
+  char *zTerm;                    /* Previous term, not written yet */
+  int nTerm;                      /* Size of zTerm in bytes */
+  int nTermAlloc;                 /* Allocated size of zTerm */
+  int nDocid;                     /* Number of documents with zTerm */
+  char zPrefix[4*FTS3_TERMSTATS_PREFIX];  /* Current prefix */
+  int nPrefix;                    /* Size of zPrefix in bytes, 0 if none */
+  Fts3DoclistUnion prefix;        /* Docids of the terms with the prefix */
+};
+
+/*
+** Write a row to the %_terms table. isExtended is 1 if longer terms start
+** with term z, 0 if not, or -1 if z is a prefix row (stored as NULL).
+*/
+static int fts3TermStatsWrite(
+  TermStats *pStats,
+  const char *z,
+  int n,
+  int nDocid,
+  int isExtended
+){
+  sqlite3_stmt *pInsert = pStats->pInsert;
+  sqlite3_bind_text(pInsert, 1, z, n, SQLITE_STATIC);
+  sqlite3_bind_int(pInsert, 2, nDocid);
+  if( isExtended<0 ){
+    sqlite3_bind_null(pInsert, 3);
   }else{
-    /* This call is to merge all segments at level iLevel. Find the next
-    ** available segment index at level iLevel+1. The call to
-    ** fts3AllocateSegdirIdx() will merge the segments at level iLevel+1 to 
-    ** a single iLevel+2 segment if necessary.
-    */
-    iNewLevel = iLevel+1;
-    rc = fts3AllocateSegdirIdx(p, iNewLevel, &iIdx);
-    if( rc!=SQLITE_OK ) goto finished;
-    rc = fts3SegmentCount(p, iLevel, &nSegment);
-    if( rc!=SQLITE_OK ) goto finished;
+    sqlite3_bind_int(pInsert, 3, isExtended);
   }
-  assert( nSegment>0 );
-  assert( iNewLevel>=0 );
+  sqlite3_step(pInsert);
+  return sqlite3_reset(pInsert);
+}
 
-  /* Allocate space for an array of pointers to segment iterators. */
-  apSegment = (Fts3SegReader**)sqlite3_malloc(sizeof(Fts3SegReader *)*nSegment);
-  if( !apSegment ){
-    rc = SQLITE_NOMEM;
-    goto finished;
+/*
+** Write the row for the current prefix, if any. The key is the prefix
+** followed by a '*', as it would be written in a MATCH expression; the
+** tokenizers never return a '*' as part of a term.
+*/
+static int fts3TermStatsFlushPrefix(TermStats *pStats){
+  int rc = SQLITE_OK;
+  if( pStats->nPrefix>0 ){
+    char *aPrefix;
+    int nPrefixDoclist;
+    rc = fts3UnionFinish(&pStats->prefix, &aPrefix, &nPrefixDoclist);
+    if( rc==SQLITE_OK ){
+      pStats->zPrefix[pStats->nPrefix] = '*';
+      rc = fts3TermStatsWrite(pStats, pStats->zPrefix, pStats->nPrefix+1,
+          fts3DoclistCount(aPrefix, nPrefixDoclist), -1
+      );
+    }
+    sqlite3_free(aPrefix);
+    pStats->nPrefix = 0;
   }
-  memset(apSegment, 0, sizeof(Fts3SegReader *)*nSegment);
+  return rc;
+}
 
-  /* Allocate a Fts3SegReader structure for each segment being merged. A 
-  ** Fts3SegReader stores the state data required to iterate through all 
-  ** entries on all leaves of a single segment. 
+/*
+** sqlite3Fts3SegReaderIterate() callback used by fts3TermStatsBuild().
+** aDoclist is a docid-only doclist.
+*/
+static int fts3TermStatsCb(
+  Fts3Table *p,
+  void *pContext,
+  char *zTerm,
+  int nTerm,
+  char *aDoclist,
+  int nDoclist
+){
+  TermStats *pStats = (TermStats *)pContext;
+  int rc = SQLITE_OK;
+  int nChar = 0;                  /* Characters in the first nPrefix bytes */
+  int nPrefix;                    /* Size of the prefix of zTerm in bytes */
+
+  UNUSED_PARAMETER(p);
+
+  /* Now it is known whether this term extends the previous one */
+  if( pStats->nDocid>0 ){
+    int isExtended = (nTerm>pStats->nTerm
+        && 0==memcmp(zTerm, pStats->zTerm, pStats->nTerm));
+    rc = fts3TermStatsWrite(pStats, pStats->zTerm, pStats->nTerm,
+        pStats->nDocid, isExtended
+    );
+    if( rc!=SQLITE_OK ) return rc;
+  }
+  if( nTerm>pStats->nTermAlloc ){
+    char *zNew = sqlite3_realloc(pStats->zTerm, nTerm*2);
+    if( !zNew ) return SQLITE_NOMEM;
+    pStats->zTerm = zNew;
+    pStats->nTermAlloc = nTerm*2;
+  }
+  memcpy(pStats->zTerm, zTerm, nTerm);
+  pStats->nTerm = nTerm;
+  pStats->nDocid = fts3DoclistCount(aDoclist, nDoclist);
+
+  /* Find the first FTS3_TERMSTATS_PREFIX characters of the term, counting
+  ** UTF-8 continuation bytes as part of the character before them.
   */
-  assert( SQL_SELECT_LEVEL+1==SQL_SELECT_ALL_LEVEL);
-  rc = fts3SqlStmt(p, SQL_SELECT_LEVEL+(iLevel<0), &pStmt, 0);
-  if( rc!=SQLITE_OK ) goto finished;
-  sqlite3_bind_int(pStmt, 1, iLevel);
-  for(i=0; SQLITE_ROW==(sqlite3_step(pStmt)); i++){
-    rc = fts3SegReaderNew(p, pStmt, i, &apSegment[i]);
-    if( rc!=SQLITE_OK ){
-      goto finished;
+  for(nPrefix=0; nPrefix<nTerm; nPrefix++){
+    if( (zTerm[nPrefix] & 0xC0)!=0x80 && nChar++==FTS3_TERMSTATS_PREFIX ){
+      break;
     }
   }
-  rc = sqlite3_reset(pStmt);
-  if( pPending ){
-    apSegment[i] = pPending;
-    pPending = 0;
+  if( nChar<FTS3_TERMSTATS_PREFIX || nPrefix>=(int)sizeof(pStats->zPrefix) ){
+    return SQLITE_OK;
   }
-  pStmt = 0;
-  if( rc!=SQLITE_OK ) goto finished;
 
-  memset(&filter, 0, sizeof(Fts3SegFilter));
-  filter.flags = FTS3_SEGMENT_REQUIRE_POS;
-  filter.flags |= (iLevel<0 ? FTS3_SEGMENT_IGNORE_EMPTY : 0);
-  rc = sqlite3Fts3SegReaderIterate(p, apSegment, nSegment,
-      &filter, fts3MergeCallback, (void *)&pWriter
+  /* Unless this is another term with the current prefix, the current
+  ** prefix is complete and this term starts a new one */
+  if( nPrefix!=pStats->nPrefix || memcmp(zTerm, pStats->zPrefix, nPrefix) ){
+    rc = fts3TermStatsFlushPrefix(pStats);
+    if( rc!=SQLITE_OK ) return rc;
+    memcpy(pStats->zPrefix, zTerm, nPrefix);
+    pStats->nPrefix = nPrefix;
+  }
+  return fts3UnionAdd(&pStats->prefix, aDoclist, nDoclist);
+}
+
+/*
+** (Re)build the %_terms table, which has the number of documents that
+** contain each term of the index, and that contain any term starting
+** with each FTS3_TERMSTATS_PREFIX character prefix. A query planner can
+** use it to pick the order in which to evaluate the terms of a query,
+** and to see that a prefix search would only find the term itself. Run
+** "INSERT INTO tbl(tbl) VALUES('termstats')" to build it. The table is
+** not kept up to date as the index changes, it is emptied instead.
+**
+**   CREATE TABLE %_terms(
+**     term TEXT PRIMARY KEY,     -- A term, or a prefix followed by '*'
+**     df INTEGER,                -- Number of documents that match
+**     extended INTEGER           -- 1 if longer terms start with this one
+**   );
+*/
+static int fts3TermStatsBuild(Fts3Table *p){
+  int rc;                         /* Return Code */
+  char *zSql;                     /* SQL to create and fill %_terms */
+  TermStats stats;                /* Callback context */
+
+  memset(&stats, 0, sizeof(TermStats));
+
+  rc = sqlite3Fts3PendingTermsFlush(p);
+  if( rc!=SQLITE_OK ) return rc;
+
+  zSql = sqlite3_mprintf(
+      "CREATE TABLE IF NOT EXISTS %Q.'%q_terms'"
+      "(term TEXT PRIMARY KEY, df INTEGER, extended INTEGER);"
+      "DELETE FROM %Q.'%q_terms';",
+      p->zDb, p->zName, p->zDb, p->zName
   );
-  if( rc!=SQLITE_OK ) goto finished;
+  if( !zSql ) return SQLITE_NOMEM;
+  rc = sqlite3_exec(p->db, zSql, 0, 0, 0);
+  sqlite3_free(zSql);
+  if( rc!=SQLITE_OK ) return rc;
 
-  rc = fts3DeleteSegdir(p, iLevel, apSegment, nSegment);
+  zSql = sqlite3_mprintf("INSERT INTO %Q.'%q_terms' VALUES(?, ?, ?)",
+      p->zDb, p->zName);
+  if( !zSql ) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stats.pInsert, 0);
+  sqlite3_free(zSql);
+  if( rc!=SQLITE_OK ) return rc;
+
+  rc = fts3IterateAllTerms(p, fts3TermStatsCb, (void *)&stats);
+
+  /* The last term has nothing after it */
+  if( rc==SQLITE_OK && stats.nDocid>0 ){
+    rc = fts3TermStatsWrite(&stats, stats.zTerm, stats.nTerm, stats.nDocid, 0);
+  }
   if( rc==SQLITE_OK ){
-    rc = fts3SegWriterFlush(p, pWriter, iNewLevel, iIdx);
+    rc = fts3TermStatsFlushPrefix(&stats);
   }
-
- finished:
-  fts3SegWriterFree(pWriter);
-  if( apSegment ){
-    for(i=0; i<nSegment; i++){
-      sqlite3Fts3SegReaderFree(p, apSegment[i]);
-    }
-    sqlite3_free(apSegment);
+  if( rc==SQLITE_OK ){
+    p->noTermStats = 0;
   }
-  sqlite3Fts3SegReaderFree(p, pPending);
-  sqlite3_reset(pStmt);
+
+  sqlite3_finalize(stats.pInsert);
+  sqlite3_free(stats.zTerm);
+  fts3UnionClear(&stats.prefix);
   return rc;
 }
 
+/*
+** State of fts3PrefixesBuild() while it goes through the terms of the
+** index. The doclists of the prefixes of 1 to nLevel characters of the
+** current term are built at the same time. Terms arrive in sorted order,
+** so each prefix is complete as soon as a term without it arrives. Its
+** doclist is then added to that of the next shorter prefix, which thus
+** only sees one doclist per distinct longer prefix instead of one per
+** term.
+*/
+typedef struct PrefixBuild PrefixBuild;
+struct PrefixBuild {
+  sqlite3_stmt *pInsert;          /* INSERT INTO %_prefixes VALUES(?, ?) */
+  char zPrefix[4*FTS3_PREFIXES_MAX];  /* Longest current prefix */
+  int nLevel;                     /* Number of prefixes being built */
+  struct PrefixLevel {
+    int nPrefix;                  /* Size of this prefix of zPrefix in bytes */
+    Fts3DoclistUnion docids;      /* Docids of the terms with the prefix */
+  } aLevel[FTS3_PREFIXES_MAX];
+};
 
-/* 
-** Flush the contents of pendingTerms to a level 0 segment.
+/*
+** Write the rows of the current prefixes longer than nKeep characters
+** and pass their docids on to the next shorter prefix.
 */
-SQLITE_PRIVATE int sqlite3Fts3PendingTermsFlush(Fts3Table *p){
-  int rc;                         /* Return Code */
-  int idx;                        /* Index of new segment created */
-  SegmentWriter *pWriter = 0;     /* Used to write the segment */
-  Fts3SegReader *pReader = 0;     /* Used to iterate through the hash table */
+static int fts3PrefixFlush(PrefixBuild *pBuild, int nKeep){
+  int rc = SQLITE_OK;
+  while( rc==SQLITE_OK && pBuild->nLevel>nKeep ){
+    struct PrefixLevel *pLevel = &pBuild->aLevel[--pBuild->nLevel];
+    sqlite3_stmt *pInsert = pBuild->pInsert;
+    char *aDoclist;
+    int nDoclist;
 
-  /* Allocate a SegReader object to iterate through the contents of the
-  ** pending-terms table. If an error occurs, or if there are no terms
-  ** in the pending-terms table, return immediately.
-  */
-  rc = sqlite3Fts3SegReaderPending(p, 0, 0, 1, &pReader);
-  if( rc!=SQLITE_OK || pReader==0 ){
-    return rc;
+    rc = fts3UnionFinish(&pLevel->docids, &aDoclist, &nDoclist);
+    if( rc!=SQLITE_OK ) break;
+    sqlite3_bind_text(pInsert, 1, pBuild->zPrefix, pLevel->nPrefix,
+        SQLITE_STATIC);
+    sqlite3_bind_blob(pInsert, 2, aDoclist, nDoclist, SQLITE_STATIC);
+    sqlite3_step(pInsert);
+    rc = sqlite3_reset(pInsert);
+
+    if( rc==SQLITE_OK && pBuild->nLevel>0 ){
+      rc = fts3UnionAdd(&pLevel[-1].docids, aDoclist, nDoclist);
+    }
+    sqlite3_free(aDoclist);
   }
+  return rc;
+}
 
-  /* Determine the next index at level 0. If level 0 is already full, this
-  ** call may merge all existing level 0 segments into a single level 1
-  ** segment.
-  */
-  rc = fts3AllocateSegdirIdx(p, 0, &idx);
+/*
+** sqlite3Fts3SegReaderIterate() callback used by fts3PrefixesBuild().
+** aDoclist is a docid-only doclist.
+*/
+static int fts3PrefixesCb(
+  Fts3Table *p,
+  void *pContext,
+  char *zTerm,
+  int nTerm,
+  char *aDoclist,
+  int nDoclist
+){
+  PrefixBuild *pBuild = (PrefixBuild *)pContext;
+  int aEnd[FTS3_PREFIXES_MAX];    /* Sizes of the prefixes of zTerm */
+  int nChar = 0;                  /* Number of prefixes in aEnd[] */
+  int nKeep = 0;                  /* Current prefixes that zTerm has too */
+  int i;
+  int rc;
 
-  /* If no errors have occured, iterate through the contents of the 
-  ** pending-terms hash table using the Fts3SegReader iterator. The callback
-  ** writes each term (along with its doclist) to the database via the
-  ** SegmentWriter handle pWriter.
+  UNUSED_PARAMETER(p);
+
+  /* A character ends where the next one starts, UTF-8 continuation bytes
+  ** belong to the character before them.
   */
-  if( rc==SQLITE_OK ){
-    void *c = (void *)&pWriter;   /* SegReaderIterate() callback context */
-    Fts3SegFilter f;              /* SegReaderIterate() parameters */
+  for(i=1; i<=nTerm && nChar<FTS3_PREFIXES_MAX; i++){
+    if( i==nTerm || (zTerm[i] & 0xC0)!=0x80 ){
+      if( i>(int)sizeof(pBuild->zPrefix) ) break;
+      aEnd[nChar++] = i;
+    }
+  }
+  if( nChar==0 ) return SQLITE_OK;
 
-    memset(&f, 0, sizeof(Fts3SegFilter));
-    f.flags = FTS3_SEGMENT_REQUIRE_POS;
-    rc = sqlite3Fts3SegReaderIterate(p, &pReader, 1, &f, fts3FlushCallback, c);
+  while( nKeep<pBuild->nLevel && nKeep<nChar
+      && pBuild->aLevel[nKeep].nPrefix==aEnd[nKeep]
+      && 0==memcmp(pBuild->zPrefix, zTerm, aEnd[nKeep])
+  ){
+    nKeep++;
   }
-  assert( pWriter || rc!=SQLITE_OK );
+  rc = fts3PrefixFlush(pBuild, nKeep);
+  if( rc!=SQLITE_OK ) return rc;
 
-  /* If no errors have occured, flush the SegmentWriter object to the
-  ** database. Then delete the SegmentWriter and Fts3SegReader objects
-  ** allocated by this function.
-  */
-  if( rc==SQLITE_OK ){
-    rc = fts3SegWriterFlush(p, pWriter, 0, idx);
+  memcpy(pBuild->zPrefix, zTerm, aEnd[nChar-1]);
+  for(i=nKeep; i<nChar; i++){
+    pBuild->aLevel[i].nPrefix = aEnd[i];
   }
-  fts3SegWriterFree(pWriter);
-  sqlite3Fts3SegReaderFree(p, pReader);
+  pBuild->nLevel = nChar;
+  return fts3UnionAdd(&pBuild->aLevel[nChar-1].docids, aDoclist, nDoclist);
+}
+
+/*
+** (Re)build the %_prefixes table, which has the docid-only doclist of
+** the documents that contain a term starting with each prefix of up to
+** FTS3_PREFIXES_MAX characters. A search for such a short prefix is then
+** a single lookup instead of a merge of the doclists of all the terms
+** that start with it. Run "INSERT INTO tbl(tbl) VALUES('prefixes')" to
+** build it. Any change to the table empties it, and prefix searches go
+** back to reading the segments until it is built again.
+**
+**   CREATE TABLE %_prefixes(
+**     prefix TEXT PRIMARY KEY,   -- Start of one or more terms
+**     doclist BLOB               -- Docids of the documents with them
+**   );
+*/
+static int fts3PrefixesBuild(Fts3Table *p){
+  int rc;                         /* Return Code */
+  char *zSql;                     /* SQL to create and fill %_prefixes */
+  PrefixBuild build;              /* Callback context */
+  int i;                          /* Iterator variable */
+
+  memset(&build, 0, sizeof(PrefixBuild));
+
+  rc = sqlite3Fts3PendingTermsFlush(p);
+  if( rc!=SQLITE_OK ) return rc;
+
+  zSql = sqlite3_mprintf(
+      "CREATE TABLE IF NOT EXISTS %Q.'%q_prefixes'"
+      "(prefix TEXT PRIMARY KEY, doclist BLOB);"
+      "DELETE FROM %Q.'%q_prefixes';",
+      p->zDb, p->zName, p->zDb, p->zName
+  );
+  if( !zSql ) return SQLITE_NOMEM;
+  rc = sqlite3_exec(p->db, zSql, 0, 0, 0);
+  sqlite3_free(zSql);
+  if( rc!=SQLITE_OK ) return rc;
+
+  zSql = sqlite3_mprintf("INSERT INTO %Q.'%q_prefixes' VALUES(?, ?)",
+      p->zDb, p->zName);
+  if( !zSql ) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &build.pInsert, 0);
+  sqlite3_free(zSql);
+  if( rc!=SQLITE_OK ) return rc;
 
+  rc = fts3IterateAllTerms(p, fts3PrefixesCb, (void *)&build);
   if( rc==SQLITE_OK ){
-    sqlite3Fts3PendingTermsClear(p);
+    rc = fts3PrefixFlush(&build, 0);
+  }
+  if( rc==SQLITE_OK ){
+    p->noPrefixes = 0;
+  }
+
+  sqlite3_finalize(build.pInsert);
+  for(i=0; i<FTS3_PREFIXES_MAX; i++){
+    fts3UnionClear(&build.aLevel[i].docids);
+  }
+  return rc;
+}
+
+/*
+** Empty the %_prefixes and %_terms tables, if there are any, as they are
+** out of date once documents are added or removed. Readers then go to the
+** segments, and have no statistics to go by, until they are built again.
+*/
+static int fts3IndexChanged(Fts3Table *p){
+  int rc = SQLITE_OK;
+  if( !p->noPrefixes ){
+    rc = fts3SqlExec(p, SQL_DELETE_ALL_PREFIXES, 0);
+    if( rc==SQLITE_ERROR ){
+      /* There is no %_prefixes table */
+      rc = SQLITE_OK;
+    }
+    p->noPrefixes = 1;
+  }
+  if( rc==SQLITE_OK && !p->noTermStats ){
+    rc = fts3SqlExec(p, SQL_DELETE_ALL_TERMS, 0);
+    if( rc==SQLITE_ERROR ){
+      /* There is no %_terms table */
+      rc = SQLITE_OK;
+    }
+    p->noTermStats = 1;
   }
   return rc;
 }
@@ -105782,8 +108251,8 @@ SQLITE_PRIVATE int sqlite3Fts3PendingTermsFlush(Fts3Table *p){
 **
 **   "INSERT INTO tbl(tbl) VALUES(<expr>)"
 **
-** Argument pVal contains the result of <expr>. Currently the only 
-** meaningful value to insert is the text 'optimize'.
+** Argument pVal contains the result of <expr>. The meaningful values to
+** insert are the texts 'optimize', 'rebuild', 'termstats' and 'prefixes'.
 */
 static int fts3SpecialInsert(Fts3Table *p, sqlite3_value *pVal){
   int rc;                         /* Return Code */
@@ -105799,6 +108268,15 @@ static int fts3SpecialInsert(Fts3Table *p, sqlite3_value *pVal){
     }else{
       sqlite3Fts3PendingTermsClear(p);
     }
+  }else if( nVal==7 && 0==sqlite3_strnicmp(zVal, "rebuild", 7) ){
+    rc = fts3IndexChanged(p);
+    if( rc==SQLITE_OK ){
+      rc = fts3RebuildIndex(p);
+    }
+  }else if( nVal==9 && 0==sqlite3_strnicmp(zVal, "termstats", 9) ){
+    rc = fts3TermStatsBuild(p);
+  }else if( nVal==8 && 0==sqlite3_strnicmp(zVal, "prefixes", 8) ){
+    rc = fts3PrefixesBuild(p);
 #ifdef SQLITE_TEST
   }else if( nVal>9 && 0==sqlite3_strnicmp(zVal, "nodesize=", 9) ){
     p->nNodeSize = atoi(&zVal[9]);
@@ -105833,7 +108311,10 @@ SQLITE_PRIVATE int sqlite3Fts3UpdateMethod(
   /* If this is a DELETE or UPDATE operation, remove the old record. */
   if( sqlite3_value_type(apVal[0])!=SQLITE_NULL ){
     int isEmpty;
-    rc = fts3IsEmpty(p, apVal, &isEmpty);
+    rc = fts3IndexChanged(p);
+    if( rc==SQLITE_OK ){
+      rc = fts3IsEmpty(p, apVal, &isEmpty);
+    }
     if( rc==SQLITE_OK ){
       if( isEmpty ){
         /* Deleting this row means the whole table is empty. In this case
@@ -105859,7 +108340,10 @@ SQLITE_PRIVATE int sqlite3Fts3UpdateMethod(
   
   /* If this is an INSERT or UPDATE operation, insert the new record. */
   if( nArg>1 && rc==SQLITE_OK ){
-    rc = fts3InsertData(p, apVal, pRowid);
+    rc = fts3IndexChanged(p);
+    if( rc==SQLITE_OK ){
+      rc = fts3InsertData(p, apVal, pRowid);
+    }
     if( rc==SQLITE_OK && (!isRemove || *pRowid!=iRemove) ){
       rc = fts3PendingTermsDocid(p, *pRowid);
     }
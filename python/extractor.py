@@ -4,7 +4,7 @@
 #
 # Wikipedia XML dump file parser
 #
-# Usage: python extractor.py <wikipedia_xml_file.xml> <sqlite_dbfile.db>
+# Usage: python extractor.py [-j N] [-b] [-i INDEX] [-r] [-u [-p]] [-s FILE] [-m KB] <wikipedia_xml_file.xml> <sqlite_dbfile.db>
 #
 # Parse the Wikipedia XML dump file (articles) and create an
 # SQLite3 database containing "articles" table with three columns,
@@ -13,6 +13,11 @@
 # Both title column and text column when uncompressed are in utf-8 encoding.
 # Integer ID is just used for quickly selecting one article at random.
 #
+# The import runs as a pipeline of processes: one parses the XML dump,
+# a pool of workers (one per core by default, -j to change) cleans up
+# and compresses the pages, and the main process stores them in the
+# database in the same order they appear in the dump.
+#
 # Most distros don't build SQLite3 with FTS3 free text search support,
 # without which article search takes forever. After the database is
 # populated using this program, it should be post-processed using
@@ -21,12 +26,68 @@
 # article titles:
 #
 #    CREATE VIRTUAL TABLE article_index USING fts3();
-#    INSERT INTO article_index SELECT title FROM articles;
+#    INSERT INTO article_index (docid, content) SELECT id, title FROM articles;
+#
+# (With mawire's SQLite, use fts3(tokenize=fold) instead, so that searches
+# ignore case and diacritics in all the titles, not just the ASCII ones.
+# For Chinese, Japanese and Korean, use fts3(tokenize=cjk), which also
+# indexes their text, written without spaces, as overlapping bigrams.)
+#
+# With -b (bulk mode), a new database is loaded as fast as possible: the
+# title index is only created once all the articles are in, and the
+# search index is built and optimized right after that, so the result
+# is ready to use. For that, Python's sqlite3 module must be using an
+# FTS3 enabled SQLite, for example the one bundled with mawire:
+#
+#    LD_LIBRARY_PATH=/opt/mawire/lib python extractor.py -b dump.xml wiki.db
+#
+# The dump can also be given compressed (.xml.bz2). Multistream dumps
+# (pages-articles-multistream.xml.bz2) are made of many independent bz2
+# streams, listed in the accompanying index file; when the index is found
+# next to the dump (or given with -i), the streams are decompressed in
+# parallel and handed to the parser in their original order.
+#
+# Progress is checkpointed in the database as the articles are committed.
+# An import that was interrupted can be continued with -r: articles that
+# are already stored are skipped, and multistream dumps are read from
+# where the import stopped instead of from the start.
+#
+# With -u, an existing database is updated to a newer dump. Each article
+# keeps a hash of its page source; pages whose hash didn't change are
+# skipped, changed ones are rewritten in place, new ones are added and
+# articles that are no longer in the dump are deleted, all while keeping
+# the search index up to date. With -p (for adds-changes dumps, which
+# only have the pages that changed) nothing is deleted.
+#
+# Once an import is complete, a "meta" table of key/value pairs records
+# the database format version, article count and highest id, how the
+# article text is compressed and how the search index was built, so
+# mawire doesn't have to work them out from the tables.
+#
+# When done, the extractor prints the time spent in each phase, how many
+# pages were filtered out and why, and the peak memory use of each stage.
+# With -s, the same summary (and the overall throughput) is also written
+# to a file as JSON, to compare imports with each other.
+#
+# Memory use doesn't depend on the size of the pages: the parser stops
+# collecting a page's text at the end of the intro (the first '=='), the
+# only part that is kept, and in any case after -m kB.
 
 from lxml import etree
 from xml.parsers import expat
+import bz2
+import collections
 import re
 import gc
+import hashlib
+import itertools
+import json
+import multiprocessing
+import optparse
+import os
+import time
+import Queue
+import resource
 
 import shelve
 import sys
@@ -34,7 +95,7 @@ import zlib
 
 from sqlalchemy import create_engine, func, select, and_
 from sqlalchemy import Table, Column, Integer, String, Binary, DateTime, MetaData
-from sqlalchemy.exc import NoSuchTableError
+from sqlalchemy.exc import NoSuchTableError, IntegrityError, OperationalError
 from sqlalchemy.sql import text
 
 class XMLStreamExtractor(object):
@@ -45,48 +106,260 @@ class XMLStreamExtractor(object):
         self.parser.EndElementHandler = self._end_handler
         self.parser.CharacterDataHandler = self._cdata_handler
         self._current_cdata = []
+        self._keep = False
         self.handle_element = lambda a, b: False
         self.filter_elements = []
 
+        # Text of an element stops being collected once it has
+        # max_cdata characters, or once the element's stop marker
+        # shows up (the chunk with the marker is still kept whole).
+        self.max_cdata = None
+        self.stop_markers = {}
+        self.n_truncated = 0
+
     def _start_handler(self, tag, attrs):
         self._current_cdata = []
+        self._size = 0
+        self._tail = ''
+        self._keep = tag in self.filter_elements
+        self._stop = self.stop_markers.get(tag)
 
     def _cdata_handler(self, data):
+        if not self._keep:
+            return
+
         self._current_cdata.append(data)
+        self._size += len(data)
+
+        if self._stop:
+            # the marker can be split between two chunks
+            if self._stop in self._tail + data:
+                self._keep = False
+            self._tail = data[1 - len(self._stop):]
+
+        if self.max_cdata and self._size > self.max_cdata:
+            self._keep = False
+            self.n_truncated += 1
 
     def _end_handler(self, tag):
         if tag in self.filter_elements:
             txt = ''.join(self._current_cdata)
+            if self.max_cdata and len(txt) > self.max_cdata:
+                txt = txt[:self.max_cdata]
             self.handle_element(tag, txt)
         self._current_cdata = []
+        self._keep = False
 
-    def run(self, fd):
-        self.parser.ParseFile(fd)
+    def run(self, chunks):
+        for data in chunks:
+            self.parser.Parse(data, False)
+        self.parser.Parse('', True)
 
 
-class WikimediaPageParser(object):
+class WikitextCleaner(object):
 
     ## TODO: check overly-zealous parsing in "Croatian Wine" article
     ## (at the end). Change " *" into bullet point, and ":", "::", ":::", ...
     ## into lists
-    def __init__(self, xml_extractor):
-        self.xml_tag_pattern = re.compile(r'(<!--.*?-->|<ref.*?</ref>|<.*?>)',
-            flags=re.S)
-        # Ugly but neccessary because Python's regexps are not recursive :'(
-        # We just hope there won't be more than 19 nested braces
-        self.braces_pattern = re.compile(r'{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{([^{}]|{})*})*})*})*})*})*})*})*})*})*})*})*})*})*})*})*})*})*})*}')
+    def __init__(self):
+        self.braces_pattern = re.compile(r'[{}]')
+        self.inner_braces_pattern = re.compile(r'{[^{}]*}')
 
+        # Links, [[Category:...]] and friends, external links with and
+        # without a description, then tags. Each is stripped from what
+        # the one before left, see _strip_links and _strip_tags.
         self.wikiref_pattern = re.compile(r'\[\[([^][|:]+\|)?([^][:]+)\]\]')
-        self.wikiref2_pattern = re.compile(r'\[\[[A-Za-z]+:.*?\]\]')
-        self.extraref_pattern = re.compile(r'\[(https?|ftp)://[^] ]+ ([^]]+)]')
-        self.extraref2_pattern = re.compile(r'\[(https?|ftp)://[^]]+]')
-        self.paren_fixup_pattern = re.compile(r'\([;,. -]+')
+        self.wikiref2_pattern = re.compile(r'\[\[[A-Za-z]+:')
+        self.extraref_pattern = re.compile(r'\[(?:https?|ftp)://')
+        self.tag_pattern = re.compile(r'<')
+
+        # Paren, space and entity fixups are done together in one pass at
+        # the end. An opening paren followed by punctuation and a closing
+        # one ends up as "()", so it is just another run of space. Single
+        # spaces are common and need no fixing, so they're skipped.
+        space = r'\([;,. -]*\)|&nbsp;|\t| '
+        self.fixup_pattern = re.compile(r'(?=[ \t(&])(?:(?! (?!%s))((?:%s)+)|'
+            r'(\([;,. -]+)|&(mdash|ndash|quot|amp|lt|gt);)' % (space, space))
+        self.entities = { 'mdash': '-', 'ndash': '-', 'quot': '"',
+            'amp': '&', 'lt': '<', 'gt': '>' }
+
+    def clean(self, text):
+        text = self._strip_templates(text)
+        text = self._strip_links(text)
+        text = self._strip_tags(text)
+        text = self.fixup_pattern.sub(self._fixup, text)
+        return text.strip()
+
+    def _fixup(self, m):
+        if m.group(1):
+            return ' '
+        elif m.group(2):
+            return '('
+        return self.entities[m.group(3)]
+
+    def _strip_templates(self, text):
+        # Matched braces, with anything between them, are removed at
+        # any nesting depth. Stray ones are left alone. Templates are
+        # rarely nested more than a few levels, so peeling them from the
+        # inside out is quickest; anything deeper than that is left to
+        # the brace matcher.
+        for i in range(4):
+            text, n = self.inner_braces_pattern.subn('', text)
+            if n == 0:
+                return text
+
+        stack = []
+        pairs = []
+        for m in self.braces_pattern.finditer(text):
+            if m.group() == '{':
+                stack.append(m.start())
+            elif stack:
+                pairs.append((stack.pop(), m.end()))
+
+        if not pairs:
+            return text
+
+        # Pairs are closed innermost first, so going backwards the
+        # outermost pair always comes before the ones inside it.
+        spans = []
+        for start, end in reversed(pairs):
+            if not spans or end <= spans[-1][0]:
+                spans.append((start, end))
+
+        pieces = []
+        pos = 0
+        for start, end in reversed(spans):
+            pieces.append(text[pos:start])
+            pos = end
+        pieces.append(text[pos:])
+        return ''.join(pieces)
+
+    def _finder(self, text):
+        # A text.find that remembers where each needle was found, so no
+        # part of the text is searched over and over again.
+        found = {}
+
+        def find(needle, start):
+            cached = found.get(needle)
+            if cached and cached[0] <= start and (cached[1] < 0 or
+                    start <= cached[1]):
+                return cached[1]
+            pos = text.find(needle, start)
+            found[needle] = (start, pos)
+            return pos
+
+        return find
+
+    def _scan(self, text, pattern, replace):
+        # Everywhere the pattern is found, replace(m) gives the end of
+        # the markup starting there and what it becomes, or None to
+        # keep the first character and look on from the next one.
+        out = []
+        pos = 0
+        while True:
+            m = pattern.search(text, pos)
+            if not m:
+                break
+
+            i = m.start()
+            r = replace(m)
+            if r is None:
+                out.append(text[pos:i + 1])
+                pos = i + 1
+            else:
+                out.append(text[pos:i])
+                out.append(r[1])
+                pos = r[0]
+
+        out.append(text[pos:])
+        return ''.join(out)
+
+    def _strip_links(self, text):
+        # Links, then [[Category:...]] and friends, then [http://url
+        # description] and then [http://url], each going over what the
+        # one before left: a link may hide the end of the next kind.
+        if '[' not in text:
+            return text
+
+        # ordinary links have no brackets inside, the regex stops at the
+        # first one it sees
+        text = self.wikiref_pattern.sub(lambda m: m.group(2), text)
+
+        find = self._finder(text)
+
+        def wikiref2(m):
+            # up to the first ]] on the same line
+            end = find(']]', m.end())
+            if end >= 0:
+                newline = find('\n', m.end())
+                if newline < 0 or end < newline:
+                    return end + 2, ''
+            return None
+
+        text = self._scan(text, self.wikiref2_pattern, wikiref2)
+
+        find = self._finder(text)
+
+        def extraref(m):
+            # the url ends at the first space and must be followed by a
+            # description
+            space = find(' ', m.end())
+            close = find(']', m.end())
+            if m.end() < space and space + 1 < close:
+                return close + 1, text[space + 1:close]
+            return None
+
+        text = self._scan(text, self.extraref_pattern, extraref)
+
+        find = self._finder(text)
+
+        def extraref2(m):
+            close = find(']', m.end())
+            if close > m.end():
+                return close + 1, ''
+            return None
 
-        self.space_fixup_pattern = re.compile(r'(\(\)|&nbsp;|\t| )+')
-        self.entity_fixup_pattern = re.compile(r'&(mdash|ndash|quot|amp|lt|gt);')
+        return self._scan(text, self.extraref_pattern, extraref2)
 
+    def _strip_tags(self, text):
+        # Comments, refs and other tags. They go after the links, which
+        # may hide the end of a tag: a ref isn't closed by a </ref> in a
+        # file link that's removed anyway.
+        if '<' not in text:
+            return text
+
+        find = self._finder(text)
+
+        def tag(m):
+            i = m.start()
+            end = -1
+            if text.startswith('<!--', i):
+                end = find('-->', i + 4)
+                if end >= 0:
+                    return end + 3, ''
+            elif text.startswith('<ref', i):
+                # <ref name="x"/> and <references/> close themselves
+                end = find('>', i + 4)
+                if end >= 0 and text[end - 1] == '/':
+                    return end + 1, ''
+                end = find('</ref>', i + 4)
+                if end >= 0:
+                    return end + 6, ''
+            end = find('>', i + 1)
+            if end >= 0:
+                return end + 1, ''
+            return None
+
+        return self._scan(text, self.tag_pattern, tag)
+
+
+class WikimediaPageParser(object):
+
+    def __init__(self, xml_extractor):
         xml_extractor.handle_element = self._handle_element
         xml_extractor.filter_elements = [ 'title', 'text', 'page' ]
+        # only the intro is kept, see _handle_page
+        xml_extractor.stop_markers = { 'text': '==' }
 
         self._current_title = None
         self._current_text = None
@@ -110,119 +383,886 @@ class WikimediaPageParser(object):
         if not self.filter_page_raw(title, text):
             return
 
+        # Only the intro is kept, so there's no point in passing
+        # the rest of the page on to the cleaner.
         if '==' in text:
             text = text.split('==')[0]
 
-        text = self.braces_pattern.sub('', text)
-        text = self.wikiref_pattern.sub(lambda x: x.groups(0)[1], text)
-        text = self.wikiref2_pattern.sub('', text)
-        text = self.extraref_pattern.sub(lambda x: x.groups(0)[1], text)
-        text = self.extraref2_pattern.sub('', text)
-
-        text = self.xml_tag_pattern.sub('', text)
-
-        text = self.paren_fixup_pattern.sub('(', text)
-        text = self.space_fixup_pattern.sub(' ', text)
-
-        text = self.entity_fixup_pattern.sub(lambda x:
-            { 'mdash': '-', 'ndash': '-', 'quot': '"',
-                'amp': '&', 'lt': '<', 'gt': '>' }[x.groups()[0]], text)
-
-        text = text.strip()
         self.handle_page(title, text)
 
 
 class WikipediaPageFilter(object):
 
-    def __init__(self, parser):
-        parser.handle_page = self._handle_page
-        parser.filter_page_raw = self._filter_page_raw
+    def __init__(self, parser=None):
+        if parser:
+            parser.filter_page_raw = self._filter_page_raw
         self.minimal_text_length = 200
-        self.callback = lambda a, b: None
+        # number of pages filtered out, by reason
+        self.filtered = collections.defaultdict(int)
 
     def _filter_page_raw(self, title, text):
-        if (':' in title or
-            title.startswith('List of ') or
-            text.startswith('#REDIRECT ')):
-                return False
-        return True
+        if ':' in title:
+            reason = 'namespace'
+        elif title.startswith('List of '):
+            reason = 'list'
+        elif text.startswith('#REDIRECT '):
+            reason = 'redirect'
+        else:
+            return True
+        self.filtered[reason] += 1
+        return False
 
-    def _handle_page(self, title, text):
+    def accept(self, text):
         if len(text) < self.minimal_text_length:
-            return
-
-        self.callback(title, text)
+            self.filtered['short'] += 1
+            return False
+        return True
 
 
 class ArticleStorage(object):
 
-    # After-the-fact FTS3 enable:
-    # CREATE VIRTUAL TABLE article_index USING fts3();
-    # INSERT INTO article_index SELECT title FROM articles;
-    #
-    def __init__(self, uri):
+    # Articles are inserted (and committed) this many at a time,
+    # all through the same prepared statement.
+    INSERT_BATCH = 1000
+
+    # Titles go into the search index this many at a time, in docid
+    # order, so FTS3 only ever has to append to its doclists.
+    INDEX_BATCH = 50000
+
+    # DB_FORMAT_VERSION in src/db.h, mawire won't open newer databases
+    FORMAT_VERSION = 1
+
+    def __init__(self, uri, bulk=False, update=False, tokenizer=None):
         self.engine = create_engine(uri)
         self.md = MetaData(self.engine)
+        self.bulk = bulk
+        self.update = update
+        self.tokenizer = tokenizer
 
         self.conn = self.engine.connect()
+
+        # databases from before updates were possible don't have the hash
+        columns = [ row[1] for row in
+            self.conn.execute(text('PRAGMA table_info(articles)')) ]
+        if columns and 'hash' not in columns:
+            self.conn.execute(text('ALTER TABLE articles '
+                'ADD COLUMN hash INTEGER')).close()
+
         try:
             self.table = Table('articles', self.md, autoload=True)
         except NoSuchTableError:
+            # In bulk mode the title index is created at the end, it's
+            # much quicker to build it in one go than to keep it up to
+            # date through the whole load.
             self.table = Table('articles', self.md,
                 Column('id', Integer, primary_key=True),
-                Column('title', String, unique=True, index=True),
-                Column('text', Binary))
+                Column('title', String, unique=not bulk, index=not bulk),
+                Column('text', Binary),
+                Column('hash', Integer))
             self.md.create_all()
 
+        # when updating, the search index is kept up to date as well
+        self.indexed = update and self.conn.execute(text('SELECT COUNT(*) '
+            'FROM sqlite_master WHERE name = \'article_index\'')).scalar()
+
         # We go as fast as possible. If the system crashes in the middle,
-        # the user can always rebuild the db.
-        self.conn.execute(text('PRAGMA journal_mode = MEMORY;'))
+        # the user can always rebuild the db. The rollback journal stays
+        # on disk though, so an import that is killed or runs out of disk
+        # space leaves a consistent db behind and can be resumed.
         self.conn.execute(text('PRAGMA synchronous = OFF;'))
+        if bulk:
+            self.conn.execute(text('PRAGMA cache_size = 100000;'))
+
+        # Where the import got to, committed together with the articles
+        # so an interrupted import can be resumed from there.
+        self.conn.execute(text('CREATE TABLE IF NOT EXISTS import_checkpoint '
+            '(id INTEGER PRIMARY KEY, input TEXT, offset INTEGER, title TEXT)'))
+
+        # The meta table is only correct for a complete import, it's
+        # written again at the end. So are the search term statistics
+        # and prefix doclists.
+        self.conn.execute(text('DROP TABLE IF EXISTS meta')).close()
+        for table in ('article_index_terms', 'article_index_prefixes'):
+            self.conn.execute(text('DROP TABLE IF EXISTS ' + table)).close()
 
         self.trans = self.conn.begin()
+        self.pending = []
+        self.updates = []
+        self.checkpoint = None
         self.orig_size = 0
         self.store_size = 0
         self.n_articles = 0
-        self.parser = None
+        self.n_updated = 0
+        self.n_deleted = 0
+        # seconds spent in each phase
+        self.times = collections.defaultdict(float)
+        # the tokenizer of the search index built in bulk mode
+        self.index_tokenizer = None
 
-    def close(self):
+    def close(self, complete=True):
+        self.flush()
+        if complete:
+            self._step('DROP TABLE import_checkpoint')
+            if self.bulk:
+                self.build_indexes()
+            elif self.indexed:
+                self.build_search_tables()
+            self.write_meta()
         self.trans.commit()
         self.conn.close()
 
-    def store(self, title, text):
-        blob = zlib.compress(text.encode('utf-8'), 9)
+    def resume_point(self):
+        """Returns (input, offset, title) of the last checkpoint, or None."""
+        return self.conn.execute(text('SELECT input, offset, title '
+            'FROM import_checkpoint WHERE id = 1')).fetchone()
+
+    def stored_articles(self):
+        """Returns { title: (id, hash) } of the articles in the database."""
+        return dict((row[0], (row[1], row[2])) for row in
+            self.conn.execute(text('SELECT title, id, hash FROM articles')))
+
+    def set_checkpoint(self, input, offset, title):
+        self.checkpoint = { 'input': input, 'offset': offset, 'title': title }
 
-        self.orig_size += len(text)
+    def store(self, title, blob, orig_size, hash):
+        self.orig_size += orig_size
         self.store_size += len(blob)
         self.n_articles += 1
 
-        self.table.insert().execute(title=title, text=blob)
+        self.pending.append({ 'title': title, 'text': blob, 'hash': hash })
+        if len(self.pending) + len(self.updates) >= self.INSERT_BATCH:
+            self.flush()
+
+    def replace(self, id, blob, orig_size, hash):
+        """Replaces the text of an existing article; the title stays,
+        so its search index entry does too."""
+        self.orig_size += orig_size
+        self.store_size += len(blob)
+        self.n_updated += 1
+
+        # buffer, so it's bound as a blob without the table's type info
+        self.updates.append({ 'id': id, 'text': buffer(blob), 'hash': hash })
+        if len(self.pending) + len(self.updates) >= self.INSERT_BATCH:
+            self.flush()
+
+    def delete(self, ids):
+        start = time.time()
+        for id in ids:
+            self.conn.execute(text('DELETE FROM articles WHERE id = :id'),
+                id=id).close()
+            if self.indexed:
+                self.conn.execute(text('DELETE FROM article_index '
+                    'WHERE docid = :id'), id=id).close()
+            self.n_deleted += 1
+            if self.n_deleted % self.INSERT_BATCH == 0:
+                self.flush()
+        self.flush()
+        self.times['delete'] = time.time() - start
+
+    def flush(self):
+        start = time.time()
+        if self.pending:
+            if self.indexed:
+                max_id = self.conn.execute(
+                    text('SELECT MAX(id) FROM articles')).scalar() or 0
+            self.conn.execute(self.table.insert(), self.pending)
+            self.pending = []
 
-        if (self.n_articles % 100) == 0:
-            sys.stderr.write("Storing article %d/%d (ratio %d%%)\n" % (self.n_articles,
-                self.parser.n_pages, 100 * self.store_size / self.orig_size))
-            self.trans.commit()
+            # new articles got ids above the old maximum
+            if self.indexed:
+                self.conn.execute(text('INSERT INTO article_index '
+                    '(docid, content) SELECT id, title FROM articles '
+                    'WHERE id > :max_id'), max_id=max_id).close()
+
+        for params in self.updates:
+            self.conn.execute(text('UPDATE articles SET text = :text, '
+                'hash = :hash WHERE id = :id'), **params).close()
+        self.updates = []
+
+        if self.checkpoint:
+            self.conn.execute(text('INSERT OR REPLACE INTO import_checkpoint '
+                '(id, input, offset, title) VALUES (1, :input, :offset, :title)'),
+                **self.checkpoint).close()
+            self.checkpoint = None
+
+        now = time.time()
+        self.times['insert'] += now - start
+        self.trans.commit()
+        self.trans = self.conn.begin()
+        self.times['commit'] += time.time() - now
+
+    def _step(self, *statements, **params):
+        start = time.time()
+        for sql in statements:
+            self.conn.execute(text(sql), **params).close()
+        self.flush()
+        return time.time() - start
+
+    def write_meta(self):
+        scalar = lambda sql: self.conn.execute(text(sql)).scalar()
+        meta = {
+            'format_version': self.FORMAT_VERSION,
+            'n_articles': scalar('SELECT COUNT(*) FROM articles'),
+            'max_id': scalar('SELECT IFNULL(MAX(id), 0) FROM articles'),
+            'codec': 'zlib',
+            'dictionary': 'none',
+        }
+        index_sql = scalar('SELECT sql FROM sqlite_master '
+            'WHERE name = \'article_index\'')
+        if index_sql:
+            meta['index'] = 'fts3'
+            m = re.search(r'tokenize=(\w+)', index_sql)
+            meta['index_tokenizer'] = m.group(1) if m else 'simple'
+            meta['index_segments'] = scalar('SELECT COUNT(*) '
+                'FROM article_index_segdir')
+
+        self.conn.execute(text('CREATE TABLE meta '
+            '(key TEXT PRIMARY KEY, value TEXT)')).close()
+        for key, value in sorted(meta.items()):
+            self.conn.execute(text('INSERT INTO meta (key, value) '
+                'VALUES (:key, :value)'), key=key, value=str(value)).close()
+        self.flush()
+
+    def build_indexes(self):
+        try:
+            t = self._step('CREATE UNIQUE INDEX '
+                'ix_articles_title ON articles (title)')
+        except IntegrityError:
+            # The dump had the same title more than once, keep the first.
+            self.trans.rollback()
             self.trans = self.conn.begin()
+            t = self._step('DELETE FROM articles WHERE id '
+                'NOT IN (SELECT MIN(id) FROM articles GROUP BY title)',
+                'CREATE UNIQUE INDEX ix_articles_title ON articles (title)')
+        self.times['title index'] = t
+        sys.stderr.write("Created title index in %.1fs\n" % t)
 
+        # mawire's SQLite has a tokenizer that folds the case of all
+        # letters (not just ASCII ones) and drops their diacritics, so
+        # searches needn't spell them; others get the plain one, with a
+        # warning. Its cjk tokenizer (-t cjk) also splits CJK text into
+        # bigrams. A tokenizer given with -t is never replaced, main()
+        # made sure it's there.
+        tokenizers = [ self.tokenizer or 'fold' ]
+        if not self.tokenizer:
+            tokenizers.append('simple')
+        for tokenizer in tokenizers:
+            try:
+                self._step('CREATE VIRTUAL TABLE article_index '
+                    'USING fts3(tokenize=%s)' % tokenizer)
+                break
+            except OperationalError:
+                self.trans.rollback()
+                self.trans = self.conn.begin()
+        else:
+            sys.stderr.write("SQLite doesn't have FTS3 with the %s "
+                "tokenizer, the search index has to be created by hand\n" %
+                tokenizers[0])
+            return
 
-def run(infile, outfile):
-    if infile == '-':
-        inp = sys.stdin
-    else:
-        inp = open(infile, 'r')
+        self.index_tokenizer = tokenizer
+        if tokenizer != tokenizers[0]:
+            sys.stderr.write("WARNING: SQLite has no fold tokenizer, the "
+                "search index uses the simple one\n")
+
+        # docid is the article id, so a search hit leads straight
+        # to the article row. mawire's SQLite can build the whole index
+        # in one go from the FTS3 content table, straight into a single
+        # segment.
+        try:
+            t = self._step('INSERT INTO article_index_content '
+                '(docid, c0content) SELECT id, title FROM articles',
+                "INSERT INTO article_index (article_index) "
+                "VALUES ('rebuild')")
+            rebuilt = True
+        except OperationalError:
+            self.trans.rollback()
+            self.trans = self.conn.begin()
+            rebuilt = False
+
+        if not rebuilt:
+            max_id = self.conn.execute(
+                text('SELECT MAX(id) FROM articles')).scalar() or 0
+            t = 0
+            for lo in range(0, max_id, self.INDEX_BATCH):
+                t += self._step('INSERT INTO article_index '
+                    '(docid, content) SELECT id, title FROM articles '
+                    'WHERE id > :lo AND id <= :hi',
+                    lo=lo, hi=lo + self.INDEX_BATCH)
+        self.times['search index'] = t
+        sys.stderr.write("Created search index (%s tokenizer) in %.1fs\n" %
+            (tokenizer, t))
+
+        # merge all the index segments into one (unless rebuilt), and
+        # gather statistics for the query planner
+        statements = [ 'ANALYZE' ]
+        if not rebuilt:
+            statements.insert(0, 'SELECT optimize(article_index) '
+                'FROM article_index LIMIT 1')
+        t = self._step(*statements)
+        self.times['optimize'] = t
+        sys.stderr.write("Optimized database in %.1fs\n" % t)
+
+        self.build_search_tables()
+
+    def build_search_tables(self):
+        # How many titles each search term (and each three letter
+        # prefix) is in, so mawire can search for the rarest first,
+        # and the merged doclists of all prefixes of up to three
+        # letters, so searching for them is a single lookup.
+        # Only mawire's SQLite can build them, mawire does without.
+        try:
+            t = self._step("INSERT INTO article_index (article_index) "
+                "VALUES ('termstats')",
+                "INSERT INTO article_index (article_index) "
+                "VALUES ('prefixes')")
+        except OperationalError:
+            self.trans.rollback()
+            self.trans = self.conn.begin()
+            return
+        self.times['search tables'] = t
+        sys.stderr.write("Built search term tables in %.1fs\n" % t)
+
+
+# Pages travel between the processes in batches, to keep the
+# queueing overhead small compared to the work done on them.
+BATCH_SIZE = 100
+REPORT_INTERVAL = 5.0
+
+CHUNK_SIZE = 1 << 20
+
+# Multistream dumps have ~100 pages per bz2 stream, adjacent streams
+# are decompressed together in ranges of at least this many bytes.
+RANGE_SIZE = 4 << 20
+
+def read_chunks(f):
+    while True:
+        data = f.read(CHUNK_SIZE)
+        if not data:
+            break
+        yield data
+
+def decompress_chunks(chunks):
+    # Python's BZ2File stops after the first stream, so multistream
+    # files are decompressed by hand, one stream after another.
+    d = bz2.BZ2Decompressor()
+    for data in chunks:
+        while data:
+            try:
+                out = d.decompress(data)
+            except EOFError:
+                # previous stream ended right at the chunk boundary
+                d = bz2.BZ2Decompressor()
+                out = d.decompress(data)
+            if out:
+                yield out
+            data = d.unused_data
+            if data:
+                d = bz2.BZ2Decompressor()
+
+def decompress_range(path, start, end):
+    f = open(path, 'rb')
+    f.seek(start)
+    data = f.read(end - start)
+    f.close()
+    return ''.join(decompress_chunks([ data ]))
+
+def read_stream_offsets(index):
+    """Offsets of the bz2 streams from a multistream index (offset:id:title)."""
+    offsets = set([ 0 ])
+    rest = ''
+    for data in decompress_chunks(read_chunks(open(index, 'rb'))):
+        lines = (rest + data).split('\n')
+        rest = lines.pop()
+        for line in lines:
+            if line:
+                offsets.add(int(line.split(':', 1)[0]))
+    if rest:
+        offsets.add(int(rest.split(':', 1)[0]))
+    return sorted(offsets)
 
+class MultistreamReader(object):
+    """Decompresses a multistream dump in parallel, in ranges of streams.
+
+    While a range is being parsed, offset is the position in the file where
+    it starts; parsing can later be resumed from there."""
+
+    def __init__(self, path, index, n_workers, resume_offset=0):
+        self.path = path
+        self.n_workers = n_workers
+        self.offset = 0
+
+        size = os.path.getsize(path)
+        offsets = read_stream_offsets(index)
+
+        # The first stream has the <mediawiki> header, the parser always
+        # needs that one, even when resuming.
+        self.ranges = [ (0, offsets[1] if len(offsets) > 1 else size) ]
+        start = self.ranges[0][1]
+        for offset in offsets[2:] + [ size ]:
+            if offset <= resume_offset:
+                start = offset
+            elif offset - start >= RANGE_SIZE or offset == size:
+                self.ranges.append((start, offset))
+                start = offset
+
+    def __iter__(self):
+        # Results are taken in order from a bounded window, so decompression
+        # can run ahead of the parser, but not too far.
+        pool = multiprocessing.Pool(self.n_workers)
+        window = collections.deque()
+        for start, end in self.ranges:
+            window.append((start, pool.apply_async(decompress_range,
+                (self.path, start, end))))
+            if len(window) >= 2 * self.n_workers:
+                self.offset, result = window.popleft()
+                yield result.get()
+        while window:
+            self.offset, result = window.popleft()
+            yield result.get()
+        pool.close()
+        pool.join()
+
+def read_dump(inp, index, n_workers, resume_offset=0):
+    """Returns the (decompressed) dump contents as an iterator of chunks."""
+    if index:
+        return MultistreamReader(inp, index, n_workers, resume_offset)
+
+    if isinstance(inp, basestring):
+        inp = open(inp, 'rb')
+
+    chunks = read_chunks(inp)
+    try:
+        first = chunks.next()
+    except StopIteration:
+        return iter([])
+
+    chunks = itertools.chain([ first ], chunks)
+    if first.startswith('BZh'):
+        return decompress_chunks(chunks)
+    return chunks
+
+def find_index(infile):
+    """Looks for the index file next to a multistream dump."""
+    if not infile.endswith('multistream.xml.bz2'):
+        return None
+    index = infile[:-len('.xml.bz2')] + '-index.txt.bz2'
+    if os.path.exists(index):
+        return index
+    return None
+
+def page_hash(text):
+    """Hash of the page source, to tell if a page changed between dumps."""
+    return int(hashlib.sha1(text.encode('utf-8')).hexdigest()[:15], 16)
+
+def has_tokenizer(name):
+    """Whether the SQLite in use has FTS3 with the named tokenizer."""
+    conn = create_engine('sqlite://').connect()
+    try:
+        conn.execute(text('CREATE VIRTUAL TABLE t '
+            'USING fts3(tokenize=%s)' % name)).close()
+        return True
+    except OperationalError:
+        return False
+    finally:
+        conn.close()
+
+def peak_rss():
+    """Peak resident set size of this process, in kB."""
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+def parse_dump(inp, index, page_queue, result_queue, n_workers, n_parsed,
+        n_bytes, checkpoint, max_page):
+    """Parser stage: reads the dump, sends (seq, offset, pages, unchanged)
+    batches to workers. Pages already stored when resuming, or unchanged
+    ones when updating, are skipped; the titles of the latter are passed
+    along so the writer knows which articles are still in the dump.
+    When done, sends its stats to the writer."""
+    start = time.time()
     x = XMLStreamExtractor()
+    x.max_cdata = max_page
     p = WikimediaPageParser(x)
     f = WikipediaPageFilter(p)
-    s = ArticleStorage('sqlite:///%s' % outfile)
-    f.callback = s.store
-    s.parser = p
-    x.run(inp)
+    reader = read_dump(inp, index, n_workers, checkpoint.offset)
+    state = { 'seq': 0, 'batch': [], 'unchanged': [] }
+    times = collections.defaultdict(float)
+
+    def read():
+        chunks = iter(reader)
+        while True:
+            t = time.time()
+            try:
+                data = chunks.next()
+            except StopIteration:
+                break
+            times['read'] += time.time() - t
+            n_bytes.value += len(data)
+            yield data
+
+    def flush():
+        # where to resume from once everything up to here is stored
+        offset = getattr(reader, 'offset', 0)
+        t = time.time()
+        page_queue.put((state['seq'], offset, state['batch'],
+            state['unchanged']))
+        times['wait for workers'] += time.time() - t
+        state['seq'] += 1
+        state['batch'] = []
+        state['unchanged'] = []
+        n_parsed.value = p.n_pages
+
+    def handle_page(title, text):
+        hash = page_hash(text)
+        if title in checkpoint.stored:
+            if not checkpoint.update:
+                f.filtered['stored'] += 1
+                return
+            if checkpoint.stored[title][1] == hash:
+                f.filtered['unchanged'] += 1
+                state['unchanged'].append(title)
+                return
+        state['batch'].append((title, text, hash))
+        if len(state['batch']) + len(state['unchanged']) >= BATCH_SIZE:
+            flush()
+
+    p.handle_page = handle_page
+    x.run(read())
+    flush()
+
+    for i in range(n_workers):
+        page_queue.put(None)
+
+    times['parse'] = time.time() - start - sum(times.values())
+    result_queue.put({ 'stage': 'parser', 'times': dict(times),
+        'filtered': dict(f.filtered), 'truncated': x.n_truncated,
+        'peak_rss': peak_rss() })
+
+def clean_pages(page_queue, result_queue, n_cleaned):
+    """Worker stage: cleans up and compresses the pages. When done,
+    sends its stats to the writer."""
+    cleaner = WikitextCleaner()
+    f = WikipediaPageFilter()
+    times = collections.defaultdict(float)
+
+    while True:
+        item = page_queue.get()
+        if item is None:
+            break
+
+        seq, offset, pages, unchanged = item
+        articles = []
+        for title, text, hash in pages:
+            t = time.time()
+            text = cleaner.clean(text)
+            t2 = time.time()
+            times['clean'] += t2 - t
+            if f.accept(text):
+                articles.append((title, zlib.compress(text.encode('utf-8'), 9),
+                    len(text), hash))
+                times['compress'] += time.time() - t2
+
+        result_queue.put((seq, offset, articles, unchanged))
+
+        with n_cleaned.get_lock():
+            n_cleaned.value += len(pages)
+
+    result_queue.put({ 'stage': 'workers', 'times': dict(times),
+        'filtered': dict(f.filtered), 'peak_rss': peak_rss() })
+
+def report(start, n_parsed, n_bytes, n_cleaned, s, page_queue, result_queue,
+        pending):
+    elapsed = max(time.time() - start, 0.001)
+    sys.stderr.write("read %.1f MB (%.1f MB/s), parsed %d (%.0f/s), "
+        "cleaned %d (%.0f/s), stored %d (%.0f/s), queued pages %d, "
+        "results %d, reorder %d, ratio %d%%\n" % (
+        n_bytes.value / 1e6, n_bytes.value / 1e6 / elapsed,
+        n_parsed.value, n_parsed.value / elapsed,
+        n_cleaned.value, n_cleaned.value / elapsed,
+        s.n_articles, s.n_articles / elapsed,
+        page_queue.qsize() * BATCH_SIZE, result_queue.qsize() * BATCH_SIZE,
+        len(pending) * BATCH_SIZE, 100 * s.store_size / max(s.orig_size, 1)))
+
+# Where the parser starts, and what it can skip: stored is
+# { title: (id, hash) } of the articles already in the database.
+Checkpoint = collections.namedtuple('Checkpoint', 'offset stored update')
+
+def resume(s, infile, index):
+    """Finds where an interrupted import stopped."""
+    point = s.resume_point()
+    if not point:
+        sys.stderr.write("No interrupted import found, starting over\n")
+        return Checkpoint(0, s.stored_articles(), False)
+
+    input, offset, title = point
+    if input != os.path.basename(infile):
+        sys.stderr.write("Warning: the interrupted import was reading %s\n" %
+            input)
+        offset = 0
+    elif not index:
+        # only multistream dumps can be read from the middle
+        offset = 0
+
+    stored = s.stored_articles()
+    sys.stderr.write("Resuming after %s (%d articles stored), "
+        "at offset %d\n" % (title.encode('utf-8'), len(stored), offset))
+    return Checkpoint(offset, stored, False)
+
+def run(infile, index, outfile, n_workers, bulk, resuming, update, partial,
+        max_page, tokenizer):
+    # multiprocessing points stdin of the child processes to /dev/null,
+    # so the parser gets its own copy
+    if infile == '-':
+        inp = os.fdopen(os.dup(0), 'rb')
+    else:
+        inp = infile
+
+    start = time.time()
+    s = ArticleStorage('sqlite:///%s' % outfile, bulk, update, tokenizer)
+    if resuming:
+        checkpoint = resume(s, infile, index)
+    elif s.resume_point():
+        sys.stderr.write("The database has an interrupted import, "
+            "use -r to resume it\n")
+        sys.exit(-1)
+    elif update:
+        checkpoint = Checkpoint(0, s.stored_articles(), True)
+    else:
+        checkpoint = Checkpoint(0, {}, False)
+
+    # Bounded, so the parser can't run away from the workers with
+    # the whole dump in memory.
+    page_queue = multiprocessing.Queue(4 * n_workers)
+    result_queue = multiprocessing.Queue()
+    n_parsed = multiprocessing.Value('l', 0)
+    n_bytes = multiprocessing.Value('l', 0)
+    n_cleaned = multiprocessing.Value('l', 0)
+
+    parser = multiprocessing.Process(target=parse_dump,
+        args=(inp, index, page_queue, result_queue, n_workers, n_parsed,
+            n_bytes, checkpoint, max_page))
+    workers = [ multiprocessing.Process(target=clean_pages,
+        args=(page_queue, result_queue, n_cleaned))
+        for i in range(n_workers) ]
+
+    parser.start()
+    for w in workers:
+        w.start()
+
+    # Writer stage: batches come back in whatever order the workers
+    # finish them, store them in the order they were parsed.
+    pending = {}
+    seen = set()
+    next_seq = 0
+    stages = []
+    running = n_workers + 1
+    last_report = time.time()
+
+    while running > 0:
+        try:
+            item = result_queue.get(timeout=REPORT_INTERVAL)
+        except Queue.Empty:
+            item = False
+
+        # a crashed process never sends its end marker
+        if [ w for w in [ parser ] + workers if w.exitcode not in (None, 0) ]:
+            sys.stderr.write("Import failed, use -r to resume it\n")
+            s.close(complete=False)
+            for w in [ parser ] + workers:
+                w.terminate()
+            sys.exit(-1)
+
+        # the processes send their stats when they're done
+        if isinstance(item, dict):
+            stages.append(item)
+            running -= 1
+            continue
+
+        if item:
+            seq = item[0]
+            pending[seq] = item[1:]
+
+        while next_seq in pending:
+            offset, articles, unchanged = pending.pop(next_seq)
+            for title, blob, orig_size, hash in articles:
+                if title in checkpoint.stored:
+                    s.replace(checkpoint.stored[title][0], blob, orig_size,
+                        hash)
+                else:
+                    s.store(title, blob, orig_size, hash)
+                seen.add(title)
+            seen.update(unchanged)
+            # an update is redone from the start, the hashes make that quick
+            if articles and not update:
+                s.set_checkpoint(os.path.basename(infile), offset,
+                    articles[-1][0])
+            next_seq += 1
+
+        if time.time() - last_report >= REPORT_INTERVAL:
+            report(start, n_parsed, n_bytes, n_cleaned, s, page_queue,
+                result_queue, pending)
+            last_report = time.time()
+
+    # Articles that are gone from the dump, or that were changed into
+    # something that is no longer an article, are removed. A partial
+    # (adds-changes) dump only has the pages that changed.
+    if update and not partial:
+        s.delete(sorted(id for title, (id, hash) in
+            checkpoint.stored.iteritems() if title not in seen))
+
     s.close()
+    parser.join()
+    for w in workers:
+        w.join()
+
+    report(start, n_parsed, n_bytes, n_cleaned, s, page_queue, result_queue,
+        pending)
+    if update:
+        sys.stderr.write("added %d, updated %d, deleted %d articles\n" %
+            (s.n_articles, s.n_updated, s.n_deleted))
+
+    return summary(time.time() - start, n_parsed, n_bytes, s, stages)
+
+def summary(elapsed, n_parsed, n_bytes, s, stages):
+    """Collects the stats of all the stages. Worker times are summed up,
+    so with several workers they add up to more than the wall clock."""
+    times = collections.defaultdict(float)
+    filtered = collections.defaultdict(int)
+    truncated = 0
+    rss = { 'writer': peak_rss() }
+    for stage in stages:
+        truncated += stage.get('truncated', 0)
+        for phase, t in stage['times'].iteritems():
+            times[phase] += t
+        for reason, n in stage['filtered'].iteritems():
+            filtered[reason] += n
+        name = stage['stage']
+        rss[name] = max(rss.get(name, 0), stage['peak_rss'])
+    times.update(s.times)
+
+    elapsed = max(elapsed, 0.001)
+    return {
+        'seconds': round(elapsed, 3),
+        'input_bytes': n_bytes.value,
+        'mb_per_second': round(n_bytes.value / 1e6 / elapsed, 3),
+        'pages': n_parsed.value,
+        'pages_per_second': round(n_parsed.value / elapsed, 1),
+        'articles_added': s.n_articles,
+        'articles_updated': s.n_updated,
+        'articles_deleted': s.n_deleted,
+        'compression_ratio': round(float(s.store_size) /
+            max(s.orig_size, 1), 3),
+        'filtered': dict(filtered),
+        'pages_truncated': truncated,
+        'phase_seconds': dict((k, round(v, 3)) for k, v in times.iteritems()),
+        'peak_rss_kb': rss,
+        'index_tokenizer': s.index_tokenizer,
+    }
+
+def print_summary(stats):
+    sys.stderr.write("phases: %s\n" % ', '.join("%s %.1fs" % (phase, t)
+        for phase, t in sorted(stats['phase_seconds'].iteritems())))
+    sys.stderr.write("filtered: %s\n" % (', '.join("%s %d" % (reason, n)
+        for reason, n in sorted(stats['filtered'].iteritems())) or 'none'))
+    if stats['pages_truncated']:
+        sys.stderr.write("truncated: %d pages\n" % stats['pages_truncated'])
+    sys.stderr.write("peak RSS: %s\n" % ', '.join("%s %d MB" %
+        (name, kb / 1024) for name, kb in
+        sorted(stats['peak_rss_kb'].iteritems())))
+
+def main():
+    op = optparse.OptionParser(
+        usage="extractor [-j N] [-b [-t NAME]] [-i INDEX] [-r] [-u [-p]] " \
+            "[-s FILE] [-m KB] <wikipedia_dump.xml[.bz2]|-> " \
+            "<sqlite_database.db>")
+    op.add_option('-j', '--jobs', type='int', dest='jobs',
+        default=multiprocessing.cpu_count(),
+        help="number of cleanup worker processes "
+            "(default: number of cores)")
+    op.add_option('-b', '--bulk', action='store_true', dest='bulk',
+        default=False,
+        help="bulk load into a new database and build the search index")
+    op.add_option('-t', '--tokenizer', type='choice', dest='tokenizer',
+        choices=['simple', 'fold', 'cjk'], default=None,
+        help="with -b, the search index tokenizer: simple, fold, or cjk for "
+            "Chinese, Japanese and Korean dumps; fold and cjk need mawire's "
+            "SQLite (default: fold if available, else simple with a "
+            "warning)")
+    op.add_option('-i', '--index', dest='index', default=None,
+        help="index of a multistream dump (default: look next to the dump)")
+    op.add_option('-r', '--resume', action='store_true', dest='resume',
+        default=False, help="resume an interrupted import")
+    op.add_option('-u', '--update', action='store_true', dest='update',
+        default=False, help="update the database to a newer dump, "
+            "rewriting only the changed articles")
+    op.add_option('-p', '--partial', action='store_true', dest='partial',
+        default=False, help="with -u, the dump only has the added and changed "
+            "pages (adds-changes dump), don't delete the missing ones")
+    op.add_option('-s', '--stats', dest='stats', default=None,
+        help="write a summary of the import to this file, in JSON")
+    op.add_option('-m', '--max-page', type='int', dest='max_page',
+        default=1024,
+        help="keep at most this many kB of a page's text, the rest is "
+            "skipped without being kept in memory (default: 1024)")
+    opts, args = op.parse_args()
+
+    if len(args) != 2 or opts.jobs < 1 or opts.max_page < 1:
+        op.print_usage()
+        sys.exit(-1)
+
+    if opts.update and (opts.bulk or opts.resume):
+        sys.stderr.write("Update mode can't be combined with -b or -r\n")
+        sys.exit(-1)
+
+    if opts.partial and not opts.update:
+        op.print_usage()
+        sys.exit(-1)
+
+    if opts.tokenizer and not opts.bulk:
+        op.print_usage()
+        sys.exit(-1)
+
+    # rather than find out after the whole import
+    if opts.tokenizer and not has_tokenizer(opts.tokenizer):
+        sys.stderr.write("SQLite has no %s tokenizer, -t %s needs "
+            "mawire's SQLite\n" % (opts.tokenizer, opts.tokenizer))
+        sys.exit(-1)
+    # zhwiki-*, jawiki-*, kowiki-*, and zh_yuewiki-* and the like
+    wiki = os.path.basename(args[0]).split('wiki-', 1)[0]
+    if opts.bulk and opts.tokenizer != 'cjk' and \
+            wiki.split('_')[0] in ('zh', 'ja', 'ko'):
+        sys.stderr.write("WARNING: %s looks like a Chinese, Japanese or "
+            "Korean dump, but the search index won't use the cjk tokenizer. "
+            "Searches will then only find the words at the start of a run "
+            "of CJK characters. Use -t cjk, with mawire's SQLite.\n" %
+            args[0])
+    if opts.bulk and not opts.tokenizer and not has_tokenizer('fold'):
+        sys.stderr.write("WARNING: SQLite has no fold tokenizer, the search "
+            "index will use the simple one. Searches will then only ignore "
+            "the case of ASCII letters, and not diacritics at all. Use "
+            "mawire's SQLite (see the top of extractor.py), or -t simple "
+            "to go without.\n")
+
+    if opts.bulk and not opts.resume and os.path.exists(args[1]):
+        sys.stderr.write("Bulk mode needs a new database\n")
+        sys.exit(-1)
 
-if len(sys.argv) != 3:
-    print "Usage: extractor <wikipedia_dump.xml|-> <sqlite_database.db>"
-    sys.exit(-1)
+    index = opts.index
+    if args[0] == '-':
+        if index:
+            sys.stderr.write("Multistream index can't be used with stdin\n")
+            sys.exit(-1)
+    elif not index:
+        index = find_index(args[0])
 
-run(sys.argv[1], sys.argv[2])
+    stats = run(args[0], index, args[1], opts.jobs, opts.bulk, opts.resume,
+        opts.update, opts.partial, opts.max_page * 1024, opts.tokenizer)
+    print_summary(stats)
+    if opts.stats:
+        f = open(opts.stats, 'w')
+        json.dump(stats, f, indent=2, sort_keys=True)
+        f.write('\n')
+        f.close()
 
+# the cleaner is imported by test_cleaner.py
+if __name__ == '__main__':
+    main()
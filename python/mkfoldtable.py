@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+#
+# Generates the character tables of the "fold" FTS3 tokenizer (and of
+# "cjk", which folds the same way) in the bundled SQLite (fts3_fold.c
+# part of ext/sqlite-3.6.22-fts3/sqlite3.c).
+#
+# Usage: python3 mkfoldtable.py > table.c
+#
+# Needs Python 3 for str.casefold. The tables depend on the Unicode
+# version of Python's unicodedata, and changing them changes the terms
+# in the search index, so databases built with the old tables have to
+# be reindexed (mawire-repack does that).
+#
+# Within the scripts listed in SCOPE, every character is either kept,
+# dropped (diacritics and invisible formatting characters), treated as
+# a token separator (punctuation, symbols and spaces), or folded: its
+# diacritics are stripped, it is case folded, and a few letters with no
+# decomposition are spelled out in ASCII (ø is o, æ is ae, and so on).
+# Ligatures and fullwidth forms become the letters they are made of.
+
+import sys
+import unicodedata
+
+# the scripts the tables cover, anything else is kept as it is
+SCOPE = [
+    (0x0080, 0x024F),   # Latin-1 Supplement, Latin Extended-A and B
+    (0x0250, 0x02FF),   # IPA Extensions, Spacing Modifier Letters
+    (0x0300, 0x036F),   # Combining Diacritical Marks
+    (0x0370, 0x03FF),   # Greek and Coptic
+    (0x0400, 0x052F),   # Cyrillic, Cyrillic Supplement
+    (0x0530, 0x058F),   # Armenian
+    (0x1E00, 0x1EFF),   # Latin Extended Additional
+    (0x1F00, 0x1FFF),   # Greek Extended
+    (0x2000, 0x206F),   # General Punctuation
+    (0x3000, 0x303F),   # CJK Symbols and Punctuation
+    (0x3040, 0x30FF),   # Hiragana, Katakana
+    (0xFB00, 0xFB17),   # Latin and Armenian ligatures
+    (0xFF00, 0xFFEF),   # Halfwidth and Fullwidth Forms
+]
+
+# combining marks that are diacritics, dropped wherever they appear
+DIACRITICS = [
+    (0x0300, 0x036F), (0x1AB0, 0x1AFF), (0x1DC0, 0x1DFF),
+    (0x20D0, 0x20FF), (0xFE20, 0xFE2F),
+]
+
+# letters without a decomposition that are still a base letter with
+# a diacritic (or two letters) to whoever types them
+SPECIAL = {
+    'ø': 'o', 'đ': 'd', 'ð': 'd', 'ł': 'l', 'ħ': 'h', 'ŧ': 't',
+    'ı': 'i', 'æ': 'ae', 'œ': 'oe', 'þ': 'th', 'ß': 'ss', 'ƀ': 'b',
+    'ƚ': 'l', 'ɨ': 'i', 'ʉ': 'u', 'ɇ': 'e', 'ɍ': 'r', 'ɏ': 'y',
+    'ƶ': 'z', 'ǥ': 'g', 'ȼ': 'c', 'ɉ': 'j',
+}
+
+# where compatibility decompositions (ligatures, fullwidth letters)
+# are applied
+COMPAT = [(0x0080, 0x024F), (0x1E00, 0x1EFF), (0xFB00, 0xFB06),
+    (0xFF00, 0xFFEF)]
+
+# must agree with the FOLD_* constants in sqlite3.c
+FOLD_DROP = 0xD800
+FOLD_DELIM = 0xD801
+FOLD_EXPAND = 0xD802
+
+BLOCK = 64
+
+
+def in_ranges(c, ranges):
+    return any(lo <= ord(c) <= hi for lo, hi in ranges)
+
+
+def strip(s):
+    d = unicodedata.normalize('NFD', s)
+    t = ''.join(c for c in d if not in_ranges(c, DIACRITICS))
+    # only decompose if that took a diacritic away (so Hangul
+    # syllables, for one, stay as they are)
+    return t if len(t) != len(d) else s
+
+
+def fold(c):
+    s = c
+    if in_ranges(c, COMPAT) and unicodedata.decomposition(c).startswith(
+            ('<compat>', '<wide>', '<narrow>')):
+        s = unicodedata.normalize('NFKD', c)
+        s = ''.join(x for x in s if unicodedata.category(x)[0] in 'LN'
+            or in_ranges(x, DIACRITICS))
+        s = unicodedata.normalize('NFC', s)
+
+    out = ''
+    for x in s:
+        y = ''.join(strip(z) for z in strip(x).casefold())
+        out += ''.join(SPECIAL.get(z, z) for z in y)
+    return out
+
+
+def classify(cp):
+    c = chr(cp)
+    cat = unicodedata.category(c)
+    if in_ranges(c, DIACRITICS) or cat == 'Cf':
+        return FOLD_DROP, None
+    if cat[0] in 'ZPS' or cat == 'Cc':
+        return FOLD_DELIM, None
+    if cat[0] not in 'LNM':
+        return 0, None
+    f = fold(c)
+    if f == c:
+        return 0, None
+    if f == '':
+        return FOLD_DROP, None
+    if len(f) == 1:
+        return ord(f), None
+    return None, f
+
+
+def main():
+    values = {}
+    expansions = []
+
+    for lo, hi in SCOPE:
+        for cp in range(lo, hi + 1):
+            v, f = classify(cp)
+            if f is not None:
+                if f not in expansions:
+                    expansions.append(f)
+                v = FOLD_EXPAND + expansions.index(f)
+            if v:
+                values[cp] = v
+
+    blocks = []
+    index = [0] * (0x10000 // BLOCK)
+    for b in range(len(index)):
+        block = tuple(values.get(b * BLOCK + i, 0) for i in range(BLOCK))
+        if any(block):
+            if block not in blocks:
+                blocks.append(block)
+            index[b] = blocks.index(block) + 1
+
+    out = sys.stdout
+    out.write('static const unsigned char aFoldIndex[%d] = {\n' % len(index))
+    rows = [index[i:i + 16] for i in range(0, len(index), 16)]
+    out.write(',\n'.join('  ' + ', '.join('%2d' % x for x in row)
+        for row in rows) + '\n};\n\n')
+
+    out.write('static const unsigned short aFoldBlock[%d][%d] = {\n'
+        % (len(blocks), BLOCK))
+    out.write(',\n'.join('  {\n' + ',\n'.join('    ' +
+        ', '.join('0x%04x' % x for x in block[i:i + 8])
+        for i in range(0, BLOCK, 8)) + '\n  }' for block in blocks) +
+        '\n};\n\n')
+
+    def cstring(s):
+        r = ''
+        escaped = False
+        for b in s.encode('utf-8'):
+            if 0x20 <= b < 0x7F and chr(b) not in '"\\':
+                # a hex digit would run on with the escape before it
+                if escaped and chr(b) in '0123456789abcdefABCDEF':
+                    r += '" "'
+                r += chr(b)
+                escaped = False
+            else:
+                r += '\\x%02x' % b
+                escaped = True
+        return '"%s"' % r
+
+    out.write('static const char *const aFoldExpand[%d] = {\n'
+        % len(expansions))
+    line = ' '
+    for i, s in enumerate(expansions):
+        item = ' ' + cstring(s) + (',' if i < len(expansions) - 1 else '')
+        if len(line) + len(item) > 78:
+            out.write(line + '\n')
+            line = ' '
+        line += item
+    out.write(line + '\n};\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,186 @@
+#!/usr/bin/env python
+#
+# Checks that WikitextCleaner cleans pages exactly as the regex cascade
+# it replaced did. The cascade is kept below as the reference, and both
+# clean a generated corpus of page intros, full of the constructs that
+# could tell them apart: links inside links, refs and comments inside
+# file links, unclosed links, refs and comments, stray brackets.
+#
+# Usage: python test_cleaner.py [N_PAGES [SEED]]
+#
+# Needs the same modules as extractor.py. Exits with 1 and prints the
+# first page that comes out differently, if any.
+#
+# The reference differs from the old cascade in two ways, both on
+# purpose: a self-closing <ref .../> ends at its "/>" instead of
+# swallowing everything up to the next </ref>, and templates are only
+# nested up to 19 deep here, where the cascade gave up.
+
+import random
+import re
+import sys
+
+from extractor import WikitextCleaner
+
+
+class CascadeCleaner(object):
+
+    def __init__(self):
+        self.xml_tag_pattern = re.compile(
+            r'(<!--.*?-->|<ref[^>]*/>|<ref.*?</ref>|<.*?>)', flags=re.S)
+        self.braces_pattern = re.compile(r'{([^{}]|' * 19 + r'{}' +
+            r')*}' * 19)
+
+        self.wikiref_pattern = re.compile(r'\[\[([^][|:]+\|)?([^][:]+)\]\]')
+        self.wikiref2_pattern = re.compile(r'\[\[[A-Za-z]+:.*?\]\]')
+        self.extraref_pattern = re.compile(r'\[(https?|ftp)://[^] ]+ ([^]]+)]')
+        self.extraref2_pattern = re.compile(r'\[(https?|ftp)://[^]]+]')
+        self.paren_fixup_pattern = re.compile(r'\([;,. -]+')
+
+        self.space_fixup_pattern = re.compile(r'(\(\)|&nbsp;|\t| )+')
+        self.entity_fixup_pattern = re.compile(
+            r'&(mdash|ndash|quot|amp|lt|gt);')
+
+    def clean(self, text):
+        text = self.braces_pattern.sub('', text)
+        text = self.wikiref_pattern.sub(lambda x: x.groups(0)[1], text)
+        text = self.wikiref2_pattern.sub('', text)
+        text = self.extraref_pattern.sub(lambda x: x.groups(0)[1], text)
+        text = self.extraref2_pattern.sub('', text)
+
+        text = self.xml_tag_pattern.sub('', text)
+
+        text = self.paren_fixup_pattern.sub('(', text)
+        text = self.space_fixup_pattern.sub(' ', text)
+
+        text = self.entity_fixup_pattern.sub(lambda x:
+            { 'mdash': '-', 'ndash': '-', 'quot': '"',
+                'amp': '&', 'lt': '<', 'gt': '>' }[x.groups()[0]], text)
+
+        return text.strip()
+
+
+# pages that once came out differently
+CASES = [
+    (u'a <ref x/> b [[File:a.jpg|thumb|<ref>c</ref>]] d', u'a b d'),
+    (u'a <ref>b [[File:a.jpg|<ref>c</ref>]] d', u'a b d'),
+    (u'a <!-- b [[File:a.jpg|-->]] c --> d', u'a d'),
+    (u'a <span [[Category:x>y]] z> b', u'a b'),
+    (u'a [[b|c<ref>d]] e</ref> f', u'a c f'),
+    (u'a <references/> b <ref>c</ref> d', u'a b d'),
+    (u'a <ref name="x/y">b</ref> c', u'a c'),
+]
+
+SYLLABLES = [ 'ber', 'dom', 'lin', 'ka', 'zag', 'ny', 'mos', 'te', 'ri',
+    u'\u0107ev', u'\u017eu', u'\u0161o', u'\xf1e', u'\xfc' ]
+
+
+def generate(rnd):
+    def word():
+        return ''.join(rnd.choice(SYLLABLES)
+            for i in range(rnd.randint(1, 3)))
+
+    def words(n):
+        return ' '.join(word() for i in range(n))
+
+    def template(depth):
+        parts = [ '{{' + word() ]
+        for i in range(rnd.randint(0, 3)):
+            if depth > 0 and rnd.random() < 0.4:
+                parts.append('|' + word() + '=' + template(depth - 1))
+            else:
+                parts.append('|' + words(rnd.randint(1, 3)))
+        return ''.join(parts) + '\n}}'
+
+    def inner():
+        return rnd.choice([
+            lambda: words(2),
+            lambda: '<ref>' + words(1) + '</ref>',
+            lambda: '<ref name="' + word() + '"/>',
+            lambda: '</ref>',
+            lambda: '<!-- ' + word() + ' -->',
+            lambda: '-->',
+            lambda: '>',
+            lambda: '<b>' + word(),
+            lambda: '[[' + word() + ']]',
+            lambda: '[[' + word() + '|' + word() + ']]',
+            lambda: '[http://ex.com/' + word() + ' ' + word() + ']',
+        ])()
+
+    def fragment():
+        return rnd.choice([
+            lambda: template(rnd.randint(0, 4)),
+            lambda: '[[' + words(2) + ']]',
+            lambda: '[[' + words(2) + '|' + words(1) + ']]',
+            lambda: '[[' + word() + '|' + inner() + ']]',
+            lambda: '[[Category:' + word() + inner() + ']]',
+            lambda: '[[File:' + word() + '.jpg|thumb|' + inner() + ' ' +
+                inner() + ']]',
+            lambda: '[[File:' + word() + '.jpg|' + words(2) + '\n' +
+                words(1) + ']]',
+            lambda: '[http://ex.com/' + word() + ' ' + words(2) + ']',
+            lambda: '[http://ex.com/' + word() + ' ' + inner() + ']',
+            lambda: '[http://ex.com/' + word() + ']',
+            lambda: '[http://ex.com/' + word() + inner() + ']',
+            lambda: '<ref name="' + word() + '">' + words(3) + '</ref>',
+            lambda: '<ref>' + inner() + ' ' + words(1) + '</ref>',
+            lambda: '<ref name="' + word() + '"/>',
+            lambda: '<ref name=' + word() + ' />',
+            lambda: '<references/>',
+            lambda: '<!-- ' + words(2) + ' ' + inner() + ' -->',
+            lambda: '<b>' + words(2) + '</b>',
+            lambda: '<span title="' + inner() + '">' + word() + '</span>',
+            lambda: rnd.choice([ '&mdash;', '&ndash;', '&quot;', '&amp;',
+                '&lt;', '&gt;', '&nbsp;', '&hellip;' ]),
+            lambda: '(' + rnd.choice([ ', ', '; ', '. ', '- ' ]) +
+                words(2) + ')',
+            lambda: '()',
+            lambda: "'''" + words(2) + "'''",
+            lambda: '\t' + words(1),
+            lambda: '{' + words(1) + '}',
+            lambda: '[[' + words(1),
+            lambda: ']]',
+            lambda: '}}',
+            lambda: '<ref>' + words(2),
+            lambda: '<!-- ' + words(2),
+            lambda: '<' + word(),
+            lambda: '\n',
+            lambda: words(rnd.randint(3, 12)),
+            lambda: words(rnd.randint(3, 12)),
+            lambda: words(rnd.randint(3, 12)),
+        ])()
+
+    return ' '.join(fragment() for i in range(rnd.randint(5, 80)))
+
+
+def main():
+    n = len(sys.argv) > 1 and int(sys.argv[1]) or 5000
+    seed = len(sys.argv) > 2 and int(sys.argv[2]) or 1
+    cleaner = WikitextCleaner()
+    reference = CascadeCleaner()
+
+    for text, expected in CASES:
+        for name, got in (('cleaner', cleaner.clean(text)),
+                ('cascade', reference.clean(text))):
+            if got != expected:
+                print 'case %r: %s gives %r, expected %r' % (text, name,
+                    got, expected)
+                sys.exit(1)
+
+    rnd = random.Random(seed)
+    for i in range(n):
+        text = generate(rnd)
+        got = cleaner.clean(text)
+        expected = reference.clean(text)
+        if got != expected:
+            print 'page %d differs:' % i
+            print repr(text)
+            print 'cleaner: %r' % got
+            print 'cascade: %r' % expected
+            sys.exit(1)
+
+    print '%d cases and %d generated pages cleaned the same' % (
+        len(CASES), n)
+
+if __name__ == '__main__':
+    main()
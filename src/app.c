@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include <gtk/gtk.h>
 #include <hildon/hildon.h>
 
@@ -5,6 +7,10 @@
 #include "db.h"
 #include "ui.h"
 
+/* how long the search may keep the user waiting for the results window,
+ * in milliseconds. What isn't found by then comes in later. */
+#define SEARCH_TIMEOUT 500
+
 static void
 choose_db (GtkWidget *window, gchar *folder)
 {
@@ -14,11 +20,50 @@ choose_db (GtkWidget *window, gchar *folder)
     {
       db_open (db_fname);
       save_dbname_to_gconf (db_fname);
+      save_extra_dbnames_to_gconf (NULL);
+    }
+
+  g_free (db_fname);
+}
+
+/* the added database is searched along with the ones already open */
+static void
+add_db_cb (GtkWidget *widget, GtkWidget *window)
+{
+  gchar *db_fname = show_filename_chooser (window, DEFAULT_DATABASE_FOLDER);
+
+  if (db_fname && db_add (db_fname))
+    {
+      GSList *extra = get_extra_dbnames_from_gconf ();
+
+      if (!g_slist_find_custom (extra, db_fname, (GCompareFunc) strcmp))
+        {
+          extra = g_slist_append (extra, g_strdup (db_fname));
+          save_extra_dbnames_to_gconf (extra);
+        }
+
+      g_slist_foreach (extra, (GFunc) g_free, NULL);
+      g_slist_free (extra);
     }
 
   g_free (db_fname);
 }
 
+static void
+open_extra_dbs (void)
+{
+  GSList *extra = get_extra_dbnames_from_gconf ();
+  GSList *li;
+
+  for (li = extra; li; li = li->next)
+    {
+      db_add (li->data);
+      g_free (li->data);
+    }
+
+  g_slist_free (extra);
+}
+
 static void
 installed_db_cb (GtkWidget *widget, GtkWidget *window)
 {
@@ -46,16 +91,90 @@ selected_cb (gchar *title)
       show_article_window (title, text);
 }
 
+/* user_data is where the results window is, or NULL if it was
+ * closed before the count came in */
+static void
+count_cb (gint64 count, gpointer user_data)
+{
+  GtkWidget **win = user_data;
+
+  if (*win)
+    {
+      if (count >= 0)
+          set_results_count (*win, count);
+
+      g_object_remove_weak_pointer (G_OBJECT (*win), (gpointer *) win);
+    }
+
+  g_slice_free (GtkWidget *, win);
+}
+
+/* the complete results of a search that timed out, user_data as
+ * for count_cb */
+static void
+refined_cb (GList *results, gpointer user_data)
+{
+  GtkWidget **win = user_data;
+  gboolean limited = (g_list_length (results) >= DB_MAX_RESULTS);
+
+  if (!*win)
+    {
+      g_list_foreach (results, (GFunc) g_free, NULL);
+      g_list_free (results);
+      g_slice_free (GtkWidget *, win);
+      return;
+    }
+
+  set_results (*win, results, FALSE);
+
+  if (limited)
+    {
+      db_count_async (g_object_get_data (G_OBJECT (*win), "query"),
+          count_cb, win);
+    }
+  else
+    {
+      g_object_remove_weak_pointer (G_OBJECT (*win), (gpointer *) win);
+      g_slice_free (GtkWidget *, win);
+    }
+}
+
 static void
 search_cb (GtkWidget *widget, GtkWidget *window)
 {
   gchar *txt = get_query_string (window);
+  GList *results;
+  GtkWidget **win;
+  gboolean limited;
+  gboolean partial;
 
   if (!txt)
       return;
 
-  show_results_window (txt, db_search (txt),
+  results = db_search_timed (txt, SEARCH_TIMEOUT, &partial);
+  limited = (g_list_length (results) >= DB_MAX_RESULTS);
+
+  win = g_slice_new (GtkWidget *);
+  *win = show_results_window (txt, results, partial,
       G_CALLBACK(selected_cb));
+
+  /* the search ran out of time, the window shows what was found so
+   * far until the whole search is done in the background. If there
+   * are more than the window shows, they are counted in the background
+   * too, so the window doesn't have to wait. */
+  if (partial || limited)
+    {
+      g_object_add_weak_pointer (G_OBJECT (*win), (gpointer *) win);
+
+      if (partial)
+          db_search_async (txt, refined_cb, win);
+      else
+          db_count_async (txt, count_cb, win);
+    }
+  else
+    {
+      g_slice_free (GtkWidget *, win);
+    }
 }
 
 static void
@@ -92,6 +211,10 @@ main (int argc, char **argv)
   GtkWidget *window;
   gchar *db_fname;
 
+  /* sharded databases are searched from a thread pool */
+  if (!g_thread_supported ())
+      g_thread_init (NULL);
+
   hildon_gtk_init (&argc, &argv);
   gconf_wrapper_init ();
 
@@ -100,8 +223,8 @@ main (int argc, char **argv)
   program = hildon_program_get_instance ();
 
   window = show_main_window (G_CALLBACK (installed_db_cb),
-      G_CALLBACK (custom_db_cb), G_CALLBACK (about_cb),
-      G_CALLBACK (search_cb), G_CALLBACK (random_cb));
+      G_CALLBACK (custom_db_cb), G_CALLBACK (add_db_cb),
+      G_CALLBACK (about_cb), G_CALLBACK (search_cb), G_CALLBACK (random_cb));
 
   hildon_program_add_window (program, HILDON_WINDOW (window));
   set_portrait_mode (window, !keyboard_is_open ());
@@ -122,6 +245,8 @@ main (int argc, char **argv)
   save_dbname_to_gconf (db_fname);
   g_free (db_fname);
 
+  open_extra_dbs ();
+
   gtk_main ();
 
   gconf_wrapper_dispose ();
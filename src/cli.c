@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "util.h"
+#include "db.h"
+
+static gchar *db_fname = NULL;
+static gint n_threads = 1;
+static gchar *batch_mode = NULL;
+static gboolean quiet = FALSE;
+static gint timeout = 0;
+
+static GOptionEntry entries[] = {
+  { "database", 'd', 0, G_OPTION_ARG_FILENAME, &db_fname,
+    "Database file to query", "FILE" },
+  { "threads", 'j', 0, G_OPTION_ARG_INT, &n_threads,
+    "Number of worker threads in batch mode (default: 1)", "N" },
+  { "mode", 'm', 0, G_OPTION_ARG_STRING, &batch_mode,
+    "What to do with batch input lines, 'search' or 'get' " \
+        "(default: search)", "MODE" },
+  { "quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+    "Only print the batch summary", NULL },
+  { "timeout", 't', 0, G_OPTION_ARG_INT, &timeout,
+    "Stop searching after MS milliseconds, with the titles found " \
+        "so far (default: no limit)", "MS" },
+  { NULL }
+};
+
+typedef struct {
+    GPtrArray *lines;
+    gboolean fetch;
+    volatile gint next;
+    /* set by a worker that couldn't open the database, the
+     * others stop as soon as they see it */
+    volatile gint failed;
+    gint *n_results;
+} BatchJob;
+
+static void
+print_results (GList *results)
+{
+  GList *li;
+
+  for (li = results; li; li = li->next)
+      printf ("%s\n", (gchar *) li->data);
+}
+
+static void
+free_results (GList *results)
+{
+  g_list_foreach (results, (GFunc) g_free, NULL);
+  g_list_free (results);
+}
+
+static gint
+cmd_search (DbConn *conn, const gchar *query)
+{
+  gboolean partial;
+  GList *results = db_conn_search_timed (conn, query, timeout, &partial);
+
+  print_results (results);
+  free_results (results);
+
+  if (partial)
+      g_printerr ("Search timed out, results may be incomplete\n");
+
+  return 0;
+}
+
+static gint
+cmd_count (DbConn *conn, const gchar *query)
+{
+  gint64 count = db_conn_count (conn, query);
+
+  if (count < 0)
+      return 1;
+
+  printf ("%" G_GINT64_FORMAT "\n", count);
+  return 0;
+}
+
+static gint
+cmd_get (DbConn *conn, const gchar *title)
+{
+  gchar *text = db_conn_fetch_article (conn, title);
+
+  if (!text)
+    {
+      g_printerr ("Article not found: %s\n", title);
+      return 1;
+    }
+
+  printf ("%s\n", text);
+  g_free (text);
+
+  return 0;
+}
+
+static gint
+cmd_random (DbConn *conn)
+{
+  gchar *title = db_conn_fetch_random_title (conn);
+
+  if (!title)
+      return 1;
+
+  printf ("%s\n", title);
+  g_free (title);
+
+  return 0;
+}
+
+static gint
+cmd_stats (DbConn *conn)
+{
+  DbStats stats;
+
+  if (!db_conn_get_stats (conn, &stats))
+      return 1;
+
+  if (stats.n_shards > 1)
+      printf ("shards: %d\n", stats.n_shards);
+
+  printf ("format: %d\n", stats.format_version);
+  printf ("articles: %" G_GINT64_FORMAT "\n", stats.n_articles);
+  printf ("max id: %" G_GINT64_FORMAT "\n", stats.max_id);
+
+  if (stats.n_indexed >= 0)
+      printf ("indexed titles: %" G_GINT64_FORMAT "\n", stats.n_indexed);
+  else
+      printf ("indexed titles: no index\n");
+
+  printf ("page size: %d\n", stats.page_size);
+  printf ("pages: %" G_GINT64_FORMAT "\n", stats.page_count);
+  printf ("size: %" G_GINT64_FORMAT " bytes\n",
+      stats.page_count * stats.page_size);
+
+  return 0;
+}
+
+static GPtrArray *
+read_lines (FILE *fp)
+{
+  GPtrArray *lines = g_ptr_array_new ();
+  GString *line = g_string_new (NULL);
+  gchar buf[4096];
+
+  while (fgets (buf, sizeof (buf), fp))
+    {
+      g_string_append (line, buf);
+
+      /* a line longer than the buffer comes in several pieces */
+      if (line->str[line->len - 1] != '\n' && !feof (fp))
+          continue;
+
+      g_strstrip (line->str);
+
+      if (*line->str != '\0')
+          g_ptr_array_add (lines, g_strdup (line->str));
+
+      g_string_truncate (line, 0);
+    }
+
+  g_string_free (line, TRUE);
+  return lines;
+}
+
+static gpointer
+batch_worker (BatchJob *job)
+{
+  DbConn *conn;
+
+  /* each worker gets its own connection so they don't serialize
+   * on the connection mutex */
+  conn = db_conn_open (db_fname, TRUE);
+  if (!conn)
+    {
+      g_atomic_int_set (&job->failed, TRUE);
+      return NULL;
+    }
+
+  for (;;)
+    {
+      gint i = g_atomic_int_exchange_and_add (&job->next, 1);
+      const gchar *line;
+
+      if (i >= (gint) job->lines->len || g_atomic_int_get (&job->failed))
+          break;
+
+      line = g_ptr_array_index (job->lines, i);
+
+      if (job->fetch)
+        {
+          gchar *text = db_conn_fetch_article (conn, line);
+
+          job->n_results[i] = text ? 1 : 0;
+          g_free (text);
+        }
+      else
+        {
+          GList *results = db_conn_search_timed (conn, line, timeout, NULL);
+
+          job->n_results[i] = g_list_length (results);
+          free_results (results);
+        }
+    }
+
+  db_conn_close (conn);
+  return NULL;
+}
+
+static gint
+cmd_batch (void)
+{
+  BatchJob job;
+  GThread **threads;
+  GTimer *timer;
+  gdouble elapsed;
+  gint ret = 0;
+  guint i;
+
+  if (batch_mode && strcmp (batch_mode, "search") &&
+      strcmp (batch_mode, "get"))
+    {
+      g_printerr ("Unknown batch mode: %s\n", batch_mode);
+      return 1;
+    }
+
+  if (n_threads < 1)
+      n_threads = 1;
+
+  job.lines = read_lines (stdin);
+  job.fetch = (batch_mode && !strcmp (batch_mode, "get"));
+  job.next = 0;
+  job.failed = FALSE;
+  job.n_results = g_new0 (gint, job.lines->len);
+
+  threads = g_new0 (GThread *, n_threads);
+  timer = g_timer_new ();
+
+  for (i = 0; i < (guint) n_threads; i++)
+    {
+      GError *error = NULL;
+
+      threads[i] = g_thread_create ((GThreadFunc) batch_worker, &job,
+          TRUE, &error);
+
+      if (!threads[i])
+        {
+          g_printerr ("Error creating worker thread: %s\n", error->message);
+          g_error_free (error);
+          g_atomic_int_set (&job.failed, TRUE);
+          break;
+        }
+    }
+
+  while (i-- > 0)
+      g_thread_join (threads[i]);
+
+  g_timer_stop (timer);
+  elapsed = g_timer_elapsed (timer, NULL);
+
+  if (job.failed)
+    {
+      /* with fewer workers than asked for, and queries that were
+       * never run, the results and the qps would be made up */
+      g_printerr ("Batch aborted, not every worker could start\n");
+      ret = 1;
+    }
+  else
+    {
+      if (!quiet)
+        {
+          for (i = 0; i < job.lines->len; i++)
+              printf ("%s\t%d\n",
+                  (gchar *) g_ptr_array_index (job.lines, i),
+                  job.n_results[i]);
+        }
+
+      /* summary goes to stderr in key=value form so scripts can
+       * grep it out independently of the results */
+      g_printerr ("queries=%u threads=%d seconds=%.3f qps=%.1f\n",
+          job.lines->len, n_threads, elapsed,
+          (elapsed > 0) ? job.lines->len / elapsed : 0.0);
+    }
+
+  g_timer_destroy (timer);
+  g_free (threads);
+  g_free (job.n_results);
+  g_ptr_array_foreach (job.lines, (GFunc) g_free, NULL);
+  g_ptr_array_free (job.lines, TRUE);
+
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *error = NULL;
+  DbConn *conn;
+  gchar *arg = NULL;
+  gint ret;
+
+  if (!g_thread_supported ())
+      g_thread_init (NULL);
+
+  ctx = g_option_context_new ("search QUERY | count QUERY | get TITLE | " \
+      "random | stats | batch");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+
+  if (!g_option_context_parse (ctx, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  g_option_context_free (ctx);
+
+  if (!db_fname || argc < 2)
+    {
+      g_printerr ("Usage: %s -d <database.db> " \
+          "<search|count|get|random|stats|batch> [args]\n", argv[0]);
+      return 1;
+    }
+
+  if (!strcmp (argv[1], "batch"))
+      return cmd_batch ();
+
+  conn = db_conn_open (db_fname, TRUE);
+  if (!conn)
+      return 1;
+
+  if (argc > 2)
+      arg = g_strjoinv (" ", argv + 2);
+
+  if (!strcmp (argv[1], "search") && arg)
+      ret = cmd_search (conn, arg);
+  else if (!strcmp (argv[1], "count") && arg)
+      ret = cmd_count (conn, arg);
+  else if (!strcmp (argv[1], "get") && arg)
+      ret = cmd_get (conn, arg);
+  else if (!strcmp (argv[1], "random"))
+      ret = cmd_random (conn);
+  else if (!strcmp (argv[1], "stats"))
+      ret = cmd_stats (conn);
+  else
+    {
+      g_printerr ("Unknown command or missing argument: %s\n", argv[1]);
+      ret = 1;
+    }
+
+  g_free (arg);
+  db_conn_close (conn);
+
+  return ret;
+}
@@ -0,0 +1,42 @@
+#include "codec.h"
+
+#include <zlib.h>
+
+gchar *
+uncompress_string (gpointer data, gint len)
+{
+  gchar *buf = NULL;
+  gint bufsize = len * 2;
+  gulong retlen;
+
+  for (;;)
+    {
+      gint ret;
+
+      /* leave room for the terminating zero */
+      buf = g_malloc (bufsize + 1);
+      retlen = bufsize;
+      ret = uncompress ((unsigned char *) buf, &retlen, data, len);
+
+      switch (ret)
+        {
+          case Z_OK:
+            buf[retlen] = '\0';
+            return buf;
+
+          /* retry with a larger buffer */
+          case Z_BUF_ERROR:
+            g_free (buf);
+            bufsize *= 2;
+            break;
+
+          /* unknown error, bail out */
+          default:
+            g_warning ("%s: unknown zlib error: %d", G_STRFUNC, ret);
+            g_free (buf);
+            return NULL;
+        }
+    }
+
+  g_assert_not_reached ();
+}
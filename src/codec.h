@@ -0,0 +1,8 @@
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <glib.h>
+
+gchar *uncompress_string (gpointer data, gint len);
+
+#endif
@@ -2,74 +2,605 @@
 
 #include <sqlite3.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "codec.h"
 #include "util.h"
 
-static sqlite3 *db_handle = NULL;
+typedef enum {
+    SHARD_BY_HASH,
+    SHARD_BY_RANGE
+} ShardScheme;
 
-void
-db_close (void)
+/* statements are prepared once per shard and kept around */
+enum {
+    STMT_FETCH,
+    STMT_ARTICLE_ID,
+    STMT_SEARCH,
+    STMT_RANDOM,
+    STMT_TERM_DF,
+    STMT_COUNT,
+    STMT_SEARCH_UNSORTED,
+    STMT_FOLD,
+    N_STMTS
+};
+
+static const gchar *stmt_sql[N_STMTS] = {
+    "SELECT text FROM articles WHERE title = ?",
+    "SELECT id FROM articles WHERE title = ?",
+    "SELECT content FROM article_index WHERE content MATCH ? " \
+        "ORDER BY LENGTH(content) ASC, content ASC LIMIT ?",
+    /* ids can have holes once articles were deleted by an update */
+    "SELECT title FROM articles WHERE id >= ? ORDER BY id LIMIT 1",
+    "SELECT df, extended FROM article_index_terms WHERE term = ?",
+    /* no column is read, so FTS3 only walks the doclists and never
+     * looks at the content table */
+    "SELECT COUNT(*) FROM article_index WHERE content MATCH ?",
+    /* for searches with a deadline, the titles come in as FTS3 finds
+     * them and get_best_results keeps the best */
+    "SELECT content FROM article_index WHERE content MATCH ?",
+    /* the query as the fold or cjk tokenizer indexes it */
+    "SELECT fts3_fold(?, ?)"
+};
+
+/* how often a search with a deadline checks the time within a single
+ * sqlite3_step, in SQLite virtual machine instructions. The count starts
+ * over with every step, so between rows get_best_results checks it. */
+#define DEADLINE_CHECK_OPS 1000
+
+typedef struct {
+    sqlite3 *handle;
+    sqlite3_stmt *stmts[N_STMTS];
+
+    /* the same again for db_count_async and db_search_async, which
+     * run alongside the queries from the main loop. The handle is a
+     * read-only one of their own, opened when first needed: on the
+     * one above, which serializes its users, FTS3 would keep the
+     * searches with a deadline waiting while it gathers all the
+     * matches of a background search within a single step. */
+    sqlite3 *bg_handle;
+    sqlite3_stmt *bg_stmts[N_STMTS];
+    gchar *fname;
+
+    /* from the meta table, read once when the shard is opened;
+     * n_articles is -1 when the database doesn't say */
+    gint format_version;
+    gint64 n_articles;
+    gint64 max_id;
+
+    /* whether the index has term statistics (article_index_terms,
+     * built by FTS3's 'termstats') to plan searches with */
+    gboolean has_term_stats;
+
+    /* whether FTS3 can look up short prefixes directly in
+     * article_index_prefixes (built by its 'prefixes') */
+    gboolean has_prefixes;
+
+    /* whether the index uses the fold (or cjk) tokenizer, folding case
+     * and removing diacritics, rather than the simple one */
+    gboolean folded;
+
+    /* whether it is the cjk one, which also splits Chinese, Japanese
+     * and Korean text into bigrams */
+    gboolean bigrams;
+} DbShard;
+
+/* A connection is a set of one or more shards. An ordinary database
+ * file is just a single shard. */
+struct _DbConn {
+    DbShard *shards;
+    gint n_shards;
+    ShardScheme scheme;
+
+    /* range sharding only: the first title stored in each shard
+     * except the first one, in ascending order */
+    gchar **bounds;
+};
+
+struct _DbBlob {
+    sqlite3 *handle;
+    sqlite3_blob *blob;
+};
+
+typedef struct {
+    DbShard *shard;
+    const gchar *query;
+    gint limit;
+    GList *results;
+    GAsyncQueue *done;
+
+    /* only count the matches, into count (-1 on error) */
+    gboolean count_only;
+    gint64 count;
+
+    /* stop at the deadline, if any, setting partial */
+    const GTimeVal *deadline;
+    gboolean partial;
+
+    /* for db_count_async or db_search_async */
+    gboolean background;
+} ShardQuery;
+
+/* A db_count_async or db_search_async request, answered from the
+ * main loop */
+typedef struct {
+    gchar *query;
+    gint64 count;
+    GList *results;
+    DbCountFunc count_cb;
+    DbSearchFunc search_cb;
+    gpointer user_data;
+} BackgroundJob;
+
+/* One of the databases opened through db_open/db_add, named after
+ * its file (en.db is "en") */
+typedef struct {
+    gchar *name;
+    gchar *fname;
+    DbConn *conn;
+} DbEdition;
+
+static GPtrArray *editions = NULL;
+
+static GThreadPool *search_pool = NULL;
+static GStaticMutex search_pool_lock = G_STATIC_MUTEX_INIT;
+
+/* runs the db_count_async and db_search_async requests one at a time,
+ * as they share the background handles and statements of the shards */
+static GThreadPool *background_pool = NULL;
+
+/* the deadline of the search running in this thread, if any */
+static GStaticPrivate search_deadline = G_STATIC_PRIVATE_INIT;
+
+/* FNV-1a; titles are assigned to shards by this, so it must never
+ * change or depend on the glib version. */
+guint
+db_shard_hash (const gchar *title)
 {
-  if (db_handle != NULL)
+  guint32 hash = 2166136261U;
+
+  for (; *title; title++)
     {
-      sqlite3_close (db_handle);
-      db_handle = NULL;
+      hash ^= (guchar) *title;
+      hash *= 16777619U;
     }
+
+  return hash;
 }
 
-gboolean
-db_open (const gchar *fname)
+/* Progress handler of all the handles, interrupts the statement when
+ * the search this thread is running is past its deadline. FTS3 calls
+ * it too, for every term of a prefix search. */
+static int
+past_deadline (gpointer user_data)
+{
+  const GTimeVal *deadline = g_static_private_get (&search_deadline);
+  GTimeVal now;
+
+  if (!deadline)
+      return 0;
+
+  g_get_current_time (&now);
+
+  return (now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec &&
+      now.tv_usec >= deadline->tv_usec));
+}
+
+static sqlite3 *
+open_handle (const gchar *fname, gboolean read_only)
 {
   gint ret;
+  gint flags;
+  sqlite3 *handle = NULL;
 
-  DEBUG ("Opening database: %s", fname);
+  DEBUG ("Opening database: %s%s", fname, read_only ? " (read-only)" : "");
 
-  db_close ();
+  if (read_only)
+      flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
+  else
+      flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
 
-  ret = sqlite3_open (fname, &db_handle);
+  ret = sqlite3_open_v2 (fname, &handle, flags, NULL);
 
-  if (ret == SQLITE_OK)
+  if (ret != SQLITE_OK)
     {
-      return TRUE;
+      g_warning ("%s: error opening database: %s",
+          G_STRFUNC, sqlite3_errmsg (handle));
+      sqlite3_close (handle);
+      return NULL;
     }
-  else
+
+  /* the handle may be shared by queries with and without a deadline,
+   * so the handler stays and looks the deadline up by thread */
+  sqlite3_progress_handler (handle, DEADLINE_CHECK_OPS, past_deadline, NULL);
+
+  return handle;
+}
+
+static gboolean
+get_int64 (sqlite3 *handle, const gchar *sql, gint64 *value)
+{
+  gint ret;
+  sqlite3_stmt *stmt;
+
+  ret = sqlite3_prepare_v2 (handle, sql, -1, &stmt, NULL);
+
+  if (ret != SQLITE_OK)
     {
-      g_warning ("%s: error opening database: %s",
-          G_STRFUNC, sqlite3_errmsg (db_handle));
-      db_handle = NULL;
+      g_warning ("%s: error preparing SQL statement: %s",
+          G_STRFUNC, sqlite3_errmsg (handle));
       return FALSE;
     }
+
+  ret = sqlite3_step (stmt);
+  if (ret == SQLITE_ROW)
+      *value = sqlite3_column_int64 (stmt, 0);
+  else
+      g_warning ("%s: error fetching value: %s",
+          G_STRFUNC, sqlite3_errmsg (handle));
+
+  sqlite3_finalize (stmt);
+  return (ret == SQLITE_ROW);
+}
+
+/* Reads the meta table (key/value pairs written along with the
+ * articles), refusing databases this version can't read. */
+static gboolean
+load_meta (DbShard *shard)
+{
+  sqlite3_stmt *stmt;
+  gboolean ok = TRUE;
+
+  shard->format_version = 0;
+  shard->n_articles = -1;
+  shard->max_id = -1;
+  shard->folded = FALSE;
+  shard->bigrams = FALSE;
+
+  /* older databases don't have one, that's fine */
+  if (sqlite3_prepare_v2 (shard->handle, "SELECT key, value FROM meta",
+          -1, &stmt, NULL) == SQLITE_OK)
+    {
+      while (ok && sqlite3_step (stmt) == SQLITE_ROW)
+        {
+          const gchar *key = (const gchar *) sqlite3_column_text (stmt, 0);
+          const gchar *value = (const gchar *) sqlite3_column_text (stmt, 1);
+
+          if (!key || !value)
+              continue;
+
+          if (!strcmp (key, "format_version"))
+              shard->format_version = g_ascii_strtoll (value, NULL, 10);
+          else if (!strcmp (key, "n_articles"))
+              shard->n_articles = g_ascii_strtoll (value, NULL, 10);
+          else if (!strcmp (key, "max_id"))
+              shard->max_id = g_ascii_strtoll (value, NULL, 10);
+          else if (!strcmp (key, "index_tokenizer"))
+            {
+              shard->bigrams = !strcmp (value, "cjk");
+              shard->folded = shard->bigrams || !strcmp (value, "fold");
+            }
+          else if ((!strcmp (key, "codec") && strcmp (value, "zlib")) ||
+              (!strcmp (key, "dictionary") && strcmp (value, "none")))
+            {
+              g_warning ("%s: unsupported %s: %s", G_STRFUNC, key, value);
+              ok = FALSE;
+            }
+        }
+
+      sqlite3_finalize (stmt);
+    }
+
+  if (shard->format_version > DB_FORMAT_VERSION)
+    {
+      g_warning ("%s: database format %d is newer than this version "
+          "supports (%d)", G_STRFUNC, shard->format_version,
+          DB_FORMAT_VERSION);
+      ok = FALSE;
+    }
+
+  /* the one thing we can't do without, look it up now rather
+   * than on every random article */
+  if (ok && shard->max_id < 0 && !get_int64 (shard->handle,
+          "SELECT IFNULL(MAX(id), 0) FROM articles", &shard->max_id))
+      shard->max_id = 0;
+
+  if (ok)
+    {
+      gint64 n = 0;
+
+      /* FTS3 empties these tables when the index changes */
+      if (get_int64 (shard->handle, "SELECT COUNT(*) FROM sqlite_master " \
+              "WHERE name = 'article_index_terms'", &n) && n > 0)
+          get_int64 (shard->handle, "SELECT EXISTS " \
+              "(SELECT 1 FROM article_index_terms)", &n);
+      shard->has_term_stats = (n > 0);
+
+      n = 0;
+      if (get_int64 (shard->handle, "SELECT COUNT(*) FROM sqlite_master " \
+              "WHERE name = 'article_index_prefixes'", &n) && n > 0)
+          get_int64 (shard->handle, "SELECT EXISTS " \
+              "(SELECT 1 FROM article_index_prefixes)", &n);
+      shard->has_prefixes = (n > 0);
+    }
+
+  return ok;
+}
+
+static gboolean
+open_shard (DbShard *shard, const gchar *fname, gboolean read_only)
+{
+  shard->fname = g_strdup (fname);
+  shard->handle = open_handle (fname, read_only);
+
+  return shard->handle && load_meta (shard);
+}
+
+static DbConn *
+conn_new (gint n_shards)
+{
+  DbConn *conn = g_slice_new0 (DbConn);
+
+  conn->n_shards = n_shards;
+  conn->shards = g_new0 (DbShard, n_shards);
+
+  return conn;
+}
+
+/* Opens a shard manifest, as written by mawire-shard:
+ *
+ *   [shards]
+ *   scheme=hash|range
+ *   files=wiki-0.db;wiki-1.db;...
+ *   bounds=<first title in shard 1>;<first title in shard 2>;...
+ *
+ * Relative file names are relative to the manifest location. */
+static DbConn *
+open_manifest (const gchar *fname, gboolean read_only)
+{
+  GKeyFile *kf = g_key_file_new ();
+  GError *error = NULL;
+  DbConn *conn = NULL;
+  gchar **files = NULL;
+  gchar **bounds = NULL;
+  gchar *scheme = NULL;
+  gchar *dir = NULL;
+  gsize n_files = 0;
+  gsize n_bounds = 0;
+  gboolean ok;
+  gsize i;
+
+  DEBUG ("Opening shard manifest: %s", fname);
+
+  if (!g_key_file_load_from_file (kf, fname, G_KEY_FILE_NONE, &error))
+      goto error;
+
+  scheme = g_key_file_get_string (kf, "shards", "scheme", &error);
+  if (!scheme)
+      goto error;
+
+  files = g_key_file_get_string_list (kf, "shards", "files",
+      &n_files, &error);
+  if (!files)
+      goto error;
+
+  if (!strcmp (scheme, "range"))
+    {
+      bounds = g_key_file_get_string_list (kf, "shards", "bounds",
+          &n_bounds, &error);
+      if (!bounds)
+          goto error;
+    }
+  else if (strcmp (scheme, "hash"))
+    {
+      g_warning ("%s: unknown sharding scheme: %s", G_STRFUNC, scheme);
+      goto out;
+    }
+
+  if (n_files == 0 || (bounds && n_bounds != n_files - 1))
+    {
+      g_warning ("%s: inconsistent shard manifest: %s", G_STRFUNC, fname);
+      goto out;
+    }
+
+  dir = g_path_get_dirname (fname);
+  conn = conn_new (n_files);
+  conn->scheme = bounds ? SHARD_BY_RANGE : SHARD_BY_HASH;
+  conn->bounds = bounds;
+  bounds = NULL;
+
+  for (i = 0; i < n_files; i++)
+    {
+      gchar *path;
+
+      if (g_path_is_absolute (files[i]))
+          path = g_strdup (files[i]);
+      else
+          path = g_build_filename (dir, files[i], NULL);
+
+      ok = open_shard (conn->shards + i, path, read_only);
+      g_free (path);
+
+      if (!ok)
+        {
+          db_conn_close (conn);
+          conn = NULL;
+          break;
+        }
+    }
+
+  goto out;
+
+error:
+  g_warning ("%s: error reading shard manifest %s: %s",
+      G_STRFUNC, fname, error->message);
+  g_error_free (error);
+
+out:
+  g_strfreev (files);
+  g_strfreev (bounds);
+  g_free (scheme);
+  g_free (dir);
+  g_key_file_free (kf);
+
+  return conn;
+}
+
+DbConn *
+db_conn_open (const gchar *fname, gboolean read_only)
+{
+  DbConn *conn;
+
+  if (g_str_has_suffix (fname, DB_SHARDS_SUFFIX))
+      return open_manifest (fname, read_only);
+
+  conn = conn_new (1);
+
+  if (!open_shard (conn->shards, fname, read_only))
+    {
+      db_conn_close (conn);
+      return NULL;
+    }
+
+  return conn;
+}
+
+void
+db_conn_close (DbConn *conn)
+{
+  gint i;
+
+  if (conn == NULL)
+      return;
+
+  for (i = 0; i < conn->n_shards; i++)
+    {
+      gint j;
+
+      for (j = 0; j < N_STMTS; j++)
+        {
+          sqlite3_finalize (conn->shards[i].stmts[j]);
+          sqlite3_finalize (conn->shards[i].bg_stmts[j]);
+        }
+
+      sqlite3_close (conn->shards[i].handle);
+      sqlite3_close (conn->shards[i].bg_handle);
+      g_free (conn->shards[i].fname);
+    }
+
+  g_free (conn->shards);
+  g_strfreev (conn->bounds);
+  g_slice_free (DbConn, conn);
+}
+
+static sqlite3_stmt *
+prepare_stmt (sqlite3 *handle, sqlite3_stmt **stmts, gint which)
+{
+  if (!stmts[which] && sqlite3_prepare_v2 (handle,
+          stmt_sql[which], -1, stmts + which, NULL) != SQLITE_OK)
+    {
+      g_warning ("%s: error preparing SQL statement: %s",
+          G_STRFUNC, sqlite3_errmsg (handle));
+      return NULL;
+    }
+
+  return stmts[which];
+}
+
+static sqlite3_stmt *
+get_stmt (DbShard *shard, gint which)
+{
+  return prepare_stmt (shard->handle, shard->stmts, which);
+}
+
+/* background queries have a handle and statements of their own, only
+ * ever used by one of them at a time */
+static sqlite3_stmt *
+get_query_stmt (ShardQuery *q, gint which)
+{
+  DbShard *shard = q->shard;
+
+  if (!q->background)
+      return prepare_stmt (shard->handle, shard->stmts, which);
+
+  if (!shard->bg_handle)
+      shard->bg_handle = open_handle (shard->fname, TRUE);
+
+  if (!shard->bg_handle)
+      return NULL;
+
+  return prepare_stmt (shard->bg_handle, shard->bg_stmts, which);
+}
+
+/* the handle get_query_stmt prepared the query's statements on */
+static sqlite3 *
+query_handle (ShardQuery *q)
+{
+  return q->background ? q->shard->bg_handle : q->shard->handle;
+}
+
+/* readies a cached statement for the next use */
+static void
+release_stmt (sqlite3_stmt *stmt)
+{
+  sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+}
+
+static DbShard *
+shard_for_title (DbConn *conn, const gchar *title)
+{
+  gint lo = 0;
+  gint hi;
+
+  if (conn->n_shards == 1)
+      return conn->shards;
+
+  if (conn->scheme == SHARD_BY_HASH)
+      return conn->shards + db_shard_hash (title) % conn->n_shards;
+
+  /* find the last shard whose first title is <= title; sqlite's
+   * default BINARY collation compares like strcmp */
+  hi = conn->n_shards - 1;
+  while (lo < hi)
+    {
+      gint mid = (lo + hi) / 2;
+
+      if (strcmp (title, conn->bounds[mid]) >= 0)
+          lo = mid + 1;
+      else
+          hi = mid;
+    }
+
+  return conn->shards + lo;
 }
 
 gchar *
-db_fetch_article (const gchar *title)
+db_conn_fetch_article (DbConn *conn, const gchar *title)
 {
   gint ret;
+  DbShard *shard;
   sqlite3_stmt *stmt;
   gchar *article = NULL;
 
   DEBUG ("Fetching article: %s", title);
 
-  if (!db_handle)
+  if (!conn)
       return NULL;
 
-  ret = sqlite3_prepare_v2 (db_handle,
-      "SELECT text FROM articles WHERE title = ?", -1, &stmt, NULL);
+  shard = shard_for_title (conn, title);
+  stmt = get_stmt (shard, STMT_FETCH);
 
-  if (ret != SQLITE_OK)
-    {
-      g_warning ("%s: error preparing SQL statement: %s",
-          G_STRFUNC, sqlite3_errmsg (db_handle));
+  if (!stmt)
       return NULL;
-    }
 
   ret = sqlite3_bind_text (stmt, 1, title, -1, SQLITE_STATIC);
 
   if (ret != SQLITE_OK)
     {
       g_warning ("%s: error binding to SQL statement: %s",
-          G_STRFUNC, sqlite3_errmsg (db_handle));
-      sqlite3_finalize (stmt);
+          G_STRFUNC, sqlite3_errmsg (shard->handle));
+      release_stmt (stmt);
       return NULL;
     }
 
@@ -88,15 +619,116 @@ db_fetch_article (const gchar *title)
       /* no results is ok, but errors we'd like to report */
       if (ret != SQLITE_DONE)
           g_warning ("%s: error fetching article: %s",
-              G_STRFUNC, sqlite3_errmsg (db_handle));
+              G_STRFUNC, sqlite3_errmsg (shard->handle));
     }
 
-  sqlite3_finalize (stmt);
+  release_stmt (stmt);
   return article;
 }
 
+/* Opens the compressed article text for incremental reading, so it can
+ * be passed on as is (it's in zlib format) without decompressing or
+ * copying the whole row first. */
+DbBlob *
+db_conn_open_article_blob (DbConn *conn, const gchar *title)
+{
+  gint ret;
+  sqlite3 *db;
+  DbShard *shard;
+  sqlite3_stmt *stmt;
+  sqlite3_int64 rowid;
+  sqlite3_blob *handle = NULL;
+  DbBlob *blob;
+
+  DEBUG ("Opening article blob: %s", title);
+
+  if (!conn)
+      return NULL;
+
+  shard = shard_for_title (conn, title);
+  db = shard->handle;
+  stmt = get_stmt (shard, STMT_ARTICLE_ID);
+
+  if (!stmt)
+      return NULL;
+
+  ret = sqlite3_bind_text (stmt, 1, title, -1, SQLITE_STATIC);
+
+  if (ret == SQLITE_OK)
+      ret = sqlite3_step (stmt);
+
+  if (ret != SQLITE_ROW)
+    {
+      /* no results is ok, but errors we'd like to report */
+      if (ret != SQLITE_DONE)
+          g_warning ("%s: error fetching article: %s",
+              G_STRFUNC, sqlite3_errmsg (db));
+
+      release_stmt (stmt);
+      return NULL;
+    }
+
+  rowid = sqlite3_column_int64 (stmt, 0);
+  release_stmt (stmt);
+
+  ret = sqlite3_blob_open (db, "main", "articles", "text",
+      rowid, 0, &handle);
+
+  if (ret != SQLITE_OK)
+    {
+      g_warning ("%s: error opening blob: %s",
+          G_STRFUNC, sqlite3_errmsg (db));
+      return NULL;
+    }
+
+  blob = g_slice_new (DbBlob);
+  blob->handle = db;
+  blob->blob = handle;
+
+  return blob;
+}
+
+gint
+db_blob_size (DbBlob *blob)
+{
+  return sqlite3_blob_bytes (blob->blob);
+}
+
+gboolean
+db_blob_read (DbBlob *blob, gpointer buf, gint len, gint offset)
+{
+  gint ret = sqlite3_blob_read (blob->blob, buf, len, offset);
+
+  if (ret != SQLITE_OK)
+    {
+      g_warning ("%s: error reading blob: %s",
+          G_STRFUNC, sqlite3_errmsg (blob->handle));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+void
+db_blob_close (DbBlob *blob)
+{
+  if (blob == NULL)
+      return;
+
+  sqlite3_blob_close (blob->blob);
+  g_slice_free (DbBlob, blob);
+}
+
+static void
+free_results (GList *li)
+{
+  g_list_foreach (li, (GFunc) g_free, NULL);
+  g_list_free (li);
+}
+
+/* Returns the rows in the order the statement produced them */
 static GList *
-get_results (sqlite3_stmt *stmt)
+get_results (sqlite3 *handle, sqlite3_stmt *stmt)
 {
   GList *li = NULL;
   const unsigned char *col;
@@ -112,14 +744,13 @@ get_results (sqlite3_stmt *stmt)
             break;
 
           case SQLITE_DONE:
-            if (li != NULL)
-                li = g_list_sort (li, (GCompareFunc) g_strcmp0);
-            return li;
+            return g_list_reverse (li);
 
           /* unknown error, we'll just return empty list */
           default:
             g_warning ("%s: error fetching results: %s",
-                G_STRFUNC, sqlite3_errmsg (db_handle));
+                G_STRFUNC, sqlite3_errmsg (handle));
+            free_results (li);
             return NULL;
         }
     }
@@ -127,95 +758,1275 @@ get_results (sqlite3_stmt *stmt)
   g_assert_not_reached ();
 }
 
-GList *
-db_search (const gchar *query)
+/* A search token and what the term statistics say about it */
+typedef struct {
+    gchar *token;
+    /* estimated number of matching titles, -1 if unknown */
+    gint64 df;
+    /* no longer term starts with it, so the prefix search can
+     * be skipped */
+    gboolean exact;
+} MatchToken;
+
+/* Looks up a term, or a three character prefix followed by '*', in
+ * the term statistics. Returns the number of titles it's in, or -1
+ * if it isn't there or on error. */
+static gint64
+lookup_term (ShardQuery *q, const gchar *term, gboolean *extended)
 {
-  gint ret;
-  gchar *match;
   sqlite3_stmt *stmt;
-  GString *str;
-  gchar **tokens;
-  int i;
-  GList *li = NULL;
+  gint64 df = -1;
 
-  DEBUG ("Searching the database for: %s", query);
+  stmt = get_query_stmt (q, STMT_TERM_DF);
 
-  ret = sqlite3_prepare_v2 (db_handle,
-      "SELECT content FROM article_index WHERE "
-          "content MATCH ? ORDER BY LENGTH(content) ASC LIMIT 500",
-      -1, &stmt, NULL);
+  if (!stmt)
+      return -1;
 
-  if (ret != SQLITE_OK)
+  sqlite3_bind_text (stmt, 1, term, -1, SQLITE_STATIC);
+
+  switch (sqlite3_step (stmt))
     {
-      g_warning ("%s: error preparing SQL statement: %s",
-          G_STRFUNC, sqlite3_errmsg (db_handle));
-      return NULL;
-    }
+      case SQLITE_ROW:
+        df = sqlite3_column_int64 (stmt, 0);
+        if (extended)
+            *extended = sqlite3_column_int (stmt, 1);
+        break;
+
+      case SQLITE_DONE:
+        break;
+
+      default:
+        g_warning ("%s: error looking up term: %s",
+            G_STRFUNC, sqlite3_errmsg (query_handle (q)));
+    }
+
+  release_stmt (stmt);
+  return df;
+}
+
+/* Fills in the estimate for a token the FTS3 tokenizer keeps whole,
+ * that is one made of ASCII letters and digits (lowercased, as in the
+ * index) and non-ASCII characters (folded too, for the fold and cjk
+ * tokenizers) */
+static void
+estimate_token (ShardQuery *q, MatchToken *t)
+{
+  const gchar *c;
+  gchar *prefix;
+  glong len = g_utf8_strlen (t->token, -1);
+  gboolean extended = TRUE;
+  gint64 df;
+
+  t->df = -1;
+  t->exact = FALSE;
+
+  if (!q->shard->has_term_stats)
+      return;
+
+  for (c = t->token; *c; c++)
+    {
+      if (!g_ascii_isalnum (*c) && !(*c & 0x80))
+          return;
+    }
+
+  /* there are no counts of prefixes this short, but the term itself
+   * can be looked up, which is all there is for a CJK bigram */
+  if (len < 3)
+    {
+      df = lookup_term (q, t->token, &extended);
+
+      if (df > 0 && !extended)
+        {
+          t->df = df;
+          t->exact = TRUE;
+        }
+      return;
+    }
+
+  prefix = g_strdup_printf ("%.*s*",
+      (gint) (g_utf8_offset_to_pointer (t->token, 3) - t->token), t->token);
+  t->df = lookup_term (q, prefix, NULL);
+  g_free (prefix);
+
+  /* no term started with these three letters when the statistics
+   * were built, but titles written since then may have one */
+  if (t->df <= 0)
+    {
+      t->df = -1;
+      return;
+    }
+
+  /* the prefix count is exact for a three letter token, for longer
+   * ones the count of the term itself is usually much closer */
+  df = lookup_term (q, t->token, &extended);
+
+  if (df > 0 && len > 3)
+      t->df = df;
+
+  t->exact = (df > 0 && !extended);
+}
+
+/* the most selective tokens first, the unknown ones last */
+static gint
+compare_tokens (const MatchToken *a, const MatchToken *b)
+{
+  if (a->df < 0 || b->df < 0)
+      return (a->df < 0) - (b->df < 0);
+
+  return (a->df > b->df) - (a->df < b->df);
+}
+
+/* The query as the fold or cjk tokenizer indexes it, the tokens folded
+ * (and CJK text in bigrams) and separated by single spaces; NULL on
+ * error */
+static gchar *
+fold_query (ShardQuery *q)
+{
+  sqlite3_stmt *stmt;
+  gchar *folded = NULL;
+
+  stmt = get_query_stmt (q, STMT_FOLD);
+  if (!stmt)
+      return NULL;
+
+  sqlite3_bind_text (stmt, 1, q->query, -1, SQLITE_STATIC);
+  sqlite3_bind_text (stmt, 2, q->shard->bigrams ? "cjk" : "fold", -1,
+      SQLITE_STATIC);
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+      folded = g_strdup ((const gchar *) sqlite3_column_text (stmt, 0));
+  else
+      g_warning ("%s: error folding query: %s",
+          G_STRFUNC, sqlite3_errmsg (query_handle (q)));
+
+  release_stmt (stmt);
+  return folded;
+}
+
+/* Turns the user query into FTS3 MATCH expression for the shard, or
+ * returns NULL if nothing is left to search for. The rarest tokens go
+ * first, so FTS3 starts from the shortest doclists and keeps its
+ * intermediate results small. */
+static gchar *
+build_match (ShardQuery *q)
+{
+  const gchar *query = q->query;
+  gchar *folded = NULL;
+  GString *str;
+  gchar **tokens;
+  GList *list = NULL;
+  GList *li;
+  int i;
+
+  /* FTS3 would fold the MATCH expression itself, but the term
+   * statistics and the length checks have to see the folded
+   * tokens too. Of a run of CJK characters, it would only take
+   * every other bigram. */
+  if (q->shard->folded)
+      folded = fold_query (q);
+
+  if (folded)
+      query = folded;
 
-  str = g_string_sized_new (strlen (query) * 2);
   tokens = g_strsplit (query, " ", -1);
 
   for (i = 0; tokens[i]; i++)
     {
+      MatchToken *t;
+
       /* very short search tokens cause massive performance
-       * hit, better to ignore them. */
-      if (strlen (tokens[i]) > 2)
+       * hit, better to ignore them, unless the index has their
+       * merged doclists ready. */
+      if (!*tokens[i] || (strlen (tokens[i]) <= 2 &&
+          !q->shard->has_prefixes))
+          continue;
+
+      t = g_slice_new (MatchToken);
+      t->token = g_ascii_strdown (tokens[i], -1);
+      estimate_token (q, t);
+      list = g_list_prepend (list, t);
+    }
+
+  g_strfreev (tokens);
+
+  /* g_list_sort is stable, without statistics the order is kept */
+  list = g_list_sort (g_list_reverse (list), (GCompareFunc) compare_tokens);
+  str = g_string_sized_new (strlen (query) * 2);
+
+  for (li = list; li; li = li->next)
+    {
+      MatchToken *t = li->data;
+
+      g_string_append (str, t->token);
+      g_string_append (str, t->exact ? " " : "* ");
+
+      g_free (t->token);
+      g_slice_free (MatchToken, t);
+    }
+
+  g_list_free (list);
+  g_free (folded);
+
+  if (str->len == 0)
+    {
+      g_string_free (str, TRUE);
+      return NULL;
+    }
+
+  return g_string_free (str, FALSE);
+}
+
+/* same order as the ORDER BY in query_shard */
+static gint
+compare_hits (const gchar *a, const gchar *b)
+{
+  glong la = g_utf8_strlen (a, -1);
+  glong lb = g_utf8_strlen (b, -1);
+
+  if (la != lb)
+      return (la < lb) ? -1 : 1;
+
+  return strcmp (a, b);
+}
+
+static gint
+compare_hit_ptrs (const gchar **a, const gchar **b)
+{
+  return compare_hits (*a, *b);
+}
+
+/* sorts the hits and drops all but the best n */
+static void
+keep_best_hits (GPtrArray *hits, guint n)
+{
+  guint i;
+
+  g_ptr_array_sort (hits, (GCompareFunc) compare_hit_ptrs);
+
+  for (i = n; i < hits->len; i++)
+      g_free (g_ptr_array_index (hits, i));
+
+  if (hits->len > n)
+      g_ptr_array_set_size (hits, n);
+}
+
+/* Like get_results, but for a statement that returns the rows in no
+ * particular order: keeps the best q->limit of them, ordered. If the
+ * statement is interrupted at the deadline, returns the best of the
+ * rows so far and sets q->partial.
+ *
+ * FTS3 finds all the matches within the first step, before it returns
+ * any row, so a search that runs out of time there has no rows at all
+ * but is still partial: the caller can't tell from an empty list that
+ * nothing matches, only that it has to search again without the
+ * deadline, as the UI does in the background. */
+static GList *
+get_best_results (ShardQuery *q, sqlite3_stmt *stmt)
+{
+  GPtrArray *hits = g_ptr_array_new ();
+  const gchar *worst = NULL;
+  const gchar *col;
+  GList *li = NULL;
+  guint i;
+
+  for (;;)
+    {
+      gint ret = sqlite3_step (stmt);
+
+      if (ret == SQLITE_ROW && past_deadline (NULL))
+          ret = SQLITE_INTERRUPT;
+
+      if (ret == SQLITE_ROW)
         {
-          g_string_append (str, tokens[i]);
-          g_string_append (str, "* ");
+          col = (const gchar *) sqlite3_column_text (stmt, 0);
+
+          /* once there are enough, only the better ones are kept */
+          if (!col || !*col || (worst && compare_hits (col, worst) >= 0))
+              continue;
+
+          g_ptr_array_add (hits, g_strdup (col));
+
+          if (hits->len >= 2 * q->limit)
+            {
+              keep_best_hits (hits, q->limit);
+              worst = g_ptr_array_index (hits, q->limit - 1);
+            }
+
+          continue;
         }
+
+      if (ret == SQLITE_INTERRUPT)
+        {
+          q->partial = TRUE;
+        }
+      else if (ret != SQLITE_DONE)
+        {
+          g_warning ("%s: error fetching results: %s",
+              G_STRFUNC, sqlite3_errmsg (query_handle (q)));
+          g_ptr_array_foreach (hits, (GFunc) g_free, NULL);
+          g_ptr_array_set_size (hits, 0);
+        }
+
+      break;
+    }
+
+  keep_best_hits (hits, q->limit);
+
+  for (i = hits->len; i > 0; i--)
+      li = g_list_prepend (li, g_ptr_array_index (hits, i - 1));
+
+  g_ptr_array_free (hits, TRUE);
+  return li;
+}
+
+/* Runs the query on a single shard, results are ordered from the
+ * shortest (most relevant) title to the longest. With a deadline,
+ * SQLite can't sort them as it would have to find them all first, so
+ * they are picked as they come and whatever was found is returned
+ * when the time is up. */
+static GList *
+query_shard (ShardQuery *q)
+{
+  gint ret;
+  sqlite3_stmt *stmt;
+  gchar *match;
+  GList *li = NULL;
+
+  if (q->limit <= 0)
+      return NULL;
+
+  match = build_match (q);
+  if (!match)
+      return NULL;
+
+  stmt = get_query_stmt (q,
+      q->deadline ? STMT_SEARCH_UNSORTED : STMT_SEARCH);
+
+  if (!stmt)
+    {
+      g_free (match);
+      return NULL;
+    }
+
+  ret = sqlite3_bind_text (stmt, 1, match, -1, SQLITE_STATIC);
+
+  if (ret == SQLITE_OK && !q->deadline)
+      ret = sqlite3_bind_int (stmt, 2, q->limit);
+
+  if (ret != SQLITE_OK)
+    {
+      g_warning ("%s: error binding to SQL statement: %s",
+          G_STRFUNC, sqlite3_errmsg (query_handle (q)));
+    }
+  else if (q->deadline)
+    {
+      g_static_private_set (&search_deadline, (gpointer) q->deadline, NULL);
+      li = get_best_results (q, stmt);
+      g_static_private_set (&search_deadline, NULL, NULL);
     }
+  else
+    {
+      li = get_results (query_handle (q), stmt);
+    }
+
+  release_stmt (stmt);
+  g_free (match);
+  return li;
+}
+
+/* Counts the matches on a single shard without fetching any of them,
+ * returns -1 on error */
+static gint64
+count_shard (ShardQuery *q)
+{
+  sqlite3_stmt *stmt;
+  gchar *match;
+  gint64 count = -1;
+
+  match = build_match (q);
+  if (!match)
+      return 0;
 
-  match = g_string_free (str, FALSE);
-  if (*match != '\0')
+  stmt = get_query_stmt (q, STMT_COUNT);
+
+  if (stmt)
     {
-      ret = sqlite3_bind_text (stmt, 1, match, -1, SQLITE_STATIC);
+      sqlite3_bind_text (stmt, 1, match, -1, SQLITE_STATIC);
+
+      if (sqlite3_step (stmt) == SQLITE_ROW)
+          count = sqlite3_column_int64 (stmt, 0);
+      else
+          g_warning ("%s: error counting results: %s",
+              G_STRFUNC, sqlite3_errmsg (query_handle (q)));
+
+      release_stmt (stmt);
+    }
+
+  g_free (match);
+  return count;
+}
 
-      if (ret == SQLITE_OK)
+static void
+run_query (ShardQuery *q)
+{
+  if (q->count_only)
+      q->count = count_shard (q);
+  else
+      q->results = query_shard (q);
+}
+
+static void
+run_shard_query (ShardQuery *q, gpointer user_data)
+{
+  run_query (q);
+  g_async_queue_push (q->done, q);
+}
+
+static GThreadPool *
+get_search_pool (void)
+{
+  g_static_mutex_lock (&search_pool_lock);
+
+  if (!search_pool)
+    {
+      GError *error = NULL;
+      glong n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+      search_pool = g_thread_pool_new ((GFunc) run_shard_query, NULL,
+          MAX (n_cpus, 2), FALSE, &error);
+
+      if (!search_pool)
         {
-          li = get_results (stmt);
+          g_warning ("%s: error creating search threads: %s",
+              G_STRFUNC, error->message);
+          g_error_free (error);
         }
-      else
+    }
+
+  g_static_mutex_unlock (&search_pool_lock);
+  return search_pool;
+}
+
+/* k-way merge of the per-shard results, each of which is already
+ * ordered. There are only ever a handful of shards, so picking the
+ * smallest head by linear scan beats keeping a heap. */
+static GList *
+merge_results (ShardQuery *queries, gint n, gint limit)
+{
+  GList *merged = NULL;
+  gint count;
+  gint i;
+
+  for (count = 0; count < limit; count++)
+    {
+      gint best = -1;
+
+      for (i = 0; i < n; i++)
         {
-          g_warning ("%s: error binding to SQL statement: %s",
-              G_STRFUNC, sqlite3_errmsg (db_handle));
+          if (queries[i].results && (best < 0 ||
+              compare_hits (queries[i].results->data,
+                  queries[best].results->data) < 0))
+              best = i;
         }
+
+      if (best < 0)
+          break;
+
+      merged = g_list_prepend (merged, queries[best].results->data);
+      queries[best].results = g_list_delete_link (queries[best].results,
+          queries[best].results);
     }
 
-  sqlite3_finalize (stmt);
-  g_free (match);
+  for (i = 0; i < n; i++)
+      free_results (queries[i].results);
+
+  return g_list_reverse (merged);
+}
+
+/* one query for each shard of the connection, as the prototype */
+static void
+fill_queries (ShardQuery *queries, DbConn *conn, const ShardQuery *proto)
+{
+  gint i;
+
+  for (i = 0; i < conn->n_shards; i++)
+    {
+      queries[i] = *proto;
+      queries[i].shard = conn->shards + i;
+    }
+}
+
+/* Runs the queries in parallel, returns when all are done */
+static void
+run_queries (ShardQuery *queries, gint n)
+{
+  GThreadPool *pool = get_search_pool ();
+  GAsyncQueue *done = g_async_queue_new ();
+  gint i;
+
+  for (i = 0; i < n; i++)
+    {
+      queries[i].done = done;
+
+      /* the first one we do ourselves instead of just waiting */
+      if (i > 0 && pool)
+          g_thread_pool_push (pool, queries + i, NULL);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      if (i == 0 || !pool)
+          run_query (queries + i);
+    }
+
+  if (pool)
+    {
+      for (i = 1; i < n; i++)
+          g_async_queue_pop (done);
+    }
+
+  g_async_queue_unref (done);
+}
+
+static GList *
+search_titles (DbConn *conn, const ShardQuery *proto, gboolean sorted,
+    gboolean *partial)
+{
+  GList *li;
+
+  DEBUG ("Searching the database for: %s", proto->query);
+
+  if (partial)
+      *partial = FALSE;
+
+  if (!conn)
+      return NULL;
+
+  /* each shard turns the query into a MATCH of its own, according
+   * to its term statistics */
+  if (conn->n_shards == 1)
+    {
+      ShardQuery q = *proto;
+
+      q.shard = conn->shards;
+      li = query_shard (&q);
+
+      if (partial)
+          *partial = q.partial;
+    }
+  else
+    {
+      ShardQuery *queries = g_new0 (ShardQuery, conn->n_shards);
+      gint i;
+
+      fill_queries (queries, conn, proto);
+      run_queries (queries, conn->n_shards);
+
+      for (i = 0; i < conn->n_shards && partial; i++)
+          *partial = *partial || queries[i].partial;
+
+      li = merge_results (queries, conn->n_shards, proto->limit);
+
+      g_free (queries);
+    }
+
+  if (sorted)
+      li = g_list_sort (li, (GCompareFunc) g_strcmp0);
 
   return li;
 }
 
+/* the time timeout milliseconds from now */
+static void
+make_deadline (GTimeVal *deadline, gint timeout)
+{
+  g_get_current_time (deadline);
+
+  deadline->tv_sec += timeout / 1000;
+  deadline->tv_usec += (timeout % 1000) * 1000;
+
+  if (deadline->tv_usec >= G_USEC_PER_SEC)
+    {
+      deadline->tv_sec++;
+      deadline->tv_usec -= G_USEC_PER_SEC;
+    }
+}
+
+GList *
+db_conn_search (DbConn *conn, const gchar *query)
+{
+  return db_conn_search_timed (conn, query, 0, NULL);
+}
+
+/* Like db_conn_search, but gives up after timeout milliseconds (if
+ * more than zero), setting partial. The results are then the best of
+ * the titles found so far, not necessarily the best there are, and
+ * possibly none (see get_best_results). */
+GList *
+db_conn_search_timed (DbConn *conn, const gchar *query, gint timeout,
+    gboolean *partial)
+{
+  ShardQuery proto = { 0 };
+  GTimeVal deadline;
+
+  proto.query = query;
+  proto.limit = DB_MAX_RESULTS;
+
+  if (timeout > 0)
+    {
+      make_deadline (&deadline, timeout);
+      proto.deadline = &deadline;
+    }
+
+  return search_titles (conn, &proto, TRUE, partial);
+}
+
+/* Counts the matches of the queries in parallel and adds them up,
+ * returns -1 if any of them failed */
+static gint64
+count_queries (ShardQuery *queries, gint n)
+{
+  gint64 total = 0;
+  gint i;
+
+  for (i = 0; i < n; i++)
+      queries[i].count_only = TRUE;
+
+  run_queries (queries, n);
+
+  for (i = 0; i < n && total >= 0; i++)
+      total = (queries[i].count < 0) ? -1 : total + queries[i].count;
+
+  return total;
+}
+
+/* The number of titles db_conn_search would find without its limit.
+ * Much cheaper than the search itself, as the titles are neither read
+ * nor sorted. */
+gint64
+db_conn_count (DbConn *conn, const gchar *query)
+{
+  ShardQuery proto = { 0 };
+  ShardQuery *queries;
+  gint64 count;
+
+  if (!conn)
+      return -1;
+
+  proto.query = query;
+  queries = g_new0 (ShardQuery, conn->n_shards);
+  fill_queries (queries, conn, &proto);
+  count = count_queries (queries, conn->n_shards);
+  g_free (queries);
+
+  return count;
+}
+
+/* like db_conn_search, but the results are left ordered from the
+ * shortest (most relevant) title to the longest */
+GList *
+db_conn_suggest (DbConn *conn, const gchar *query, gint limit)
+{
+  ShardQuery proto = { 0 };
+
+  proto.query = query;
+  proto.limit = limit;
+
+  return search_titles (conn, &proto, FALSE, NULL);
+}
+
+/* Picks a shard with probability proportional to its number of
+ * articles. If that isn't known for all of them, shards are of
+ * roughly equal size, so picking one uniformly is close enough. */
+static DbShard *
+random_shard (DbConn *conn)
+{
+  gint64 total = 0;
+  gdouble r;
+  gint i;
+
+  for (i = 0; i < conn->n_shards; i++)
+    {
+      if (conn->shards[i].n_articles < 0)
+          return conn->shards + g_random_int_range (0, conn->n_shards);
+
+      total += conn->shards[i].n_articles;
+    }
+
+  r = g_random_double () * total;
+
+  for (i = 0; i < conn->n_shards - 1; i++)
+    {
+      r -= conn->shards[i].n_articles;
+      if (r < 0)
+          break;
+    }
+
+  return conn->shards + i;
+}
+
 gchar *
-db_fetch_random_title (void)
+db_conn_fetch_random_title (DbConn *conn)
 {
-  gint ret;
+  DbShard *shard;
   sqlite3_stmt *stmt;
   GList *li;
   gchar *title = NULL;
 
   DEBUG ("Picking random article");
 
-  ret = sqlite3_prepare_v2 (db_handle,
-      "SELECT title FROM articles WHERE id = " \
-          "(SELECT ABS(RANDOM()) % (SELECT MAX(id) FROM articles));",
-      -1, &stmt, NULL);
+  if (!conn)
+      return NULL;
 
-  if (ret != SQLITE_OK)
-    {
-      g_warning ("%s: error preparing SQL statement: %s",
-          G_STRFUNC, sqlite3_errmsg (db_handle));
+  shard = random_shard (conn);
+  if (shard->max_id < 1)
+      return NULL;
+
+  stmt = get_stmt (shard, STMT_RANDOM);
+
+  if (!stmt)
       return NULL;
-    }
 
-  li = get_results (stmt);
+  sqlite3_bind_int64 (stmt, 1,
+      1 + (gint64) (g_random_double () * shard->max_id));
+
+  li = get_results (shard->handle, stmt);
   if (li != NULL)
       title = li->data;
 
   g_list_free (li);
+  release_stmt (stmt);
   return title;
 }
 
+gboolean
+db_conn_get_stats (DbConn *conn, DbStats *stats)
+{
+  gint i;
+
+  if (!conn)
+      return FALSE;
+
+  memset (stats, 0, sizeof (DbStats));
+  stats->n_shards = conn->n_shards;
+  stats->format_version = DB_FORMAT_VERSION;
+
+  for (i = 0; i < conn->n_shards; i++)
+    {
+      DbShard *shard = conn->shards + i;
+      sqlite3 *handle = shard->handle;
+      gint64 n_articles, page_size, page_count, n_indexed;
+
+      /* counting takes a full scan, use the count in meta if there */
+      n_articles = shard->n_articles;
+
+      if ((n_articles < 0 && !get_int64 (handle,
+              "SELECT COUNT(*) FROM articles", &n_articles)) ||
+          !get_int64 (handle, "PRAGMA page_size", &page_size) ||
+          !get_int64 (handle, "PRAGMA page_count", &page_count))
+          return FALSE;
+
+      stats->n_articles += n_articles;
+      stats->max_id = MAX (stats->max_id, shard->max_id);
+      stats->format_version = MIN (stats->format_version,
+          shard->format_version);
+      stats->page_size = page_size;
+      stats->page_count += page_count;
+
+      /* the index is optional, databases that weren't post-processed
+       * with FTS3 enabled sqlite won't have it */
+      if (stats->n_indexed >= 0 && get_int64 (handle,
+              "SELECT COUNT(*) FROM article_index_content", &n_indexed))
+          stats->n_indexed += n_indexed;
+      else
+          stats->n_indexed = -1;
+    }
+
+  return TRUE;
+}
+
+/* For the tools that write databases: runs SQL, printing what failed
+ * if it does */
+gboolean
+db_exec_sql (sqlite3 *handle, const gchar *sql)
+{
+  gchar *errmsg = NULL;
+
+  if (sqlite3_exec (handle, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+      g_printerr ("Error executing '%s': %s\n", sql, errmsg);
+      sqlite3_free (errmsg);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Fills in the meta table for the articles just written, keeping
+ * whatever else the source database recorded there, and the tokenizer
+ * if the search index was made with another one (NULL if not) */
+gboolean
+db_write_meta (sqlite3 *handle, const gchar *tokenizer)
+{
+  gchar *sql;
+  gchar *index_sql;
+  gboolean ok;
+
+  index_sql = tokenizer ? g_strdup_printf (" UNION ALL " \
+      "SELECT 'index_tokenizer', '%s'", tokenizer) : g_strdup ("");
+  sql = g_strdup_printf ("INSERT OR REPLACE INTO meta (key, value) " \
+      "SELECT 'format_version', %d " \
+      "UNION ALL SELECT 'n_articles', COUNT(*) FROM articles " \
+      "UNION ALL SELECT 'max_id', IFNULL(MAX(id), 0) FROM articles " \
+      "UNION ALL SELECT 'index_segments', COUNT(*) " \
+          "FROM article_index_segdir%s", DB_FORMAT_VERSION, index_sql);
+
+  /* databases without meta all have zlib compressed articles
+   * and a plain FTS3 index */
+  ok = db_exec_sql (handle, "CREATE TABLE IF NOT EXISTS meta " \
+          "(key TEXT PRIMARY KEY, value TEXT)") &&
+      db_exec_sql (handle, "INSERT OR IGNORE INTO meta (key, value) " \
+          "SELECT 'codec', 'zlib' " \
+          "UNION ALL SELECT 'dictionary', 'none' " \
+          "UNION ALL SELECT 'index', 'fts3' " \
+          "UNION ALL SELECT 'index_tokenizer', 'simple'") &&
+      db_exec_sql (handle, sql);
+
+  g_free (index_sql);
+  g_free (sql);
+  return ok;
+}
+
+/* Waits for the db_count_async and db_search_async requests to finish,
+ * before the set of open databases changes under them */
+static void
+stop_background (void)
+{
+  if (background_pool)
+    {
+      g_thread_pool_free (background_pool, FALSE, TRUE);
+      background_pool = NULL;
+    }
+}
+
+static void
+edition_free (DbEdition *ed)
+{
+  db_conn_close (ed->conn);
+  g_free (ed->name);
+  g_free (ed->fname);
+  g_slice_free (DbEdition, ed);
+}
+
+void
+db_close (void)
+{
+  stop_background ();
+
+  if (editions != NULL)
+    {
+      g_ptr_array_foreach (editions, (GFunc) edition_free, NULL);
+      g_ptr_array_free (editions, TRUE);
+      editions = NULL;
+    }
+}
+
+/* en.db and en.shards are both "en" */
+static gchar *
+edition_name (const gchar *fname)
+{
+  gchar delim[] = { DB_EDITION_SEPARATOR, '\0' };
+  gchar *name = g_path_get_basename (fname);
+  gchar *dot = strrchr (name, '.');
+
+  if (dot && dot != name)
+      *dot = '\0';
+
+  return g_strdelimit (name, delim, '_');
+}
+
+/* Adds another database to the set searched by db_search, leaving the
+ * ones already open (and their caches) as they are */
+gboolean
+db_add (const gchar *fname)
+{
+  DbEdition *ed;
+  gchar *name = edition_name (fname);
+  guint i;
+
+  stop_background ();
+
+  if (!editions)
+      editions = g_ptr_array_new ();
+
+  for (i = 0; i < editions->len; i++)
+    {
+      ed = g_ptr_array_index (editions, i);
+
+      if (!strcmp (ed->name, name))
+        {
+          if (!strcmp (ed->fname, fname))
+            {
+              g_free (name);
+              return TRUE;
+            }
+
+          /* same edition from another file replaces the old one */
+          g_ptr_array_remove_index (editions, i);
+          edition_free (ed);
+          break;
+        }
+    }
+
+  ed = g_slice_new (DbEdition);
+  ed->conn = db_conn_open (fname, FALSE);
+
+  if (!ed->conn)
+    {
+      g_slice_free (DbEdition, ed);
+      g_free (name);
+      return FALSE;
+    }
+
+  ed->name = name;
+  ed->fname = g_strdup (fname);
+  g_ptr_array_add (editions, ed);
+
+  return TRUE;
+}
+
+gboolean
+db_open (const gchar *fname)
+{
+  db_close ();
+  return db_add (fname);
+}
+
+/* With more than one database open, titles are tagged with the
+ * edition they come from, as "en:Title". Finds the edition for
+ * the title and where the untagged title starts. */
+static DbEdition *
+find_edition (const gchar *title, const gchar **untagged)
+{
+  const gchar *sep;
+  guint i;
+
+  *untagged = title;
+
+  if (!editions || editions->len == 0)
+      return NULL;
+
+  if (editions->len == 1)
+      return g_ptr_array_index (editions, 0);
+
+  sep = strchr (title, DB_EDITION_SEPARATOR);
+  if (!sep)
+      return NULL;
+
+  for (i = 0; i < editions->len; i++)
+    {
+      DbEdition *ed = g_ptr_array_index (editions, i);
+
+      if (strlen (ed->name) == sep - title &&
+          !strncmp (ed->name, title, sep - title))
+        {
+          *untagged = sep + 1;
+          return ed;
+        }
+    }
+
+  return NULL;
+}
+
+static gchar *
+tag_title (DbEdition *ed, gchar *title)
+{
+  gchar *tagged;
+
+  if (editions->len == 1)
+      return title;
+
+  tagged = g_strdup_printf ("%s%c%s", ed->name, DB_EDITION_SEPARATOR, title);
+  g_free (title);
+
+  return tagged;
+}
+
+/* by title first, then by edition */
+static gint
+compare_tagged (const gchar *a, const gchar *b)
+{
+  gint ret = strcmp (strchr (a, DB_EDITION_SEPARATOR),
+      strchr (b, DB_EDITION_SEPARATOR));
+
+  return ret ? ret : strcmp (a, b);
+}
+
+gchar *
+db_fetch_article (const gchar *title)
+{
+  const gchar *untagged;
+  DbEdition *ed = find_edition (title, &untagged);
+
+  if (!ed)
+      return NULL;
+
+  return db_conn_fetch_article (ed->conn, untagged);
+}
+
+/* One query for each shard of each open database, as the prototype,
+ * the number of them in n */
+static ShardQuery *
+edition_queries (const ShardQuery *proto, gint *n)
+{
+  ShardQuery *queries;
+  guint i;
+
+  *n = 0;
+
+  for (i = 0; i < editions->len; i++)
+      *n += ((DbEdition *) g_ptr_array_index (editions, i))->conn->n_shards;
+
+  queries = g_new0 (ShardQuery, *n);
+
+  for (i = 0, *n = 0; i < editions->len; i++)
+    {
+      DbConn *conn = ((DbEdition *) g_ptr_array_index (editions, i))->conn;
+
+      fill_queries (queries + *n, conn, proto);
+      *n += conn->n_shards;
+    }
+
+  return queries;
+}
+
+/* Searches all the open databases at once: every shard of every
+ * edition gets its own query on the search pool, and the results
+ * are then merged per edition and tagged. */
+static GList *
+search_editions (const ShardQuery *proto, gboolean *partial)
+{
+  ShardQuery *queries;
+  GList *li = NULL;
+  gint n;
+  guint i;
+
+  if (partial)
+      *partial = FALSE;
+
+  if (!editions || editions->len == 0)
+      return NULL;
+
+  if (editions->len == 1)
+      return search_titles (((DbEdition *)
+          g_ptr_array_index (editions, 0))->conn, proto, TRUE, partial);
+
+  DEBUG ("Searching %d databases for: %s", editions->len, proto->query);
+
+  queries = edition_queries (proto, &n);
+  run_queries (queries, n);
+
+  for (i = 0, n = 0; i < editions->len; i++)
+    {
+      DbEdition *ed = g_ptr_array_index (editions, i);
+      GList *results, *r;
+      gint j;
+
+      for (j = 0; j < ed->conn->n_shards && partial; j++)
+          *partial = *partial || queries[n + j].partial;
+
+      results = merge_results (queries + n, ed->conn->n_shards,
+          proto->limit);
+      n += ed->conn->n_shards;
+
+      for (r = results; r; r = r->next)
+          r->data = tag_title (ed, r->data);
+
+      li = g_list_concat (results, li);
+    }
+
+  g_free (queries);
+
+  return g_list_sort (li, (GCompareFunc) compare_tagged);
+}
+
+GList *
+db_search (const gchar *query)
+{
+  return db_search_timed (query, 0, NULL);
+}
+
+/* Like db_search, but gives up after timeout milliseconds (if more
+ * than zero) with what was found so far, setting partial. That may be
+ * nothing at all, see get_best_results; db_search_async then gets the
+ * complete results without holding up the next db_search_timed. */
+GList *
+db_search_timed (const gchar *query, gint timeout, gboolean *partial)
+{
+  ShardQuery proto = { 0 };
+  GTimeVal deadline;
+
+  proto.query = query;
+  proto.limit = DB_MAX_RESULTS;
+
+  if (timeout > 0)
+    {
+      make_deadline (&deadline, timeout);
+      proto.deadline = &deadline;
+    }
+
+  return search_editions (&proto, partial);
+}
+
+static gint64
+count_editions (const ShardQuery *proto)
+{
+  ShardQuery *queries;
+  gint64 count;
+  gint n;
+
+  if (!editions || editions->len == 0)
+      return 0;
+
+  queries = edition_queries (proto, &n);
+  count = count_queries (queries, n);
+  g_free (queries);
+
+  return count;
+}
+
+/* The number of titles in all the open databases that match the query,
+ * -1 on error. Unlike db_search, this isn't limited to DB_MAX_RESULTS
+ * per database. */
+gint64
+db_count (const gchar *query)
+{
+  ShardQuery proto = { 0 };
+
+  proto.query = query;
+
+  return count_editions (&proto);
+}
+
+static gboolean
+background_done (BackgroundJob *job)
+{
+  if (job->search_cb)
+      job->search_cb (job->results, job->user_data);
+  else
+      job->count_cb (job->count, job->user_data);
+
+  g_free (job->query);
+  g_slice_free (BackgroundJob, job);
+  return FALSE;
+}
+
+static void
+run_background_job (BackgroundJob *job, gpointer user_data)
+{
+  ShardQuery proto = { 0 };
+
+  proto.query = job->query;
+  proto.background = TRUE;
+
+  if (job->search_cb)
+    {
+      proto.limit = DB_MAX_RESULTS;
+      job->results = search_editions (&proto, NULL);
+    }
+  else
+    {
+      job->count = count_editions (&proto);
+    }
+
+  g_idle_add ((GSourceFunc) background_done, job);
+}
+
+static gboolean
+queue_background_job (BackgroundJob *job)
+{
+  if (!background_pool)
+    {
+      GError *error = NULL;
+
+      background_pool = g_thread_pool_new ((GFunc) run_background_job, NULL,
+          1, FALSE, &error);
+
+      if (!background_pool)
+        {
+          g_warning ("%s: error creating background thread: %s",
+              G_STRFUNC, error->message);
+          g_error_free (error);
+          return FALSE;
+        }
+    }
 
+  g_thread_pool_push (background_pool, job, NULL);
+  return TRUE;
+}
+
+static BackgroundJob *
+background_job_new (const gchar *query, gpointer user_data)
+{
+  BackgroundJob *job = g_slice_new0 (BackgroundJob);
+
+  job->query = g_strdup (query);
+  job->count = -1;
+  job->user_data = user_data;
+
+  return job;
+}
+
+/* Counts in the background, like db_count. The callback gets the count
+ * from the main loop. To be called from the main loop thread only, as
+ * are db_open, db_add and db_close, which wait for the counts still
+ * running. */
+void
+db_count_async (const gchar *query, DbCountFunc callback, gpointer user_data)
+{
+  BackgroundJob *job = background_job_new (query, user_data);
+
+  job->count_cb = callback;
+
+  if (!queue_background_job (job))
+    {
+      g_free (job->query);
+      g_slice_free (BackgroundJob, job);
+      callback (-1, user_data);
+    }
+}
+
+/* Searches in the background, like db_search, for when db_search_timed
+ * ran out of time. The callback gets the results from the main loop and
+ * frees them. Same rules as for db_count_async apply. */
+void
+db_search_async (const gchar *query, DbSearchFunc callback,
+    gpointer user_data)
+{
+  BackgroundJob *job = background_job_new (query, user_data);
+
+  job->search_cb = callback;
+
+  if (!queue_background_job (job))
+    {
+      g_free (job->query);
+      g_slice_free (BackgroundJob, job);
+      callback (NULL, user_data);
+    }
+}
+
+gchar *
+db_fetch_random_title (void)
+{
+  DbEdition *ed;
+  gchar *title;
+
+  if (!editions || editions->len == 0)
+      return NULL;
+
+  ed = g_ptr_array_index (editions,
+      g_random_int_range (0, editions->len));
+  title = db_conn_fetch_random_title (ed->conn);
+
+  return title ? tag_title (ed, title) : NULL;
+}
@@ -4,11 +4,68 @@
 #include <glib.h>
 
 #define DEFAULT_DATABASE_FOLDER "/opt/mawire/data"
+#define DB_MAX_RESULTS 500
+#define DB_SHARDS_SUFFIX ".shards"
+
+/* version of the database layout, recorded in its meta table by the
+ * tools that write it; databases without one are version 0 */
+#define DB_FORMAT_VERSION 1
+
+/* separates the edition name from the title in db_search results when
+ * more than one database is open, as in "en:Title" */
+#define DB_EDITION_SEPARATOR ':'
+
+typedef struct _DbConn DbConn;
+typedef struct _DbBlob DbBlob;
+
+/* gets the result of db_count_async, -1 on error */
+typedef void (*DbCountFunc) (gint64 count, gpointer user_data);
+
+/* gets the results of db_search_async, to be freed by it */
+typedef void (*DbSearchFunc) (GList *results, gpointer user_data);
+
+typedef struct {
+    gint64 n_articles;
+    gint64 max_id;
+    gint64 n_indexed;
+    gint page_size;
+    gint64 page_count;
+    gint n_shards;
+    gint format_version;
+} DbStats;
+
+DbConn *db_conn_open (const gchar *fname, gboolean read_only);
+void db_conn_close (DbConn *conn);
+gchar *db_conn_fetch_article (DbConn *conn, const gchar *title);
+DbBlob *db_conn_open_article_blob (DbConn *conn, const gchar *title);
+gint db_blob_size (DbBlob *blob);
+gboolean db_blob_read (DbBlob *blob, gpointer buf, gint len, gint offset);
+void db_blob_close (DbBlob *blob);
+GList *db_conn_search (DbConn *conn, const gchar *query);
+GList *db_conn_search_timed (DbConn *conn, const gchar *query, gint timeout,
+    gboolean *partial);
+gint64 db_conn_count (DbConn *conn, const gchar *query);
+GList *db_conn_suggest (DbConn *conn, const gchar *query, gint limit);
+gchar *db_conn_fetch_random_title (DbConn *conn);
+gboolean db_conn_get_stats (DbConn *conn, DbStats *stats);
+guint db_shard_hash (const gchar *title);
+
+/* for the tools that write databases */
+struct sqlite3;
+gboolean db_exec_sql (struct sqlite3 *handle, const gchar *sql);
+gboolean db_write_meta (struct sqlite3 *handle, const gchar *tokenizer);
 
 void db_close (void);
 gboolean db_open (const gchar *fname);
+gboolean db_add (const gchar *fname);
 gchar *db_fetch_article (const gchar *title);
 GList *db_search (const gchar *query);
+GList *db_search_timed (const gchar *query, gint timeout, gboolean *partial);
+gint64 db_count (const gchar *query);
+void db_count_async (const gchar *query, DbCountFunc callback,
+    gpointer user_data);
+void db_search_async (const gchar *query, DbSearchFunc callback,
+    gpointer user_data);
 gchar *db_fetch_random_title (void);
 
 #endif
@@ -0,0 +1,342 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+static gchar *address = "127.0.0.1";
+static gint port = 8080;
+static gint n_connections = 4;
+static gint n_requests = 10000;
+static gboolean deflate = FALSE;
+
+static GOptionEntry entries[] = {
+  { "address", 'a', 0, G_OPTION_ARG_STRING, &address,
+    "Server address (default: 127.0.0.1)", "ADDR" },
+  { "port", 'p', 0, G_OPTION_ARG_INT, &port,
+    "Server port (default: 8080)", "PORT" },
+  { "connections", 'c', 0, G_OPTION_ARG_INT, &n_connections,
+    "Number of concurrent keep-alive connections (default: 4)", "N" },
+  { "requests", 'n', 0, G_OPTION_ARG_INT, &n_requests,
+    "Total number of requests to make (default: 10000)", "N" },
+  { "deflate", 'z', 0, G_OPTION_ARG_NONE, &deflate,
+    "Accept deflate encoded responses", NULL },
+  { NULL }
+};
+
+typedef struct {
+    GPtrArray *paths;
+    volatile gint next;
+    volatile gint n_errors;
+    gdouble *latencies;
+    gsize *sizes;
+} LoadJob;
+
+static gint
+connect_to_server (void)
+{
+  struct sockaddr_in sa;
+  gint one = 1;
+  gint fd;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  inet_aton (address, &sa.sin_addr);
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+      return -1;
+
+  if (connect (fd, (struct sockaddr *) &sa, sizeof (sa)) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  return fd;
+}
+
+static gboolean
+send_all (gint fd, const gchar *buf, gsize len)
+{
+  while (len > 0)
+    {
+      gssize n = send (fd, buf, len, MSG_NOSIGNAL);
+
+      if (n < 0 && errno == EINTR)
+          continue;
+
+      if (n <= 0)
+          return FALSE;
+
+      buf += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+/* Reads one complete response. Returns the HTTP status code, or -1 if
+ * the connection broke. Sets *keep_alive if the server is willing to
+ * take more requests on this connection. */
+static gint
+read_response (gint fd, GString *buf, gboolean *keep_alive)
+{
+  gchar tmp[8192];
+  gchar *end = NULL;
+  gchar *p;
+  gsize header_len;
+  gsize content_length = 0;
+  gint status;
+
+  g_string_truncate (buf, 0);
+
+  while (!end)
+    {
+      gssize n = recv (fd, tmp, sizeof (tmp), 0);
+
+      if (n < 0 && errno == EINTR)
+          continue;
+
+      if (n <= 0)
+          return -1;
+
+      g_string_append_len (buf, tmp, n);
+      end = strstr (buf->str, "\r\n\r\n");
+    }
+
+  header_len = end + 4 - buf->str;
+
+  if (sscanf (buf->str, "HTTP/1.%*d %d", &status) != 1)
+      return -1;
+
+  *keep_alive = TRUE;
+
+  for (p = strstr (buf->str, "\r\n"); p && p < end; p = strstr (p, "\r\n"))
+    {
+      p += 2;
+
+      if (!g_ascii_strncasecmp (p, "Content-Length:", 15))
+          content_length = strtoul (p + 15, NULL, 10);
+      else if (!g_ascii_strncasecmp (p, "Connection: close", 17))
+          *keep_alive = FALSE;
+    }
+
+  while (buf->len < header_len + content_length)
+    {
+      gssize n = recv (fd, tmp, sizeof (tmp), 0);
+
+      if (n < 0 && errno == EINTR)
+          continue;
+
+      if (n <= 0)
+          return -1;
+
+      g_string_append_len (buf, tmp, n);
+    }
+
+  return status;
+}
+
+static gpointer
+load_worker (LoadJob *job)
+{
+  GString *buf = g_string_sized_new (65536);
+  gint fd = -1;
+
+  for (;;)
+    {
+      gint i = g_atomic_int_exchange_and_add (&job->next, 1);
+      const gchar *path;
+      gchar *req;
+      GTimer *timer;
+      gboolean keep_alive = FALSE;
+      gint status = -1;
+
+      if (i >= n_requests)
+          break;
+
+      path = g_ptr_array_index (job->paths, i % job->paths->len);
+      req = g_strdup_printf ("GET %s HTTP/1.1\r\n" \
+          "Host: %s\r\n%s\r\n", path, address,
+          deflate ? "Accept-Encoding: deflate\r\n" : "");
+
+      timer = g_timer_new ();
+
+      if (fd < 0)
+          fd = connect_to_server ();
+
+      if (fd >= 0 && send_all (fd, req, strlen (req)))
+          status = read_response (fd, buf, &keep_alive);
+
+      job->latencies[i] = g_timer_elapsed (timer, NULL);
+      job->sizes[i] = (status > 0) ? buf->len : 0;
+      g_timer_destroy (timer);
+      g_free (req);
+
+      if (status < 200 || status >= 400)
+          g_atomic_int_add (&job->n_errors, 1);
+
+      if (!keep_alive && fd >= 0)
+        {
+          close (fd);
+          fd = -1;
+        }
+    }
+
+  if (fd >= 0)
+      close (fd);
+
+  g_string_free (buf, TRUE);
+  return NULL;
+}
+
+static gint
+compare_doubles (const gdouble *a, const gdouble *b)
+{
+  return (*a > *b) - (*a < *b);
+}
+
+static gdouble
+percentile (gdouble *sorted, gint n, gdouble pct)
+{
+  gint i = (gint) (n * pct / 100.0);
+
+  return sorted[CLAMP (i, 0, n - 1)] * 1000.0;
+}
+
+/* Lines starting with a slash are used as request paths, anything
+ * else is taken to be a search query. */
+static GPtrArray *
+read_paths (FILE *fp)
+{
+  GPtrArray *paths = g_ptr_array_new ();
+  GString *line = g_string_new (NULL);
+  gchar buf[4096];
+
+  while (fgets (buf, sizeof (buf), fp))
+    {
+      g_string_append (line, buf);
+
+      /* a line longer than the buffer comes in several pieces */
+      if (line->str[line->len - 1] != '\n' && !feof (fp))
+          continue;
+
+      g_strstrip (line->str);
+
+      if (*line->str == '/')
+        {
+          g_ptr_array_add (paths, g_strdup (line->str));
+        }
+      else if (*line->str != '\0')
+        {
+          gchar *q = g_uri_escape_string (line->str, NULL, FALSE);
+
+          g_ptr_array_add (paths, g_strdup_printf ("/search?q=%s", q));
+          g_free (q);
+        }
+
+      g_string_truncate (line, 0);
+    }
+
+  g_string_free (line, TRUE);
+  return paths;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *error = NULL;
+  GThread **threads;
+  GTimer *timer;
+  LoadJob job;
+  gdouble elapsed;
+  guint64 total = 0;
+  gint i;
+
+  if (!g_thread_supported ())
+      g_thread_init (NULL);
+
+  ctx = g_option_context_new ("< paths-or-queries - load test mawire-serve");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+
+  if (!g_option_context_parse (ctx, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  g_option_context_free (ctx);
+
+  job.paths = read_paths (stdin);
+  if (job.paths->len == 0 || n_requests < 1)
+    {
+      g_printerr ("Nothing to do, give request paths or queries on stdin\n");
+      return 1;
+    }
+
+  if (n_connections < 1)
+      n_connections = 1;
+
+  job.next = 0;
+  job.n_errors = 0;
+  job.latencies = g_new0 (gdouble, n_requests);
+  job.sizes = g_new0 (gsize, n_requests);
+
+  threads = g_new0 (GThread *, n_connections);
+  timer = g_timer_new ();
+
+  for (i = 0; i < n_connections; i++)
+    {
+      threads[i] = g_thread_create ((GThreadFunc) load_worker, &job,
+          TRUE, &error);
+
+      if (!threads[i])
+        {
+          g_printerr ("Error creating thread: %s\n", error->message);
+          g_error_free (error);
+          break;
+        }
+    }
+
+  while (i-- > 0)
+      g_thread_join (threads[i]);
+
+  elapsed = g_timer_elapsed (timer, NULL);
+
+  for (i = 0; i < n_requests; i++)
+      total += job.sizes[i];
+
+  qsort (job.latencies, n_requests, sizeof (gdouble),
+      (GCompareFunc) compare_doubles);
+
+  g_print ("requests=%d connections=%d errors=%d seconds=%.3f rps=%.1f " \
+      "p50=%.2fms p90=%.2fms p99=%.2fms max=%.2fms " \
+      "bytes=%" G_GUINT64_FORMAT "\n",
+      n_requests, n_connections, job.n_errors, elapsed,
+      (elapsed > 0) ? n_requests / elapsed : 0.0,
+      percentile (job.latencies, n_requests, 50),
+      percentile (job.latencies, n_requests, 90),
+      percentile (job.latencies, n_requests, 99),
+      job.latencies[n_requests - 1] * 1000.0, total);
+
+  g_timer_destroy (timer);
+  g_free (threads);
+  g_free (job.latencies);
+  g_free (job.sizes);
+  g_ptr_array_foreach (job.paths, (GFunc) g_free, NULL);
+  g_ptr_array_free (job.paths, TRUE);
+
+  return job.n_errors ? 2 : 0;
+}
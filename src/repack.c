@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <sqlite3.h>
+
+#include "db.h"
+
+static gint page_size = 4096;
+static gchar *order = NULL;
+static gint n_samples = 500;
+static gchar *tokenizer = NULL;
+
+static GOptionEntry entries[] = {
+  { "page-size", 'p', 0, G_OPTION_ARG_INT, &page_size,
+    "Page size of the new database (default: 4096)", "BYTES" },
+  { "order", 'o', 0, G_OPTION_ARG_STRING, &order,
+    "Order to store the articles in, 'id' or 'title' " \
+        "(default: id)", "ORDER" },
+  { "samples", 'n', 0, G_OPTION_ARG_INT, &n_samples,
+    "Number of article fetches to measure (default: 500)", "N" },
+  { "tokenizer", 't', 0, G_OPTION_ARG_STRING, &tokenizer,
+    "Tokenizer for the search index, 'simple', 'fold' or 'cjk' " \
+        "(default: as in the source)", "NAME" },
+  { NULL }
+};
+
+typedef struct {
+    gint page_size;
+    gint64 page_count;
+    gint64 overflow_pages;
+    gint64 n_segments;
+    gdouble reads_per_fetch;
+} RepackStats;
+
+/* A VFS that passes everything on to the default one, counting the
+ * reads. Used to see how many pages fetching an article takes. */
+typedef struct {
+    sqlite3_file base;
+    sqlite3_file *real;
+} CountFile;
+
+static sqlite3_vfs *parent_vfs;
+static sqlite3_vfs count_vfs;
+static gint64 n_reads;
+
+static int
+count_close (sqlite3_file *f)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xClose (cf->real);
+}
+
+static int
+count_read (sqlite3_file *f, void *buf, int amount, sqlite3_int64 offset)
+{
+  CountFile *cf = (CountFile *) f;
+
+  n_reads++;
+  return cf->real->pMethods->xRead (cf->real, buf, amount, offset);
+}
+
+static int
+count_write (sqlite3_file *f, const void *buf, int amount,
+    sqlite3_int64 offset)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xWrite (cf->real, buf, amount, offset);
+}
+
+static int
+count_truncate (sqlite3_file *f, sqlite3_int64 size)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xTruncate (cf->real, size);
+}
+
+static int
+count_sync (sqlite3_file *f, int flags)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xSync (cf->real, flags);
+}
+
+static int
+count_file_size (sqlite3_file *f, sqlite3_int64 *size)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xFileSize (cf->real, size);
+}
+
+static int
+count_lock (sqlite3_file *f, int lock)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xLock (cf->real, lock);
+}
+
+static int
+count_unlock (sqlite3_file *f, int lock)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xUnlock (cf->real, lock);
+}
+
+static int
+count_check_reserved_lock (sqlite3_file *f, int *out)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xCheckReservedLock (cf->real, out);
+}
+
+static int
+count_file_control (sqlite3_file *f, int op, void *arg)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xFileControl (cf->real, op, arg);
+}
+
+static int
+count_sector_size (sqlite3_file *f)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xSectorSize (cf->real);
+}
+
+static int
+count_device_characteristics (sqlite3_file *f)
+{
+  CountFile *cf = (CountFile *) f;
+
+  return cf->real->pMethods->xDeviceCharacteristics (cf->real);
+}
+
+static const sqlite3_io_methods count_io_methods = {
+  1,
+  count_close,
+  count_read,
+  count_write,
+  count_truncate,
+  count_sync,
+  count_file_size,
+  count_lock,
+  count_unlock,
+  count_check_reserved_lock,
+  count_file_control,
+  count_sector_size,
+  count_device_characteristics
+};
+
+static int
+count_open (sqlite3_vfs *vfs, const char *name, sqlite3_file *f,
+    int flags, int *out_flags)
+{
+  CountFile *cf = (CountFile *) f;
+  int rc;
+
+  /* the real file lives right after ours, see szOsFile */
+  cf->real = (sqlite3_file *) &cf[1];
+  rc = parent_vfs->xOpen (parent_vfs, name, cf->real, flags, out_flags);
+  cf->base.pMethods = (rc == SQLITE_OK) ? &count_io_methods : NULL;
+
+  return rc;
+}
+
+static void
+register_count_vfs (void)
+{
+  parent_vfs = sqlite3_vfs_find (NULL);
+
+  /* everything but opening files is done by the default VFS as is */
+  count_vfs = *parent_vfs;
+  count_vfs.pNext = NULL;
+  count_vfs.zName = "mawire-count";
+  count_vfs.szOsFile = sizeof (CountFile) + parent_vfs->szOsFile;
+  count_vfs.xOpen = count_open;
+
+  sqlite3_vfs_register (&count_vfs, 0);
+}
+
+static gint64
+get_int64 (sqlite3 *handle, const gchar *sql)
+{
+  sqlite3_stmt *stmt;
+  gint64 value = -1;
+
+  if (sqlite3_prepare_v2 (handle, sql, -1, &stmt, NULL) != SQLITE_OK)
+      return -1;
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+      value = sqlite3_column_int64 (stmt, 0);
+
+  sqlite3_finalize (stmt);
+  return value;
+}
+
+/* Number of overflow pages a row with a payload of the given size needs,
+ * following the table leaf cell layout in SQLite's btree.c */
+static gint64
+overflow_pages (gint64 payload, gint usable)
+{
+  gint64 max_local = usable - 35;
+  gint64 min_local = (usable - 12) * 32 / 255 - 23;
+  gint64 local;
+
+  if (payload <= max_local)
+      return 0;
+
+  local = min_local + (payload - min_local) % (usable - 4);
+  if (local > max_local)
+      local = min_local;
+
+  return (payload - local + usable - 5) / (usable - 4);
+}
+
+/* Picks the titles whose fetching is measured, so the same ones can be
+ * used on the database before and after repacking */
+static GPtrArray *
+pick_titles (const gchar *fname, gint n)
+{
+  GPtrArray *titles = g_ptr_array_new ();
+  sqlite3 *handle = NULL;
+  sqlite3_stmt *stmt;
+
+  if (sqlite3_open_v2 (fname, &handle, SQLITE_OPEN_READONLY,
+          NULL) == SQLITE_OK &&
+      sqlite3_prepare_v2 (handle,
+          "SELECT title FROM articles ORDER BY RANDOM() LIMIT ?",
+          -1, &stmt, NULL) == SQLITE_OK)
+    {
+      sqlite3_bind_int (stmt, 1, n);
+
+      while (sqlite3_step (stmt) == SQLITE_ROW)
+          g_ptr_array_add (titles,
+              g_strdup ((const gchar *) sqlite3_column_text (stmt, 0)));
+
+      sqlite3_finalize (stmt);
+    }
+
+  sqlite3_close (handle);
+  return titles;
+}
+
+static gboolean
+measure (const gchar *fname, GPtrArray *titles, RepackStats *stats)
+{
+  sqlite3 *handle = NULL;
+  sqlite3_stmt *stmt;
+  gint64 total = 0;
+  guint i;
+
+  if (sqlite3_open_v2 (fname, &handle, SQLITE_OPEN_READONLY,
+          "mawire-count") != SQLITE_OK)
+    {
+      g_printerr ("Error opening %s: %s\n", fname, sqlite3_errmsg (handle));
+      sqlite3_close (handle);
+      return FALSE;
+    }
+
+  stats->page_size = get_int64 (handle, "PRAGMA page_size");
+  stats->page_count = get_int64 (handle, "PRAGMA page_count");
+  stats->n_segments = get_int64 (handle,
+      "SELECT COUNT(*) FROM article_index_segdir");
+  stats->overflow_pages = 0;
+  stats->reads_per_fetch = 0;
+
+  /* the record is the title and text plus a few bytes of header
+   * and the other columns */
+  if (sqlite3_prepare_v2 (handle,
+          "SELECT LENGTH(title) + LENGTH(text) + 16 FROM articles",
+          -1, &stmt, NULL) == SQLITE_OK)
+    {
+      while (sqlite3_step (stmt) == SQLITE_ROW)
+          stats->overflow_pages += overflow_pages (
+              sqlite3_column_int64 (stmt, 0), stats->page_size);
+
+      sqlite3_finalize (stmt);
+    }
+
+  /* Fetch the articles the way mawire does, with a minimal page
+   * cache, so mostly only the root and upper index pages are cached
+   * between fetches. */
+  db_exec_sql (handle, "PRAGMA cache_size = 10");
+  db_exec_sql (handle, "BEGIN");
+
+  if (titles->len > 0 && sqlite3_prepare_v2 (handle,
+          "SELECT text FROM articles WHERE title = ?",
+          -1, &stmt, NULL) == SQLITE_OK)
+    {
+      for (i = 0; i < titles->len; i++)
+        {
+          gint64 start = n_reads;
+
+          sqlite3_bind_text (stmt, 1, g_ptr_array_index (titles, i), -1,
+              SQLITE_STATIC);
+
+          if (sqlite3_step (stmt) == SQLITE_ROW)
+              sqlite3_column_blob (stmt, 0);
+
+          sqlite3_reset (stmt);
+          total += n_reads - start;
+        }
+
+      sqlite3_finalize (stmt);
+      stats->reads_per_fetch = (gdouble) total / titles->len;
+    }
+
+  db_exec_sql (handle, "COMMIT");
+  sqlite3_close (handle);
+  return TRUE;
+}
+
+static gchar *
+get_columns (sqlite3 *handle)
+{
+  GString *cols = g_string_new (NULL);
+  sqlite3_stmt *stmt;
+
+  if (sqlite3_prepare_v2 (handle, "PRAGMA src.table_info(articles)",
+          -1, &stmt, NULL) != SQLITE_OK)
+      return g_string_free (cols, TRUE);
+
+  while (sqlite3_step (stmt) == SQLITE_ROW)
+    {
+      const gchar *name = (const gchar *) sqlite3_column_text (stmt, 1);
+
+      if (!strcmp (name, "id"))
+          continue;
+
+      if (cols->len > 0)
+          g_string_append (cols, ", ");
+      g_string_append_printf (cols, "\"%s\"", name);
+    }
+
+  sqlite3_finalize (stmt);
+  return g_string_free (cols, FALSE);
+}
+
+/* Runs each row of the query as an SQL statement */
+static gboolean
+exec_each (sqlite3 *handle, const gchar *sql)
+{
+  sqlite3_stmt *stmt;
+  gboolean ok;
+
+  ok = (sqlite3_prepare_v2 (handle, sql, -1, &stmt, NULL) == SQLITE_OK);
+
+  while (ok && sqlite3_step (stmt) == SQLITE_ROW)
+      ok = db_exec_sql (handle,
+          (const gchar *) sqlite3_column_text (stmt, 0));
+
+  sqlite3_finalize (stmt);
+  return ok;
+}
+
+/* Writes a new copy of the database. The articles go in first, in the
+ * chosen order, then the indexes and the search index (rebuilt as one
+ * segment), so each of them ends up in consecutive pages. */
+static gboolean
+repack (const gchar *src_fname, const gchar *fname, gboolean by_title)
+{
+  sqlite3 *handle = NULL;
+  gchar *sql;
+  gchar *index_sql;
+  gchar *cols = NULL;
+  gboolean ok = FALSE;
+
+  if (sqlite3_open (fname, &handle) != SQLITE_OK)
+    {
+      g_printerr ("Error opening %s: %s\n", fname, sqlite3_errmsg (handle));
+      goto out;
+    }
+
+  sql = g_strdup_printf ("PRAGMA page_size = %d", page_size);
+  ok = db_exec_sql (handle, sql);
+  g_free (sql);
+
+  sql = sqlite3_mprintf ("ATTACH DATABASE %Q AS src", src_fname);
+  ok = ok && db_exec_sql (handle, sql);
+  sqlite3_free (sql);
+
+  if (!ok || !db_exec_sql (handle, "PRAGMA synchronous = OFF") ||
+      !db_exec_sql (handle, "BEGIN"))
+      goto out;
+
+  /* The articles table, and any other plain tables that were in the
+   * source. The search index is made from scratch and a leftover import
+   * checkpoint isn't of any use in the copy. */
+  ok = exec_each (handle,
+      "SELECT sql FROM src.sqlite_master WHERE type = 'table' " \
+          "AND name != 'import_checkpoint' " \
+          "AND name NOT LIKE 'article_index%' " \
+          "AND name NOT LIKE 'sqlite_%'") &&
+      exec_each (handle,
+          "SELECT 'INSERT INTO main.\"' || name || '\" " \
+              "SELECT * FROM src.\"' || name || '\"' " \
+          "FROM src.sqlite_master WHERE type = 'table' " \
+          "AND name NOT IN ('articles', 'import_checkpoint') " \
+          "AND name NOT LIKE 'article_index%' " \
+          "AND name NOT LIKE 'sqlite_%'");
+
+  if (!ok)
+      goto out;
+
+  if (by_title)
+    {
+      /* renumbered, so neighbouring titles are neighbours on disk too */
+      cols = get_columns (handle);
+      sql = g_strdup_printf ("INSERT INTO articles (%s) " \
+          "SELECT %s FROM src.articles ORDER BY title", cols, cols);
+    }
+  else
+    {
+      sql = g_strdup ("INSERT INTO articles " \
+          "SELECT * FROM src.articles ORDER BY id");
+    }
+
+  /* the search index is made as in the source, unless asked for
+   * another tokenizer */
+  if (tokenizer)
+      index_sql = g_strdup_printf ("SELECT 'CREATE VIRTUAL TABLE " \
+          "article_index USING fts3(tokenize=%s)'", tokenizer);
+  else
+      index_sql = g_strdup ("SELECT sql FROM src.sqlite_master " \
+          "WHERE type = 'table' AND name = 'article_index'");
+
+  ok = db_exec_sql (handle, sql) &&
+      exec_each (handle,
+          "SELECT sql FROM src.sqlite_master WHERE type = 'index' " \
+              "AND sql NOT NULL AND tbl_name != 'import_checkpoint' " \
+              "AND tbl_name NOT LIKE 'article_index%'") &&
+      exec_each (handle, index_sql) &&
+      db_exec_sql (handle, "INSERT INTO article_index_content " \
+          "(docid, c0content) SELECT id, title FROM articles") &&
+      db_exec_sql (handle, "INSERT INTO article_index (article_index) " \
+          "VALUES ('rebuild')") &&
+      db_exec_sql (handle, "INSERT INTO article_index (article_index) " \
+          "VALUES ('termstats')") &&
+      db_exec_sql (handle, "INSERT INTO article_index (article_index) " \
+          "VALUES ('prefixes')") &&
+      db_write_meta (handle, tokenizer) &&
+      db_exec_sql (handle, "COMMIT") &&
+      db_exec_sql (handle, "DETACH DATABASE src") &&
+      db_exec_sql (handle, "ANALYZE");
+  g_free (index_sql);
+  g_free (sql);
+
+out:
+  g_free (cols);
+  sqlite3_close (handle);
+  return ok;
+}
+
+static void
+print_stats (RepackStats *before, RepackStats *after)
+{
+  g_print ("%-28s %12s %12s\n", "", "before", "after");
+  g_print ("%-28s %12d %12d\n", "page size",
+      before->page_size, after->page_size);
+  g_print ("%-28s %12" G_GINT64_FORMAT " %12" G_GINT64_FORMAT "\n",
+      "pages", before->page_count, after->page_count);
+  g_print ("%-28s %12.1f %12.1f\n", "size (MB)",
+      before->page_size * before->page_count / 1048576.0,
+      after->page_size * after->page_count / 1048576.0);
+  g_print ("%-28s %12" G_GINT64_FORMAT " %12" G_GINT64_FORMAT "\n",
+      "overflow pages (estimated)",
+      before->overflow_pages, after->overflow_pages);
+  g_print ("%-28s %12" G_GINT64_FORMAT " %12" G_GINT64_FORMAT "\n",
+      "search index segments", before->n_segments, after->n_segments);
+  g_print ("%-28s %12.2f %12.2f\n", "pages read per fetch",
+      before->reads_per_fetch, after->reads_per_fetch);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *error = NULL;
+  RepackStats before, after;
+  GPtrArray *titles;
+  gint ret = 0;
+
+  ctx = g_option_context_new ("SOURCE.db OUTPUT.db - rewrite a database " \
+      "for fewer reads per article");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+
+  if (!g_option_context_parse (ctx, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  g_option_context_free (ctx);
+
+  if (argc != 3)
+    {
+      g_printerr ("Usage: %s [-p BYTES] [-o id|title] [-n N] " \
+          "[-t simple|fold|cjk] SOURCE.db OUTPUT.db\n", argv[0]);
+      return 1;
+    }
+
+  /* what SQLite accepts, anything else is silently ignored */
+  if (page_size < 512 || page_size > 32768 ||
+      (page_size & (page_size - 1)) != 0)
+    {
+      g_printerr ("Page size must be a power of two " \
+          "between 512 and 32768\n");
+      return 1;
+    }
+
+  if (order && strcmp (order, "id") && strcmp (order, "title"))
+    {
+      g_printerr ("Unknown order: %s\n", order);
+      return 1;
+    }
+
+  if (tokenizer && strcmp (tokenizer, "simple") &&
+      strcmp (tokenizer, "fold") && strcmp (tokenizer, "cjk"))
+    {
+      g_printerr ("Unknown tokenizer: %s\n", tokenizer);
+      return 1;
+    }
+
+  if (g_file_test (argv[2], G_FILE_TEST_EXISTS))
+    {
+      g_printerr ("Refusing to overwrite %s\n", argv[2]);
+      return 1;
+    }
+
+  register_count_vfs ();
+  titles = pick_titles (argv[1], n_samples);
+
+  if (!measure (argv[1], titles, &before))
+      ret = 1;
+  else if (!repack (argv[1], argv[2], order && !strcmp (order, "title")))
+      ret = 1;
+  else if (!measure (argv[2], titles, &after))
+      ret = 1;
+  else
+      print_stats (&before, &after);
+
+  g_ptr_array_foreach (titles, (GFunc) g_free, NULL);
+  g_ptr_array_free (titles, TRUE);
+
+  return ret;
+}
@@ -0,0 +1,899 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "util.h"
+#include "db.h"
+
+#define MAX_EVENTS 64
+#define MAX_REQUEST_SIZE 16384
+#define SUGGEST_LIMIT 10
+
+/* how much of an article blob is buffered for sending at a time */
+#define BLOB_CHUNK_SIZE 65536
+
+#define TEXT_HEADERS "Content-Type: text/plain; charset=utf-8\r\n"
+#define ARTICLE_HEADERS TEXT_HEADERS "Vary: Accept-Encoding\r\n"
+
+/* A reader thread's database connection. Articles are streamed from
+ * blobs opened on it, and the next chunk can be read by any reader
+ * thread, so the connection is locked while it's being used. */
+typedef struct {
+    DbConn *conn;
+    GMutex *lock;
+} Reader;
+
+typedef struct {
+    gint fd;
+    guint32 events;
+
+    GString *in;
+    GString *out;
+    gsize out_pos;
+
+    /* current request, only touched by the worker while it's
+     * being processed */
+    gchar *path;
+    gchar *query;
+    gboolean keep_alive;
+    gboolean accept_deflate;
+    gboolean close_after_write;
+
+    /* the article being streamed, if any, and where the next chunk
+     * starts; blob_reader is the reader that opened it */
+    DbBlob *blob;
+    gint blob_pos;
+    Reader *blob_reader;
+} Client;
+
+static gchar *db_fname = NULL;
+static gchar *address = "127.0.0.1";
+static gint port = 8080;
+static gint n_threads = 4;
+
+static GOptionEntry entries[] = {
+  { "database", 'd', 0, G_OPTION_ARG_FILENAME, &db_fname,
+    "Database file to serve", "FILE" },
+  { "address", 'a', 0, G_OPTION_ARG_STRING, &address,
+    "Address to listen on (default: 127.0.0.1)", "ADDR" },
+  { "port", 'p', 0, G_OPTION_ARG_INT, &port,
+    "Port to listen on (default: 8080)", "PORT" },
+  { "threads", 'j', 0, G_OPTION_ARG_INT, &n_threads,
+    "Number of database reader threads (default: 4)", "N" },
+  { NULL }
+};
+
+static gint epoll_fd = -1;
+static gint wake_fds[2] = { -1, -1 };
+static GAsyncQueue *done_queue = NULL;
+static GPrivate *thread_reader = NULL;
+static GThreadPool *pool = NULL;
+static volatile sig_atomic_t quit = 0;
+
+/* epoll user data for the two non-client descriptors */
+static gint listen_tag;
+static gint wake_tag;
+
+static void
+set_nonblocking (gint fd)
+{
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void
+client_watch (Client *client, guint32 events)
+{
+  struct epoll_event ev;
+  gint op;
+
+  if (client->events == events)
+      return;
+
+  if (events == 0)
+      op = EPOLL_CTL_DEL;
+  else if (client->events == 0)
+      op = EPOLL_CTL_ADD;
+  else
+      op = EPOLL_CTL_MOD;
+
+  ev.events = events;
+  ev.data.ptr = client;
+
+  if (epoll_ctl (epoll_fd, op, client->fd, &ev) < 0)
+      g_warning ("%s: epoll_ctl failed: %s", G_STRFUNC, g_strerror (errno));
+
+  client->events = events;
+}
+
+static Client *
+client_new (gint fd)
+{
+  Client *client = g_slice_new0 (Client);
+
+  client->fd = fd;
+  client->in = g_string_sized_new (1024);
+  client->out = g_string_sized_new (4096);
+
+  return client;
+}
+
+static void
+client_destroy (Client *client)
+{
+  g_string_free (client->in, TRUE);
+  g_string_free (client->out, TRUE);
+  g_free (client->path);
+  g_free (client->query);
+  g_slice_free (Client, client);
+}
+
+static void
+client_free (Client *client)
+{
+  client_watch (client, 0);
+  close (client->fd);
+  client->fd = -1;
+
+  /* a blob that's still open is closed by a reader thread, which
+   * frees the client after it */
+  if (client->blob)
+      g_thread_pool_push (pool, client, NULL);
+  else
+      client_destroy (client);
+}
+
+/* Returns the value of the query string parameter, decoded, or NULL */
+static gchar *
+get_param (const gchar *query, const gchar *name)
+{
+  gchar **params;
+  gchar *value = NULL;
+  gint i;
+
+  if (!query)
+      return NULL;
+
+  params = g_strsplit (query, "&", -1);
+
+  for (i = 0; params[i] && !value; i++)
+    {
+      gchar *eq = strchr (params[i], '=');
+
+      if (!eq || strncmp (params[i], name, eq - params[i]) ||
+          strlen (name) != (gsize) (eq - params[i]))
+          continue;
+
+      g_strdelimit (eq + 1, "+", ' ');
+      value = g_uri_unescape_string (eq + 1, NULL);
+    }
+
+  g_strfreev (params);
+  return value;
+}
+
+static void
+respond_headers (Client *client, const gchar *status, const gchar *headers,
+    gsize len)
+{
+  g_string_append_printf (client->out,
+      "HTTP/1.1 %s\r\n"
+      "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+      "Connection: %s\r\n"
+      "%s"
+      "\r\n", status, len,
+      client->keep_alive ? "keep-alive" : "close",
+      headers ? headers : "");
+}
+
+static void
+respond (Client *client, const gchar *status, const gchar *headers,
+    const gchar *body, gsize len)
+{
+  respond_headers (client, status, headers, len);
+  g_string_append_len (client->out, body, len);
+}
+
+static void
+respond_text (Client *client, const gchar *status, const gchar *text)
+{
+  respond (client, status, TEXT_HEADERS, text, strlen (text));
+}
+
+/* Appends the next chunk of the article blob to the output buffer,
+ * closing the blob after the last one. The blob's reader must be
+ * locked. */
+static gboolean
+read_blob_chunk (Client *client)
+{
+  gsize pos = client->out->len;
+  gint len = MIN (db_blob_size (client->blob) - client->blob_pos,
+      BLOB_CHUNK_SIZE);
+  gboolean ok;
+
+  g_string_set_size (client->out, pos + len);
+  ok = db_blob_read (client->blob, client->out->str + pos, len,
+      client->blob_pos);
+
+  if (ok)
+      client->blob_pos += len;
+  else
+      g_string_truncate (client->out, pos);
+
+  if (!ok || client->blob_pos == db_blob_size (client->blob))
+    {
+      db_blob_close (client->blob);
+      client->blob = NULL;
+      client->blob_reader = NULL;
+    }
+
+  return ok;
+}
+
+/* The stored article text is already zlib (RFC 1950) data, which is
+ * exactly what HTTP calls "deflate", so it's sent straight from the
+ * database without being decompressed, a chunk at a time as the
+ * client takes it. The client owns the blob after this succeeds. */
+static gboolean
+respond_blob (Client *client, Reader *reader, DbBlob *blob)
+{
+  gsize start = client->out->len;
+
+  respond_headers (client, "200 OK",
+      ARTICLE_HEADERS "Content-Encoding: deflate\r\n",
+      db_blob_size (blob));
+
+  client->blob = blob;
+  client->blob_pos = 0;
+  client->blob_reader = reader;
+
+  if (!read_blob_chunk (client))
+    {
+      /* read_blob_chunk closed it */
+      g_string_truncate (client->out, start);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+respond_list (Client *client, GList *li)
+{
+  GString *body = g_string_sized_new (4096);
+
+  for (; li; li = li->next)
+    {
+      g_string_append (body, li->data);
+      g_string_append_c (body, '\n');
+    }
+
+  respond (client, "200 OK", TEXT_HEADERS, body->str, body->len);
+
+  g_string_free (body, TRUE);
+}
+
+static void
+reader_free (Reader *reader)
+{
+  db_conn_close (reader->conn);
+  g_mutex_free (reader->lock);
+  g_slice_free (Reader, reader);
+}
+
+static Reader *
+get_thread_reader (void)
+{
+  Reader *reader = g_private_get (thread_reader);
+
+  if (!reader)
+    {
+      reader = g_slice_new0 (Reader);
+      reader->lock = g_mutex_new ();
+      g_private_set (thread_reader, reader);
+    }
+
+  if (!reader->conn)
+      reader->conn = db_conn_open (db_fname, TRUE);
+
+  return reader;
+}
+
+static void
+handle_search (Client *client, DbConn *conn, gboolean suggest)
+{
+  gchar *q = get_param (client->query, "q");
+  GList *li;
+
+  if (!q)
+    {
+      respond_text (client, "400 Bad Request", "Missing query\n");
+      return;
+    }
+
+  if (suggest)
+      li = db_conn_suggest (conn, q, SUGGEST_LIMIT);
+  else
+      li = db_conn_search (conn, q);
+
+  respond_list (client, li);
+
+  g_list_foreach (li, (GFunc) g_free, NULL);
+  g_list_free (li);
+  g_free (q);
+}
+
+static void
+handle_article (Client *client, Reader *reader, const gchar *escaped)
+{
+  DbConn *conn = reader->conn;
+  gchar *title = g_uri_unescape_string (escaped, NULL);
+  gchar *text = NULL;
+
+  if (title && client->accept_deflate)
+    {
+      DbBlob *blob = db_conn_open_article_blob (conn, title);
+
+      if (blob && respond_blob (client, reader, blob))
+        {
+          g_free (title);
+          return;
+        }
+    }
+
+  /* only clients that can't take deflate pay for decompression */
+  if (title)
+      text = db_conn_fetch_article (conn, title);
+
+  if (text)
+      respond (client, "200 OK", ARTICLE_HEADERS, text, strlen (text));
+  else
+      respond_text (client, "404 Not Found", "No such article\n");
+
+  g_free (title);
+  g_free (text);
+}
+
+static void
+handle_random (Client *client, DbConn *conn)
+{
+  gchar *title = db_conn_fetch_random_title (conn);
+  gchar *escaped;
+  gchar *location;
+
+  if (!title)
+    {
+      respond_text (client, "404 Not Found", "No articles\n");
+      return;
+    }
+
+  escaped = g_uri_escape_string (title, NULL, FALSE);
+  location = g_strdup_printf ("Location: /article/%s\r\n", escaped);
+
+  respond (client, "302 Found", location, "", 0);
+
+  g_free (location);
+  g_free (escaped);
+  g_free (title);
+}
+
+/* Hands the client back to the main loop */
+static void
+request_done (Client *client)
+{
+  g_async_queue_push (done_queue, client);
+
+  /* wake up the main loop, it'll pick the client up from the queue */
+  if (write (wake_fds[1], "x", 1) < 0 && errno != EAGAIN)
+      g_warning ("%s: error waking up main loop: %s",
+          G_STRFUNC, g_strerror (errno));
+}
+
+/* Reads the next chunk of the article being streamed, or closes the
+ * blob of a client that's gone, on the connection it was opened on */
+static void
+handle_blob (Client *client)
+{
+  GMutex *lock = client->blob_reader->lock;
+
+  g_mutex_lock (lock);
+
+  if (client->fd < 0)
+    {
+      db_blob_close (client->blob);
+      client->blob = NULL;
+    }
+  else if (!read_blob_chunk (client))
+    {
+      /* the headers are out already, all we can do is hang up */
+      client->keep_alive = FALSE;
+      client->close_after_write = TRUE;
+    }
+
+  g_mutex_unlock (lock);
+
+  if (client->fd < 0)
+      client_destroy (client);
+  else
+      request_done (client);
+}
+
+/* Runs in one of the reader threads. The client is not watched by
+ * the main loop while we're here, so we own it exclusively. */
+static void
+handle_request (Client *client, gpointer user_data)
+{
+  Reader *reader;
+  DbConn *conn;
+
+  if (client->blob)
+    {
+      handle_blob (client);
+      return;
+    }
+
+  reader = get_thread_reader ();
+  conn = reader->conn;
+  g_mutex_lock (reader->lock);
+
+  DEBUG ("Request: %s%s%s", client->path,
+      client->query ? "?" : "", client->query ? client->query : "");
+
+  if (!conn)
+      respond_text (client, "503 Service Unavailable",
+          "Database not available\n");
+  else if (!strcmp (client->path, "/search"))
+      handle_search (client, conn, FALSE);
+  else if (!strcmp (client->path, "/suggest"))
+      handle_search (client, conn, TRUE);
+  else if (g_str_has_prefix (client->path, "/article/"))
+      handle_article (client, reader, client->path + strlen ("/article/"));
+  else if (!strcmp (client->path, "/random"))
+      handle_random (client, conn);
+  else
+      respond_text (client, "404 Not Found", "Not found\n");
+
+  g_mutex_unlock (reader->lock);
+  request_done (client);
+}
+
+/* Checks whether an Accept-Encoding header value allows deflate */
+static gboolean
+accepts_deflate (const gchar *value)
+{
+  gchar **codings = g_strsplit (value, ",", -1);
+  gboolean ok = FALSE;
+  gint i;
+
+  for (i = 0; codings[i] && !ok; i++)
+    {
+      gchar *params = strchr (codings[i], ';');
+      gchar *q;
+
+      if (params)
+          *params++ = '\0';
+
+      if (g_ascii_strcasecmp (g_strstrip (codings[i]), "deflate"))
+          continue;
+
+      /* "deflate;q=0" explicitly refuses it */
+      q = params ? strstr (params, "q=") : NULL;
+      ok = !q || g_ascii_strtod (q + 2, NULL) > 0;
+    }
+
+  g_strfreev (codings);
+  return ok;
+}
+
+/* Parses a complete request from the input buffer, if there is one.
+ * Returns FALSE if more data is needed. */
+static gboolean
+parse_request (Client *client)
+{
+  gchar *end = strstr (client->in->str, "\r\n\r\n");
+  gchar **lines;
+  gchar **req;
+  gchar *target;
+  gchar *q;
+  gint i;
+
+  if (!end)
+      return FALSE;
+
+  *end = '\0';
+  lines = g_strsplit (client->in->str, "\r\n", -1);
+  g_string_erase (client->in, 0, end + 4 - client->in->str);
+
+  g_free (client->path);
+  g_free (client->query);
+  client->path = NULL;
+  client->query = NULL;
+
+  req = g_strsplit (lines[0], " ", 3);
+
+  if (g_strv_length (req) != 3 || strcmp (req[0], "GET") ||
+      !g_str_has_prefix (req[2], "HTTP/1."))
+    {
+      /* we can't know where the next request would start */
+      client->keep_alive = FALSE;
+      client->close_after_write = TRUE;
+      g_strfreev (req);
+      g_strfreev (lines);
+      return TRUE;
+    }
+
+  /* HTTP/1.1 defaults to keep-alive, 1.0 to close */
+  client->keep_alive = strcmp (req[2], "HTTP/1.0") != 0;
+  client->accept_deflate = FALSE;
+
+  for (i = 1; lines[i]; i++)
+    {
+      gchar *colon = strchr (lines[i], ':');
+
+      if (!colon)
+          continue;
+
+      *colon = '\0';
+      if (!g_ascii_strcasecmp (lines[i], "Connection"))
+        {
+          gchar *value = g_strstrip (colon + 1);
+
+          if (!g_ascii_strcasecmp (value, "close"))
+              client->keep_alive = FALSE;
+          else if (!g_ascii_strcasecmp (value, "keep-alive"))
+              client->keep_alive = TRUE;
+        }
+      else if (!g_ascii_strcasecmp (lines[i], "Accept-Encoding"))
+        {
+          client->accept_deflate = accepts_deflate (colon + 1);
+        }
+    }
+
+  target = req[1];
+  q = strchr (target, '?');
+  if (q)
+    {
+      *q = '\0';
+      client->query = g_strdup (q + 1);
+    }
+
+  client->path = g_strdup (target);
+  client->close_after_write = !client->keep_alive;
+
+  g_strfreev (req);
+  g_strfreev (lines);
+  return TRUE;
+}
+
+static void client_write (Client *client);
+
+/* Hands the next buffered request to the reader pool, or goes back
+ * to waiting for more input. */
+static void
+client_dispatch (Client *client)
+{
+  if (!parse_request (client))
+    {
+      if (client->in->len > MAX_REQUEST_SIZE)
+        {
+          client->keep_alive = FALSE;
+          client->close_after_write = TRUE;
+          respond_text (client, "413 Request Entity Too Large",
+              "Request too large\n");
+          client_write (client);
+          return;
+        }
+
+      client_watch (client, EPOLLIN);
+      return;
+    }
+
+  if (!client->path)
+    {
+      respond_text (client, "400 Bad Request", "Bad request\n");
+      client_write (client);
+      return;
+    }
+
+  client_watch (client, 0);
+  g_thread_pool_push (pool, client, NULL);
+}
+
+static void
+client_write (Client *client)
+{
+  while (client->out_pos < client->out->len)
+    {
+      gssize n = send (client->fd, client->out->str + client->out_pos,
+          client->out->len - client->out_pos, MSG_NOSIGNAL);
+
+      if (n < 0)
+        {
+          if (errno == EINTR)
+              continue;
+
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+              client_watch (client, EPOLLOUT);
+              return;
+            }
+
+          client_free (client);
+          return;
+        }
+
+      client->out_pos += n;
+    }
+
+  g_string_truncate (client->out, 0);
+  client->out_pos = 0;
+
+  /* more of the article to come, a reader thread fetches it */
+  if (client->blob)
+    {
+      client_watch (client, 0);
+      g_thread_pool_push (pool, client, NULL);
+      return;
+    }
+
+  if (client->close_after_write)
+    {
+      client_free (client);
+      return;
+    }
+
+  /* the client may have pipelined the next request already */
+  client_dispatch (client);
+}
+
+static void
+client_read (Client *client)
+{
+  gchar buf[4096];
+
+  for (;;)
+    {
+      gssize n = recv (client->fd, buf, sizeof (buf), 0);
+
+      if (n > 0)
+        {
+          g_string_append_len (client->in, buf, n);
+          continue;
+        }
+
+      if (n < 0 && errno == EINTR)
+          continue;
+
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          break;
+
+      /* orderly shutdown or error */
+      client_free (client);
+      return;
+    }
+
+  client_dispatch (client);
+}
+
+static void
+accept_clients (gint listen_fd)
+{
+  for (;;)
+    {
+      gint one = 1;
+      gint fd = accept (listen_fd, NULL, NULL);
+
+      if (fd < 0)
+        {
+          if (errno == EINTR)
+              continue;
+
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+              g_warning ("%s: accept failed: %s",
+                  G_STRFUNC, g_strerror (errno));
+          return;
+        }
+
+      set_nonblocking (fd);
+      setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+      client_watch (client_new (fd), EPOLLIN);
+    }
+}
+
+static void
+finish_requests (void)
+{
+  gchar buf[256];
+  Client *client;
+
+  while (read (wake_fds[0], buf, sizeof (buf)) > 0);
+
+  while ((client = g_async_queue_try_pop (done_queue)) != NULL)
+      client_write (client);
+}
+
+static gint
+listen_on (const gchar *addr, gint port)
+{
+  struct sockaddr_in sa;
+  gint one = 1;
+  gint fd;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+
+  if (!inet_aton (addr, &sa.sin_addr))
+    {
+      g_printerr ("Invalid address: %s\n", addr);
+      return -1;
+    }
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      g_printerr ("Error creating socket: %s\n", g_strerror (errno));
+      return -1;
+    }
+
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  if (bind (fd, (struct sockaddr *) &sa, sizeof (sa)) < 0 ||
+      listen (fd, SOMAXCONN) < 0)
+    {
+      g_printerr ("Error listening on %s:%d: %s\n",
+          addr, port, g_strerror (errno));
+      close (fd);
+      return -1;
+    }
+
+  set_nonblocking (fd);
+  return fd;
+}
+
+static void
+quit_cb (int signum)
+{
+  quit = 1;
+}
+
+static gboolean
+add_watch (gint fd, gpointer tag)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = tag;
+
+  return epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *error = NULL;
+  struct epoll_event events[MAX_EVENTS];
+  DbConn *conn;
+  gint listen_fd;
+
+  if (!g_thread_supported ())
+      g_thread_init (NULL);
+
+  ctx = g_option_context_new ("- serve a Mawire database over HTTP");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+
+  if (!g_option_context_parse (ctx, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  g_option_context_free (ctx);
+
+  if (!db_fname)
+    {
+      g_printerr ("Usage: %s -d <database.db> [-a address] [-p port] " \
+          "[-j threads]\n", argv[0]);
+      return 1;
+    }
+
+  /* fail early if the database can't be opened at all */
+  conn = db_conn_open (db_fname, TRUE);
+  if (!conn)
+      return 1;
+  db_conn_close (conn);
+
+  listen_fd = listen_on (address, port);
+  if (listen_fd < 0)
+      return 1;
+
+  if (pipe (wake_fds) < 0)
+    {
+      g_printerr ("Error creating pipe: %s\n", g_strerror (errno));
+      return 1;
+    }
+
+  set_nonblocking (wake_fds[0]);
+  set_nonblocking (wake_fds[1]);
+
+  epoll_fd = epoll_create (MAX_EVENTS);
+  if (epoll_fd < 0 || !add_watch (listen_fd, &listen_tag) ||
+      !add_watch (wake_fds[0], &wake_tag))
+    {
+      g_printerr ("Error setting up epoll: %s\n", g_strerror (errno));
+      return 1;
+    }
+
+  if (n_threads < 1)
+      n_threads = 1;
+
+  done_queue = g_async_queue_new ();
+  thread_reader = g_private_new ((GDestroyNotify) reader_free);
+  pool = g_thread_pool_new ((GFunc) handle_request, NULL, n_threads,
+      TRUE, &error);
+
+  if (!pool)
+    {
+      g_printerr ("Error creating reader threads: %s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  signal (SIGINT, quit_cb);
+  signal (SIGTERM, quit_cb);
+
+  g_print ("Serving %s on http://%s:%d/ with %d reader threads\n",
+      db_fname, address, port, n_threads);
+
+  while (!quit)
+    {
+      gint i;
+      gint n = epoll_wait (epoll_fd, events, MAX_EVENTS, -1);
+
+      if (n < 0)
+        {
+          if (errno == EINTR)
+              continue;
+
+          g_warning ("%s: epoll_wait failed: %s",
+              G_STRFUNC, g_strerror (errno));
+          break;
+        }
+
+      for (i = 0; i < n; i++)
+        {
+          gpointer tag = events[i].data.ptr;
+          Client *client = tag;
+
+          if (tag == &listen_tag)
+              accept_clients (listen_fd);
+          else if (tag == &wake_tag)
+              finish_requests ();
+          else if (events[i].events & (EPOLLERR | EPOLLHUP))
+              client_free (client);
+          else if (events[i].events & EPOLLOUT)
+              client_write (client);
+          else if (events[i].events & EPOLLIN)
+              client_read (client);
+        }
+    }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+  close (listen_fd);
+  close (epoll_fd);
+
+  return 0;
+}
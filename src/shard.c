@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <sqlite3.h>
+
+#include "db.h"
+
+static gint n_shards = 4;
+static gchar *scheme = NULL;
+static gchar *tokenizer = NULL;
+
+static GOptionEntry entries[] = {
+  { "shards", 'n', 0, G_OPTION_ARG_INT, &n_shards,
+    "Number of shards to create (default: 4)", "N" },
+  { "scheme", 's', 0, G_OPTION_ARG_STRING, &scheme,
+    "How to assign articles to shards, 'hash' or 'range' " \
+        "(default: hash)", "SCHEME" },
+  { "tokenizer", 't', 0, G_OPTION_ARG_STRING, &tokenizer,
+    "Tokenizer for the search index, 'simple', 'fold' or 'cjk' " \
+        "(default: as in the source)", "NAME" },
+  { NULL }
+};
+
+typedef struct {
+    gint n_shards;
+    gchar **bounds;
+} Sharding;
+
+/* The search index, made as in the source unless asked for another
+ * tokenizer, or with the simple one if the source has none */
+static gboolean
+create_index (sqlite3 *handle)
+{
+  sqlite3_stmt *stmt;
+  gchar *sql = NULL;
+  gboolean ok;
+
+  if (!tokenizer && sqlite3_prepare_v2 (handle,
+          "SELECT sql FROM src.sqlite_master " \
+              "WHERE type = 'table' AND name = 'article_index'",
+          -1, &stmt, NULL) == SQLITE_OK)
+    {
+      if (sqlite3_step (stmt) == SQLITE_ROW)
+          sql = g_strdup ((const gchar *) sqlite3_column_text (stmt, 0));
+
+      sqlite3_finalize (stmt);
+    }
+
+  if (!sql)
+      sql = g_strdup_printf ("CREATE VIRTUAL TABLE article_index " \
+          "USING fts3(tokenize=%s)", tokenizer ? tokenizer : "simple");
+
+  ok = db_exec_sql (handle, sql);
+  g_free (sql);
+  return ok;
+}
+
+/* SQL function mawire_shard(title), returns the shard the title
+ * belongs to. Must agree with shard_for_title in db.c. */
+static void
+shard_func (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  Sharding *sh = sqlite3_user_data (ctx);
+  const gchar *title = (const gchar *) sqlite3_value_text (argv[0]);
+  gint i;
+
+  if (!title)
+    {
+      sqlite3_result_null (ctx);
+      return;
+    }
+
+  if (!sh->bounds)
+    {
+      sqlite3_result_int (ctx, db_shard_hash (title) % sh->n_shards);
+      return;
+    }
+
+  for (i = 0; sh->bounds[i] && strcmp (title, sh->bounds[i]) >= 0; i++);
+  sqlite3_result_int (ctx, i);
+}
+
+/* Picks the first title of shards 1..n-1 so that each shard gets
+ * (roughly) the same number of articles */
+static gchar **
+pick_bounds (sqlite3 *src, gint n)
+{
+  sqlite3_stmt *stmt;
+  gchar **bounds;
+  gint64 count;
+  gint i;
+
+  if (sqlite3_prepare_v2 (src, "SELECT COUNT(*) FROM articles",
+          -1, &stmt, NULL) != SQLITE_OK)
+      return NULL;
+
+  sqlite3_step (stmt);
+  count = sqlite3_column_int64 (stmt, 0);
+  sqlite3_finalize (stmt);
+
+  if (sqlite3_prepare_v2 (src,
+          "SELECT title FROM articles ORDER BY title LIMIT 1 OFFSET ?",
+          -1, &stmt, NULL) != SQLITE_OK)
+      return NULL;
+
+  bounds = g_new0 (gchar *, n);
+
+  for (i = 1; i < n; i++)
+    {
+      sqlite3_bind_int64 (stmt, 1, count * i / n);
+
+      if (sqlite3_step (stmt) != SQLITE_ROW)
+        {
+          g_printerr ("Not enough articles for %d shards\n", n);
+          g_strfreev (bounds);
+          bounds = NULL;
+          break;
+        }
+
+      bounds[i - 1] = g_strdup ((const gchar *) sqlite3_column_text (stmt, 0));
+      sqlite3_reset (stmt);
+    }
+
+  sqlite3_finalize (stmt);
+  return bounds;
+}
+
+/* Creates one shard: same articles schema as the source, articles
+ * renumbered from 1 and the title index built right away. Random
+ * picks take the first article at or after a random id, so with no
+ * gaps in the ids each article is as likely to come up as any other. */
+static gboolean
+write_shard (const gchar *src_fname, const gchar *fname,
+    Sharding *sh, gint shard)
+{
+  sqlite3 *handle = NULL;
+  sqlite3_stmt *stmt = NULL;
+  gchar *sql;
+  gboolean ok = FALSE;
+
+  g_print ("Writing shard %d/%d: %s\n", shard + 1, sh->n_shards, fname);
+
+  if (g_file_test (fname, G_FILE_TEST_EXISTS))
+    {
+      g_printerr ("Refusing to overwrite %s\n", fname);
+      return FALSE;
+    }
+
+  if (sqlite3_open (fname, &handle) != SQLITE_OK)
+    {
+      g_printerr ("Error opening %s: %s\n", fname, sqlite3_errmsg (handle));
+      goto out;
+    }
+
+  sqlite3_create_function (handle, "mawire_shard", 1, SQLITE_UTF8,
+      sh, shard_func, NULL, NULL);
+
+  sql = sqlite3_mprintf ("ATTACH DATABASE %Q AS src", src_fname);
+  ok = db_exec_sql (handle, sql);
+  sqlite3_free (sql);
+
+  if (!ok || !db_exec_sql (handle, "PRAGMA synchronous = OFF") ||
+      !db_exec_sql (handle, "BEGIN"))
+      goto out;
+
+  /* copy the tables and their indexes as they are in the source */
+  ok = (sqlite3_prepare_v2 (handle,
+      "SELECT sql FROM src.sqlite_master " \
+          "WHERE tbl_name IN ('articles', 'meta') " \
+          "AND sql NOT NULL ORDER BY type = 'index'",
+      -1, &stmt, NULL) == SQLITE_OK);
+
+  while (ok && sqlite3_step (stmt) == SQLITE_ROW)
+      ok = db_exec_sql (handle,
+          (const gchar *) sqlite3_column_text (stmt, 0));
+
+  sqlite3_finalize (stmt);
+
+  /* along with what the source recorded about itself, if anything */
+  if (ok && sqlite3_prepare_v2 (handle,
+          "INSERT INTO meta SELECT * FROM src.meta",
+          -1, &stmt, NULL) == SQLITE_OK)
+    {
+      ok = (sqlite3_step (stmt) == SQLITE_DONE);
+      sqlite3_finalize (stmt);
+    }
+
+  if (!ok)
+      goto out;
+
+  sql = sqlite3_mprintf ("INSERT INTO articles (title, text) " \
+      "SELECT title, text FROM src.articles " \
+      "WHERE mawire_shard(title) = %d ORDER BY id", shard);
+  ok = db_exec_sql (handle, sql) &&
+      create_index (handle) &&
+      /* fill the content table, then index it all into one segment */
+      db_exec_sql (handle, "INSERT INTO article_index_content " \
+          "(docid, c0content) SELECT id, title FROM articles") &&
+      db_exec_sql (handle, "INSERT INTO article_index (article_index) " \
+          "VALUES ('rebuild')") &&
+      /* and count the titles of each term, and merge the doclists
+       * of the short prefixes, for the searches */
+      db_exec_sql (handle, "INSERT INTO article_index (article_index) " \
+          "VALUES ('termstats')") &&
+      db_exec_sql (handle, "INSERT INTO article_index (article_index) " \
+          "VALUES ('prefixes')") &&
+      db_write_meta (handle, tokenizer) &&
+      db_exec_sql (handle, "COMMIT") &&
+      db_exec_sql (handle, "DETACH DATABASE src");
+  sqlite3_free (sql);
+
+out:
+  sqlite3_close (handle);
+  return ok;
+}
+
+static gboolean
+write_manifest (const gchar *fname, Sharding *sh, gchar **files)
+{
+  GKeyFile *kf = g_key_file_new ();
+  GError *error = NULL;
+  gchar *data;
+  gsize len;
+  gboolean ok;
+
+  g_key_file_set_string (kf, "shards", "scheme",
+      sh->bounds ? "range" : "hash");
+  g_key_file_set_string_list (kf, "shards", "files",
+      (const gchar * const *) files, sh->n_shards);
+
+  if (sh->bounds)
+      g_key_file_set_string_list (kf, "shards", "bounds",
+          (const gchar * const *) sh->bounds, sh->n_shards - 1);
+
+  data = g_key_file_to_data (kf, &len, NULL);
+  ok = g_file_set_contents (fname, data, len, &error);
+
+  if (!ok)
+    {
+      g_printerr ("Error writing %s: %s\n", fname, error->message);
+      g_error_free (error);
+    }
+
+  g_free (data);
+  g_key_file_free (kf);
+  return ok;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *error = NULL;
+  Sharding sh = { 0, NULL };
+  sqlite3 *src = NULL;
+  gchar **files;
+  gchar *base;
+  gchar *dir;
+  gint ret = 0;
+  gint i;
+
+  ctx = g_option_context_new ("SOURCE.db OUTPUT" DB_SHARDS_SUFFIX \
+      " - split a database into shards");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+
+  if (!g_option_context_parse (ctx, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  g_option_context_free (ctx);
+
+  if (argc != 3 || !g_str_has_suffix (argv[2], DB_SHARDS_SUFFIX) ||
+      n_shards < 2)
+    {
+      g_printerr ("Usage: %s [-n N] [-s hash|range] [-t simple|fold|cjk] " \
+          "SOURCE.db OUTPUT" DB_SHARDS_SUFFIX "\n", argv[0]);
+      return 1;
+    }
+
+  if (scheme && strcmp (scheme, "hash") && strcmp (scheme, "range"))
+    {
+      g_printerr ("Unknown sharding scheme: %s\n", scheme);
+      return 1;
+    }
+
+  if (tokenizer && strcmp (tokenizer, "simple") &&
+      strcmp (tokenizer, "fold") && strcmp (tokenizer, "cjk"))
+    {
+      g_printerr ("Unknown tokenizer: %s\n", tokenizer);
+      return 1;
+    }
+
+  sh.n_shards = n_shards;
+
+  if (scheme && !strcmp (scheme, "range"))
+    {
+      if (sqlite3_open_v2 (argv[1], &src, SQLITE_OPEN_READONLY,
+              NULL) != SQLITE_OK)
+        {
+          g_printerr ("Error opening %s: %s\n", argv[1],
+              sqlite3_errmsg (src));
+          sqlite3_close (src);
+          return 1;
+        }
+
+      sh.bounds = pick_bounds (src, n_shards);
+      sqlite3_close (src);
+
+      if (!sh.bounds)
+          return 1;
+    }
+
+  /* shards are named after the manifest and stored next to it,
+   * the manifest refers to them by relative path */
+  base = g_path_get_basename (argv[2]);
+  base[strlen (base) - strlen (DB_SHARDS_SUFFIX)] = '\0';
+  dir = g_path_get_dirname (argv[2]);
+  files = g_new0 (gchar *, n_shards + 1);
+
+  for (i = 0; i < n_shards && ret == 0; i++)
+    {
+      gchar *path;
+
+      files[i] = g_strdup_printf ("%s-%d.db", base, i);
+      path = g_build_filename (dir, files[i], NULL);
+
+      if (!write_shard (argv[1], path, &sh, i))
+          ret = 1;
+
+      g_free (path);
+    }
+
+  if (ret == 0 && !write_manifest (argv[2], &sh, files))
+      ret = 1;
+
+  g_strfreev (files);
+  g_strfreev (sh.bounds);
+  g_free (base);
+  g_free (dir);
+
+  return ret;
+}
@@ -253,23 +253,27 @@ show_article_window (gchar *title, gchar *text)
 
 static GtkWidget *
 create_app_menu (GtkWidget *win, GCallback installed_db_cb,
-    GCallback custom_db_cb, GCallback about_cb)
+    GCallback custom_db_cb, GCallback add_db_cb, GCallback about_cb)
 {
   GtkWidget *menu;
   GtkWidget *use_installed_btn;
   GtkWidget *use_custom_btn;
+  GtkWidget *add_btn;
   GtkWidget *about_btn;
 
   menu = hildon_app_menu_new ();
 
   use_installed_btn = append_menu_button (menu, "Use installed DB");
   use_custom_btn = append_menu_button (menu, "Use custom DB");
+  add_btn = append_menu_button (menu, "Add another DB");
   about_btn = append_menu_button (menu, "About");
 
   g_signal_connect (G_OBJECT (use_installed_btn), "clicked",
       G_CALLBACK (installed_db_cb), win);
   g_signal_connect (G_OBJECT (use_custom_btn), "clicked",
       G_CALLBACK (custom_db_cb), win);
+  g_signal_connect (G_OBJECT (add_btn), "clicked",
+      G_CALLBACK (add_db_cb), win);
   g_signal_connect (G_OBJECT (about_btn), "clicked",
       G_CALLBACK (about_cb), win);
 
@@ -295,57 +299,44 @@ row_activated_cb (GtkTreeView *view, GtkTreePath *path,
   g_free (text);
 }
 
-GtkWidget *
-show_results_window (gchar *query, GList *results,
-  GCallback selected_cb)
+/* Fills the results window with the results, freeing them, in place
+ * of whatever it showed before. Partial results are the ones found
+ * before the search ran out of time, the label says so. */
+void
+set_results (GtkWidget *win, GList *results, gboolean partial)
 {
-  GtkWidget *win;
-  GtkWidget *pannable;
   GtkWidget *view;
+  GtkWidget *label;
   GtkListStore *model;
-  GtkWidget *aa;
-  GtkWidget *n_results_label;
   GtkTreePath *exact_match = NULL;
+  gchar *query;
   gchar *query_icase;
   gint n_results;
   gchar *tmp;
 
+  view = g_object_get_data (G_OBJECT (win), "view");
+  label = g_object_get_data (G_OBJECT (win), "n-results-label");
+  query = g_object_get_data (G_OBJECT (win), "query");
+  model = GTK_LIST_STORE (gtk_tree_view_get_model (GTK_TREE_VIEW (view)));
+
   query_icase = g_utf8_casefold (query, -1);
   n_results = g_list_length (results);
 
-  DEBUG ("Showing %d results for: %s", n_results, query);
-
-  win = hildon_stackable_window_new ();
-  gtk_window_set_title (GTK_WINDOW (win), "Search results");
-
-  g_signal_connect (G_OBJECT (win), "delete-event",
-      G_CALLBACK (gtk_widget_destroy), win);
-
-  pannable = hildon_pannable_area_new ();
-
-  g_object_set (pannable,
-      "mov-mode", HILDON_MOVEMENT_MODE_VERT,
-      "hscrollbar-policy", GTK_POLICY_NEVER,
-      NULL);
-
-  view = create_tree_view (&model);
-
-  aa = hildon_tree_view_get_action_area_box (GTK_TREE_VIEW (view));
-  hildon_tree_view_set_action_area_visible (GTK_TREE_VIEW (view), TRUE);
+  DEBUG ("Showing %d%s results for: %s", n_results,
+      partial ? " partial" : "", query);
 
-  tmp = g_strdup_printf ("Found %s%d articles about %s",
-      (n_results == 500) ? "more than " : "",
-      n_results, query);
+  if (partial)
+      tmp = g_strdup_printf ("Found %d articles about %s so far",
+          n_results, query);
+  else
+      tmp = g_strdup_printf ("Found %s%d articles about %s",
+          (n_results >= 500) ? "more than " : "",
+          n_results, query);
 
-  n_results_label = gtk_label_new (tmp);
+  gtk_label_set_text (GTK_LABEL (label), tmp);
   g_free (tmp);
 
-  gtk_container_add (GTK_CONTAINER (aa), n_results_label);
-  gtk_container_add (GTK_CONTAINER (win), pannable);
-  gtk_container_add (GTK_CONTAINER (pannable), view);
-
-  g_signal_connect (G_OBJECT (view), "row-activated",
-      G_CALLBACK (row_activated_cb), selected_cb);
+  gtk_list_store_clear (model);
 
   while (results)
     {
@@ -355,7 +346,7 @@ show_results_window (gchar *query, GList *results,
 
       gtk_list_store_insert_with_values (model, &iter, -1, 0, tmp, -1);
 
-      if (!g_utf8_collate (tmp_icase, query_icase))
+      if (!exact_match && !g_utf8_collate (tmp_icase, query_icase))
           exact_match = gtk_tree_model_get_path (GTK_TREE_MODEL (model), &iter);
 
       results = g_list_remove (results, tmp);
@@ -363,6 +354,8 @@ show_results_window (gchar *query, GList *results,
       g_free (tmp_icase);
     }
 
+  g_free (query_icase);
+
   /* if there's exact match in the results, we want to scroll
    * to it so the user doesn't need to scroll potentially huge
    * list to find it. */
@@ -373,14 +366,80 @@ show_results_window (gchar *query, GList *results,
       gtk_tree_path_free (exact_match);
       exact_match = NULL;
     }
+}
+
+GtkWidget *
+show_results_window (gchar *query, GList *results, gboolean partial,
+  GCallback selected_cb)
+{
+  GtkWidget *win;
+  GtkWidget *pannable;
+  GtkWidget *view;
+  GtkListStore *model;
+  GtkWidget *aa;
+  GtkWidget *n_results_label;
+
+  win = hildon_stackable_window_new ();
+  gtk_window_set_title (GTK_WINDOW (win), "Search results");
+
+  g_signal_connect (G_OBJECT (win), "delete-event",
+      G_CALLBACK (gtk_widget_destroy), win);
+
+  pannable = hildon_pannable_area_new ();
+
+  g_object_set (pannable,
+      "mov-mode", HILDON_MOVEMENT_MODE_VERT,
+      "hscrollbar-policy", GTK_POLICY_NEVER,
+      NULL);
+
+  view = create_tree_view (&model);
+
+  aa = hildon_tree_view_get_action_area_box (GTK_TREE_VIEW (view));
+  hildon_tree_view_set_action_area_visible (GTK_TREE_VIEW (view), TRUE);
+
+  n_results_label = gtk_label_new (NULL);
+
+  /* for set_results and set_results_count */
+  g_object_set_data (G_OBJECT (win), "view", view);
+  g_object_set_data (G_OBJECT (win), "n-results-label", n_results_label);
+  g_object_set_data_full (G_OBJECT (win), "query", g_strdup (query),
+      g_free);
+
+  gtk_container_add (GTK_CONTAINER (aa), n_results_label);
+  gtk_container_add (GTK_CONTAINER (win), pannable);
+  gtk_container_add (GTK_CONTAINER (pannable), view);
+
+  g_signal_connect (G_OBJECT (view), "row-activated",
+      G_CALLBACK (row_activated_cb), selected_cb);
+
+  set_results (win, results, partial);
 
   gtk_widget_show_all (win);
   return win;
 }
 
+/* Replaces the "more than" in the results window label with the
+ * exact number of results, once it has been counted */
+void
+set_results_count (GtkWidget *win, gint64 count)
+{
+  GtkWidget *label;
+  gchar *tmp;
+
+  label = g_object_get_data (G_OBJECT (win), "n-results-label");
+  if (!label)
+      return;
+
+  tmp = g_strdup_printf ("Found %" G_GINT64_FORMAT " articles about %s",
+      count, (gchar *) g_object_get_data (G_OBJECT (win), "query"));
+
+  gtk_label_set_text (GTK_LABEL (label), tmp);
+  g_free (tmp);
+}
+
 GtkWidget *
 show_main_window (GCallback installed_db_cb, GCallback custom_db_cb,
-    GCallback about_cb, GCallback search_clicked_cb,
+    GCallback add_db_cb, GCallback about_cb, GCallback search_clicked_cb,
     GCallback random_clicked_cb)
 {
   GtkWidget *window;
@@ -398,7 +457,7 @@ show_main_window (GCallback installed_db_cb, GCallback custom_db_cb,
 
   hildon_window_set_app_menu (HILDON_WINDOW (window),
       HILDON_APP_MENU (create_app_menu (window,
-          installed_db_cb, custom_db_cb, about_cb)));
+          installed_db_cb, custom_db_cb, add_db_cb, about_cb)));
 
   vbox = gtk_vbox_new (FALSE, 0);
   hbox = gtk_hbox_new (TRUE, 10);
@@ -6,10 +6,12 @@
 #define MAIN_WINDOW_IMAGE "/usr/share/pixmaps/mawire.png"
 
 GtkWidget *show_main_window (GCallback installed_db_cb,
-    GCallback custom_db_cb, GCallback about_cb,
+    GCallback custom_db_cb, GCallback add_db_cb, GCallback about_cb,
     GCallback search_clicked_cb, GCallback random_clicked_cb);
 GtkWidget *show_results_window (gchar *query, GList *results,
-  GCallback selected_cb);
+  gboolean partial, GCallback selected_cb);
+void set_results (GtkWidget *win, GList *results, gboolean partial);
+void set_results_count (GtkWidget *win, gint64 count);
 GtkWidget *show_article_window (gchar *title, gchar *text);
 gchar *get_query_string (GtkWidget *window);
 gchar *show_filename_chooser (GtkWidget *window, gchar *folder);
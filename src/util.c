@@ -2,7 +2,6 @@
 
 #include <dbus/dbus-glib.h>
 #include <gconf/gconf-client.h>
-#include <zlib.h>
 
 static struct {
     GConfClient *gc;
@@ -56,44 +55,6 @@ launch_browser (const gchar *url)
   return TRUE;
 }
 
-gchar *
-uncompress_string (gpointer data, gint len)
-{
-  gchar *buf = NULL;
-  gint bufsize = len * 2;
-  gulong retlen;
-
-  for (;;)
-    {
-      gint ret;
-
-      buf = g_malloc (bufsize);
-      retlen = bufsize;
-      ret = uncompress ((unsigned char *) buf, &retlen, data, len);
-
-      switch (ret)
-        {
-          case Z_OK:
-            buf[retlen] = '\0';
-            return buf;
-
-          /* retry with a larger buffer */
-          case Z_BUF_ERROR:
-            g_free (buf);
-            bufsize *= 2;
-            break;
-
-          /* unknown error, bail out */
-          default:
-            g_warning ("%s: unknown zlib error: %d", G_STRFUNC, ret);
-            g_free (buf);
-            return NULL;
-        }
-    }
-
-  g_assert_not_reached ();
-}
-
 void
 gconf_wrapper_init (void)
 {
@@ -127,6 +88,22 @@ save_dbname_to_gconf (gchar *fname)
       NULL);
 }
 
+GSList *
+get_extra_dbnames_from_gconf (void)
+{
+  g_assert (gconf_wrapper.gc);
+  return gconf_client_get_list (gconf_wrapper.gc,
+      MAWIRE_GCONF_EXTRA_DB_FNAMES, GCONF_VALUE_STRING, NULL);
+}
+
+void
+save_extra_dbnames_to_gconf (GSList *fnames)
+{
+  g_assert (gconf_wrapper.gc);
+  gconf_client_set_list (gconf_wrapper.gc, MAWIRE_GCONF_EXTRA_DB_FNAMES,
+      GCONF_VALUE_STRING, fnames, NULL);
+}
+
 gboolean
 keyboard_is_open (void)
 {
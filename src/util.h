@@ -10,14 +10,16 @@
 #endif
 
 #define MAWIRE_GCONF_DB_FNAME "/apps/mawire/database"
+#define MAWIRE_GCONF_EXTRA_DB_FNAMES "/apps/mawire/extra_databases"
 
 void gconf_wrapper_init (void);
 void gconf_wrapper_dispose (void);
 
 gboolean launch_browser (const gchar *url);
-gchar *uncompress_string (gpointer data, gint len);
 gchar *get_dbname_from_gconf (void);
 void save_dbname_to_gconf (gchar *fname);
+GSList *get_extra_dbnames_from_gconf (void);
+void save_extra_dbnames_to_gconf (GSList *fnames);
 gboolean keyboard_is_open (void);
 
 void set_keyboard_slide_callback (GFunc cb, gpointer user_data);